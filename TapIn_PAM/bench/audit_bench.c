@@ -0,0 +1,143 @@
+/*
+ * TapIn Audit Benchmark
+ * Times audit journal appends against writing the same facts as text
+ *
+ * Appends records for -u users from -t threads through the journal, as the
+ * helper does for each request, and then writes the same requests as
+ * syslog-style text lines with one write() each. The journal and the text
+ * file are left in the directory, so queries can be timed on them:
+ *
+ *   time ./tapin-audit --dir DIR --user user17 --count
+ *   time ./tapin-audit --dir DIR --user user17 --count --scan
+ *   time grep -c "user: user17," DIR/text.log
+ *
+ * Usage: audit_bench [-n records] [-u users] [-t threads] [-s segment_records] [-d dir]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include "audit_journal.h"
+#include "async_log.h"
+
+static int records = 1000000;
+static int users = 1000;
+static int threads = 1;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void fill_record(audit_record_t *record, unsigned seed) {
+    memset(record, 0, sizeof(*record));
+    snprintf(record->username, sizeof(record->username), "user%u", seed % users);
+    record->outcome = seed % 50 == 0 ? AUDIT_BAD_MAC : AUDIT_ACCEPTED;
+    record->has_device = 1;
+    memcpy(record->device, "\x00\x1a\x7d\xda\x71", 5);
+    record->device[5] = seed % users;
+    record->mac_us = 2;
+    record->replay_us = 1;
+    record->token_us = 3;
+    record->total_us = 8;
+}
+
+static void *append_thread(void *arg) {
+    int id = (int)(long)arg, i;
+    audit_record_t record;
+
+    for (i = id; i < records; i += threads) {
+        fill_record(&record, (unsigned)i * 2654435761u);
+        audit_journal_append(&record);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    const char *dir = "/tmp/tapin-audit-bench";
+    uint32_t segment_records = AUDIT_DEFAULT_SEGMENT_RECORDS;
+    pthread_t workers[64];
+    audit_record_t record;
+    char path[4096], line[256];
+    double start, elapsed;
+    int opt, i, fd;
+
+    while ((opt = getopt(argc, argv, "n:u:t:s:d:")) != -1) {
+        switch (opt) {
+        case 'n': records = atoi(optarg); break;
+        case 'u': users = atoi(optarg); break;
+        case 't': threads = atoi(optarg); break;
+        case 's': segment_records = atoi(optarg); break;
+        case 'd': dir = optarg; break;
+        default:
+            fprintf(stderr, "Usage: %s [-n records] [-u users] [-t threads] [-s segment_records] [-d dir]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (records <= 0 || users <= 0 || threads <= 0 || threads > 64 || segment_records == 0) {
+        fprintf(stderr, "Invalid arguments\n");
+        return 1;
+    }
+
+    // Start from nothing, so the timings include creating every segment
+    uint32_t *existing;
+    int existing_count = audit_list_segments(dir, &existing);
+    free(existing);
+    if (existing_count > 0) {
+        fprintf(stderr, "%s already holds a journal; remove it first\n", dir);
+        return 1;
+    }
+
+    // Keep every segment, so queries see all the records
+    if (!audit_journal_open(dir, segment_records, (records + segment_records - 1) / segment_records + 1)) {
+        fprintf(stderr, "Could not open a journal in %s\n", dir);
+        return 1;
+    }
+
+    start = now_ns();
+    for (i = 0; i < threads; i++) {
+        pthread_create(&workers[i], NULL, append_thread, (void *)(long)i);
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    elapsed = now_ns() - start;
+    audit_journal_close();
+    printf("%-28s %8.1f ns/record (%d records, %d threads, %u per segment)\n", "audit_journal_append()",
+           elapsed / records, records, threads, segment_records);
+
+    // The same facts as the text lines the helper used to log
+    snprintf(path, sizeof(path), "%s/text.log", dir);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+    start = now_ns();
+    for (i = 0; i < records; i++) {
+        time_t now = time(NULL);
+        struct tm tm;
+        char when[32];
+        fill_record(&record, (unsigned)i * 2654435761u);
+        localtime_r(&now, &tm);
+        strftime(when, sizeof(when), "%b %d %H:%M:%S", &tm);
+        int length = snprintf(line, sizeof(line), "%s host tapin_helper[1]: "
+                              "Authentication token created for user: %s, expires at: %ld\n",
+                              when, record.username, (long)now + 20);
+        if (write(fd, line, length) != length) {
+            perror(path);
+            break;
+        }
+    }
+    elapsed = now_ns() - start;
+    close(fd);
+    printf("%-28s %8.1f ns/record\n", "text line, write()", elapsed / records);
+    printf("Journal and %s left for queries\n", path);
+    return 0;
+}
@@ -0,0 +1,198 @@
+/*
+ * TapIn Crypto Microbenchmark
+ * Measures the per-request cost of checking a request's HMAC
+ *
+ * "original" is the first helper's check: re-read the shared secret file,
+ * compute the HMAC with a fresh key setup, print it as hex with sprintf
+ * and compare the hex text. "one-shot" is the check on the binary record
+ * with HMAC() and CRYPTO_memcmp, still keying from scratch. "keyed engine"
+ * is the current path: an hmac_engine_t prepared once per secret and
+ * cloned per request. The pieces (hex decode, hex encode, compare) are
+ * also timed on their own.
+ *
+ * Usage: crypto_bench [-n iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include "hmac_engine.h"
+#include "auth_record.h"
+
+static const char *secret = "0123456789abcdef0123456789abcdef";
+static const char *signed_data = "alice:1760000000:Zx81kQp0aLm3Tn7v";
+static char secret_path[] = "/tmp/crypto_bench_secretXXXXXX";
+static char mac_hex[HMAC_ENGINE_MAC_LENGTH * 2 + 1];
+static uint8_t mac[HMAC_ENGINE_MAC_LENGTH];
+
+// Separate copies, as a received MAC would be
+static char received_hex[sizeof(mac_hex)];
+static uint8_t received_mac[HMAC_ENGINE_MAC_LENGTH];
+static hmac_engine_t *engine;
+
+// Keeps results alive so the loops are not optimised away
+static volatile unsigned sink;
+
+static int read_secret(char *out, size_t size) {
+    FILE *file = fopen(secret_path, "r");
+    int ok;
+    
+    if (!file) {
+        return 0;
+    }
+    ok = fgets(out, size, file) != NULL;
+    fclose(file);
+    return ok;
+}
+
+static int original(void) {
+    char key[256];
+    char hex_result[EVP_MAX_MD_SIZE * 2 + 1];
+    unsigned char result[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    unsigned char diff = 0;
+    unsigned int i;
+    
+    if (!read_secret(key, sizeof(key))) {
+        return 0;
+    }
+    HMAC(EVP_sha256(), key, strlen(key), (const unsigned char *)signed_data, strlen(signed_data), result, &len);
+    for (i = 0; i < len; i++) {
+        sprintf(hex_result + i * 2, "%02x", result[i]);
+    }
+    for (i = 0; i < len * 2; i++) {
+        diff |= hex_result[i] ^ mac_hex[i];
+    }
+    return diff == 0;
+}
+
+static int one_shot(void) {
+    unsigned char result[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    
+    HMAC(EVP_sha256(), secret, strlen(secret), (const unsigned char *)signed_data, strlen(signed_data), result, &len);
+    return CRYPTO_memcmp(result, mac, HMAC_ENGINE_MAC_LENGTH) == 0;
+}
+
+static int keyed_engine(void) {
+    return hmac_engine_verify(engine, signed_data, strlen(signed_data), mac);
+}
+
+static int hex_decode(void) {
+    uint8_t decoded[HMAC_ENGINE_MAC_LENGTH];
+    int ok = auth_mac_from_hex(mac_hex, HMAC_ENGINE_MAC_LENGTH * 2, decoded);
+    
+    sink += decoded[0];
+    return ok;
+}
+
+static int hex_encode(void) {
+    char hex[HMAC_ENGINE_MAC_LENGTH * 2 + 1];
+    int i;
+    
+    for (i = 0; i < HMAC_ENGINE_MAC_LENGTH; i++) {
+        sprintf(hex + i * 2, "%02x", mac[i]);
+    }
+    sink += hex[0];
+    return 1;
+}
+
+static int compare_hex(void) {
+    unsigned char diff = 0;
+    int i;
+    
+    for (i = 0; i < HMAC_ENGINE_MAC_LENGTH * 2; i++) {
+        diff |= received_hex[i] ^ mac_hex[i];
+    }
+    return diff == 0;
+}
+
+static int compare_binary(void) {
+    return CRYPTO_memcmp(received_mac, mac, HMAC_ENGINE_MAC_LENGTH) == 0;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void run(const char *name, int (*path)(void), int iterations) {
+    double start;
+    int i;
+    
+    // Warm up
+    for (i = 0; i < iterations / 10; i++) {
+        path();
+    }
+    
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        if (!path()) {
+            fprintf(stderr, "%s: sample MAC rejected\n", name);
+            exit(1);
+        }
+    }
+    double elapsed = now_ns() - start;
+    
+    printf("%-14s %8.1f ns/op  %10.0f ops/s\n", name, elapsed / iterations, iterations / (elapsed / 1e9));
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = 500000;
+    unsigned int len = 0;
+    int opt, fd, i;
+    
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n': iterations = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-n iterations]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (iterations <= 0) {
+        iterations = 1;
+    }
+    
+    fd = mkstemp(secret_path);
+    if (fd < 0 || write(fd, secret, strlen(secret)) != (ssize_t)strlen(secret)) {
+        perror("crypto_bench: secret file");
+        return 1;
+    }
+    close(fd);
+    
+    HMAC(EVP_sha256(), secret, strlen(secret), (const unsigned char *)signed_data, strlen(signed_data), mac, &len);
+    for (i = 0; i < HMAC_ENGINE_MAC_LENGTH; i++) {
+        sprintf(mac_hex + i * 2, "%02x", mac[i]);
+    }
+    memcpy(received_hex, mac_hex, sizeof(received_hex));
+    memcpy(received_mac, mac, sizeof(received_mac));
+    
+    engine = hmac_engine_new(secret, strlen(secret));
+    if (!engine) {
+        fprintf(stderr, "crypto_bench: could not prepare HMAC key\n");
+        unlink(secret_path);
+        return 1;
+    }
+    
+    printf("Verify a request MAC\n");
+    run("original", original, iterations);
+    run("one-shot", one_shot, iterations);
+    run("keyed engine", keyed_engine, iterations);
+    
+    printf("Pieces\n");
+    run("hex decode", hex_decode, iterations);
+    run("hex encode", hex_encode, iterations);
+    run("compare hex", compare_hex, iterations);
+    run("compare binary", compare_binary, iterations);
+    
+    hmac_engine_free(engine);
+    unlink(secret_path);
+    return 0;
+}
@@ -0,0 +1,268 @@
+/*
+ * TapIn Helper Benchmark
+ * Measures helper daemon request latency under concurrent load
+ *
+ * Each client thread sends freshly signed authentication records to the
+ * helper socket as channel frames and records each round trip. By default
+ * every request gets its own connection; with -p a client keeps one
+ * connection open and keeps up to -d requests in flight on it, the way the
+ * Bluetooth listener does. Optional stalled clients connect and sit on the
+ * connection without sending anything, which exposes head-of-line blocking
+ * in the daemon.
+ *
+ * Usage: helper_bench [-c clients] [-n requests] [-p] [-d depth] [-s stalled]
+ *                     [-t stall_ms] [-S socket] [-k secret_file] [-u username]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <openssl/hmac.h>
+#include "tapin_channel.h"
+
+#define DEFAULT_SOCKET_PATH "/tmp/tapin_helper.sock"
+#define DEFAULT_SECRET_FILE "/etc/tapin/shared_secret"
+
+static const char *socket_path = DEFAULT_SOCKET_PATH;
+static const char *username = "bench";
+static char secret[256];
+static int requests_per_client = 200;
+static int persistent = 0;
+static int pipeline_depth = 1;
+static int stall_ms = 1000;
+static volatile int stop_stalling = 0;
+
+typedef struct {
+    int id;
+    double *latencies;
+    int completed;
+    int failed;
+} client_t;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static int connect_helper(void) {
+    struct sockaddr_un addr;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/*
+ * Build a record signed the same way the mobile app signs its request
+ */
+static void build_request(tapin_auth_record_t *record, int client, int seq) {
+    unsigned int mac_len = 0;
+    char data[256];
+
+    memset(record, 0, sizeof(*record));
+    record->version = TAPIN_AUTH_RECORD_VERSION;
+    record->timestamp = time(NULL);
+    snprintf(record->username, sizeof(record->username), "%s", username);
+    snprintf(record->nonce, sizeof(record->nonce), "b%dn%d", client, seq);
+    record->username_length = strlen(record->username);
+    record->nonce_length = strlen(record->nonce);
+
+    snprintf(data, sizeof(data), "%s:%lld:%s", record->username, (long long)record->timestamp, record->nonce);
+    HMAC(EVP_sha256(), secret, strlen(secret), (unsigned char *)data, strlen(data), record->mac, &mac_len);
+}
+
+static int send_request(int sock, uint32_t request_id, const tapin_auth_record_t *record) {
+    tapin_channel_header_t header = { TAPIN_CHANNEL_MAGIC, request_id, TAPIN_CHANNEL_AUTH_REQUEST, 0, sizeof(*record) };
+    struct iovec iov[2] = { { &header, sizeof(header) }, { (void *)record, sizeof(*record) } };
+
+    return writev(sock, iov, 2) == (ssize_t)(sizeof(header) + sizeof(*record));
+}
+
+static int read_reply(int sock, tapin_channel_header_t *reply) {
+    return recv(sock, reply, sizeof(*reply), MSG_WAITALL) == sizeof(*reply) &&
+           reply->magic == TAPIN_CHANNEL_MAGIC && reply->request_id < (uint32_t)requests_per_client;
+}
+
+static void *client_thread(void *arg) {
+    client_t *client = arg;
+    tapin_channel_header_t reply;
+    tapin_auth_record_t request;
+    double *sent_at = calloc(requests_per_client, sizeof(double));
+    int i, sock = -1, in_flight = 0;
+
+    for (i = 0; i < requests_per_client; i++) {
+        build_request(&request, client->id, i);
+
+        if (sock < 0) {
+            sock = connect_helper();
+            if (sock < 0) {
+                client->failed++;
+                continue;
+            }
+        }
+
+        sent_at[i] = now_ms();
+        if (!send_request(sock, i, &request)) {
+            client->failed += in_flight + 1;
+            in_flight = 0;
+            close(sock);
+            sock = -1;
+            continue;
+        }
+        in_flight++;
+
+        // Keep the pipeline full, then collect replies in whatever order
+        while (in_flight >= (persistent ? pipeline_depth : 1) ||
+               (i == requests_per_client - 1 && in_flight > 0)) {
+            if (!read_reply(sock, &reply)) {
+                client->failed += in_flight;
+                in_flight = 0;
+                close(sock);
+                sock = -1;
+                break;
+            }
+            client->latencies[client->completed++] = now_ms() - sent_at[reply.request_id];
+            in_flight--;
+        }
+
+        if (!persistent && sock >= 0) {
+            close(sock);
+            sock = -1;
+        }
+    }
+
+    if (sock >= 0) {
+        close(sock);
+    }
+    free(sent_at);
+    return NULL;
+}
+
+static void *stalled_thread(void *arg) {
+    (void)arg;
+
+    // Connect, send nothing and hold the connection open
+    while (!stop_stalling) {
+        int sock = connect_helper();
+        if (sock < 0) {
+            usleep(10000);
+            continue;
+        }
+        usleep(stall_ms * 1000);
+        close(sock);
+    }
+
+    return NULL;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int read_secret(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return 0;
+    }
+    if (!fgets(secret, sizeof(secret), file)) {
+        fclose(file);
+        return 0;
+    }
+    fclose(file);
+    secret[strcspn(secret, "\n")] = '\0';
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    const char *secret_file = DEFAULT_SECRET_FILE;
+    int clients = 16, stalled = 0;
+    int opt, i, total = 0, failed = 0;
+
+    while ((opt = getopt(argc, argv, "c:n:pd:s:t:S:k:u:")) != -1) {
+        switch (opt) {
+        case 'c': clients = atoi(optarg); break;
+        case 'n': requests_per_client = atoi(optarg); break;
+        case 'p': persistent = 1; break;
+        case 'd': pipeline_depth = atoi(optarg); break;
+        case 's': stalled = atoi(optarg); break;
+        case 't': stall_ms = atoi(optarg); break;
+        case 'S': socket_path = optarg; break;
+        case 'k': secret_file = optarg; break;
+        case 'u': username = optarg; break;
+        default:
+            fprintf(stderr, "Usage: %s [-c clients] [-n requests] [-p] [-d depth] [-s stalled] "
+                            "[-t stall_ms] [-S socket] [-k secret_file] [-u username]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (pipeline_depth < 1) {
+        pipeline_depth = 1;
+    }
+
+    if (!read_secret(secret_file)) {
+        fprintf(stderr, "Could not read shared secret from %s\n", secret_file);
+        return 1;
+    }
+
+    client_t *state = calloc(clients, sizeof(client_t));
+    pthread_t *threads = calloc(clients + stalled, sizeof(pthread_t));
+
+    for (i = 0; i < stalled; i++) {
+        pthread_create(&threads[clients + i], NULL, stalled_thread, NULL);
+    }
+
+    double start = now_ms();
+    for (i = 0; i < clients; i++) {
+        state[i].id = i;
+        state[i].latencies = calloc(requests_per_client, sizeof(double));
+        pthread_create(&threads[i], NULL, client_thread, &state[i]);
+    }
+    for (i = 0; i < clients; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now_ms() - start;
+
+    stop_stalling = 1;
+    for (i = 0; i < stalled; i++) {
+        pthread_join(threads[clients + i], NULL);
+    }
+
+    // Merge and sort all latencies
+    double *all = calloc((size_t)clients * requests_per_client, sizeof(double));
+    for (i = 0; i < clients; i++) {
+        memcpy(all + total, state[i].latencies, state[i].completed * sizeof(double));
+        total += state[i].completed;
+        failed += state[i].failed;
+    }
+    qsort(all, total, sizeof(double), compare_double);
+
+    printf("clients=%d %s depth=%d stalled=%d requests=%d failed=%d elapsed=%.1fms throughput=%.0f req/s\n",
+           clients, persistent ? "persistent" : "per-request", persistent ? pipeline_depth : 1,
+           stalled, total, failed, elapsed, total / (elapsed / 1000.0));
+    if (total > 0) {
+        printf("latency ms: p50=%.3f p90=%.3f p99=%.3f max=%.3f\n",
+               all[total / 2], all[total * 90 / 100], all[total * 99 / 100], all[total - 1]);
+    }
+
+    return failed > 0;
+}
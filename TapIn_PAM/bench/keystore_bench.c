@@ -0,0 +1,120 @@
+/*
+ * TapIn Keystore Benchmark
+ * Times loading a keystore and looking entries up in it
+ *
+ * Builds a keystore of N enrolled phones in a temporary directory, then
+ * measures keystore_open (what the helper does at startup and on every
+ * reload) and lookups by username and by device address.
+ *
+ * Usage: keystore_bench [-e entries] [-n lookups]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "keystore.h"
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void make_device(size_t i, uint8_t *device) {
+    device[0] = 0xAA;
+    device[1] = 0xBB;
+    device[2] = (uint8_t)(i >> 24);
+    device[3] = (uint8_t)(i >> 16);
+    device[4] = (uint8_t)(i >> 8);
+    device[5] = (uint8_t)i;
+}
+
+int main(int argc, char *argv[]) {
+    char directory[] = "/tmp/keystore_benchXXXXXX";
+    char path[64], username[32];
+    size_t entry_count = 10000, lookups = 1000000, i, count;
+    keystore_entry_t *entries;
+    keystore_t *keystore;
+    uint8_t device[6];
+    volatile long found = 0;
+    double start, open_ns, user_ns, device_ns;
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "e:n:")) != -1) {
+        switch (opt) {
+        case 'e': entry_count = strtoul(optarg, NULL, 10); break;
+        case 'n': lookups = strtoul(optarg, NULL, 10); break;
+        default:
+            fprintf(stderr, "Usage: %s [-e entries] [-n lookups]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (entry_count == 0 || lookups == 0) {
+        fprintf(stderr, "%s: entries and lookups must be positive\n", argv[0]);
+        return 1;
+    }
+    
+    if (!mkdtemp(directory)) {
+        perror("keystore_bench: mkdtemp");
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/keystore", directory);
+    
+    entries = calloc(entry_count, sizeof(*entries));
+    if (!entries) {
+        rmdir(directory);
+        return 1;
+    }
+    for (i = 0; i < entry_count; i++) {
+        snprintf(entries[i].username, sizeof(entries[i].username), "user%zu", i);
+        entries[i].has_device = 1;
+        make_device(i, entries[i].device);
+        entries[i].secret_length = 32;
+        memset(entries[i].secret, 'k', 32);
+    }
+    
+    start = now_ns();
+    if (!keystore_write(path, entries, entry_count)) {
+        perror("keystore_bench: keystore_write");
+        free(entries);
+        rmdir(directory);
+        return 1;
+    }
+    printf("write   %8zu entries  %8.2f ms\n", entry_count, (now_ns() - start) / 1e6);
+    free(entries);
+    
+    start = now_ns();
+    keystore = keystore_open(path);
+    open_ns = now_ns() - start;
+    if (!keystore) {
+        fprintf(stderr, "keystore_bench: could not open %s\n", path);
+        unlink(path);
+        rmdir(directory);
+        return 1;
+    }
+    
+    start = now_ns();
+    for (i = 0; i < lookups; i++) {
+        snprintf(username, sizeof(username), "user%zu", (i * 7919) % entry_count);
+        found += keystore_find_user(keystore, username, &count);
+    }
+    user_ns = (now_ns() - start) / lookups;
+    
+    start = now_ns();
+    for (i = 0; i < lookups; i++) {
+        make_device((i * 7919) % entry_count, device);
+        found += keystore_find_device(keystore, device);
+    }
+    device_ns = (now_ns() - start) / lookups;
+    
+    printf("open    %8zu entries  %8.2f ms\n", entry_count, open_ns / 1e6);
+    printf("lookup  by username    %8.1f ns (including formatting the name)\n", user_ns);
+    printf("lookup  by device      %8.1f ns\n", device_ns);
+    
+    keystore_close(keystore);
+    unlink(path);
+    rmdir(directory);
+    return 0;
+}
@@ -0,0 +1,143 @@
+/*
+ * TapIn Log Benchmark
+ * Compares syslog() on the request path with the async log ring
+ *
+ * Times the caller's side of logging a typical per-request message: a
+ * direct syslog() call; async_log() in bursts the ring can hold, with the
+ * drain thread catching up between them (not timed); async_log() into a
+ * full ring, where records are dropped; and async_log() below the runtime
+ * level. With -d the log sink takes that many microseconds per message,
+ * like a busy journald: syslog() callers then block, while the ring only
+ * drops and counts what it cannot hold.
+ *
+ * If there is no /dev/log the benchmark binds its own sink there (needs
+ * root); otherwise messages go to the system's syslog daemon.
+ *
+ * Usage: log_bench [-n messages] [-d sink_delay_us]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "async_log.h"
+
+#define LOG_SOCKET "/dev/log"
+#define BURST (ASYNC_LOG_RING_SIZE / 2 - 1)
+
+static int sink_fd = -1;
+static int sink_delay_us = 0;
+static volatile int sink_stop = 0;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *sink_thread(void *arg) {
+    char buffer[2048];
+    (void)arg;
+
+    while (!sink_stop) {
+        if (recv(sink_fd, buffer, sizeof(buffer), 0) > 0 && sink_delay_us > 0) {
+            usleep(sink_delay_us);
+        }
+    }
+    return NULL;
+}
+
+static int start_sink(pthread_t *thread) {
+    struct sockaddr_un addr;
+    struct timeval timeout = { 0, 100000 };
+
+    if (access(LOG_SOCKET, F_OK) == 0) {
+        printf("Using the system syslog daemon at %s\n", LOG_SOCKET);
+        return 0;
+    }
+
+    sink_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, LOG_SOCKET, sizeof(addr.sun_path) - 1);
+    if (sink_fd < 0 || bind(sink_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Could not bind a log sink at " LOG_SOCKET);
+        exit(1);
+    }
+    setsockopt(sink_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    pthread_create(thread, NULL, sink_thread, NULL);
+    return 1;
+}
+
+static void print_result(const char *label, double elapsed_ns, int messages) {
+    printf("%-28s %8.1f ns/msg\n", label, elapsed_ns / messages);
+}
+
+int main(int argc, char *argv[]) {
+    pthread_t sink;
+    int messages = 20000;
+    int opt, i, own_sink;
+    double start, elapsed = 0;
+
+    while ((opt = getopt(argc, argv, "n:d:")) != -1) {
+        switch (opt) {
+        case 'n': messages = atoi(optarg); break;
+        case 'd': sink_delay_us = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-n messages] [-d sink_delay_us]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    own_sink = start_sink(&sink);
+    openlog("tapin_log_bench", LOG_PID, LOG_DAEMON);
+
+    // The message the helper logs for every accepted request
+    start = now_ns();
+    for (i = 0; i < messages; i++) {
+        syslog(LOG_INFO, "Authentication request validated successfully for user: %s", "bench");
+    }
+    print_result("syslog()", now_ns() - start, messages);
+
+    async_log_start();
+
+    for (i = 0; i < messages; i += BURST) {
+        int burst = messages - i < BURST ? messages - i : BURST;
+        start = now_ns();
+        for (int j = 0; j < burst; j++) {
+            async_log(LOG_INFO, "Authentication request validated successfully for user: %s", "bench");
+        }
+        elapsed += now_ns() - start;
+        usleep((ASYNC_LOG_DRAIN_INTERVAL_MS + 20) * 1000);
+    }
+    print_result("async_log()", elapsed, messages);
+    printf("  dropped %lu\n", async_log_dropped());
+
+    start = now_ns();
+    for (i = 0; i < messages; i++) {
+        async_log(LOG_INFO, "Authentication request validated successfully for user: %s", "bench");
+    }
+    print_result("async_log(), ring full", now_ns() - start, messages);
+    printf("  dropped %lu\n", async_log_dropped());
+
+    start = now_ns();
+    for (i = 0; i < messages; i++) {
+        async_log(LOG_DEBUG, "Authentication request validated successfully for user: %s", "bench");
+    }
+    print_result("async_log(), filtered out", now_ns() - start, messages);
+
+    async_log_stop();
+
+    closelog();
+    if (own_sink) {
+        sink_stop = 1;
+        pthread_join(sink, NULL);
+        close(sink_fd);
+        unlink(LOG_SOCKET);
+    }
+    return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * TapIn PAM Harness
+ * Minimal libpam stand-in for driving the module from a benchmark
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <security/pam_appl.h>
+#include <security/pam_modules.h>
+#include <security/pam_ext.h>
+#include "pam_harness.h"
+
+PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv);
+
+struct pam_handle {
+    const char *user;
+    const char *service;
+};
+
+int pam_get_user(pam_handle_t *pamh, const char **user, const char *prompt) {
+    (void)prompt;
+    *user = pamh->user;
+    return PAM_SUCCESS;
+}
+
+int pam_get_item(const pam_handle_t *pamh, int item_type, const void **item) {
+    switch (item_type) {
+    case PAM_USER: *item = pamh->user; break;
+    case PAM_SERVICE: *item = pamh->service; break;
+    default: *item = NULL; break;
+    }
+    return PAM_SUCCESS;
+}
+
+// Prompts would go to the user's terminal; a benchmark has none
+int pam_info(pam_handle_t *pamh, const char *fmt, ...) {
+    (void)pamh;
+    (void)fmt;
+    return PAM_SUCCESS;
+}
+
+void pam_syslog(const pam_handle_t *pamh, int priority, const char *fmt, ...) {
+    va_list args;
+    (void)pamh;
+    (void)priority;
+
+    va_start(args, fmt);
+    fputs("pam_tapin: ", stderr);
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+int pam_harness_authenticate(const char *user, const char *service, unsigned int wait_ms,
+                             const char *broker_socket) {
+    struct pam_handle handle = { user, service };
+    char wait_option[32], socket_option[128];
+    const char *argv[2];
+    int argc = 0;
+
+    if (wait_ms > 0) {
+        snprintf(wait_option, sizeof(wait_option), "wait=%ums", wait_ms);
+        argv[argc++] = wait_option;
+    }
+    if (broker_socket) {
+        snprintf(socket_option, sizeof(socket_option), "socket=%s", broker_socket);
+        argv[argc++] = socket_option;
+    }
+    return pam_sm_authenticate(&handle, PAM_SILENT, argc, argv);
+}
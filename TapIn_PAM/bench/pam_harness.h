@@ -0,0 +1,22 @@
+/*
+ * TapIn PAM Harness
+ * Runs the TapIn PAM module in-process, without a PAM stack
+ *
+ * The harness supplies the handful of libpam calls the module makes, so a
+ * benchmark can call pam_sm_authenticate directly, the way sshd or a
+ * display manager would through libpam, and time the broker round trip.
+ */
+
+#ifndef TAPIN_PAM_HARNESS_H
+#define TAPIN_PAM_HARNESS_H
+
+/*
+ * Authenticate user through the module with the given service name
+ * wait_ms is passed as the module's wait= option (0 to only consume), and
+ * broker_socket as its socket= option (NULL for the default)
+ * Returns the module's PAM result code
+ */
+int pam_harness_authenticate(const char *user, const char *service, unsigned int wait_ms,
+                             const char *broker_socket);
+
+#endif /* TAPIN_PAM_HARNESS_H */
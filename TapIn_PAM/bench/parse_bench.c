@@ -0,0 +1,280 @@
+/*
+ * TapIn Request Parsing Benchmark
+ * Compares the per-request decoding work of the request paths
+ *
+ * "json twice" is the original path: the listener parses the phone's JSON
+ * to check its format and throws the result away, then the helper parses
+ * the same text again to validate it. "json-c once" decodes the JSON once
+ * with json-c into a tapin_auth_record_t that the helper only checks.
+ * "in place" is the JSON path today: the same record, filled by the
+ * schema-specific parser in auth_record.c. "binary" decodes the same
+ * request sent in the binary layout newer apps use. All stop short of the
+ * HMAC itself, which is the same work either way.
+ *
+ * Allocations are counted by interposing malloc and friends.
+ *
+ * Usage: parse_bench [-n iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <json-c/json.h>
+#include "auth_record.h"
+
+static const char *sample_request =
+    "{\"username\":\"alice\",\"timestamp\":\"1760000000\",\"nonce\":\"Zx81kQp0aLm3Tn7v\","
+    "\"hmac\":\"9f86d081884c7d659a2feaa0c55ad015a3bf4f1b2b0b822cd15d6c15b0f00a08\"}";
+static size_t sample_length;
+
+// The same request in the binary layout, with a 16-byte nonce
+static uint8_t sample_binary[AUTH_WIRE_HEADER_LENGTH + 5 + 16];
+
+/*
+ * Allocation counting
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long allocations = 0;
+
+void *malloc(size_t size) {
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    allocations++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+/*
+ * The old path, as the listener and helper used to do it
+ */
+static int listener_validate_format(const char *data) {
+    struct json_object *json_obj, *username_obj, *timestamp_obj, *nonce_obj, *hmac_obj;
+
+    json_obj = json_tokener_parse(data);
+    if (!json_obj) {
+        return 0;
+    }
+    if (!json_object_object_get_ex(json_obj, "username", &username_obj) ||
+        !json_object_object_get_ex(json_obj, "timestamp", &timestamp_obj) ||
+        !json_object_object_get_ex(json_obj, "nonce", &nonce_obj) ||
+        !json_object_object_get_ex(json_obj, "hmac", &hmac_obj) ||
+        !json_object_is_type(username_obj, json_type_string) ||
+        !json_object_is_type(timestamp_obj, json_type_string) ||
+        !json_object_is_type(nonce_obj, json_type_string) ||
+        !json_object_is_type(hmac_obj, json_type_string) ||
+        strlen(json_object_get_string(username_obj)) > 64 ||
+        strlen(json_object_get_string(timestamp_obj)) > 20 ||
+        strlen(json_object_get_string(nonce_obj)) > 64 ||
+        strlen(json_object_get_string(hmac_obj)) > 128) {
+        json_object_put(json_obj);
+        return 0;
+    }
+    json_object_put(json_obj);
+    return 1;
+}
+
+static int helper_prepare_json(const char *data, char *signed_data, size_t size) {
+    struct json_object *json_obj, *username_obj, *timestamp_obj, *nonce_obj, *hmac_obj;
+
+    json_obj = json_tokener_parse(data);
+    if (!json_obj) {
+        return 0;
+    }
+    if (!json_object_object_get_ex(json_obj, "username", &username_obj) ||
+        !json_object_object_get_ex(json_obj, "timestamp", &timestamp_obj) ||
+        !json_object_object_get_ex(json_obj, "nonce", &nonce_obj) ||
+        !json_object_object_get_ex(json_obj, "hmac", &hmac_obj)) {
+        json_object_put(json_obj);
+        return 0;
+    }
+    volatile long timestamp = atol(json_object_get_string(timestamp_obj));
+    (void)timestamp;
+    snprintf(signed_data, size, "%s:%s:%s", json_object_get_string(username_obj),
+             json_object_get_string(timestamp_obj), json_object_get_string(nonce_obj));
+
+    // Username looked up again for token creation
+    json_object_object_get_ex(json_obj, "username", &username_obj);
+    json_object_put(json_obj);
+    return 1;
+}
+
+static int json_twice(char *signed_data, size_t size) {
+    return listener_validate_format(sample_request) && helper_prepare_json(sample_request, signed_data, size);
+}
+
+/*
+ * Single json-c parse into a record, as the listener did before the
+ * in-place parser
+ */
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static int json_c_record(const char *data, tapin_auth_record_t *record) {
+    struct json_object *json_obj, *username_obj, *timestamp_obj, *nonce_obj, *hmac_obj;
+    const char *hmac;
+    int i;
+
+    memset(record, 0, sizeof(*record));
+    json_obj = json_tokener_parse(data);
+    if (!json_obj) {
+        return 0;
+    }
+    if (!json_object_object_get_ex(json_obj, "username", &username_obj) ||
+        !json_object_object_get_ex(json_obj, "timestamp", &timestamp_obj) ||
+        !json_object_object_get_ex(json_obj, "nonce", &nonce_obj) ||
+        !json_object_object_get_ex(json_obj, "hmac", &hmac_obj) ||
+        !json_object_is_type(username_obj, json_type_string) ||
+        !json_object_is_type(timestamp_obj, json_type_string) ||
+        !json_object_is_type(nonce_obj, json_type_string) ||
+        !json_object_is_type(hmac_obj, json_type_string) ||
+        strlen(json_object_get_string(username_obj)) > TAPIN_AUTH_USERNAME_LENGTH ||
+        strlen(json_object_get_string(nonce_obj)) > TAPIN_AUTH_NONCE_LENGTH ||
+        strlen(json_object_get_string(hmac_obj)) != TAPIN_AUTH_MAC_LENGTH * 2) {
+        json_object_put(json_obj);
+        return 0;
+    }
+
+    record->version = TAPIN_AUTH_RECORD_VERSION;
+    record->timestamp = atoll(json_object_get_string(timestamp_obj));
+    strcpy(record->username, json_object_get_string(username_obj));
+    strcpy(record->nonce, json_object_get_string(nonce_obj));
+    record->username_length = strlen(record->username);
+    record->nonce_length = strlen(record->nonce);
+    hmac = json_object_get_string(hmac_obj);
+    for (i = 0; i < TAPIN_AUTH_MAC_LENGTH; i++) {
+        record->mac[i] = (uint8_t)(hex_value(hmac[i * 2]) << 4 | hex_value(hmac[i * 2 + 1]));
+    }
+
+    json_object_put(json_obj);
+    return 1;
+}
+
+static int json_c_once(char *signed_data, size_t size) {
+    tapin_auth_record_t record;
+
+    return json_c_record(sample_request, &record) &&
+           auth_record_valid(&record, sizeof(record)) &&
+           auth_record_signed_data(&record, signed_data, size) > 0;
+}
+
+static int in_place(char *signed_data, size_t size) {
+    tapin_auth_record_t record;
+
+    return auth_record_from_json(sample_request, sample_length, &record) &&
+           auth_record_valid(&record, sizeof(record)) &&
+           auth_record_signed_data(&record, signed_data, size) > 0;
+}
+
+static int binary(char *signed_data, size_t size) {
+    tapin_auth_record_t record;
+
+    return auth_record_from_message(sample_binary, sizeof(sample_binary), &record) &&
+           auth_record_valid(&record, sizeof(record)) &&
+           auth_record_signed_data(&record, signed_data, size) > 0;
+}
+
+/*
+ * Encode the sample request in the binary layout
+ */
+static void build_binary(void) {
+    static const uint8_t nonce[16] = "Zx81kQp0aLm3Tn7v";
+    uint64_t timestamp = 1760000000;
+    int i;
+
+    sample_binary[0] = AUTH_WIRE_BINARY_V1;
+    sample_binary[1] = 0;
+    sample_binary[2] = 5;
+    sample_binary[3] = sizeof(nonce);
+    for (i = 0; i < 8; i++) {
+        sample_binary[4 + i] = (uint8_t)(timestamp >> (56 - 8 * i));
+    }
+    auth_mac_from_hex("9f86d081884c7d659a2feaa0c55ad015a3bf4f1b2b0b822cd15d6c15b0f00a08", 64, sample_binary + 12);
+    memcpy(sample_binary + AUTH_WIRE_HEADER_LENGTH, "alice", 5);
+    memcpy(sample_binary + AUTH_WIRE_HEADER_LENGTH + 5, nonce, sizeof(nonce));
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void run(const char *name, int (*path)(char *, size_t), int iterations) {
+    char signed_data[256];
+    unsigned long before;
+    double start;
+    int i;
+
+    // Warm up
+    for (i = 0; i < iterations / 10; i++) {
+        path(signed_data, sizeof(signed_data));
+    }
+
+    before = allocations;
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        if (!path(signed_data, sizeof(signed_data))) {
+            fprintf(stderr, "%s: sample request rejected\n", name);
+            exit(1);
+        }
+    }
+    double elapsed = now_ns() - start;
+
+    printf("%-12s %8.0f ns/request  %9.0f requests/s  %6.1f allocations/request\n", name,
+           elapsed / iterations, iterations / (elapsed / 1e9), (double)(allocations - before) / iterations);
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = 200000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n': iterations = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-n iterations]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (iterations <= 0) {
+        iterations = 1;
+    }
+
+    sample_length = strlen(sample_request);
+    build_binary();
+
+    printf("Request size: %zu bytes as JSON, %zu binary\n", sample_length, sizeof(sample_binary));
+    run("json twice", json_twice, iterations);
+    run("json-c once", json_c_once, iterations);
+    run("in place", in_place, iterations);
+    run("binary", binary, iterations);
+    return 0;
+}
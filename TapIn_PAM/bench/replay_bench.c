@@ -0,0 +1,146 @@
+/*
+ * TapIn Replay Cache Benchmark
+ * Drives the replay cache at a fixed request rate over simulated time
+ *
+ * Each simulated second brings `rate` fresh requests, with timestamps
+ * up to a few seconds behind the clock as phones' clocks drift, plus
+ * replays of recently accepted ones. The run reports cache checks per
+ * second of CPU time, the memory reserved for the rate, and how much of
+ * it was actually touched.
+ *
+ * Usage: replay_bench [-r rate] [-s seconds] [-p replay_percent]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "replay_cache.h"
+
+#define WINDOW_SECONDS 30
+#define MAX_SKEW_SECONDS 3
+#define RECENT_DIGESTS 4096
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t next_random(void) {
+    // xorshift64*: fast, and the digests only need to look random
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static long resident_kib(void) {
+    long pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    
+    if (statm) {
+        if (fscanf(statm, "%*d %ld", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(statm);
+    }
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int run(unsigned rate, int seconds, int replay_percent) {
+    static struct {
+        int64_t timestamp;
+        uint8_t digest[8];
+    } recent[RECENT_DIGESTS];
+    unsigned long checks = 0, fresh = 0, seen = 0, full = 0, recent_count = 0;
+    long rss_before = resident_kib();
+    int64_t second = 1760000000;
+    double elapsed = 0;
+    int s;
+    
+    if (!replay_cache_init(WINDOW_SECONDS, rate)) {
+        fprintf(stderr, "replay_bench: could not allocate cache for %u requests/s\n", rate);
+        return 0;
+    }
+    
+    for (s = 0; s < seconds; s++, second++) {
+        unsigned i;
+        double start = now_ns();
+    
+        for (i = 0; i < rate; i++) {
+            uint8_t digest[8];
+            int64_t timestamp;
+            replay_result_t result;
+    
+            if (recent_count > 0 && next_random() % 100 < (uint64_t)replay_percent) {
+                size_t pick = next_random() % (recent_count < RECENT_DIGESTS ? recent_count : RECENT_DIGESTS);
+                result = replay_cache_check(recent[pick].timestamp, recent[pick].digest);
+            } else {
+                uint64_t value = next_random();
+                memcpy(digest, &value, sizeof(digest));
+                timestamp = second - (int64_t)(next_random() % (MAX_SKEW_SECONDS + 1));
+                result = replay_cache_check(timestamp, digest);
+                if (result == REPLAY_FRESH) {
+                    size_t slot = recent_count++ % RECENT_DIGESTS;
+                    recent[slot].timestamp = timestamp;
+                    memcpy(recent[slot].digest, digest, sizeof(digest));
+                }
+            }
+    
+            checks++;
+            fresh += result == REPLAY_FRESH;
+            seen += result == REPLAY_SEEN;
+            full += result == REPLAY_FULL;
+        }
+    
+        elapsed += now_ns() - start;
+    }
+    
+    printf("%7u req/s  %6.1f ns/check  %6.1fM checks/s  reserved %7zu KiB  touched %7ld KiB"
+           "  (%lu fresh, %lu replays caught, %lu refused)\n",
+           rate, elapsed / checks, checks / (elapsed / 1e9) / 1e6, replay_cache_memory() / 1024,
+           resident_kib() - rss_before, fresh, seen, full);
+    
+    replay_cache_free();
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned rates[8] = { 10000, 100000 };
+    int rate_count = 2, seconds = 120, replay_percent = 10;
+    int explicit_rates = 0;
+    int opt, i;
+    
+    while ((opt = getopt(argc, argv, "r:s:p:")) != -1) {
+        switch (opt) {
+        case 'r':
+            if (!explicit_rates) {
+                rate_count = 0;
+                explicit_rates = 1;
+            }
+            if (rate_count < 8) {
+                rates[rate_count++] = (unsigned)atoi(optarg);
+            }
+            break;
+        case 's': seconds = atoi(optarg); break;
+        case 'p': replay_percent = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-r rate]... [-s seconds] [-p replay_percent]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (seconds <= 0) {
+        seconds = 1;
+    }
+    
+    for (i = 0; i < rate_count; i++) {
+        if (rates[i] == 0 || !run(rates[i], seconds, replay_percent)) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,172 @@
+#!/bin/bash
+
+# TapIn End-to-End Benchmark
+# Starts a private helper and listener (phones on a Unix socket instead of
+# RFCOMM), then drives them with tapin-loadgen through to the PAM module,
+# including beside a flood of bad requests from a second process, with and
+# without rate limits, answering challenges instead of sending timestamps,
+# and keeping connections open or sending requests a byte at a time. Then
+# does the same against the helper alone in
+# combined mode, where phone sessions validate and issue tokens in-process.
+# Run from the TapIn_PAM directory after "make all bench". Every socket,
+# the config file and the keystore are private to a scratch directory, so
+# a running TapIn install is left alone.
+
+set -e
+
+# The broker only hands another user's token to root, and the phones log
+# in as made-up users; a user namespace makes us its root, nothing more
+if [[ $EUID -ne 0 ]]; then
+    if ! unshare --user --map-root-user true 2>/dev/null; then
+        echo "End-to-end benchmark needs root or unprivileged user namespaces (unshare -r)" >&2
+        exit 1
+    fi
+    exec unshare --user --map-root-user "$0" "$@"
+fi
+
+LOADGEN=bench/tapin-loadgen
+WORKDIR=$(mktemp -d /tmp/tapin-bench.XXXXXX)
+CONFIG="$WORKDIR/tapin.conf"
+PHONE_SOCKET="$WORKDIR/phone.sock"
+HELPER_SOCKET="$WORKDIR/helper.sock"
+BROKER_SOCKET="$WORKDIR/broker.sock"
+HELPER_PID=
+LISTENER_PID=
+
+# Function to stop whichever daemons are running
+stop_daemons() {
+    [[ -n "$LISTENER_PID" ]] && kill "$LISTENER_PID" 2>/dev/null && wait "$LISTENER_PID" 2>/dev/null
+    [[ -n "$HELPER_PID" ]] && kill "$HELPER_PID" 2>/dev/null && wait "$HELPER_PID" 2>/dev/null
+    LISTENER_PID=
+    HELPER_PID=
+}
+
+# Function to stop the daemons and remove the scratch directory
+cleanup() {
+    stop_daemons
+    rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+# Function to wait for a daemon to create its socket
+wait_for_socket() {
+    for _ in $(seq 50); do
+        [[ -S "$1" ]] && return 0
+        sleep 0.1
+    done
+    echo "Timed out waiting for $1"
+    exit 1
+}
+
+# Function to run one load pattern
+run() {
+    echo "== tapin-loadgen $*"
+    "$LOADGEN" -L "$PHONE_SOCKET" -b "$BROKER_SOCKET" -k "$WORKDIR/secret" "$@" || echo "(some requests failed)"
+    echo
+}
+
+# One loadgen process is one peer, so it would trip the per-phone limits
+NO_LIMITS="--device-rate 0 --user-rate 0"
+
+# Limits scaled so the clients below stay under them: per phone 300/s,
+# per user 50/s
+BENCH_LIMITS="--device-rate 18000 --device-burst 50 --user-rate 3000 --user-burst 20"
+
+# Function to start a listener for the split layout
+start_listener() {
+    ./bluetooth_listener --config "$CONFIG" --helper-socket "$HELPER_SOCKET" \
+        --transport "unix:$PHONE_SOCKET" --workers 8 --queue 256 \
+        --stats-socket "$WORKDIR/listener-stats.sock" "$@" &
+    LISTENER_PID=$!
+    wait_for_socket "$PHONE_SOCKET"
+}
+
+# Function to stop just the listener
+stop_listener() {
+    kill "$LISTENER_PID" 2>/dev/null && wait "$LISTENER_PID" 2>/dev/null
+    LISTENER_PID=
+    rm -f "$PHONE_SOCKET"
+}
+
+# Function to run every load pattern
+run_all() {
+    run -c 16 -n 200
+    run -c 16 -n 200 -P
+    run -c 64 -n 50 -r 2000 -P
+}
+
+# Built-in defaults, whatever /etc/tapin/tapin.conf says
+: > "$CONFIG"
+
+# One wildcard secret; tapinctl prints the one it generates
+./tapinctl --keystore "$WORKDIR/keystore" add '*' - > "$WORKDIR/secret"
+
+# Room in the replay cache for the bursts below
+./tapin_helper --config "$CONFIG" --helper-socket "$HELPER_SOCKET" --broker-socket "$BROKER_SOCKET" \
+    --keystore "$WORKDIR/keystore" --replay-rate 20000 --audit-dir "$WORKDIR/audit" \
+    --stats-socket "$WORKDIR/helper-stats.sock" &
+HELPER_PID=$!
+wait_for_socket "$HELPER_SOCKET"
+
+start_listener $NO_LIMITS
+
+echo "### Split: listener and helper"
+echo
+run_all
+
+# 8 well-behaved phones at 200 logins/s, alone and beside a flood
+echo "### Flood: split, no rate limits"
+echo
+run -c 8 -n 100 -r 200 -P
+run -c 8 -n 100 -r 200 -P -F 8
+stop_listener
+
+start_listener $BENCH_LIMITS
+
+echo "### Flood: split, rate limited"
+echo
+run -c 8 -n 100 -r 200 -P -F 8
+stop_listener
+
+# Phones answer the listener's challenge; with clocks 45 s out, only
+# challenge responses get through
+start_listener $NO_LIMITS --challenge
+
+echo "### Challenge: split, listener with --challenge"
+echo
+run -c 16 -n 200 -C
+run -c 16 -n 200 -C -P
+run -c 16 -n 200 -C -B -P
+run -c 8 -n 200 -C -K -P
+run -c 8 -n 50 -C -S 45 -P
+stop_listener
+
+start_listener $NO_LIMITS
+
+echo "### Timestamped: split, skewed clocks, then binary layout"
+echo
+run -c 8 -n 50 -S 45 -P
+run -c 16 -n 200 -B -P
+stop_listener
+
+# A worker per phone, since kept-alive phones hold on to theirs
+start_listener $NO_LIMITS --workers 16
+
+echo "### Keep-alive: split, one connection per phone, then one byte per write"
+echo
+run -c 16 -n 200 -K -P
+run -c 16 -n 200 -T -P
+run -c 16 -n 200 -K -T -P
+stop_daemons
+
+# The same sessions, one process, no helper socket
+./tapin_helper --config "$CONFIG" --broker-socket "$BROKER_SOCKET" \
+    --keystore "$WORKDIR/keystore" --replay-rate 20000 --audit-dir "$WORKDIR/audit" \
+    --transport "unix:$PHONE_SOCKET" --workers 8 --queue 256 $NO_LIMITS \
+    --stats-socket "$WORKDIR/helper-stats.sock" --listener-stats-socket "$WORKDIR/listener-stats.sock" &
+HELPER_PID=$!
+wait_for_socket "$PHONE_SOCKET"
+
+echo "### Combined: helper with --transport"
+echo
+run_all
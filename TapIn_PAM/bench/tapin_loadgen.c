@@ -0,0 +1,661 @@
+/*
+ * TapIn Load Generator
+ * Drives the whole login path with simulated phones and PAM logins
+ *
+ * Each client thread plays one phone: it connects to the Bluetooth
+ * listener, sends a request signed the way the mobile app signs it
+ * (HMAC-SHA256 over username:timestamp:nonce, hex in JSON) and waits for
+ * ACK or ERR. With -P the same thread then logs the user in through the
+ * real PAM module, run in-process by the PAM harness, which collects the
+ * token from the helper's broker.
+ *
+ * The listener is reached over its Unix socket transport
+ * (--transport unix:PATH), which stands in for RFCOMM on machines without
+ * Bluetooth. With -r the clients share a fixed request rate and latency is
+ * measured from when each request was due, so a slow daemon cannot hide
+ * its queueing delay by slowing the clients down.
+ *
+ * With -F a separate process floods the listener alongside the clients,
+ * from that many threads, with requests carrying a bad MAC. Being another
+ * process it is another peer, so it stands in for one hostile phone.
+ *
+ * With -C the phones expect a listener started with --challenge: each reads
+ * the listener's challenge line and answers it (HMAC-SHA256 over
+ * username:challenge:<challenge>) instead of sending a timestamp. -S skews
+ * the phones' clocks by that many seconds, which only timestamped requests
+ * notice. With -B requests go in the binary layout instead of JSON.
+ *
+ * With -K each phone keeps one connection open (KEEPALIVE) and sends all
+ * its requests over it, so only the first pays for connecting. With -T
+ * requests are sent one byte per write, so the listener has to put them
+ * back together from many partial reads.
+ *
+ * -b points the PAM module at a helper whose broker socket is not at the
+ * default path.
+ *
+ * Usage: tapin-loadgen [-c clients] [-n requests] [-r rate] [-P] [-F flooders] [-C]
+ *                      [-S skew] [-B] [-K] [-T] [-L listener_socket] [-k secret_file]
+ *                      [-u user_prefix] [-b broker_socket]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <openssl/hmac.h>
+#include <security/pam_appl.h>
+#include "pam_harness.h"
+#include "random_pool.h"
+#include "auth_record.h"
+
+#define DEFAULT_LISTENER_SOCKET "/tmp/tapin_phone.sock"
+#define DEFAULT_SECRET_FILE "/etc/tapin/shared_secret"
+#define NONCE_LENGTH 16
+#define BINARY_NONCE_LENGTH 16
+#define CHALLENGE_LENGTH 64
+#define PAM_SERVICE_NAME "tapin-loadgen"
+
+static const char *listener_socket = DEFAULT_LISTENER_SOCKET;
+static const char *broker_socket = NULL;
+static const char *user_prefix = "loadgen";
+static char secret[256];
+static int requests_per_client = 200;
+static int clients = 16;
+static double rate = 0;
+static int use_pam = 0;
+static int flooders = 0;
+static int challenge_mode = 0;
+static int binary_mode = 0;
+static int keepalive_mode = 0;
+static int trickle_mode = 0;
+static long skew = 0;
+static double start_ms;
+static volatile sig_atomic_t flood_stop = 0;
+
+// What the listener answered
+enum {
+    ANSWER_NONE = -1,    // No connection or no answer
+    ANSWER_ERR,
+    ANSWER_ACK,
+    ANSWER_BUSY
+};
+
+// Latencies kept for each completed request
+enum {
+    SERIES_PHONE,        // Connect (send, with -K) until ACK
+    SERIES_PAM,          // ACK until the PAM module returns
+    SERIES_TOTAL,        // Due time until done (logged in, with -P)
+    SERIES_COUNT
+};
+
+// A phone's connection to the listener; with -K it outlives one request
+typedef struct {
+    int sock;
+    char buffer[256];    // Listener output not yet read as lines
+    size_t length;
+    char challenge[CHALLENGE_LENGTH + 1];
+} phone_link_t;
+
+typedef struct {
+    int id;
+    double *latencies[SERIES_COUNT];
+    int completed;
+    int rejected;        // Listener answered ERR
+    int busy;            // Listener answered BUSY
+    int failed;          // No connection or no answer
+    int pam_failed;      // ACKed, but PAM found no token
+} client_t;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void sleep_until(double when_ms) {
+    double wait = when_ms - now_ms();
+    if (wait > 0) {
+        long long ns = (long long)(wait * 1e6);
+        struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+static int connect_listener(void) {
+    struct sockaddr_un addr;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, listener_socket, sizeof(addr.sun_path) - 1);
+
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/*
+ * Build the binary request as the mobile app does
+ */
+static int build_binary_request(char *out, size_t size, const char *username, const char *challenge) {
+    static const char hex[] = "0123456789abcdef";
+    unsigned char mac[EVP_MAX_MD_SIZE], *message = (unsigned char *)out;
+    unsigned char nonce[BINARY_NONCE_LENGTH];
+    unsigned int mac_len = 0, i;
+    int length;
+    char nonce_hex[2 * BINARY_NONCE_LENGTH + 1], data[256];
+    size_t username_length = strlen(username), nonce_length = challenge ? 0 : sizeof(nonce);
+    unsigned long long timestamp = challenge ? 0 : (unsigned long long)(time(NULL) + skew);
+
+    if (size < AUTH_WIRE_HEADER_LENGTH + username_length + nonce_length) {
+        return 0;
+    }
+    if (challenge) {
+        length = snprintf(data, sizeof(data), "%s:challenge:%s", username, challenge);
+    } else {
+        if (!random_bytes(nonce, sizeof(nonce))) {
+            return 0;
+        }
+        for (i = 0; i < sizeof(nonce); i++) {
+            nonce_hex[2 * i] = hex[nonce[i] >> 4];
+            nonce_hex[2 * i + 1] = hex[nonce[i] & 0x0f];
+        }
+        nonce_hex[2 * sizeof(nonce)] = '\0';
+        length = snprintf(data, sizeof(data), "%s:%llu:%s", username, timestamp, nonce_hex);
+    }
+    if (length < 0 || length >= (int)sizeof(data)) {
+        return 0;
+    }
+    HMAC(EVP_sha256(), secret, strlen(secret), (unsigned char *)data, length, mac, &mac_len);
+
+    message[0] = AUTH_WIRE_BINARY_V1;
+    message[1] = challenge ? AUTH_WIRE_CHALLENGE : 0;
+    message[2] = (unsigned char)username_length;
+    message[3] = (unsigned char)nonce_length;
+    for (i = 0; i < 8; i++) {
+        message[4 + i] = (unsigned char)(timestamp >> (56 - 8 * i));
+    }
+    memcpy(message + 12, mac, TAPIN_AUTH_MAC_LENGTH);
+    memcpy(message + AUTH_WIRE_HEADER_LENGTH, username, username_length);
+    memcpy(message + AUTH_WIRE_HEADER_LENGTH + username_length, nonce, nonce_length);
+    return (int)(AUTH_WIRE_HEADER_LENGTH + username_length + nonce_length);
+}
+
+/*
+ * Build the JSON request exactly as the mobile app does: timestamped, or
+ * answering challenge if there is one
+ */
+static int build_request(char *out, size_t size, const char *username, const char *challenge) {
+    static const char hex[] = "0123456789abcdef";
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    unsigned int mac_len = 0, i;
+    char nonce[NONCE_LENGTH + 1], data[256], mac_hex[2 * EVP_MAX_MD_SIZE + 1];
+    long long timestamp = time(NULL) + skew;
+
+    if (binary_mode) {
+        return build_binary_request(out, size, username, challenge);
+    }
+
+    if (challenge) {
+        snprintf(data, sizeof(data), "%s:challenge:%s", username, challenge);
+    } else {
+        if (!random_token(nonce, sizeof(nonce))) {
+            return 0;
+        }
+        snprintf(data, sizeof(data), "%s:%lld:%s", username, timestamp, nonce);
+    }
+    HMAC(EVP_sha256(), secret, strlen(secret), (unsigned char *)data, strlen(data), mac, &mac_len);
+    for (i = 0; i < mac_len; i++) {
+        mac_hex[2 * i] = hex[mac[i] >> 4];
+        mac_hex[2 * i + 1] = hex[mac[i] & 0x0f];
+    }
+    mac_hex[2 * mac_len] = '\0';
+
+    if (challenge) {
+        return snprintf(out, size, "{\"username\":\"%s\",\"challenge\":\"%s\",\"hmac\":\"%s\"}",
+                        username, challenge, mac_hex);
+    }
+    return snprintf(out, size, "{\"username\":\"%s\",\"timestamp\":\"%lld\",\"nonce\":\"%s\",\"hmac\":\"%s\"}",
+                    username, timestamp, nonce, mac_hex);
+}
+
+/*
+ * Read one line from the listener, without its newline
+ */
+static int read_line(phone_link_t *link, char *line, size_t size) {
+    for (;;) {
+        char *newline = memchr(link->buffer, '\n', link->length);
+        if (newline) {
+            size_t length = newline - link->buffer;
+            if (length >= size) {
+                return 0;
+            }
+            memcpy(line, link->buffer, length);
+            line[length] = '\0';
+            link->length -= length + 1;
+            memmove(link->buffer, newline + 1, link->length);
+            return 1;
+        }
+        if (link->length == sizeof(link->buffer)) {
+            return 0;
+        }
+        ssize_t n = recv(link->sock, link->buffer + link->length, sizeof(link->buffer) - link->length, 0);
+        if (n <= 0) {
+            return 0;
+        }
+        link->length += n;
+    }
+}
+
+/*
+ * Keep a "CHALLENGE <hex>" line from the listener as the one to answer
+ * Returns 1 if line was a challenge
+ */
+static int take_challenge(phone_link_t *link, const char *line) {
+    if (strncmp(line, "CHALLENGE ", 10) != 0 || strlen(line + 10) != CHALLENGE_LENGTH) {
+        return 0;
+    }
+    memcpy(link->challenge, line + 10, CHALLENGE_LENGTH + 1);
+    return 1;
+}
+
+static void phone_hang_up(phone_link_t *link) {
+    if (link->sock >= 0) {
+        close(link->sock);
+        link->sock = -1;
+    }
+}
+
+/*
+ * Connect, read the challenge with -C and ask to be kept alive with -K
+ */
+static int phone_connect(phone_link_t *link) {
+    char line[128];
+
+    link->sock = connect_listener();
+    link->length = 0;
+    if (link->sock < 0) {
+        return 0;
+    }
+    if (challenge_mode && (!read_line(link, line, sizeof(line)) || !take_challenge(link, line))) {
+        phone_hang_up(link);
+        return 0;
+    }
+    if (keepalive_mode) {
+        if (send(link->sock, "KEEPALIVE\n", 10, MSG_NOSIGNAL) != 10 || !read_line(link, line, sizeof(line)) ||
+            strncmp(line, "KEEPALIVE ", 10) != 0) {
+            phone_hang_up(link);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int send_request(int sock, const char *request, int length) {
+    int i;
+
+    if (!trickle_mode) {
+        return send(sock, request, length, MSG_NOSIGNAL) == length;
+    }
+    for (i = 0; i < length; i++) {
+        if (send(sock, request + i, 1, MSG_NOSIGNAL) != 1) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * One request for username over the phone's link, with its MAC spoiled
+ * if asked: returns one of the ANSWER_* values
+ */
+static int phone_request(phone_link_t *link, const char *username, int spoil) {
+    char request[512], reply[128];
+    size_t received;
+    ssize_t n;
+    int length;
+
+    if (link->sock < 0 && !phone_connect(link)) {
+        return ANSWER_NONE;
+    }
+
+    length = build_request(request, sizeof(request), username, challenge_mode ? link->challenge : NULL);
+    if (length <= 0 || length >= (int)sizeof(request)) {
+        phone_hang_up(link);
+        return ANSWER_NONE;
+    }
+
+    // Spoil the MAC: its first byte, or in JSON the last hex digit, just
+    // before the closing "}
+    if (spoil && binary_mode) {
+        request[12] ^= 1;
+    } else if (spoil) {
+        request[length - 3] = request[length - 3] == '0' ? '1' : '0';
+    }
+
+    if (!send_request(link->sock, request, length)) {
+        phone_hang_up(link);
+        return ANSWER_NONE;
+    }
+
+    // A kept-alive session answers with a line, after the next challenge
+    if (keepalive_mode) {
+        while (read_line(link, reply, sizeof(reply))) {
+            if (take_challenge(link, reply)) {
+                continue;
+            }
+            if (strcmp(reply, "ACK") == 0) {
+                return ANSWER_ACK;
+            }
+            if (strcmp(reply, "BUSY") == 0) {
+                return ANSWER_BUSY;
+            }
+            if (strcmp(reply, "ERR") == 0) {
+                return ANSWER_ERR;
+            }
+            break;
+        }
+        phone_hang_up(link);
+        return ANSWER_NONE;
+    }
+
+    // Otherwise the listener closes the connection after its reply
+    received = link->length < 8 ? link->length : 8;
+    memcpy(reply, link->buffer, received);
+    while (received < 8 && (n = recv(link->sock, reply + received, 8 - received, 0)) > 0) {
+        received += n;
+    }
+    phone_hang_up(link);
+
+    if (received == 3 && memcmp(reply, "ACK", 3) == 0) {
+        return ANSWER_ACK;
+    }
+    if (received == 4 && memcmp(reply, "BUSY", 4) == 0) {
+        return ANSWER_BUSY;
+    }
+    return received == 3 && memcmp(reply, "ERR", 3) == 0 ? ANSWER_ERR : ANSWER_NONE;
+}
+
+/*
+ * One request, connecting again if a kept-alive connection turns out to
+ * have been closed by the listener (idle, or its worker was wanted)
+ */
+static int phone_session(phone_link_t *link, const char *username, int spoil) {
+    int reused = link->sock >= 0;
+    int answer = phone_request(link, username, spoil);
+
+    if (answer == ANSWER_NONE && reused) {
+        answer = phone_request(link, username, spoil);
+    }
+    return answer;
+}
+
+static void *client_thread(void *arg) {
+    client_t *client = arg;
+    phone_link_t link = { .sock = -1 };
+    char username[65];
+    double interval = rate > 0 ? clients * 1000.0 / rate : 0;
+    double due = start_ms + (rate > 0 ? client->id * 1000.0 / rate : 0);
+    int i;
+
+    snprintf(username, sizeof(username), "%s%d", user_prefix, client->id);
+
+    for (i = 0; i < requests_per_client; i++, due += interval) {
+        if (rate > 0) {
+            sleep_until(due);
+        } else {
+            due = now_ms();
+        }
+
+        double sent = now_ms();
+        int answer = phone_session(&link, username, 0);
+        double acked = now_ms();
+
+        if (answer == ANSWER_NONE) {
+            client->failed++;
+            continue;
+        }
+        if (answer == ANSWER_ERR) {
+            client->rejected++;
+            continue;
+        }
+        if (answer == ANSWER_BUSY) {
+            client->busy++;
+            continue;
+        }
+
+        if (use_pam && pam_harness_authenticate(username, PAM_SERVICE_NAME, 0, broker_socket) != PAM_SUCCESS) {
+            client->pam_failed++;
+            continue;
+        }
+        double done = now_ms();
+
+        client->latencies[SERIES_PHONE][client->completed] = acked - sent;
+        client->latencies[SERIES_PAM][client->completed] = done - acked;
+        client->latencies[SERIES_TOTAL][client->completed] = done - due;
+        client->completed++;
+    }
+
+    phone_hang_up(&link);
+    return NULL;
+}
+
+/*
+ * One flooding thread: bad-MAC requests, back to back, until told to stop
+ */
+static void *flood_thread(void *arg) {
+    client_t *flood = arg;
+    phone_link_t link = { .sock = -1 };
+
+    while (!flood_stop) {
+        switch (phone_session(&link, "flood", 1)) {
+        case ANSWER_ACK:
+            flood->completed++;
+            break;
+        case ANSWER_ERR:
+            flood->rejected++;
+            break;
+        case ANSWER_BUSY:
+            flood->busy++;
+            break;
+        default:
+            flood->failed++;
+            break;
+        }
+    }
+    phone_hang_up(&link);
+    return NULL;
+}
+
+static void stop_flood(int sig) {
+    (void)sig;
+    flood_stop = 1;
+}
+
+/*
+ * Start the flooding process; it runs until sent SIGTERM, then prints how
+ * its sessions were answered
+ * Returns its process ID, or -1 on failure
+ */
+static pid_t start_flood(void) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+
+    client_t *state = calloc(flooders, sizeof(client_t));
+    pthread_t *threads = calloc(flooders, sizeof(pthread_t));
+    int i, sessions = 0, rejected = 0, busy = 0, failed = 0, accepted = 0;
+    double started = now_ms();
+
+    signal(SIGTERM, stop_flood);
+    for (i = 0; i < flooders; i++) {
+        pthread_create(&threads[i], NULL, flood_thread, &state[i]);
+    }
+    for (i = 0; i < flooders; i++) {
+        pthread_join(threads[i], NULL);
+        accepted += state[i].completed;
+        rejected += state[i].rejected;
+        busy += state[i].busy;
+        failed += state[i].failed;
+    }
+    sessions = accepted + rejected + busy + failed;
+
+    printf("flood: threads=%d sessions=%d (%.0f/s) busy=%d rejected=%d failed=%d accepted=%d\n",
+           flooders, sessions, sessions / ((now_ms() - started) / 1000.0), busy, rejected, failed, accepted);
+    fflush(stdout);
+    _exit(0);
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int read_secret(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return 0;
+    }
+    if (!fgets(secret, sizeof(secret), file)) {
+        fclose(file);
+        return 0;
+    }
+    fclose(file);
+    secret[strcspn(secret, "\n")] = '\0';
+    return 1;
+}
+
+/*
+ * Merge one latency series from all clients, sort it and print percentiles
+ */
+static void report(const char *label, client_t *state, int series, int total) {
+    double *all = calloc(total, sizeof(double));
+    int i, merged = 0;
+
+    for (i = 0; i < clients; i++) {
+        memcpy(all + merged, state[i].latencies[series], state[i].completed * sizeof(double));
+        merged += state[i].completed;
+    }
+    qsort(all, total, sizeof(double), compare_double);
+    printf("%-12s p50=%.3f p90=%.3f p99=%.3f max=%.3f\n", label,
+           all[total / 2], all[total * 90 / 100], all[total * 99 / 100], all[total - 1]);
+    free(all);
+}
+
+int main(int argc, char *argv[]) {
+    const char *secret_file = DEFAULT_SECRET_FILE;
+    int opt, i, total = 0, rejected = 0, busy = 0, failed = 0, pam_failed = 0;
+    pid_t flood_pid = -1;
+
+    while ((opt = getopt(argc, argv, "c:n:r:PF:CS:BKTL:k:u:b:")) != -1) {
+        switch (opt) {
+        case 'c': clients = atoi(optarg); break;
+        case 'n': requests_per_client = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'P': use_pam = 1; break;
+        case 'F': flooders = atoi(optarg); break;
+        case 'C': challenge_mode = 1; break;
+        case 'S': skew = atol(optarg); break;
+        case 'B': binary_mode = 1; break;
+        case 'K': keepalive_mode = 1; break;
+        case 'T': trickle_mode = 1; break;
+        case 'L': listener_socket = optarg; break;
+        case 'k': secret_file = optarg; break;
+        case 'u': user_prefix = optarg; break;
+        case 'b': broker_socket = optarg; break;
+        default:
+            fprintf(stderr, "Usage: %s [-c clients] [-n requests] [-r rate] [-P] [-F flooders] [-C] "
+                            "[-S skew] [-B] [-K] [-T] [-L listener_socket] [-k secret_file] [-u user_prefix]\n"
+                            "       [-b broker_socket]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    if (clients < 1 || requests_per_client < 1 || rate < 0 || flooders < 0) {
+        fprintf(stderr, "Clients and requests must be positive\n");
+        return 1;
+    }
+
+    if (!read_secret(secret_file)) {
+        fprintf(stderr, "Could not read shared secret from %s\n", secret_file);
+        return 1;
+    }
+
+    // Let the flood get going before the clients start
+    if (flooders > 0) {
+        flood_pid = start_flood();
+        if (flood_pid < 0) {
+            fprintf(stderr, "Could not start the flood: %s\n", strerror(errno));
+            return 1;
+        }
+        usleep(200000);
+    }
+
+    client_t *state = calloc(clients, sizeof(client_t));
+    pthread_t *threads = calloc(clients, sizeof(pthread_t));
+
+    start_ms = now_ms();
+    for (i = 0; i < clients; i++) {
+        state[i].id = i;
+        for (int j = 0; j < SERIES_COUNT; j++) {
+            state[i].latencies[j] = calloc(requests_per_client, sizeof(double));
+        }
+        pthread_create(&threads[i], NULL, client_thread, &state[i]);
+    }
+    for (i = 0; i < clients; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now_ms() - start_ms;
+
+    if (flood_pid > 0) {
+        kill(flood_pid, SIGTERM);
+        waitpid(flood_pid, NULL, 0);
+    }
+
+    for (i = 0; i < clients; i++) {
+        total += state[i].completed;
+        rejected += state[i].rejected;
+        busy += state[i].busy;
+        failed += state[i].failed;
+        pam_failed += state[i].pam_failed;
+    }
+
+    if (rate > 0) {
+        printf("clients=%d rate=%.0f/s", clients, rate);
+    } else {
+        printf("clients=%d rate=max", clients);
+    }
+    printf(" requests=%d rejected=%d busy=%d failed=%d", total, rejected, busy, failed);
+    if (use_pam) {
+        printf(" pam_failed=%d", pam_failed);
+    }
+    printf(" elapsed=%.1fms throughput=%.0f req/s\n", elapsed, total / (elapsed / 1000.0));
+
+    if (total > 0) {
+        printf("latency ms:\n");
+        report("  phone", state, SERIES_PHONE, total);
+        if (use_pam) {
+            report("  pam", state, SERIES_PAM, total);
+        }
+        if (use_pam || rate > 0) {
+            report("  end-to-end", state, SERIES_TOTAL, total);
+        }
+    }
+
+    return rejected + busy + failed + pam_failed > 0;
+}
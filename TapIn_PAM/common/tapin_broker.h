@@ -0,0 +1,62 @@
+/*
+ * TapIn Token Broker Protocol
+ * Shared between the helper daemon and the PAM module
+ *
+ * The helper daemon keeps pending authentication tokens in memory. The PAM
+ * module fetches and consumes its token with a single fixed-size request and
+ * response over a Unix socket; the helper checks the caller's peer
+ * credentials before handing a token out.
+ *
+ * A wait request that finds no token is parked by the helper, which first
+ * answers TAPIN_BROKER_PENDING and sends the final response once a token is
+ * issued for the user or the wait times out.
+ */
+
+#ifndef TAPIN_BROKER_H
+#define TAPIN_BROKER_H
+
+#include <stdint.h>
+
+#define TAPIN_RUN_DIR "/run/tapin"
+#define TAPIN_BROKER_SOCKET_PATH TAPIN_RUN_DIR "/broker.sock"
+#define TAPIN_BROKER_VERSION 2
+
+#define TAPIN_BROKER_USERNAME_LENGTH 64
+#define TAPIN_BROKER_SERVICE_LENGTH 32
+#define TAPIN_BROKER_TTY_LENGTH 32
+#define TAPIN_BROKER_TOKEN_LENGTH 64
+
+// Upper bound the helper applies to wait requests
+#define TAPIN_BROKER_MAX_WAIT_MS 120000
+
+// Request operations
+#define TAPIN_BROKER_OP_CONSUME 1
+#define TAPIN_BROKER_OP_WAIT 2
+
+// Response status codes
+#define TAPIN_BROKER_OK 0
+#define TAPIN_BROKER_NO_TOKEN 1
+#define TAPIN_BROKER_DENIED 2
+#define TAPIN_BROKER_BAD_REQUEST 3
+#define TAPIN_BROKER_PENDING 4
+#define TAPIN_BROKER_BUSY 5
+
+// Request sent by the PAM module (all strings NUL-terminated)
+typedef struct {
+    uint32_t version;
+    uint32_t op;
+    uint32_t wait_ms;
+    char username[TAPIN_BROKER_USERNAME_LENGTH + 1];
+    char service[TAPIN_BROKER_SERVICE_LENGTH];
+    char tty[TAPIN_BROKER_TTY_LENGTH];
+} tapin_broker_request_t;
+
+// Response sent back by the helper daemon
+typedef struct {
+    uint32_t version;
+    int32_t status;
+    int64_t expiry;
+    char token[TAPIN_BROKER_TOKEN_LENGTH];
+} tapin_broker_response_t;
+
+#endif /* TAPIN_BROKER_H */
@@ -0,0 +1,68 @@
+/*
+ * TapIn Helper Channel Protocol
+ * Shared between the Bluetooth listener and the helper daemon
+ *
+ * The listener keeps one long-lived connection to the helper socket and
+ * sends every authentication request over it as a frame: a fixed header
+ * followed by `length` payload bytes. Each request carries an ID that the
+ * helper copies into its reply, so several requests can be in flight at
+ * once and replies matched in any order.
+ *
+ * JSON stops at the listener: an authentication request travels as a
+ * fixed-layout record that the helper checks without parsing.
+ */
+
+#ifndef TAPIN_CHANNEL_H
+#define TAPIN_CHANNEL_H
+
+#include <stdint.h>
+
+#define TAPIN_CHANNEL_MAGIC 0x43504154  // "TAPC" in little-endian byte order
+#define TAPIN_CHANNEL_MAX_PAYLOAD 1024
+
+// Frame types
+#define TAPIN_CHANNEL_AUTH_REQUEST 1   // Payload is a tapin_auth_record_t
+#define TAPIN_CHANNEL_AUTH_REPLY 2     // No payload; outcome is in status
+
+// Reply status codes
+#define TAPIN_CHANNEL_OK 0
+#define TAPIN_CHANNEL_REJECTED 1
+#define TAPIN_CHANNEL_BAD_FRAME 2
+
+// Frame header, in host byte order (both ends share the machine)
+typedef struct {
+    uint32_t magic;
+    uint32_t request_id;
+    uint16_t type;
+    uint16_t status;
+    uint32_t length;
+} tapin_channel_header_t;
+
+#define TAPIN_AUTH_RECORD_VERSION 2
+#define TAPIN_AUTH_USERNAME_LENGTH 64
+#define TAPIN_AUTH_NONCE_LENGTH 64
+#define TAPIN_AUTH_MAC_LENGTH 32   // Raw HMAC-SHA256
+
+// Record flags
+#define TAPIN_AUTH_HAS_DEVICE 0x0001   // device holds the phone's Bluetooth address
+#define TAPIN_AUTH_CHALLENGE 0x0002    // nonce is the listener's challenge, timestamp when it was sent
+
+// Authentication request as decoded from the phone's JSON
+// Strings are NUL-terminated; the signed data is "username:timestamp:nonce"
+// with the timestamp in plain decimal, or "username:challenge:nonce" for a
+// challenge response. The device address, when known, selects the phone's
+// key in the keystore
+typedef struct {
+    uint16_t version;
+    uint8_t username_length;
+    uint8_t nonce_length;
+    uint16_t flags;
+    uint8_t device[6];         // Most significant byte first, as printed
+    uint32_t reserved;
+    int64_t timestamp;
+    uint8_t mac[TAPIN_AUTH_MAC_LENGTH];
+    char username[TAPIN_AUTH_USERNAME_LENGTH + 1];
+    char nonce[TAPIN_AUTH_NONCE_LENGTH + 1];
+} tapin_auth_record_t;
+
+#endif /* TAPIN_CHANNEL_H */
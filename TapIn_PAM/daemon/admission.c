@@ -0,0 +1,159 @@
+/*
+ * TapIn Admission Control
+ * Fixed-size token bucket tables, one for phones and one for usernames
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "admission.h"
+#include "session_pool.h"
+#include "transport.h"
+#include "tapin_channel.h"
+
+#define TABLE_SIZE 1024                 // Buckets per table, a power of two
+#define PROBE_LIMIT 16                  // Slots searched for a key
+#define TOKEN_SCALE 60000               // Token fractions: one per ms at 1/minute
+#define KEY_LENGTH (PEER_ADDRESS_LENGTH + TAPIN_AUTH_USERNAME_LENGTH + 1)
+
+typedef struct {
+    char key[KEY_LENGTH];               // Empty if the slot was never used
+    long long updated_ms;
+    long long tokens;                   // In 1/TOKEN_SCALE of a token
+} bucket_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    long long rate;                     // Tokens per minute; 0 admits everything
+    long long capacity;                 // Burst, in 1/TOKEN_SCALE of a token
+    bucket_t buckets[TABLE_SIZE];
+} bucket_table_t;
+
+static bucket_table_t devices = { PTHREAD_MUTEX_INITIALIZER, 0, 0, { { { 0 }, 0, 0 } } };
+static bucket_table_t users = { PTHREAD_MUTEX_INITIALIZER, 0, 0, { { { 0 }, 0, 0 } } };
+
+/*
+ * FNV-1a, over a peer address or a user key
+ */
+static uint32_t hash_key(const char *key) {
+    const unsigned char *p = (const unsigned char *)key;
+    uint32_t hash = 2166136261u;
+    
+    while (*p) {
+        hash ^= *p++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Function to bring a bucket's tokens up to date
+ */
+static void refill(const bucket_table_t *table, bucket_t *bucket, long long now_ms) {
+    long long elapsed = now_ms - bucket->updated_ms;
+    
+    if (elapsed > 0) {
+        // Past a full refill the exact time no longer matters
+        if (elapsed > table->capacity / table->rate) {
+            bucket->tokens = table->capacity;
+        } else {
+            bucket->tokens += elapsed * table->rate;
+            if (bucket->tokens > table->capacity) {
+                bucket->tokens = table->capacity;
+            }
+        }
+        bucket->updated_ms = now_ms;
+    }
+}
+
+static void configure_table(bucket_table_t *table, int rate, int burst) {
+    pthread_mutex_lock(&table->lock);
+    __atomic_store_n(&table->rate, rate > 0 ? rate : 0, __ATOMIC_RELAXED);
+    table->capacity = (long long)(burst > 0 ? burst : 1) * TOKEN_SCALE;
+    memset(table->buckets, 0, sizeof(table->buckets));
+    pthread_mutex_unlock(&table->lock);
+}
+
+/*
+ * Function to take a token from the key's bucket, creating it if needed
+ * Returns 1 if a token was taken, 0 if the bucket is empty or the table
+ * has no room for a new bucket
+ */
+static int take_token(bucket_table_t *table, const char *key) {
+    uint32_t slot = hash_key(key);
+    bucket_t *found = NULL, *unused = NULL;
+    long long now_ms;
+    int admitted = 0, i;
+    
+    // No lock needed to see that limits are off
+    if (__atomic_load_n(&table->rate, __ATOMIC_RELAXED) == 0) {
+        return 1;
+    }
+    
+    now_ms = session_clock_ms();
+    pthread_mutex_lock(&table->lock);
+    
+    // A reload may have turned them off since; refill() divides by the rate
+    if (table->rate == 0) {
+        pthread_mutex_unlock(&table->lock);
+        return 1;
+    }
+    
+    // Search the whole probe window: reused slots leave no gaps to stop at
+    for (i = 0; i < PROBE_LIMIT; i++) {
+        bucket_t *bucket = &table->buckets[(slot + i) & (TABLE_SIZE - 1)];
+        if (bucket->key[0] == '\0') {
+            if (!unused) {
+                unused = bucket;
+            }
+            continue;
+        }
+        if (strncmp(bucket->key, key, KEY_LENGTH - 1) == 0) {
+            found = bucket;
+            break;
+        }
+    
+        // A full bucket holds nothing a new one wouldn't
+        refill(table, bucket, now_ms);
+        if (!unused && bucket->tokens == table->capacity) {
+            unused = bucket;
+        }
+    }
+    
+    if (!found && unused) {
+        found = unused;
+        strncpy(found->key, key, KEY_LENGTH - 1);
+        found->key[KEY_LENGTH - 1] = '\0';
+        found->tokens = table->capacity;
+        found->updated_ms = now_ms;
+    }
+    
+    if (found) {
+        refill(table, found, now_ms);
+        if (found->tokens >= TOKEN_SCALE) {
+            found->tokens -= TOKEN_SCALE;
+            admitted = 1;
+        }
+    }
+    
+    pthread_mutex_unlock(&table->lock);
+    return admitted;
+}
+
+void admission_configure(const admission_config_t *config) {
+    configure_table(&devices, config->device_rate, config->device_burst);
+    configure_table(&users, config->user_rate, config->user_burst);
+}
+
+int admission_allow_device(const char *address) {
+    return take_token(&devices, address);
+}
+
+int admission_allow_user(const char *address, const char *username) {
+    char key[KEY_LENGTH];
+    
+    // Addresses never hold a '/', so the pair cannot collide with another
+    snprintf(key, sizeof(key), "%s/%s", address, username);
+    return take_token(&users, key);
+}
@@ -0,0 +1,48 @@
+/*
+ * TapIn Admission Control
+ * Token buckets per phone and per user, checked before any real work
+ *
+ * Every phone address, and every username a phone claims, gets a bucket
+ * that refills at a fixed rate up to a burst. A session costs one token
+ * from the phone's bucket as it is accepted, before the pairing check or
+ * any reading, and one from the user's bucket once its request is
+ * decoded, before the HMAC. The claim is not verified yet, so user buckets
+ * are kept per phone: a phone naming someone else spends only its own. Each further request on a kept-alive connection costs
+ * the phone another token. Sessions without a token are answered "BUSY" and
+ * closed, so a phone that floods the daemon is turned away for the price
+ * of a hash lookup instead of a parse and an HMAC.
+ *
+ * Buckets live in fixed-size hash tables; a bucket that has refilled
+ * completely is indistinguishable from a new one and its slot is reused.
+ */
+
+#ifndef TAPIN_ADMISSION_H
+#define TAPIN_ADMISSION_H
+
+#define ADMISSION_DEFAULT_RATE 30      // Sessions per minute
+#define ADMISSION_DEFAULT_BURST 10
+
+typedef struct {
+    int device_rate;        // Sessions per minute per phone, 0 for no limit
+    int device_burst;       // Sessions a quiet phone may open at once
+    int user_rate;          // Requests per minute per username, 0 for no limit
+    int user_burst;
+} admission_config_t;
+
+// Set the limits; until this is called, everything is admitted
+void admission_configure(const admission_config_t *config);
+
+/*
+ * Take a token for a session from the phone at this address
+ * Returns 1 if admitted, 0 if the phone is over its rate
+ */
+int admission_allow_device(const char *address);
+
+/*
+ * Take a token for a request from the phone at this address claiming
+ * this username
+ * Returns 1 if admitted, 0 if the phone has claimed the user too often
+ */
+int admission_allow_user(const char *address, const char *username);
+
+#endif /* TAPIN_ADMISSION_H */
@@ -0,0 +1,431 @@
+/*
+ * TapIn Async Log
+ * Bounded multi-producer ring of unformatted records and its drain thread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "async_log.h"
+
+#define SPEC_MAX 16
+#define FORMATTED_MAX 1024
+
+// Argument kinds, as found by scanning the format
+enum {
+    ARG_SIGNED,
+    ARG_UNSIGNED,
+    ARG_STRING,
+    ARG_POINTER
+};
+
+typedef struct {
+    const char *format;
+    int priority;
+    unsigned arg_count;
+    uint64_t args[ASYNC_LOG_MAX_ARGS];   // Integers, pointers, or text offsets for strings
+    char text[ASYNC_LOG_TEXT_SIZE];
+} log_record_t;
+
+// A ring slot; sequence says whether it is free or filled for a lap
+typedef struct {
+    uint64_t sequence;
+    log_record_t record;
+} log_cell_t;
+
+int async_log_level = LOG_INFO;
+
+static log_cell_t *ring = NULL;
+static uint64_t enqueue_position = 0;
+static uint64_t dequeue_position = 0;
+static unsigned long dropped = 0;
+static int running = 0;
+static int stopping = 0;
+static int sleeping = 0;             // Drain thread is waiting with no timeout
+static int wake_fd = -1;
+static pthread_t drain_thread;
+
+/*
+ * Function to find the next conversion in a format
+ * Sets *start to its '%', copies the whole specification (e.g. "%-08lld")
+ * to spec and returns a pointer past it, or NULL at the end of the format
+ */
+static const char *next_conversion(const char *format, const char **start, char *spec,
+                                   char *conversion, int *length) {
+    const char *p;
+    size_t size;
+    
+    *start = strchr(format, '%');
+    while (*start && (*start)[1] == '%') {
+        *start = strchr(*start + 2, '%');
+    }
+    if (!*start) {
+        return NULL;
+    }
+    
+    p = *start + 1;
+    while (*p && strchr("-+ #0123456789.", *p)) {
+        p++;
+    }
+    
+    // Length modifiers, counted in "longs": z and t are as wide as long,
+    // j as long long
+    *length = 0;
+    while (*p && strchr("hlzjt", *p)) {
+        *length += *p == 'j' ? 2 : *p != 'h';
+        p++;
+    }
+    
+    *conversion = *p;
+    if (*p) {
+        p++;
+    }
+    size = (size_t)(p - *start);
+    if (size >= SPEC_MAX) {
+        size = SPEC_MAX - 1;
+    }
+    memcpy(spec, *start, size);
+    spec[size] = '\0';
+    return p;
+}
+
+static int argument_kind(char conversion) {
+    switch (conversion) {
+    case 'd': case 'i': case 'c': return ARG_SIGNED;
+    case 'u': case 'x': case 'X': case 'o': return ARG_UNSIGNED;
+    case 's': return ARG_STRING;
+    case 'p': return ARG_POINTER;
+    default: return -1;
+    }
+}
+
+/*
+ * Function to copy the arguments a format calls for into a record
+ */
+static void capture_arguments(log_record_t *record, va_list args) {
+    const char *p = record->format, *start;
+    char spec[SPEC_MAX], conversion;
+    size_t text_used = 0;
+    int length;
+    
+    record->arg_count = 0;
+    while (record->arg_count < ASYNC_LOG_MAX_ARGS &&
+           (p = next_conversion(p, &start, spec, &conversion, &length)) != NULL) {
+        uint64_t *slot = &record->args[record->arg_count];
+    
+        switch (argument_kind(conversion)) {
+        case ARG_SIGNED:
+            *slot = (uint64_t)(length >= 2 ? va_arg(args, long long) :
+                               length == 1 ? va_arg(args, long) : va_arg(args, int));
+            break;
+        case ARG_UNSIGNED:
+            *slot = length >= 2 ? va_arg(args, unsigned long long) :
+                    length == 1 ? va_arg(args, unsigned long) : va_arg(args, unsigned int);
+            break;
+        case ARG_STRING: {
+            const char *string = va_arg(args, const char *);
+            size_t copy;
+    
+            // There is always room for a NUL at text_used; once the text is
+            // full, further strings come out empty
+            if (!string) {
+                string = "(null)";
+            }
+            copy = strnlen(string, ASYNC_LOG_STRING_MAX);
+            if (copy > sizeof(record->text) - 1 - text_used) {
+                copy = sizeof(record->text) - 1 - text_used;
+            }
+            memcpy(record->text + text_used, string, copy);
+            record->text[text_used + copy] = '\0';
+            *slot = text_used;
+            text_used += copy;
+            if (text_used < sizeof(record->text) - 1) {
+                text_used++;
+            }
+            break;
+        }
+        case ARG_POINTER:
+            *slot = (uint64_t)(uintptr_t)va_arg(args, void *);
+            break;
+        default:
+            // Unsupported conversion: the rest is printed as it stands
+            return;
+        }
+        record->arg_count++;
+    }
+}
+
+/*
+ * Function to turn a record back into the message syslog() would have got
+ */
+static void format_record(const log_record_t *record, char *out, size_t size) {
+    const char *p = record->format, *next, *start;
+    char spec[SPEC_MAX], conversion;
+    size_t used = 0;
+    unsigned i = 0;
+    int length, n = 0;
+    
+    while (used < size - 1) {
+        next = i < record->arg_count ? next_conversion(p, &start, spec, &conversion, &length) : NULL;
+        const char *literal_end = next ? start : p + strlen(p);
+    
+        // Literal text, with %% collapsed
+        while (p < literal_end && used < size - 1) {
+            out[used++] = *p;
+            p += (p[0] == '%' && p[1] == '%') ? 2 : 1;
+        }
+        if (!next) {
+            break;
+        }
+    
+        uint64_t value = record->args[i++];
+        n = 0;
+        switch (argument_kind(conversion)) {
+        case ARG_SIGNED:
+            n = length >= 2 ? snprintf(out + used, size - used, spec, (long long)value) :
+                length == 1 ? snprintf(out + used, size - used, spec, (long)value) :
+                snprintf(out + used, size - used, spec, (int)value);
+            break;
+        case ARG_UNSIGNED:
+            n = length >= 2 ? snprintf(out + used, size - used, spec, (unsigned long long)value) :
+                length == 1 ? snprintf(out + used, size - used, spec, (unsigned long)value) :
+                snprintf(out + used, size - used, spec, (unsigned int)value);
+            break;
+        case ARG_STRING:
+            n = snprintf(out + used, size - used, spec, record->text + value);
+            break;
+        case ARG_POINTER:
+            n = snprintf(out + used, size - used, spec, (void *)(uintptr_t)value);
+            break;
+        }
+        used += n < 0 ? 0 : (size_t)n < size - used ? (size_t)n : size - used - 1;
+        p = next;
+    }
+    out[used] = '\0';
+}
+
+/*
+ * Function to hand every filled record to syslog, oldest first
+ */
+static void drain_ring(void) {
+    char message[FORMATTED_MAX];
+    
+    for (;;) {
+        log_cell_t *cell = &ring[dequeue_position & (ASYNC_LOG_RING_SIZE - 1)];
+        if (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) != dequeue_position + 1) {
+            break;
+        }
+    
+        format_record(&cell->record, message, sizeof(message));
+        syslog(cell->record.priority, "%s", message);
+    
+        __atomic_store_n(&cell->sequence, dequeue_position + ASYNC_LOG_RING_SIZE, __ATOMIC_RELEASE);
+        __atomic_store_n(&dequeue_position, dequeue_position + 1, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Function to decide whether the drain thread may sleep until woken
+ * A writer looks at `sleeping` after publishing its record, so either it
+ * sees the flag and wakes the thread, or the thread sees its record here
+ */
+static int ring_idle(void) {
+    log_cell_t *cell = &ring[dequeue_position & (ASYNC_LOG_RING_SIZE - 1)];
+    
+    __atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&cell->sequence, __ATOMIC_SEQ_CST) == dequeue_position + 1 ||
+        __atomic_load_n(&stopping, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+static void *drain_main(void *arg) {
+    struct pollfd pfd = { wake_fd, POLLIN, 0 };
+    unsigned long reported = 0;
+    uint64_t count;
+    (void)arg;
+    
+    // An empty ring waits for the next record with no timeout, so an idle
+    // daemon never wakes; otherwise records are drained at a steady pace,
+    // or at once when the ring is nearly full
+    for (;;) {
+        if (ring_idle()) {
+            while (poll(&pfd, 1, -1) < 0 && errno == EINTR) {
+            }
+            if (read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                break;
+            }
+        }
+        if (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE) &&
+            poll(&pfd, 1, ASYNC_LOG_DRAIN_INTERVAL_MS) > 0 &&
+            read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+            break;
+        }
+        drain_ring();
+    
+        unsigned long now_dropped = async_log_dropped();
+        if (now_dropped != reported) {
+            syslog(LOG_WARNING, "Log ring full, dropped %lu messages", now_dropped - reported);
+            reported = now_dropped;
+        }
+        if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+            drain_ring();
+            break;
+        }
+    }
+    
+    return NULL;
+}
+
+void async_log_write(int priority, const char *format, ...) {
+    int saved_errno = errno;
+    va_list args;
+    
+    va_start(args, format);
+    
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        vsyslog(priority, format, args);
+        va_end(args);
+        errno = saved_errno;
+        return;
+    }
+    
+    // Claim a slot: its sequence equals our position when it is free
+    uint64_t position = __atomic_load_n(&enqueue_position, __ATOMIC_RELAXED);
+    log_cell_t *cell;
+    for (;;) {
+        cell = &ring[position & (ASYNC_LOG_RING_SIZE - 1)];
+        int64_t lag = (int64_t)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - position);
+        if (lag == 0) {
+            if (__atomic_compare_exchange_n(&enqueue_position, &position, position + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (lag < 0) {
+            // Full: the drain thread is a lap behind
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            va_end(args);
+            errno = saved_errno;
+            return;
+        } else {
+            position = __atomic_load_n(&enqueue_position, __ATOMIC_RELAXED);
+        }
+    }
+    
+    cell->record.format = format;
+    cell->record.priority = priority;
+    capture_arguments(&cell->record, args);
+    va_end(args);
+    __atomic_store_n(&cell->sequence, position + 1, __ATOMIC_SEQ_CST);
+    
+    // Only the first record after a quiet spell, or a ring passing half
+    // full, is worth a system call
+    if ((__atomic_load_n(&sleeping, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&sleeping, 0, __ATOMIC_SEQ_CST)) ||
+        position - __atomic_load_n(&dequeue_position, __ATOMIC_RELAXED) == ASYNC_LOG_RING_SIZE / 2) {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0) {
+            // Only fails when the count is already high, which wakes it just the same
+        }
+    }
+    errno = saved_errno;
+}
+
+int async_log_start(void) {
+    sigset_t all, old;
+    uint64_t i;
+    int started;
+    
+    ring = calloc(ASYNC_LOG_RING_SIZE, sizeof(log_cell_t));
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (!ring || wake_fd < 0) {
+        syslog(LOG_ERR, "Could not set up the log ring, logging synchronously");
+        free(ring);
+        ring = NULL;
+        if (wake_fd >= 0) {
+            close(wake_fd);
+            wake_fd = -1;
+        }
+        return 0;
+    }
+    
+    for (i = 0; i < ASYNC_LOG_RING_SIZE; i++) {
+        ring[i].sequence = i;
+    }
+    enqueue_position = dequeue_position = 0;
+    stopping = 0;
+    sleeping = 0;
+    
+    // The drain thread leaves signal handling to the main loop
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    started = pthread_create(&drain_thread, NULL, drain_main, NULL) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    
+    if (!started) {
+        syslog(LOG_ERR, "Could not start the log thread, logging synchronously");
+        free(ring);
+        ring = NULL;
+        close(wake_fd);
+        wake_fd = -1;
+        return 0;
+    }
+    
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+void async_log_stop(void) {
+    uint64_t one = 1;
+    
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    
+    // Callers are expected to have stopped their other threads by now
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        syslog(LOG_WARNING, "Could not wake the log thread: %s", strerror(errno));
+    }
+    pthread_join(drain_thread, NULL);
+    
+    close(wake_fd);
+    wake_fd = -1;
+    free(ring);
+    ring = NULL;
+}
+
+unsigned long async_log_dropped(void) {
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+int async_log_level_from_name(const char *name) {
+    static const struct {
+        const char *name;
+        int priority;
+    } levels[] = {
+        { "err", LOG_ERR },
+        { "warning", LOG_WARNING },
+        { "notice", LOG_NOTICE },
+        { "info", LOG_INFO },
+        { "debug", LOG_DEBUG },
+    };
+    size_t i;
+    
+    for (i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+        if (strcmp(name, levels[i].name) == 0) {
+            return levels[i].priority;
+        }
+    }
+    return -1;
+}
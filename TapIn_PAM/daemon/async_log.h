@@ -0,0 +1,70 @@
+/*
+ * TapIn Async Log
+ * Logging that keeps syslog() off the request path
+ *
+ * async_log() takes the same arguments as syslog(), but instead of
+ * formatting and writing to /dev/log it copies the format pointer and the
+ * arguments into a fixed-size record in a lock-free ring. A background
+ * thread formats the records and hands them to syslog, in batches every
+ * ASYNC_LOG_DRAIN_INTERVAL_MS while there are any and not at all while
+ * there are none. Logging from a request costs a format scan and a few
+ * stores, and never blocks on journald; when the ring is full, records
+ * are dropped and counted.
+ *
+ * Messages above TAPIN_LOG_MAX_LEVEL are compiled out; messages above the
+ * runtime level cost one comparison. Before async_log_start() and after
+ * async_log_stop() records go straight to syslog, so tools sharing the
+ * daemon modules need no logging thread.
+ *
+ * Formats must be string literals. Conversions may be d, i, u, x, X, o,
+ * c, s, p with the usual flags, widths and length modifiers (no '*').
+ * Each string argument is copied up to ASYNC_LOG_STRING_MAX bytes: log
+ * names and lengths, never request payloads.
+ */
+
+#ifndef TAPIN_ASYNC_LOG_H
+#define TAPIN_ASYNC_LOG_H
+
+#include <syslog.h>
+
+#ifndef TAPIN_LOG_MAX_LEVEL
+#define TAPIN_LOG_MAX_LEVEL LOG_DEBUG
+#endif
+
+#define ASYNC_LOG_RING_SIZE 1024       // Records, a power of two
+#define ASYNC_LOG_MAX_ARGS 8
+#define ASYNC_LOG_TEXT_SIZE 256        // Room for copied string arguments
+#define ASYNC_LOG_STRING_MAX 128
+#define ASYNC_LOG_DRAIN_INTERVAL_MS 50
+
+// Messages less severe than this are skipped at runtime
+extern int async_log_level;
+
+#define async_log(priority, format, ...) \
+    do { \
+        if ((priority) <= TAPIN_LOG_MAX_LEVEL && (priority) <= async_log_level) { \
+            async_log_write((priority), "" format, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+void async_log_write(int priority, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/*
+ * Start the drain thread and route messages through the ring
+ * Returns 1 on success, 0 on failure (messages then stay synchronous)
+ */
+int async_log_start(void);
+
+// Drain what is left and go back to synchronous syslog
+void async_log_stop(void);
+
+// Records dropped because the ring was full
+unsigned long async_log_dropped(void);
+
+/*
+ * Map "err", "warning", "notice", "info" or "debug" to a priority
+ * Returns -1 for anything else
+ */
+int async_log_level_from_name(const char *name);
+
+#endif /* TAPIN_ASYNC_LOG_H */
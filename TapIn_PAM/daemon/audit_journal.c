@@ -0,0 +1,494 @@
+/*
+ * TapIn Audit Journal
+ * Mapped segment files, their indexes, and rotation
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <signal.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "audit_journal.h"
+#include "async_log.h"
+
+#define PATH_LENGTH 4096
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static int journal_open = 0;                 // Read without the lock to skip appends early
+static char journal_dir[PATH_LENGTH - 32];       // Room left for file names
+static uint32_t journal_segment_records;
+static int journal_max_segments;
+static audit_segment_header_t *segment;      // Mapping of the segment being appended to
+static size_t segment_size;
+
+// The last full segment, indexed on a thread of its own
+static pthread_t sealer;
+static int sealer_running = 0;
+static audit_segment_header_t *sealing;
+static size_t sealing_size;
+
+const char *audit_outcome_name(audit_outcome_t outcome) {
+    static const char *const names[AUDIT_OUTCOME_COUNT] = {
+        [AUDIT_ACCEPTED] = "accepted",
+        [AUDIT_MALFORMED] = "malformed",
+        [AUDIT_TIMESTAMP] = "timestamp",
+        [AUDIT_BAD_MAC] = "bad_mac",
+        [AUDIT_REPLAYED] = "replayed",
+        [AUDIT_REPLAY_FULL] = "replay_full",
+        [AUDIT_TOKEN_FAILED] = "token_failed",
+    };
+    
+    return (unsigned)outcome < AUDIT_OUTCOME_COUNT ? names[outcome] : "unknown";
+}
+
+uint32_t audit_user_hash(const char *username) {
+    const unsigned char *p = (const unsigned char *)username;
+    uint32_t hash = 2166136261u;
+    
+    while (*p) {
+        hash ^= *p++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+int audit_segment_path(char *out, size_t size, const char *dir, uint32_t sequence) {
+    return snprintf(out, size, "%s/audit-%08u.seg", dir, sequence) < (int)size;
+}
+
+int audit_index_path(char *out, size_t size, const char *dir, uint32_t sequence) {
+    return snprintf(out, size, "%s/audit-%08u.idx", dir, sequence) < (int)size;
+}
+
+static audit_record_t *segment_records(const audit_segment_header_t *header) {
+    return (audit_record_t *)(header + 1);
+}
+
+static size_t segment_file_size(uint32_t capacity) {
+    return sizeof(audit_segment_header_t) + (size_t)capacity * sizeof(audit_record_t);
+}
+
+int audit_segment_valid(const audit_segment_header_t *header, size_t size) {
+    return size >= sizeof(*header) && header->magic == AUDIT_SEGMENT_MAGIC &&
+           header->version == AUDIT_VERSION && header->record_size == sizeof(audit_record_t) &&
+           header->capacity > 0 && size == segment_file_size(header->capacity) &&
+           __atomic_load_n(&header->count, __ATOMIC_ACQUIRE) <= header->capacity;
+}
+
+int audit_index_valid(const audit_index_header_t *header, size_t size) {
+    return size >= sizeof(*header) && header->magic == AUDIT_INDEX_MAGIC &&
+           header->version == AUDIT_VERSION && header->block_records == AUDIT_INDEX_BLOCK &&
+           header->block_count == (header->record_count + AUDIT_INDEX_BLOCK - 1) / AUDIT_INDEX_BLOCK &&
+           size == sizeof(*header) + (size_t)header->block_count * sizeof(int64_t) +
+                   (size_t)header->user_count * sizeof(audit_user_entry_t);
+}
+
+static int compare_sequences(const void *a, const void *b) {
+    uint32_t left = *(const uint32_t *)a, right = *(const uint32_t *)b;
+    return (left > right) - (left < right);
+}
+
+int audit_list_segments(const char *dir, uint32_t **sequences) {
+    DIR *handle = opendir(dir);
+    struct dirent *entry;
+    uint32_t *list = NULL, sequence;
+    int count = 0, capacity = 0;
+    char name[32];
+    
+    *sequences = NULL;
+    if (!handle) {
+        return -1;
+    }
+    
+    while ((entry = readdir(handle)) != NULL) {
+        // Only names this module would have written
+        if (sscanf(entry->d_name, "audit-%8u.seg", &sequence) != 1) {
+            continue;
+        }
+        snprintf(name, sizeof(name), "audit-%08u.seg", sequence);
+        if (strcmp(name, entry->d_name) != 0) {
+            continue;
+        }
+    
+        if (count == capacity) {
+            int grown_capacity = capacity ? capacity * 2 : 32;
+            uint32_t *grown = realloc(list, grown_capacity * sizeof(*grown));
+            if (!grown) {
+                break;
+            }
+            list = grown;
+            capacity = grown_capacity;
+        }
+        list[count++] = sequence;
+    }
+    closedir(handle);
+    
+    qsort(list, count, sizeof(*list), compare_sequences);
+    *sequences = list;
+    return count;
+}
+
+/*
+ * Function to write a whole buffer, resuming after partial writes
+ */
+static int write_all(int fd, const void *data, size_t length) {
+    const char *p = data;
+    
+    while (length > 0) {
+        ssize_t n = write(fd, p, length);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        p += n;
+        length -= n;
+    }
+    return 1;
+}
+
+static int compare_user_entries(const void *a, const void *b) {
+    const audit_user_entry_t *left = a, *right = b;
+    
+    if (left->hash != right->hash) {
+        return left->hash < right->hash ? -1 : 1;
+    }
+    return (left->block > right->block) - (left->block < right->block);
+}
+
+/*
+ * Function to write the index of a segment's records so far, replacing
+ * any older index of it atomically
+ * Returns 1 on success, 0 on failure
+ */
+static int write_index(const audit_segment_header_t *header) {
+    const audit_record_t *records = segment_records(header);
+    audit_index_header_t index;
+    audit_user_entry_t *users;
+    int64_t *block_times;
+    char path[PATH_LENGTH], temp_path[PATH_LENGTH + 8];
+    uint32_t i, users_kept = 0;
+    int fd, ok;
+    
+    memset(&index, 0, sizeof(index));
+    index.magic = AUDIT_INDEX_MAGIC;
+    index.version = AUDIT_VERSION;
+    index.block_records = AUDIT_INDEX_BLOCK;
+    index.record_count = __atomic_load_n(&header->count, __ATOMIC_ACQUIRE);
+    index.block_count = (index.record_count + AUDIT_INDEX_BLOCK - 1) / AUDIT_INDEX_BLOCK;
+    if (index.record_count == 0) {
+        return 1;
+    }
+    
+    block_times = malloc(index.block_count * sizeof(*block_times));
+    users = malloc(index.record_count * sizeof(*users));
+    if (!block_times || !users) {
+        free(block_times);
+        free(users);
+        return 0;
+    }
+    
+    for (i = 0; i < index.record_count; i++) {
+        if (i % AUDIT_INDEX_BLOCK == 0) {
+            block_times[i / AUDIT_INDEX_BLOCK] = records[i].time_us;
+        }
+        users[i].hash = audit_user_hash(records[i].username);
+        users[i].block = i / AUDIT_INDEX_BLOCK;
+    }
+    
+    // One entry per user per block
+    qsort(users, index.record_count, sizeof(*users), compare_user_entries);
+    for (i = 0; i < index.record_count; i++) {
+        if (users_kept == 0 || compare_user_entries(&users[users_kept - 1], &users[i]) != 0) {
+            users[users_kept++] = users[i];
+        }
+    }
+    index.user_count = users_kept;
+    
+    audit_index_path(path, sizeof(path), journal_dir, header->sequence);
+    snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", path);
+    fd = mkstemp(temp_path);
+    ok = fd >= 0 &&
+         fchmod(fd, 0600) == 0 &&
+         write_all(fd, &index, sizeof(index)) &&
+         write_all(fd, block_times, index.block_count * sizeof(*block_times)) &&
+         write_all(fd, users, users_kept * sizeof(*users));
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(block_times);
+    free(users);
+    
+    if (!ok || rename(temp_path, path) != 0) {
+        async_log(LOG_ERR, "Could not write audit index %s: %s", path, strerror(errno));
+        if (fd >= 0) {
+            unlink(temp_path);
+        }
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Function to map a segment for appending, creating and preallocating it
+ * if it does not exist yet
+ * Returns the mapping, or NULL if the file is unusable or full
+ */
+static audit_segment_header_t *map_segment(uint32_t sequence, size_t *size) {
+    audit_segment_header_t *header;
+    char path[PATH_LENGTH];
+    struct stat st;
+    int fd, created, error = 0;
+    
+    audit_segment_path(path, sizeof(path), journal_dir, sequence);
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        async_log(LOG_ERR, "Could not open audit segment %s: %s", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    
+    // Reserve the blocks now, so appends never meet a full disk: a store
+    // into a hole that cannot be filled would be SIGBUS. Only a filesystem
+    // that cannot reserve at all gets a sparse file
+    created = st.st_size == 0;
+    *size = created ? segment_file_size(journal_segment_records) : (size_t)st.st_size;
+    if (created) {
+        error = posix_fallocate(fd, 0, *size);
+        if (error == EOPNOTSUPP) {
+            error = ftruncate(fd, *size) == 0 ? 0 : errno;
+        }
+    }
+    if (error != 0) {
+        async_log(LOG_ERR, "Could not allocate audit segment %s: %s", path, strerror(error));
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+    
+    header = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED) {
+        async_log(LOG_ERR, "Could not map audit segment %s: %s", path, strerror(errno));
+        return NULL;
+    }
+    
+    if (created) {
+        header->magic = AUDIT_SEGMENT_MAGIC;
+        header->version = AUDIT_VERSION;
+        header->record_size = sizeof(audit_record_t);
+        header->sequence = sequence;
+        header->capacity = journal_segment_records;
+    } else if (!audit_segment_valid(header, *size) || header->sequence != sequence ||
+               header->count == header->capacity) {
+        // Left as it is; the journal carries on in the next segment
+        munmap(header, *size);
+        return NULL;
+    }
+    
+    return header;
+}
+
+/*
+ * Function to index a segment that will not be appended to again and
+ * unmap it
+ */
+static void seal_segment(audit_segment_header_t *header, size_t size) {
+    write_index(header);
+    munmap(header, size);
+}
+
+/*
+ * Function to delete all but the newest segments, up to and including
+ * newest; any started since are left alone
+ */
+static void prune_segments(uint32_t newest) {
+    char path[PATH_LENGTH];
+    uint32_t *sequences;
+    int count, i;
+    
+    count = audit_list_segments(journal_dir, &sequences);
+    for (i = 0; i < count; i++) {
+        if (sequences[i] > newest || newest - sequences[i] < (uint32_t)journal_max_segments) {
+            continue;
+        }
+        audit_segment_path(path, sizeof(path), journal_dir, sequences[i]);
+        unlink(path);
+        audit_index_path(path, sizeof(path), journal_dir, sequences[i]);
+        unlink(path);
+    }
+    free(sequences);
+}
+
+static void *seal_thread(void *arg) {
+    uint32_t next = sealing->sequence + 1;
+    (void)arg;
+    
+    seal_segment(sealing, sealing_size);
+    prune_segments(next);
+    return NULL;
+}
+
+// Wait for the last full segment to be indexed; called with the lock held
+static void wait_for_sealer(void) {
+    if (sealer_running) {
+        pthread_join(sealer, NULL);
+        sealer_running = 0;
+    }
+}
+
+/*
+ * Function to move on to the next segment and hand the full one to a
+ * thread to index, so no request waits for the index to be built; called
+ * with the lock held
+ * Returns 1 on success, 0 if no new segment could be started
+ */
+static int rotate_segment(void) {
+    audit_segment_header_t *full = segment;
+    size_t full_size = segment_size;
+    sigset_t all, old;
+    
+    segment = map_segment(full->sequence + 1, &segment_size);
+    if (!segment) {
+        async_log(LOG_ERR, "Audit journal stopped: no segment after %u", full->sequence);
+        seal_segment(full, full_size);
+        return 0;
+    }
+    
+    // The previous one is long done unless segments fill faster than that
+    wait_for_sealer();
+    sealing = full;
+    sealing_size = full_size;
+    
+    // The sealer leaves signal handling to the event loop
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    sealer_running = pthread_create(&sealer, NULL, seal_thread, NULL) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (!sealer_running) {
+        seal_thread(NULL);
+    }
+    return 1;
+}
+
+/*
+ * Function to create a directory and any missing parents
+ */
+static int make_directories(const char *dir) {
+    char path[PATH_LENGTH];
+    char *slash;
+    
+    if (snprintf(path, sizeof(path), "%s", dir) >= (int)sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    for (slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+            return 0;
+        }
+        *slash = '/';
+    }
+    
+    // The journal itself names users, so only root reads it
+    return mkdir(path, 0700) == 0 || errno == EEXIST;
+}
+
+int audit_journal_open(const char *dir, uint32_t segment_records, int max_segments) {
+    uint32_t *sequences, sequence = 0;
+    int count;
+    
+    if (segment_records == 0 || max_segments <= 0 ||
+        snprintf(journal_dir, sizeof(journal_dir), "%s", dir) >= (int)sizeof(journal_dir)) {
+        return 0;
+    }
+    if (!make_directories(dir)) {
+        async_log(LOG_ERR, "Could not create audit directory %s: %s", dir, strerror(errno));
+        return 0;
+    }
+    journal_segment_records = segment_records;
+    journal_max_segments = max_segments;
+    
+    // Carry on in the newest segment if it has room, else start the next
+    count = audit_list_segments(dir, &sequences);
+    if (count > 0) {
+        sequence = sequences[count - 1];
+    }
+    free(sequences);
+    
+    pthread_mutex_lock(&journal_lock);
+    segment = count > 0 ? map_segment(sequence, &segment_size) : NULL;
+    if (!segment) {
+        sequence += count > 0;
+        segment = map_segment(sequence, &segment_size);
+    }
+    __atomic_store_n(&journal_open, segment != NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&journal_lock);
+    
+    if (!segment) {
+        return 0;
+    }
+    prune_segments(sequence);
+    async_log(LOG_INFO, "Audit journal in %s, segment %u (%u of %u records used)",
+              dir, sequence, segment->count, segment->capacity);
+    return 1;
+}
+
+void audit_journal_close(void) {
+    pthread_mutex_lock(&journal_lock);
+    __atomic_store_n(&journal_open, 0, __ATOMIC_RELEASE);
+    wait_for_sealer();
+    if (segment) {
+        // Indexed as far as it goes; reopening carries on after it
+        seal_segment(segment, segment_size);
+        segment = NULL;
+    }
+    pthread_mutex_unlock(&journal_lock);
+}
+
+void audit_journal_append(audit_record_t *record) {
+    struct timespec ts;
+    uint32_t count;
+    
+    if (!__atomic_load_n(&journal_open, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    
+    clock_gettime(CLOCK_REALTIME, &ts);
+    record->time_us = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    
+    pthread_mutex_lock(&journal_lock);
+    if (!segment) {
+        pthread_mutex_unlock(&journal_lock);
+        return;
+    }
+    if (segment->count == segment->capacity && !rotate_segment()) {
+        __atomic_store_n(&journal_open, 0, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&journal_lock);
+        return;
+    }
+    
+    // Keep each segment in time order even if the clock steps back
+    count = segment->count;
+    if (count > 0 && record->time_us < segment->last_time_us) {
+        record->time_us = segment->last_time_us;
+    }
+    segment_records(segment)[count] = *record;
+    if (count == 0) {
+        segment->first_time_us = record->time_us;
+    }
+    segment->last_time_us = record->time_us;
+    __atomic_store_n(&segment->count, count + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&journal_lock);
+}
@@ -0,0 +1,132 @@
+/*
+ * TapIn Audit Journal
+ * Fixed-size binary records of every authentication request
+ *
+ * The helper appends one record per request it checks: when, the claimed
+ * user, the phone's address, how it ended and how long each stage took.
+ * Records go into segment files that are preallocated and memory-mapped,
+ * so an append is a copy into the page cache under a short lock, with no
+ * write() and no formatting. Records are stamped as they are appended, so
+ * each segment is in time order and can be binary searched.
+ *
+ * A full segment is sealed and the next one started; only the newest
+ * segments are kept. Sealing writes a sparse index beside the segment:
+ * the time of every AUDIT_INDEX_BLOCK-th record, and for each username
+ * hash the blocks it appears in. tapin-audit reads segments and indexes
+ * through read-only mappings while the helper is still writing.
+ *
+ *   audit-00000042.seg   header, then capacity records
+ *   audit-00000042.idx   header, block times, sorted (hash, block) pairs
+ */
+
+#ifndef TAPIN_AUDIT_JOURNAL_H
+#define TAPIN_AUDIT_JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "tapin_channel.h"
+
+#define AUDIT_JOURNAL_DIR "/var/lib/tapin/audit"
+#define AUDIT_SEGMENT_MAGIC 0x41504154          // "TAPA" in little-endian byte order
+#define AUDIT_INDEX_MAGIC 0x49504154            // "TAPI"
+#define AUDIT_VERSION 1
+#define AUDIT_DEFAULT_SEGMENT_RECORDS 65536     // 8 MiB segments
+#define AUDIT_MAX_SEGMENT_RECORDS (1 << 24)     // 2 GiB
+#define AUDIT_DEFAULT_SEGMENTS 16
+#define AUDIT_INDEX_BLOCK 256                   // Records per index block
+
+// How a request ended
+typedef enum {
+    AUDIT_ACCEPTED = 0,
+    AUDIT_MALFORMED,
+    AUDIT_TIMESTAMP,
+    AUDIT_BAD_MAC,
+    AUDIT_REPLAYED,
+    AUDIT_REPLAY_FULL,
+    AUDIT_TOKEN_FAILED,
+    AUDIT_OUTCOME_COUNT
+} audit_outcome_t;
+
+// Segment header, in host byte order (the journal never leaves the host)
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t sequence;
+    uint32_t capacity;
+    uint32_t count;                   // Records written; stored last, with release order
+    uint32_t reserved;
+    int64_t first_time_us;
+    int64_t last_time_us;
+    uint8_t padding[24];
+} audit_segment_header_t;
+
+typedef struct {
+    int64_t time_us;                  // Wall clock, microseconds since the epoch
+    uint32_t total_us;                // Whole request, then its stages
+    uint32_t mac_us;
+    uint32_t replay_us;
+    uint32_t token_us;
+    uint8_t outcome;                  // audit_outcome_t
+    uint8_t has_device;
+    uint8_t device[6];                // Most significant byte first, as printed
+    char username[TAPIN_AUTH_USERNAME_LENGTH + 1];
+    uint8_t reserved[31];
+} audit_record_t;
+
+// Index header; block times and user entries follow it
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t block_records;
+    uint32_t record_count;            // Records of the segment this index covers
+    uint32_t block_count;
+    uint32_t user_count;
+    uint32_t reserved;
+} audit_index_header_t;
+
+// A username hash seen in a block; sorted by hash, then block
+typedef struct {
+    uint32_t hash;
+    uint32_t block;
+} audit_user_entry_t;
+
+// "accepted", "malformed", "timestamp", "bad_mac", ...
+const char *audit_outcome_name(audit_outcome_t outcome);
+
+// FNV-1a of a username, as used by the index
+uint32_t audit_user_hash(const char *username);
+
+/*
+ * Map the newest segment in dir, or start one, for appending
+ * Returns 1 on success, 0 on failure
+ */
+int audit_journal_open(const char *dir, uint32_t segment_records, int max_segments);
+
+// Index the current segment and unmap it
+void audit_journal_close(void);
+
+/*
+ * Stamp a record with the current time and append it; safe from any
+ * thread, and does nothing unless the journal is open
+ */
+void audit_journal_append(audit_record_t *record);
+
+/*
+ * List the segment sequence numbers in dir, oldest first
+ * Returns the count, or -1 if dir cannot be read; free *sequences
+ */
+int audit_list_segments(const char *dir, uint32_t **sequences);
+
+/*
+ * Check a mapped segment or index file of size bytes
+ * Returns 1 if its header is sound and its contents fit in the file
+ */
+int audit_segment_valid(const audit_segment_header_t *header, size_t size);
+int audit_index_valid(const audit_index_header_t *header, size_t size);
+
+// Segment or index file name for a sequence number
+int audit_segment_path(char *out, size_t size, const char *dir, uint32_t sequence);
+int audit_index_path(char *out, size_t size, const char *dir, uint32_t sequence);
+
+#endif /* TAPIN_AUDIT_JOURNAL_H */
@@ -0,0 +1,305 @@
+/*
+ * TapIn Batch Verification
+ * Mapped or streamed input, checked a block of lines at a time
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "auth_batch.h"
+#include "auth_core.h"
+#include "auth_record.h"
+
+#define BATCH_LINES 16384               // Lines checked per block
+#define READ_BUFFER_SIZE (4 << 20)      // Longest line read from a stream
+
+typedef struct {
+    const char *start;
+    size_t length;
+    size_t number;                      // Line number in the input, from 1
+    auth_result_t result;
+    tapin_auth_record_t record;
+} batch_line_t;
+
+// One worker's share of a block
+typedef struct {
+    batch_line_t *lines;
+    size_t count;
+    time_t now;                         // 0 skips the timestamp window
+} batch_slice_t;
+
+// State carried from block to block
+typedef struct {
+    const auth_batch_config_t *config;
+    FILE *out;
+    batch_line_t *lines;
+    size_t count;                       // Lines collected for this block
+    size_t line_number;                 // Lines seen, blank ones included
+    size_t requests;
+    size_t totals[AUTH_RESULT_COUNT];
+} batch_t;
+
+/*
+ * Function to decode and check one worker's lines
+ */
+static void *check_slice(void *arg) {
+    batch_slice_t *slice = arg;
+    size_t i;
+    
+    for (i = 0; i < slice->count; i++) {
+        batch_line_t *line = &slice->lines[i];
+        if (auth_record_from_json(line->start, line->length, &line->record)) {
+            line->result = auth_core_check(&line->record, slice->now);
+        } else {
+            line->result = AUTH_MALFORMED;
+            line->record.username[0] = '\0';
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function to split a block's lines across the workers and wait for them
+ * The calling thread takes the first share
+ */
+static void check_block(batch_t *batch) {
+    pthread_t threads[AUTH_BATCH_MAX_JOBS];
+    batch_slice_t slices[AUTH_BATCH_MAX_JOBS];
+    int created[AUTH_BATCH_MAX_JOBS];
+    time_t now = batch->config->check_timestamps ? time(NULL) : 0;
+    size_t jobs = batch->config->jobs, share, offset = 0, i;
+    
+    if (jobs > batch->count) {
+        jobs = batch->count;
+    }
+    share = (batch->count + jobs - 1) / jobs;
+    
+    for (i = 0; i < jobs; i++) {
+        slices[i].lines = batch->lines + offset;
+        slices[i].count = batch->count - offset < share ? batch->count - offset : share;
+        slices[i].now = now;
+        offset += slices[i].count;
+    }
+    
+    for (i = 1; i < jobs; i++) {
+        created[i] = pthread_create(&threads[i], NULL, check_slice, &slices[i]) == 0;
+    }
+    check_slice(&slices[0]);
+    
+    // A share whose thread could not be started is done here instead
+    for (i = 1; i < jobs; i++) {
+        if (created[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            check_slice(&slices[i]);
+        }
+    }
+}
+
+/*
+ * Function to write a username, replacing anything that would break the
+ * one-line-per-request format
+ */
+static void write_username(FILE *out, const char *username) {
+    const unsigned char *p = (const unsigned char *)username;
+    
+    if (*p == '\0') {
+        fputc('-', out);
+        return;
+    }
+    for (; *p; p++) {
+        fputc(isgraph(*p) ? *p : '?', out);
+    }
+}
+
+/*
+ * Function to check the collected lines and write their results in order
+ */
+static void finish_block(batch_t *batch) {
+    size_t i;
+    
+    if (batch->count == 0) {
+        return;
+    }
+    
+    check_block(batch);
+    
+    for (i = 0; i < batch->count; i++) {
+        batch_line_t *line = &batch->lines[i];
+    
+        // Only authentic requests reach the replay cache, as in the daemon
+        if (line->result == AUTH_VALID) {
+            line->result = auth_core_check_replay(&line->record);
+        }
+        batch->totals[line->result]++;
+    
+        fprintf(batch->out, "%zu %s ", line->number, auth_result_name(line->result));
+        write_username(batch->out, line->record.username);
+        fputc('\n', batch->out);
+    }
+    
+    batch->requests += batch->count;
+    batch->count = 0;
+}
+
+static void add_line(batch_t *batch, const char *start, size_t length) {
+    batch->line_number++;
+    
+    // Tolerate CRLF line ends
+    if (length > 0 && start[length - 1] == '\r') {
+        length--;
+    }
+    if (length == 0) {
+        return;
+    }
+    
+    batch_line_t *line = &batch->lines[batch->count++];
+    line->start = start;
+    line->length = length;
+    line->number = batch->line_number;
+    
+    if (batch->count == BATCH_LINES) {
+        finish_block(batch);
+    }
+}
+
+/*
+ * Function to check every complete line in data; with final set, a last
+ * line without a newline counts too
+ * Returns the number of bytes used. All lines are finished on return, so
+ * the caller may reuse the buffer
+ */
+static size_t split_lines(batch_t *batch, const char *data, size_t length, int final) {
+    size_t offset = 0;
+    
+    while (offset < length) {
+        const char *end = memchr(data + offset, '\n', length - offset);
+        if (!end) {
+            if (final) {
+                add_line(batch, data + offset, length - offset);
+                offset = length;
+            }
+            break;
+        }
+        add_line(batch, data + offset, end - (data + offset));
+        offset = end - data + 1;
+    }
+    
+    finish_block(batch);
+    return offset;
+}
+
+/*
+ * Function to check a regular file through a read-only mapping
+ * Returns 1 on success, 0 if it could not be mapped
+ */
+static int run_mapped(batch_t *batch, int fd, size_t size) {
+    const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    
+    if (data == MAP_FAILED) {
+        return 0;
+    }
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+    
+    split_lines(batch, data, size, 1);
+    
+    munmap((void *)data, size);
+    return 1;
+}
+
+/*
+ * Function to check lines from a pipe or terminal as they arrive
+ * Returns 1 on success, 0 on a read error
+ */
+static int run_stream(batch_t *batch, int fd) {
+    char *buffer = malloc(READ_BUFFER_SIZE);
+    size_t used = 0, consumed;
+    int eof = 0, skipping = 0;
+    
+    if (!buffer) {
+        fprintf(stderr, "Out of memory\n");
+        return 0;
+    }
+    
+    while (!eof) {
+        ssize_t n = read(fd, buffer + used, READ_BUFFER_SIZE - used);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Read error: %s\n", strerror(errno));
+            free(buffer);
+            return 0;
+        }
+        eof = n == 0;
+        used += n;
+    
+        // Drop the rest of a line that was too long
+        consumed = 0;
+        if (skipping) {
+            const char *end = memchr(buffer, '\n', used);
+            if (!end) {
+                used = 0;
+                continue;
+            }
+            consumed = end - buffer + 1;
+            skipping = 0;
+        }
+    
+        consumed += split_lines(batch, buffer + consumed, used - consumed, eof);
+    
+        if (consumed == 0 && used == READ_BUFFER_SIZE) {
+            // One line fills the buffer: report it and skip past its end
+            split_lines(batch, buffer, used, 1);
+            skipping = 1;
+            used = 0;
+            continue;
+        }
+    
+        memmove(buffer, buffer + consumed, used - consumed);
+        used -= consumed;
+    }
+    
+    free(buffer);
+    return 1;
+}
+
+int auth_batch_run(int fd, FILE *out, const auth_batch_config_t *config) {
+    struct timespec started, finished;
+    struct stat st;
+    batch_t batch;
+    int read_ok, i;
+    
+    memset(&batch, 0, sizeof(batch));
+    batch.config = config;
+    batch.out = out;
+    batch.lines = malloc(BATCH_LINES * sizeof(*batch.lines));
+    if (!batch.lines) {
+        fprintf(stderr, "Out of memory\n");
+        return 0;
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    read_ok = (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+               run_mapped(&batch, fd, st.st_size)) || run_stream(&batch, fd);
+    fflush(out);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    
+    double elapsed = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+    fprintf(stderr, "%zu requests in %.3f s (%.0f/s, %d jobs):", batch.requests, elapsed,
+            elapsed > 0 ? batch.requests / elapsed : 0.0, config->jobs);
+    for (i = 0; i < AUTH_RESULT_COUNT; i++) {
+        fprintf(stderr, " %s %zu", auth_result_name(i), batch.totals[i]);
+    }
+    fputc('\n', stderr);
+    
+    free(batch.lines);
+    return read_ok && batch.totals[AUTH_VALID] == batch.requests;
+}
@@ -0,0 +1,42 @@
+/*
+ * TapIn Batch Verification
+ * Checks newline-delimited JSON requests in bulk, without the daemon
+ *
+ * Used by "tapin_helper --process-auth-request --batch" to replay captured
+ * traffic or audit a day of requests. Each line is decoded as the listener
+ * decodes it (auth_record_from_json) and checked as the helper checks it
+ * (auth_core_check, then auth_core_check_replay), but no token is issued.
+ * One result line is written per request, in input order:
+ *
+ *   <line number> <result> <username>
+ *
+ * where result is an auth_result_name() ("valid", "bad_mac", ...) and the
+ * username is "-" if the line could not be decoded. Blank lines are
+ * skipped. A regular file is mapped rather than read.
+ *
+ * Lines are taken a block at a time: decoding and MAC checks for the block
+ * are split across worker threads, then replay checks and output run in
+ * order on the calling thread.
+ */
+
+#ifndef TAPIN_AUTH_BATCH_H
+#define TAPIN_AUTH_BATCH_H
+
+#include <stdio.h>
+
+#define AUTH_BATCH_MAX_JOBS 64
+
+typedef struct {
+    int jobs;                 // Threads decoding and checking MACs
+    int check_timestamps;     // Reject timestamps outside the window around now
+} auth_batch_config_t;
+
+/*
+ * Verify every request read from fd, writing results to out and a summary
+ * to stderr. Keys must be preloaded (key_cache_preload) and the replay
+ * cache set up (auth_core_start)
+ * Returns 1 if every request was valid, 0 otherwise
+ */
+int auth_batch_run(int fd, FILE *out, const auth_batch_config_t *config);
+
+#endif /* TAPIN_AUTH_BATCH_H */
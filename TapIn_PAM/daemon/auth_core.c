@@ -0,0 +1,393 @@
+/*
+ * TapIn Auth Core
+ * Timestamp, HMAC and replay checks, then a token in the store
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <syslog.h>
+#include "auth_core.h"
+#include "auth_record.h"
+#include "audit_journal.h"
+#include "key_cache.h"
+#include "random_pool.h"
+#include "replay_cache.h"
+#include "token_store.h"
+#include "async_log.h"
+
+#define MAX_TOKEN_LENGTH 64
+
+// Stages of an authentication request
+enum {
+    STAGE_REQUEST,
+    STAGE_MAC,
+    STAGE_REPLAY,
+    STAGE_TOKEN,
+    STAGE_COUNT
+};
+
+static stats_histogram_t stages[STAGE_COUNT] = {
+    [STAGE_REQUEST] = { "request" },
+    [STAGE_MAC] = { "mac" },
+    [STAGE_REPLAY] = { "replay" },
+    [STAGE_TOKEN] = { "token" },
+};
+
+// How authentication requests end
+enum {
+    RESULT_ACCEPTED,
+    RESULT_MALFORMED,
+    RESULT_TIMESTAMP,
+    RESULT_BAD_MAC,
+    RESULT_REPLAYED,
+    RESULT_REPLAY_FULL,
+    RESULT_TOKEN_FAILED,
+    RESULT_COUNT
+};
+
+static stats_counter_t results[RESULT_COUNT] = {
+    [RESULT_ACCEPTED] = { "accepted" },
+    [RESULT_MALFORMED] = { "malformed" },
+    [RESULT_TIMESTAMP] = { "timestamp" },
+    [RESULT_BAD_MAC] = { "bad_mac" },
+    [RESULT_REPLAYED] = { "replayed" },
+    [RESULT_REPLAY_FULL] = { "replay_full" },
+    [RESULT_TOKEN_FAILED] = { "token_failed" },
+};
+
+const stats_registry_t auth_core_stats = {
+    "tapin_helper", stages, STAGE_COUNT, results, RESULT_COUNT
+};
+
+// Audit outcome for each check result
+static const uint8_t audit_outcomes[AUTH_RESULT_COUNT] = {
+    [AUTH_VALID] = AUDIT_ACCEPTED,
+    [AUTH_MALFORMED] = AUDIT_MALFORMED,
+    [AUTH_TIMESTAMP] = AUDIT_TIMESTAMP,
+    [AUTH_BAD_MAC] = AUDIT_BAD_MAC,
+    [AUTH_REPLAYED] = AUDIT_REPLAYED,
+    [AUTH_REPLAY_FULL] = AUDIT_REPLAY_FULL,
+};
+
+// Held for writing while keys are reloaded, for reading while they are used
+static pthread_rwlock_t keys_lock = PTHREAD_RWLOCK_INITIALIZER;
+static int keys_shared = 0;   // Every HMAC key prepared, so readers may share them
+
+// Held while the replay cache is in use
+static pthread_mutex_t replay_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Set by auth_core_configure(); the window only changes under replay_lock,
+// together with the replay cache sized for it
+static int window_seconds = AUTH_CORE_TIMESTAMP_WINDOW_SECONDS;
+static int token_expiry_seconds = AUTH_CORE_TOKEN_EXPIRY_SECONDS;
+static int replay_rate = REPLAY_CACHE_DEFAULT_RATE;
+
+/*
+ * Function to read the monotonic clock in microseconds, for stage timings
+ */
+static long long monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int auth_core_start(const char *keystore_path, int rate) {
+    // Size the replay cache for the whole timestamp window up front
+    if (!replay_cache_init(window_seconds, rate)) {
+        async_log(LOG_ERR, "Failed to allocate replay cache for %d requests/s", rate);
+        return 0;
+    }
+    replay_rate = rate;
+    async_log(LOG_INFO, "Replay cache holds %d requests/s (%zu KiB)", rate, replay_cache_memory() / 1024);
+    
+    // Keys are loaded once and reloaded when tapinctl replaces the keystore
+    key_cache_start(keystore_path, AUTH_CORE_SHARED_SECRET_FILE);
+    keys_shared = key_cache_preload();
+    return 1;
+}
+
+int auth_core_configure(int window, int token_expiry, int rate) {
+    int ok = 1;
+    
+    __atomic_store_n(&token_expiry_seconds, token_expiry, __ATOMIC_RELAXED);
+    
+    pthread_mutex_lock(&replay_lock);
+    if (replay_cache_memory() == 0) {
+        // Not started yet; auth_core_start() sizes the cache
+        __atomic_store_n(&window_seconds, window, __ATOMIC_RELAXED);
+    } else if (window != window_seconds || rate != replay_rate) {
+        if (replay_cache_resize(window, rate, time(NULL))) {
+            async_log(LOG_INFO, "Replay cache now covers %d seconds at %d requests/s (%zu KiB)", window, rate,
+                      replay_cache_memory() / 1024);
+            __atomic_store_n(&window_seconds, window, __ATOMIC_RELAXED);
+            replay_rate = rate;
+        } else {
+            async_log(LOG_ERR, "Failed to resize replay cache, keeping a %d second window", window_seconds);
+            ok = 0;
+        }
+    }
+    pthread_mutex_unlock(&replay_lock);
+    return ok;
+}
+
+void auth_core_each_replay(void (*fn)(int64_t timestamp, const uint8_t *digest, void *arg), void *arg) {
+    pthread_mutex_lock(&replay_lock);
+    replay_cache_each(time(NULL), fn, arg);
+    pthread_mutex_unlock(&replay_lock);
+}
+
+void auth_core_restore_replay(int64_t timestamp, const uint8_t *digest) {
+    int64_t now = time(NULL);
+    
+    // The cache only takes timestamps inside its window
+    pthread_mutex_lock(&replay_lock);
+    if (timestamp >= now - window_seconds && timestamp <= now + window_seconds) {
+        replay_cache_check(timestamp, digest);
+    }
+    pthread_mutex_unlock(&replay_lock);
+}
+
+void auth_core_stop(void) {
+    key_cache_stop();
+    replay_cache_free();
+}
+
+int auth_core_watch_fd(void) {
+    return key_cache_watch_fd();
+}
+
+void auth_core_handle_key_events(void) {
+    // Engines for the old keys may be in use by a worker
+    pthread_rwlock_wrlock(&keys_lock);
+    key_cache_handle_events();
+    keys_shared = key_cache_preload();
+    pthread_rwlock_unlock(&keys_lock);
+}
+
+const char *auth_result_name(auth_result_t result) {
+    static const char *const names[AUTH_RESULT_COUNT] = {
+        [AUTH_VALID] = "valid",
+        [AUTH_MALFORMED] = "malformed",
+        [AUTH_TIMESTAMP] = "timestamp",
+        [AUTH_BAD_MAC] = "bad_mac",
+        [AUTH_REPLAYED] = "replayed",
+        [AUTH_REPLAY_FULL] = "replay_full",
+    };
+    
+    return (unsigned)result < AUTH_RESULT_COUNT ? names[result] : "unknown";
+}
+
+/*
+ * Function to check a record's timestamp and HMAC, reporting how long the
+ * HMAC took in *mac_us
+ */
+static auth_result_t check_record(const tapin_auth_record_t* record, time_t now, uint32_t* mac_us) {
+    char data_to_verify[256];
+    int data_len, verified;
+    long long started_us;
+    
+    // Check timestamp validity (within the window, 30 seconds by default)
+    int window = __atomic_load_n(&window_seconds, __ATOMIC_RELAXED);
+    if (now != 0 && (record->timestamp > (int64_t)now + window || record->timestamp < (int64_t)now - window)) {
+        return AUTH_TIMESTAMP;
+    }
+    
+    // Prepare data for HMAC verification (username:timestamp:nonce)
+    data_len = auth_record_signed_data(record, data_to_verify, sizeof(data_to_verify));
+    if (data_len < 0) {
+        return AUTH_MALFORMED;
+    }
+    
+    // Validate HMAC
+    started_us = monotonic_us();
+    verified = key_cache_verify(record, data_to_verify, data_len);
+    *mac_us = monotonic_us() - started_us;
+    stats_record(&stages[STAGE_MAC], *mac_us);
+    return verified ? AUTH_VALID : AUTH_BAD_MAC;
+}
+
+auth_result_t auth_core_check(const tapin_auth_record_t* record, time_t now) {
+    uint32_t mac_us;
+    return check_record(record, now, &mac_us);
+}
+
+/*
+ * Function to look a record up in the replay cache, reporting how long it
+ * took in *replay_us
+ */
+static auth_result_t check_replay(const tapin_auth_record_t* record, uint32_t* replay_us) {
+    long long started_us = monotonic_us();
+    int replay = replay_cache_check(record->timestamp, record->mac);
+    
+    *replay_us = monotonic_us() - started_us;
+    stats_record(&stages[STAGE_REPLAY], *replay_us);
+    switch (replay) {
+    case REPLAY_SEEN:
+        return AUTH_REPLAYED;
+    case REPLAY_FULL:
+        return AUTH_REPLAY_FULL;
+    default:
+        return AUTH_VALID;
+    }
+}
+
+auth_result_t auth_core_check_replay(const tapin_auth_record_t* record) {
+    uint32_t replay_us;
+    return check_replay(record, &replay_us);
+}
+
+/*
+ * Function to check a record against the current keys
+ * Prepared keys are shared by any number of threads; if some could not be
+ * prepared, they are keyed on first use and checks take turns
+ */
+static auth_result_t check_with_keys(const tapin_auth_record_t* record, time_t now, uint32_t* mac_us) {
+    auth_result_t result;
+    
+    pthread_rwlock_rdlock(&keys_lock);
+    if (!keys_shared) {
+        pthread_rwlock_unlock(&keys_lock);
+        pthread_rwlock_wrlock(&keys_lock);
+    }
+    result = check_record(record, now, mac_us);
+    pthread_rwlock_unlock(&keys_lock);
+    return result;
+}
+
+/*
+ * Function to validate the authentication request, filling in the stage
+ * timings of its audit record
+ */
+static auth_result_t validate_request(const tapin_auth_record_t* record, audit_record_t* audit) {
+    auth_result_t result = check_with_keys(record, time(NULL), &audit->mac_us);
+    
+    // Only authentic requests reach the replay cache, so it cannot be
+    // filled with forged ones. The window may have shrunk since it was
+    // checked, and the cache only holds timestamps inside it
+    if (result == AUTH_VALID) {
+        time_t now = time(NULL);
+        pthread_mutex_lock(&replay_lock);
+        if (record->timestamp > (int64_t)now + window_seconds || record->timestamp < (int64_t)now - window_seconds) {
+            result = AUTH_TIMESTAMP;
+        } else {
+            result = check_replay(record, &audit->replay_us);
+        }
+        pthread_mutex_unlock(&replay_lock);
+    }
+    
+    switch (result) {
+    case AUTH_VALID:
+        async_log(LOG_INFO, "Authentication request validated successfully for user: %s", record->username);
+        break;
+    case AUTH_TIMESTAMP:
+        async_log(LOG_ERR, "Authentication request timestamp is too old or in the future");
+        stats_count(&results[RESULT_TIMESTAMP]);
+        break;
+    case AUTH_BAD_MAC:
+        async_log(LOG_ERR, "HMAC validation failed for authentication request");
+        stats_count(&results[RESULT_BAD_MAC]);
+        break;
+    case AUTH_REPLAYED:
+        async_log(LOG_WARNING, "Replayed authentication request rejected for user: %s", record->username);
+        stats_count(&results[RESULT_REPLAYED]);
+        break;
+    case AUTH_REPLAY_FULL:
+        async_log(LOG_ERR, "Replay cache full for timestamp %lld, rejecting request", (long long)record->timestamp);
+        stats_count(&results[RESULT_REPLAY_FULL]);
+        break;
+    default:
+        stats_count(&results[RESULT_MALFORMED]);
+        break;
+    }
+    return result;
+}
+
+/*
+ * Function to validate the authentication request
+ */
+int validate_auth_request(const tapin_auth_record_t* record) {
+    audit_record_t audit;
+    return validate_request(record, &audit) == AUTH_VALID;
+}
+
+/*
+ * Function to issue an authentication token for a user
+ * The token is held in the in-memory token store until the PAM module
+ * consumes it or it expires
+ */
+int issue_auth_token(const char* username) {
+    char token[MAX_TOKEN_LENGTH];
+    time_t expiry_time;
+    
+    // Generate random token
+    if (!random_token(token, sizeof(token))) {
+        async_log(LOG_ERR, "Could not generate a token for user: %s", username);
+        return 0;
+    }
+    
+    // Calculate expiry time
+    time(&expiry_time);
+    expiry_time += __atomic_load_n(&token_expiry_seconds, __ATOMIC_RELAXED);
+    
+    // Unbound token: any PAM service/tty may consume it for this user
+    int stored = token_store_put(username, "", "", token, expiry_time);
+    explicit_bzero(token, sizeof(token));
+    if (!stored) {
+        async_log(LOG_ERR, "Token store is full, could not issue token for user: %s", username);
+        return 0;
+    }
+    
+    async_log(LOG_INFO, "Authentication token created for user: %s, expires at: %ld", username, expiry_time);
+    return 1;
+}
+
+/*
+ * Main processing function
+ * The listener has already decoded the phone's JSON into a record
+ */
+int process_auth_request(const void* payload, size_t length) {
+    const tapin_auth_record_t* record = payload;
+    long long started_us = monotonic_us();
+    long long token_us;
+    auth_result_t result;
+    audit_record_t audit;
+    int issued;
+    
+    memset(&audit, 0, sizeof(audit));
+    if (!auth_record_valid(payload, length)) {
+        async_log(LOG_ERR, "Malformed authentication record received");
+        stats_count(&results[RESULT_MALFORMED]);
+        audit.outcome = AUDIT_MALFORMED;
+        audit_journal_append(&audit);
+        return 0;
+    }
+    strcpy(audit.username, record->username);
+    if (record->flags & TAPIN_AUTH_HAS_DEVICE) {
+        audit.has_device = 1;
+        memcpy(audit.device, record->device, sizeof(audit.device));
+    }
+    
+    // Validate the request
+    result = validate_request(record, &audit);
+    if (result != AUTH_VALID) {
+        audit.total_us = monotonic_us() - started_us;
+        audit.outcome = audit_outcomes[result];
+        stats_record(&stages[STAGE_REQUEST], audit.total_us);
+        audit_journal_append(&audit);
+        return 0;
+    }
+    
+    // Issue authentication token
+    token_us = monotonic_us();
+    issued = issue_auth_token(record->username);
+    audit.token_us = monotonic_us() - token_us;
+    audit.total_us = monotonic_us() - started_us;
+    audit.outcome = issued ? AUDIT_ACCEPTED : AUDIT_TOKEN_FAILED;
+    stats_record(&stages[STAGE_TOKEN], audit.token_us);
+    stats_record(&stages[STAGE_REQUEST], audit.total_us);
+    stats_count(&results[issued ? RESULT_ACCEPTED : RESULT_TOKEN_FAILED]);
+    audit_journal_append(&audit);
+    return issued;
+}
@@ -0,0 +1,114 @@
+/*
+ * TapIn Auth Core
+ * Request validation and token issuing, shared by both ways of running
+ *
+ * Checks a decoded authentication record (timestamp window, HMAC under
+ * the phone's key, replay cache) and puts a fresh token for the user in
+ * the token store. For a challenge response the timestamp is when the
+ * listener sent the challenge, so the window bounds the challenge's age.
+ * The helper daemon runs it for records framed over its socket by the
+ * Bluetooth listener; in combined mode the helper's own session workers
+ * call it directly, with no socket in between.
+ *
+ * Requests may be processed from any thread. HMAC keys are all prepared
+ * when loaded, so MAC checks run in parallel and only wait for a key
+ * reload; the replay cache is checked under a lock. The timestamp window
+ * and token lifetime default to the values below and may be changed while
+ * requests are being processed. Issuing a token does not wake PAM
+ * requests waiting for it; that is up to the caller. Each processed
+ * request, accepted or not, goes to the audit journal if the caller has
+ * opened one.
+ */
+
+#ifndef TAPIN_AUTH_CORE_H
+#define TAPIN_AUTH_CORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "tapin_channel.h"
+#include "stats.h"
+
+#define AUTH_CORE_SHARED_SECRET_FILE "/etc/tapin/shared_secret"
+#define AUTH_CORE_TIMESTAMP_WINDOW_SECONDS 30
+#define AUTH_CORE_TOKEN_EXPIRY_SECONDS 20
+
+// Stage timings and outcomes, exported as "tapin_helper"
+extern const stats_registry_t auth_core_stats;
+
+// What the checks found
+typedef enum {
+    AUTH_VALID = 0,
+    AUTH_MALFORMED,
+    AUTH_TIMESTAMP,
+    AUTH_BAD_MAC,
+    AUTH_REPLAYED,
+    AUTH_REPLAY_FULL,
+    AUTH_RESULT_COUNT
+} auth_result_t;
+
+// "valid", "malformed", "timestamp", "bad_mac", "replayed" or "replay_full"
+const char *auth_result_name(auth_result_t result);
+
+/*
+ * Size the replay cache and load the keys
+ * Returns 1 on success, 0 if the replay cache could not be allocated
+ */
+int auth_core_start(const char *keystore_path, int rate);
+
+/*
+ * Set the timestamp window, the token lifetime and the replay rate; may be
+ * called before auth_core_start() or while requests are processed. The
+ * replay cache is resized for a new window or rate, keeping what it
+ * remembers
+ * Returns 1 on success, 0 if the cache could not be resized and keeps its
+ * old window
+ */
+int auth_core_configure(int window, int token_expiry, int rate);
+
+// Call fn for every request the replay cache remembers, for a new image
+void auth_core_each_replay(void (*fn)(int64_t timestamp, const uint8_t *digest, void *arg), void *arg);
+
+// Remember a request a previous image accepted, if it is still in the window
+void auth_core_restore_replay(int64_t timestamp, const uint8_t *digest);
+
+void auth_core_stop(void);
+
+// inotify descriptor to poll for keystore changes, or -1
+int auth_core_watch_fd(void);
+
+// Reload changed keys; call when auth_core_watch_fd() is readable
+void auth_core_handle_key_events(void);
+
+/*
+ * Check a record's timestamp against now (skipped if now is 0) and its
+ * HMAC, without logging. Safe from several threads at once after
+ * key_cache_preload(), until the keys are next reloaded
+ */
+auth_result_t auth_core_check(const tapin_auth_record_t *record, time_t now);
+
+/*
+ * Remember an authentic record, or report it as replayed; not thread-safe
+ */
+auth_result_t auth_core_check_replay(const tapin_auth_record_t *record);
+
+/*
+ * Check a decoded record's timestamp, HMAC and freshness; safe from any
+ * thread
+ * Returns 1 if the request is authentic and new
+ */
+int validate_auth_request(const tapin_auth_record_t *record);
+
+/*
+ * Put a new token for the user in the token store
+ * Returns 1 on success, 0 on failure
+ */
+int issue_auth_token(const char *username);
+
+/*
+ * Validate a record and issue a token for it; safe from any thread
+ * Returns 1 if a token was issued, 0 if the request was rejected
+ */
+int process_auth_request(const void *payload, size_t length);
+
+#endif /* TAPIN_AUTH_CORE_H */
@@ -0,0 +1,714 @@
+/*
+ * TapIn Authentication Records
+ * In-place JSON request parser and layout checks for tapin_auth_record_t
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include "auth_record.h"
+#include "async_log.h"
+
+// Longest timestamp accepted, in decimal digits
+#define MAX_TIMESTAMP_DIGITS 18
+
+// Deepest nesting allowed inside values of keys we don't use
+#define MAX_SKIP_DEPTH 16
+
+// A \uXXXX escape is the longest way to spell one byte of a value
+#define MAX_ESCAPE_EXPANSION 6
+
+// Fields each form of request must have, as match_field bits
+#define FIELDS_TIMESTAMPED 0x0F       // username, timestamp, nonce, hmac
+#define FIELDS_CHALLENGE 0x19         // username, hmac, challenge
+
+// decode_string results besides a length
+#define DECODE_TOO_LONG -1
+#define DECODE_INVALID -2
+
+// Read position in the buffer being parsed
+typedef struct {
+    const char *p;
+    const char *end;
+} json_cursor_t;
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/*
+ * Function to parse a timestamp in plain decimal
+ * Anything that would not print back identically (leading zeros, signs,
+ * spaces) is rejected, since the helper re-creates the signed text from
+ * the integer
+ */
+static int parse_timestamp(const char *text, int64_t *timestamp) {
+    size_t length = strlen(text);
+    int64_t value = 0;
+    size_t i;
+    
+    if (length == 0 || length > MAX_TIMESTAMP_DIGITS || (text[0] == '0' && length > 1)) {
+        return 0;
+    }
+    
+    for (i = 0; i < length; i++) {
+        if (text[i] < '0' || text[i] > '9') {
+            return 0;
+        }
+        value = value * 10 + (text[i] - '0');
+    }
+    
+    *timestamp = value;
+    return 1;
+}
+
+/*
+ * Function to decode one hex digit without branching on its value
+ * Sets bits in *invalid if c is not a hex digit
+ */
+static unsigned hex_nibble_ct(unsigned char c, unsigned *invalid) {
+    // All-ones masks when c is in '0'..'9' or (case-folded) 'A'..'F'
+    unsigned digit = c ^ 0x30U;
+    unsigned digit_mask = ((digit - 10U) >> 8) & 0xffU;
+    unsigned alpha = (c & ~0x20U) - 55U;
+    unsigned alpha_mask = (((alpha - 10U) ^ (alpha - 16U)) >> 8) & 0xffU;
+    
+    *invalid |= (digit_mask | alpha_mask) ^ 0xffU;
+    return ((digit_mask & digit) | (alpha_mask & alpha)) & 0x0fU;
+}
+
+int auth_mac_from_hex(const char *hex, size_t length, uint8_t *mac) {
+    unsigned invalid = 0;
+    int i;
+    
+    if (length != TAPIN_AUTH_MAC_LENGTH * 2) {
+        return 0;
+    }
+    
+    // Every digit is decoded before the verdict, so the time taken does
+    // not depend on where a bad digit sits
+    for (i = 0; i < TAPIN_AUTH_MAC_LENGTH; i++) {
+        unsigned high = hex_nibble_ct((unsigned char)hex[i * 2], &invalid);
+        unsigned low = hex_nibble_ct((unsigned char)hex[i * 2 + 1], &invalid);
+        mac[i] = (uint8_t)(high << 4 | low);
+    }
+    
+    return invalid == 0;
+}
+
+static int hex4_value(const char *p) {
+    int value = 0, i;
+    
+    for (i = 0; i < 4; i++) {
+        int digit = hex_value(p[i]);
+        if (digit < 0) {
+            return -1;
+        }
+        value = value << 4 | digit;
+    }
+    return value;
+}
+
+static void skip_whitespace(json_cursor_t *c) {
+    while (c->p < c->end && (*c->p == ' ' || *c->p == '\t' || *c->p == '\n' || *c->p == '\r')) {
+        c->p++;
+    }
+}
+
+/*
+ * Function to scan a JSON string starting at its opening quote
+ * Escapes are checked but not decoded. max_raw bounds the scan, so an
+ * overlong field is rejected without reading all of it.
+ */
+static auth_parse_result_t scan_string(json_cursor_t *c, auth_field_span_t *span, size_t max_raw) {
+    if (c->p >= c->end || *c->p != '"') {
+        return AUTH_PARSE_SYNTAX;
+    }
+    
+    c->p++;
+    span->start = c->p;
+    span->escaped = 0;
+    
+    while (c->p < c->end) {
+        unsigned char ch = (unsigned char)*c->p;
+    
+        if (ch == '"') {
+            span->length = (size_t)(c->p - span->start);
+            c->p++;
+            return AUTH_PARSE_OK;
+        }
+        if (ch < 0x20) {
+            return AUTH_PARSE_SYNTAX;
+        }
+        if ((size_t)(c->p - span->start) >= max_raw) {
+            return AUTH_PARSE_TOO_LONG;
+        }
+    
+        if (ch != '\\') {
+            c->p++;
+            continue;
+        }
+    
+        span->escaped = 1;
+        if (c->end - c->p < 2) {
+            return AUTH_PARSE_SYNTAX;
+        }
+        switch (c->p[1]) {
+        case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':
+            c->p += 2;
+            break;
+        case 'u':
+            if (c->end - c->p < 6 || hex4_value(c->p + 2) < 0) {
+                return AUTH_PARSE_SYNTAX;
+            }
+            c->p += 6;
+            break;
+        default:
+            return AUTH_PARSE_SYNTAX;
+        }
+    }
+    
+    return AUTH_PARSE_SYNTAX;
+}
+
+static int skip_digits(json_cursor_t *c) {
+    const char *start = c->p;
+    
+    while (c->p < c->end && *c->p >= '0' && *c->p <= '9') {
+        c->p++;
+    }
+    return c->p > start;
+}
+
+static auth_parse_result_t skip_number(json_cursor_t *c) {
+    if (c->p < c->end && *c->p == '-') {
+        c->p++;
+    }
+    if (c->p < c->end && *c->p == '0') {
+        c->p++;
+    } else if (!skip_digits(c)) {
+        return AUTH_PARSE_SYNTAX;
+    }
+    
+    if (c->p < c->end && *c->p == '.') {
+        c->p++;
+        if (!skip_digits(c)) {
+            return AUTH_PARSE_SYNTAX;
+        }
+    }
+    
+    if (c->p < c->end && (*c->p == 'e' || *c->p == 'E')) {
+        c->p++;
+        if (c->p < c->end && (*c->p == '+' || *c->p == '-')) {
+            c->p++;
+        }
+        if (!skip_digits(c)) {
+            return AUTH_PARSE_SYNTAX;
+        }
+    }
+    
+    return AUTH_PARSE_OK;
+}
+
+static auth_parse_result_t skip_literal(json_cursor_t *c, const char *literal) {
+    size_t length = strlen(literal);
+    
+    if ((size_t)(c->end - c->p) < length || memcmp(c->p, literal, length) != 0) {
+        return AUTH_PARSE_SYNTAX;
+    }
+    c->p += length;
+    return AUTH_PARSE_OK;
+}
+
+/*
+ * Function to step over the value of a key we don't use
+ */
+static auth_parse_result_t skip_value(json_cursor_t *c, int depth) {
+    auth_field_span_t ignored;
+    auth_parse_result_t result;
+    
+    if (c->p >= c->end) {
+        return AUTH_PARSE_SYNTAX;
+    }
+    
+    switch (*c->p) {
+    case '"':
+        return scan_string(c, &ignored, (size_t)-1);
+    case 't':
+        return skip_literal(c, "true");
+    case 'f':
+        return skip_literal(c, "false");
+    case 'n':
+        return skip_literal(c, "null");
+    case '{':
+    case '[':
+        break;
+    default:
+        return skip_number(c);
+    }
+    
+    // Object or array
+    char close = *c->p == '{' ? '}' : ']';
+    if (depth >= MAX_SKIP_DEPTH) {
+        return AUTH_PARSE_SYNTAX;
+    }
+    
+    c->p++;
+    skip_whitespace(c);
+    if (c->p < c->end && *c->p == close) {
+        c->p++;
+        return AUTH_PARSE_OK;
+    }
+    
+    for (;;) {
+        if (close == '}') {
+            result = scan_string(c, &ignored, (size_t)-1);
+            if (result != AUTH_PARSE_OK) {
+                return result;
+            }
+            skip_whitespace(c);
+            if (c->p >= c->end || *c->p != ':') {
+                return AUTH_PARSE_SYNTAX;
+            }
+            c->p++;
+            skip_whitespace(c);
+        }
+    
+        result = skip_value(c, depth + 1);
+        if (result != AUTH_PARSE_OK) {
+            return result;
+        }
+    
+        skip_whitespace(c);
+        if (c->p >= c->end) {
+            return AUTH_PARSE_SYNTAX;
+        }
+        if (*c->p == close) {
+            c->p++;
+            return AUTH_PARSE_OK;
+        }
+        if (*c->p != ',') {
+            return AUTH_PARSE_SYNTAX;
+        }
+        c->p++;
+        skip_whitespace(c);
+    }
+}
+
+static size_t encode_utf8(unsigned int code_point, char *out) {
+    if (code_point < 0x80) {
+        out[0] = (char)code_point;
+        return 1;
+    }
+    if (code_point < 0x800) {
+        out[0] = (char)(0xC0 | code_point >> 6);
+        out[1] = (char)(0x80 | (code_point & 0x3F));
+        return 2;
+    }
+    if (code_point < 0x10000) {
+        out[0] = (char)(0xE0 | code_point >> 12);
+        out[1] = (char)(0x80 | (code_point >> 6 & 0x3F));
+        out[2] = (char)(0x80 | (code_point & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | code_point >> 18);
+    out[1] = (char)(0x80 | (code_point >> 12 & 0x3F));
+    out[2] = (char)(0x80 | (code_point >> 6 & 0x3F));
+    out[3] = (char)(0x80 | (code_point & 0x3F));
+    return 4;
+}
+
+/*
+ * Function to unescape a scanned string into out (or just measure it if
+ * out is NULL). Returns the decoded length, DECODE_TOO_LONG if it exceeds
+ * capacity, or DECODE_INVALID for escapes a C string can't hold
+ */
+static long decode_string(const auth_field_span_t *span, char *out, size_t capacity) {
+    const char *p = span->start, *end = span->start + span->length;
+    size_t length = 0;
+    
+    if (!span->escaped) {
+        if (span->length > capacity) {
+            return DECODE_TOO_LONG;
+        }
+        if (out) {
+            memcpy(out, span->start, span->length);
+        }
+        return (long)span->length;
+    }
+    
+    // scan_string has already checked every escape is complete
+    while (p < end) {
+        char bytes[4];
+        size_t count = 1;
+    
+        if (*p != '\\') {
+            bytes[0] = *p++;
+        } else {
+            char escape = p[1];
+            p += 2;
+            switch (escape) {
+            case 'b': bytes[0] = '\b'; break;
+            case 'f': bytes[0] = '\f'; break;
+            case 'n': bytes[0] = '\n'; break;
+            case 'r': bytes[0] = '\r'; break;
+            case 't': bytes[0] = '\t'; break;
+            case 'u': {
+                unsigned int code_point = (unsigned int)hex4_value(p);
+                p += 4;
+                if (code_point >= 0xD800 && code_point <= 0xDBFF) {
+                    // High surrogate: must be followed by a low one
+                    if (end - p < 6 || p[0] != '\\' || p[1] != 'u') {
+                        return DECODE_INVALID;
+                    }
+                    int low = hex4_value(p + 2);
+                    if (low < 0xDC00 || low > 0xDFFF) {
+                        return DECODE_INVALID;
+                    }
+                    code_point = 0x10000 + ((code_point - 0xD800) << 10) + (unsigned int)(low - 0xDC00);
+                    p += 6;
+                } else if ((code_point >= 0xDC00 && code_point <= 0xDFFF) || code_point == 0) {
+                    return DECODE_INVALID;
+                }
+                count = encode_utf8(code_point, bytes);
+                break;
+            }
+            default:
+                bytes[0] = escape;
+                break;
+            }
+        }
+    
+        if (length + count > capacity) {
+            return DECODE_TOO_LONG;
+        }
+        if (out) {
+            memcpy(out + length, bytes, count);
+        }
+        length += count;
+    }
+    
+    return (long)length;
+}
+
+/*
+ * Function to pick the span and length limit for a key, if it is one of ours
+ */
+static auth_field_span_t *match_field(const auth_field_span_t *key, auth_request_spans_t *spans,
+                                      size_t *limit, unsigned int *bit) {
+    static const struct {
+        const char *name;
+        size_t offset;
+        size_t limit;
+    } fields[] = {
+        { "username", offsetof(auth_request_spans_t, username), TAPIN_AUTH_USERNAME_LENGTH },
+        { "timestamp", offsetof(auth_request_spans_t, timestamp), AUTH_FIELD_TIMESTAMP_MAX },
+        { "nonce", offsetof(auth_request_spans_t, nonce), TAPIN_AUTH_NONCE_LENGTH },
+        { "hmac", offsetof(auth_request_spans_t, hmac), AUTH_FIELD_HMAC_MAX },
+        { "challenge", offsetof(auth_request_spans_t, challenge), TAPIN_AUTH_NONCE_LENGTH }
+    };
+    size_t i;
+    
+    // Our keys never need escaping; an escaped key is someone else's
+    if (key->escaped) {
+        return NULL;
+    }
+    
+    for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        if (key->length == strlen(fields[i].name) && memcmp(key->start, fields[i].name, key->length) == 0) {
+            *limit = fields[i].limit;
+            *bit = 1u << i;
+            return (auth_field_span_t *)((char *)spans + fields[i].offset);
+        }
+    }
+    return NULL;
+}
+
+auth_parse_result_t auth_request_parse(const char *data, size_t length, auth_request_spans_t *spans) {
+    json_cursor_t c = { data, data + length };
+    auth_field_span_t key;
+    auth_parse_result_t result;
+    unsigned int seen = 0, bit = 0;
+    size_t limit = 0;
+    
+    memset(spans, 0, sizeof(*spans));
+    
+    skip_whitespace(&c);
+    if (c.p >= c.end || *c.p != '{') {
+        return AUTH_PARSE_SYNTAX;
+    }
+    c.p++;
+    skip_whitespace(&c);
+    
+    if (c.p < c.end && *c.p == '}') {
+        c.p++;
+    } else {
+        for (;;) {
+            result = scan_string(&c, &key, (size_t)-1);
+            if (result != AUTH_PARSE_OK) {
+                return result;
+            }
+            skip_whitespace(&c);
+            if (c.p >= c.end || *c.p != ':') {
+                return AUTH_PARSE_SYNTAX;
+            }
+            c.p++;
+            skip_whitespace(&c);
+    
+            auth_field_span_t *field = match_field(&key, spans, &limit, &bit);
+            if (field) {
+                if (seen & bit) {
+                    return AUTH_PARSE_DUPLICATE_FIELD;
+                }
+                if (c.p >= c.end) {
+                    return AUTH_PARSE_SYNTAX;
+                }
+                if (*c.p != '"') {
+                    return AUTH_PARSE_FIELD_TYPE;
+                }
+                result = scan_string(&c, field, limit * MAX_ESCAPE_EXPANSION);
+                if (result != AUTH_PARSE_OK) {
+                    return result;
+                }
+    
+                long decoded = decode_string(field, NULL, limit);
+                if (decoded == DECODE_INVALID) {
+                    return AUTH_PARSE_SYNTAX;
+                }
+                if (decoded == DECODE_TOO_LONG) {
+                    return AUTH_PARSE_TOO_LONG;
+                }
+                seen |= bit;
+            } else {
+                result = skip_value(&c, 1);
+                if (result != AUTH_PARSE_OK) {
+                    return result;
+                }
+            }
+    
+            skip_whitespace(&c);
+            if (c.p >= c.end) {
+                return AUTH_PARSE_SYNTAX;
+            }
+            if (*c.p == '}') {
+                c.p++;
+                break;
+            }
+            if (*c.p != ',') {
+                return AUTH_PARSE_SYNTAX;
+            }
+            c.p++;
+            skip_whitespace(&c);
+        }
+    }
+    
+    // Only whitespace may follow the object
+    skip_whitespace(&c);
+    if (c.p != c.end) {
+        return AUTH_PARSE_SYNTAX;
+    }
+    
+    // Either form, but not a mixture of the two
+    return seen == FIELDS_TIMESTAMPED || seen == FIELDS_CHALLENGE ? AUTH_PARSE_OK : AUTH_PARSE_MISSING_FIELD;
+}
+
+int auth_record_from_json(const char *json, size_t length, tapin_auth_record_t *record) {
+    auth_request_spans_t spans;
+    char timestamp[AUTH_FIELD_TIMESTAMP_MAX + 1];
+    char hmac[AUTH_FIELD_HMAC_MAX + 1];
+    long username_length, nonce_length, timestamp_length, hmac_length;
+    
+    memset(record, 0, sizeof(*record));
+    
+    switch (auth_request_parse(json, length, &spans)) {
+    case AUTH_PARSE_OK:
+        break;
+    case AUTH_PARSE_MISSING_FIELD:
+        async_log(LOG_ERR, "Missing required fields in authentication request");
+        return 0;
+    case AUTH_PARSE_DUPLICATE_FIELD:
+        async_log(LOG_ERR, "Duplicate fields in authentication request");
+        return 0;
+    case AUTH_PARSE_FIELD_TYPE:
+        async_log(LOG_ERR, "Invalid field types in authentication request");
+        return 0;
+    case AUTH_PARSE_TOO_LONG:
+        async_log(LOG_ERR, "Authentication request fields too long");
+        return 0;
+    default:
+        async_log(LOG_ERR, "Invalid JSON format in authentication request");
+        return 0;
+    }
+    
+    // The parser has checked every field decodes within its limit
+    username_length = decode_string(&spans.username, record->username, TAPIN_AUTH_USERNAME_LENGTH);
+    hmac_length = decode_string(&spans.hmac, hmac, AUTH_FIELD_HMAC_MAX);
+    hmac[hmac_length] = '\0';
+    
+    if (username_length == 0) {
+        async_log(LOG_ERR, "Empty username in authentication request");
+        return 0;
+    }
+    
+    // A challenge response carries the listener's challenge in place of
+    // the phone's timestamp and nonce
+    if (spans.challenge.start) {
+        nonce_length = decode_string(&spans.challenge, record->nonce, TAPIN_AUTH_NONCE_LENGTH);
+        record->flags |= TAPIN_AUTH_CHALLENGE;
+        if (nonce_length != TAPIN_AUTH_NONCE_LENGTH || !auth_mac_from_hex(hmac, hmac_length, record->mac)) {
+            async_log(LOG_ERR, "Malformed challenge or HMAC in authentication request");
+            memset(record, 0, sizeof(*record));
+            return 0;
+        }
+    } else {
+        nonce_length = decode_string(&spans.nonce, record->nonce, TAPIN_AUTH_NONCE_LENGTH);
+        timestamp_length = decode_string(&spans.timestamp, timestamp, AUTH_FIELD_TIMESTAMP_MAX);
+        timestamp[timestamp_length] = '\0';
+        if (!parse_timestamp(timestamp, &record->timestamp) || !auth_mac_from_hex(hmac, hmac_length, record->mac)) {
+            async_log(LOG_ERR, "Malformed timestamp or HMAC in authentication request");
+            memset(record, 0, sizeof(*record));
+            return 0;
+        }
+    }
+    
+    record->version = TAPIN_AUTH_RECORD_VERSION;
+    record->username_length = (uint8_t)username_length;
+    record->nonce_length = (uint8_t)nonce_length;
+    return 1;
+}
+
+int auth_record_from_binary(const void *message, size_t length, tapin_auth_record_t *record) {
+    static const char hex[] = "0123456789abcdef";
+    const uint8_t *data = message;
+    uint64_t timestamp = 0;
+    int i;
+    
+    memset(record, 0, sizeof(*record));
+    
+    if (length < AUTH_WIRE_HEADER_LENGTH || data[0] != AUTH_WIRE_BINARY_V1) {
+        async_log(LOG_ERR, "Binary authentication request too short or of another version");
+        return 0;
+    }
+    
+    uint8_t flags = data[1], username_length = data[2], nonce_length = data[3];
+    for (i = 0; i < 8; i++) {
+        timestamp = timestamp << 8 | data[4 + i];
+    }
+    
+    // Lengths must account for every byte, and a challenge response
+    // carries neither a nonce nor a timestamp of its own
+    if ((flags & ~AUTH_WIRE_CHALLENGE) != 0 || username_length == 0 ||
+        username_length > TAPIN_AUTH_USERNAME_LENGTH || nonce_length > AUTH_WIRE_NONCE_MAX ||
+        length != (size_t)AUTH_WIRE_HEADER_LENGTH + username_length + nonce_length ||
+        timestamp > INT64_MAX ||
+        ((flags & AUTH_WIRE_CHALLENGE) && (nonce_length != 0 || timestamp != 0))) {
+        async_log(LOG_ERR, "Malformed binary authentication request");
+        return 0;
+    }
+    
+    // The username becomes a C string, so it cannot hold a NUL
+    const uint8_t *username = data + AUTH_WIRE_HEADER_LENGTH;
+    if (memchr(username, '\0', username_length)) {
+        async_log(LOG_ERR, "Invalid username in binary authentication request");
+        return 0;
+    }
+    
+    memcpy(record->username, username, username_length);
+    memcpy(record->mac, data + 12, TAPIN_AUTH_MAC_LENGTH);
+    for (i = 0; i < nonce_length; i++) {
+        uint8_t byte = username[username_length + i];
+        record->nonce[i * 2] = hex[byte >> 4];
+        record->nonce[i * 2 + 1] = hex[byte & 0x0f];
+    }
+    
+    record->version = TAPIN_AUTH_RECORD_VERSION;
+    record->username_length = username_length;
+    record->nonce_length = (uint8_t)(nonce_length * 2);
+    record->timestamp = (int64_t)timestamp;
+    if (flags & AUTH_WIRE_CHALLENGE) {
+        record->flags |= TAPIN_AUTH_CHALLENGE;
+    }
+    return 1;
+}
+
+int auth_record_from_message(const void *message, size_t length, tapin_auth_record_t *record) {
+    const uint8_t *data = message;
+    
+    // Bytes 0xB0-0xBF never start a JSON text
+    if (length > 0 && (data[0] & 0xF0) == (AUTH_WIRE_BINARY_V1 & 0xF0)) {
+        if (data[0] != AUTH_WIRE_BINARY_V1) {
+            memset(record, 0, sizeof(*record));
+            async_log(LOG_ERR, "Unsupported binary authentication request version 0x%02x", data[0]);
+            return 0;
+        }
+        return auth_record_from_binary(message, length, record);
+    }
+    return auth_record_from_json(message, length, record);
+}
+
+int auth_device_from_text(const char *text, uint8_t *device) {
+    int i;
+    
+    if (strlen(text) != 17) {
+        return 0;
+    }
+    
+    for (i = 0; i < 6; i++) {
+        int high = hex_value(text[i * 3]);
+        int low = hex_value(text[i * 3 + 1]);
+        if (high < 0 || low < 0 || (i < 5 && text[i * 3 + 2] != ':')) {
+            return 0;
+        }
+        device[i] = (uint8_t)(high << 4 | low);
+    }
+    
+    return 1;
+}
+
+int auth_record_valid(const void *payload, size_t length) {
+    const tapin_auth_record_t *record = payload;
+    
+    if (length != sizeof(*record) || record->version != TAPIN_AUTH_RECORD_VERSION ||
+        (record->flags & ~(TAPIN_AUTH_HAS_DEVICE | TAPIN_AUTH_CHALLENGE)) != 0) {
+        return 0;
+    }
+    
+    // The listener always sends challenges of full length
+    if ((record->flags & TAPIN_AUTH_CHALLENGE) && record->nonce_length != TAPIN_AUTH_NONCE_LENGTH) {
+        return 0;
+    }
+    
+    // Lengths must match the strings, which must be terminated
+    return record->username_length > 0 &&
+           record->username_length <= TAPIN_AUTH_USERNAME_LENGTH &&
+           record->nonce_length <= TAPIN_AUTH_NONCE_LENGTH &&
+           strnlen(record->username, sizeof(record->username)) == record->username_length &&
+           strnlen(record->nonce, sizeof(record->nonce)) == record->nonce_length &&
+           record->timestamp >= 0;
+}
+
+int auth_record_signed_data(const tapin_auth_record_t *record, char *out, size_t size) {
+    int length;
+    
+    // "challenge" is never a decimal timestamp, so a phone's answer to a
+    // challenge can never pass for a timestamped request, or the reverse
+    if (record->flags & TAPIN_AUTH_CHALLENGE) {
+        length = snprintf(out, size, "%s:challenge:%s", record->username, record->nonce);
+    } else {
+        length = snprintf(out, size, "%s:%lld:%s", record->username,
+                          (long long)record->timestamp, record->nonce);
+    }
+    
+    return length < 0 || (size_t)length >= size ? -1 : length;
+}
@@ -0,0 +1,127 @@
+/*
+ * TapIn Authentication Records
+ * Conversion from the phone's JSON request to the helper channel record
+ *
+ * The listener decodes each request exactly once at the phone boundary;
+ * the helper only checks the record's layout before verifying it.
+ *
+ * The request schema is fixed, so instead of building a general JSON tree
+ * the parser makes a single pass over the receive buffer and records where
+ * each field's value lies. It allocates nothing.
+ *
+ * Newer apps send the same fields in a fixed binary layout instead, which
+ * the listener takes apart with a length check and a few copies. The first
+ * byte of a message says which it is: JSON starts with '{' (or
+ * whitespace), a binary message with its version, one of 0xB0-0xBF.
+ *
+ *   0   version        AUTH_WIRE_BINARY_V1
+ *   1   flags          AUTH_WIRE_CHALLENGE if it answers the challenge
+ *   2   username bytes 1..TAPIN_AUTH_USERNAME_LENGTH
+ *   3   nonce bytes    0..AUTH_WIRE_NONCE_MAX; 0 in a challenge response
+ *   4   timestamp      8 bytes, big-endian seconds; 0 in a challenge response
+ *   12  MAC            TAPIN_AUTH_MAC_LENGTH raw bytes
+ *   44  username, then nonce
+ *
+ * The nonce is signed as lowercase hex, so the signed text is the same as
+ * for JSON; a challenge response signs the challenge it was sent.
+ */
+
+#ifndef TAPIN_AUTH_RECORD_H
+#define TAPIN_AUTH_RECORD_H
+
+#include <stddef.h>
+#include "tapin_channel.h"
+
+// Limits on field values as sent (after unescaping)
+#define AUTH_FIELD_TIMESTAMP_MAX 20
+#define AUTH_FIELD_HMAC_MAX 128
+
+// Binary messages
+#define AUTH_WIRE_BINARY_V1 0xB1
+#define AUTH_WIRE_HEADER_LENGTH 44
+#define AUTH_WIRE_NONCE_MAX (TAPIN_AUTH_NONCE_LENGTH / 2)
+#define AUTH_WIRE_CHALLENGE 0x01
+
+// Results of auth_request_parse
+typedef enum {
+    AUTH_PARSE_OK,
+    AUTH_PARSE_SYNTAX,          // Not a JSON object
+    AUTH_PARSE_MISSING_FIELD,   // A required field is absent
+    AUTH_PARSE_DUPLICATE_FIELD, // A required field appears twice
+    AUTH_PARSE_FIELD_TYPE,      // A required field is not a string
+    AUTH_PARSE_TOO_LONG         // A field exceeds its length limit
+} auth_parse_result_t;
+
+// Raw value of a string field inside the receive buffer, without quotes
+typedef struct {
+    const char *start;
+    size_t length;
+    int escaped;                // Contains backslash escapes
+} auth_field_span_t;
+
+typedef struct {
+    auth_field_span_t username;
+    auth_field_span_t timestamp;
+    auth_field_span_t nonce;
+    auth_field_span_t hmac;
+    auth_field_span_t challenge;  // Only in challenge responses
+} auth_request_spans_t;
+
+/*
+ * Parse a JSON request of the form
+ * {"username":"...","timestamp":"...","nonce":"...","hmac":"<hex>"}
+ * or a challenge response {"username":"...","challenge":"...","hmac":"<hex>"}
+ * in place. Other keys are skipped; the fields must be strings within
+ * their length limits, and one form's fields must not appear in the
+ * other's. Spans point into data; absent fields have a NULL start.
+ */
+auth_parse_result_t auth_request_parse(const char *data, size_t length, auth_request_spans_t *spans);
+
+/*
+ * Decode a JSON request into a record. A challenge response comes back
+ * with TAPIN_AUTH_CHALLENGE set, the challenge as its nonce and no
+ * timestamp; the session that sent the challenge fills that in
+ * Returns 1 on success, 0 if the request is malformed
+ */
+int auth_record_from_json(const char *json, size_t length, tapin_auth_record_t *record);
+
+/*
+ * Decode a binary request into a record. A challenge response comes back
+ * with TAPIN_AUTH_CHALLENGE set and no nonce; the session that sent the
+ * challenge fills in both
+ * Returns 1 on success, 0 if the request is malformed
+ */
+int auth_record_from_binary(const void *message, size_t length, tapin_auth_record_t *record);
+
+/*
+ * Decode a request in whichever encoding its first byte names
+ * Returns 1 on success, 0 if the request is malformed or of an unknown version
+ */
+int auth_record_from_message(const void *message, size_t length, tapin_auth_record_t *record);
+
+/*
+ * Decode a hex MAC (either case) into TAPIN_AUTH_MAC_LENGTH raw bytes in
+ * constant time. Returns 1 on success, 0 if the text is not a MAC
+ */
+int auth_mac_from_hex(const char *hex, size_t length, uint8_t *mac);
+
+/*
+ * Parse a Bluetooth address ("XX:XX:XX:XX:XX:XX") into six bytes, most
+ * significant first. Returns 1 on success, 0 if text is not an address
+ */
+int auth_device_from_text(const char *text, uint8_t *device);
+
+/*
+ * Check that a received payload is a well-formed record of this version
+ * Returns 1 if it is, 0 otherwise
+ */
+int auth_record_valid(const void *payload, size_t length);
+
+/*
+ * Format the data covered by the MAC ("username:timestamp:nonce", or
+ * "username:challenge:nonce" for a challenge response)
+ * Returns the length written, or -1 if it does not fit
+ */
+int auth_record_signed_data(const tapin_auth_record_t *record, char *out, size_t size);
+
+#endif /* TAPIN_AUTH_RECORD_H */
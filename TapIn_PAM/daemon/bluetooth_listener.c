@@ -4,6 +4,7 @@
  * 
  * This daemon listens on a Bluetooth RFCOMM socket for authentication requests
  * from the TapIn mobile application and forwards them to the helper daemon.
+ * Sessions are handled concurrently by a bounded pool of worker threads.
  */
 
 #include <stdio.h>
@@ -20,299 +21,406 @@
 #include <signal.h>
 #include <syslog.h>
 #include <sys/un.h>
-#include <json-c/json.h>
-#include <sys/wait.h>
+#include <poll.h>
+#include <getopt.h>
+#include "transport.h"
+#include "session_pool.h"
+#include "phone_session.h"
+#include "admission.h"
+#include "device_allowlist.h"
+#include "helper_channel.h"
+#include "tapin_channel.h"
+#include "auth_record.h"
+#include "stats.h"
+#include "service_manager.h"
+#include "daemon_config.h"
+#include "live_upgrade.h"
+#include "async_log.h"
 
-#define MAX_BUFFER_SIZE 1024
 #define SERVICE_NAME "TapIn Authentication Service"
 #define SERVICE_UUID "00001101-0000-1000-8000-00805f9b34fb"  // Standard Serial Port Profile UUID
-#define SOCKET_PATH "/tmp/tapin_helper.sock"
+#define HELPER_TIMEOUT_MS 5000
+#define DEFAULT_LISTEN_BACKLOG 16
+#define DEFAULT_WORKERS 8
+#define DEFAULT_QUEUE_SIZE 32
+#define DEFAULT_STATS_SOCKET "/run/tapin/listener-stats.sock"
 
-// Function to check if a Bluetooth device is paired/trusted
-int is_device_paired(const char* device_address) {
-    char command[256];
-    int result;
-    
-    // Command to check if the device is paired using bluetoothctl
-    snprintf(command, sizeof(command), 
-            "timeout 5 bluetoothctl info %s 2>/dev/null | grep -q 'Paired: yes' && echo 1 || echo 0");
-    
-    // For security, we replace the device address in the command template
-    char actual_command[256];
-    snprintf(actual_command, sizeof(actual_command), 
-            "timeout 5 bluetoothctl info %s 2>/dev/null | grep -q 'Paired: yes' && echo 1 || echo 0", 
-            device_address);
-    
-    // Execute the command and capture output
-    FILE* pipe = popen(actual_command, "r");
-    if (!pipe) {
-        syslog(LOG_ERR, "Failed to execute bluetoothctl command");
-        return 0;
-    }
-    
-    char result_str[10];
-    if (fgets(result_str, sizeof(result_str), pipe) != NULL) {
-        result = atoi(result_str);
-    } else {
-        result = 0;
-    }
-    
-    pclose(pipe);
-    
-    return result;
-}
+// Transport phones connect over
+static const listener_transport_t *active_transport = &rfcomm_transport;
 
-// Global flag for signal handling
-static volatile sig_atomic_t running = 1;
+/*
+ * Function to send a decoded request to the helper daemon
+ * Goes over the shared framed channel, so concurrent sessions don't each
+ * pay for a connection of their own
+ */
+int forward_to_helper(const tapin_auth_record_t* record) {
+    return helper_channel_request(TAPIN_CHANNEL_AUTH_REQUEST, record, sizeof(*record),
+                                  session_clock_ms() + HELPER_TIMEOUT_MS);
+}
 
-// Signal handler to gracefully stop the daemon
-void signal_handler(int sig) {
-    running = 0;
+void print_usage(const char* program) {
+    fprintf(stderr, "Usage: %s [--config PATH] [--transport rfcomm|unix:PATH] [--backlog N] [--workers N]\n"
+                    "          [--queue N] [--session-timeout MS] [--keepalive MS] [--bluez-dir PATH]\n"
+                    "          [--pairing-fallback bluetoothctl|none] [--stats-socket PATH]\n"
+                    "          [--log-level err|warning|notice|info|debug] [--device-rate N]\n"
+                    "          [--device-burst N] [--user-rate N] [--user-burst N] [--challenge]\n"
+                    "          [--helper-socket PATH]\n", program);
 }
 
 /*
- * Function to validate authentication request JSON format
+ * Function to put a new configuration into effect
+ * Sessions already running keep the limits they started with
  */
-int validate_auth_request_format(const char* data) {
-    json_object *json_obj;
-    struct json_object *username_obj, *timestamp_obj, *nonce_obj, *hmac_obj;
-    
-    // Parse the JSON data
-    json_obj = json_tokener_parse(data);
-    if (!json_obj) {
-        syslog(LOG_ERR, "Invalid JSON format in authentication request");
-        return 0;
-    }
+void apply_config(const daemon_config_t* old, const daemon_config_t* config) {
+    __atomic_store_n(&async_log_level, config->log_level, __ATOMIC_RELAXED);
+    phone_session_configure(config->session_timeout_ms, config->keepalive_ms, config->max_message_length);
     
-    // Check for required fields
-    if (!json_object_object_get_ex(json_obj, "username", &username_obj) ||
-        !json_object_object_get_ex(json_obj, "timestamp", &timestamp_obj) ||
-        !json_object_object_get_ex(json_obj, "nonce", &nonce_obj) ||
-        !json_object_object_get_ex(json_obj, "hmac", &hmac_obj)) {
-        syslog(LOG_ERR, "Missing required fields in authentication request");
-        json_object_put(json_obj);
-        return 0;
+    // New limits start every phone over with a full bucket
+    if (memcmp(&old->admission, &config->admission, sizeof(config->admission)) != 0) {
+        admission_configure(&config->admission);
     }
     
-    // Validate field types
-    if (!json_object_is_type(username_obj, json_type_string) ||
-        !json_object_is_type(timestamp_obj, json_type_string) ||
-        !json_object_is_type(nonce_obj, json_type_string) ||
-        !json_object_is_type(hmac_obj, json_type_string)) {
-        syslog(LOG_ERR, "Invalid field types in authentication request");
-        json_object_put(json_obj);
-        return 0;
+    if (strcmp(old->helper_socket, config->helper_socket) != 0 || old->rfcomm_channel != config->rfcomm_channel) {
+        async_log(LOG_NOTICE, "New socket settings take effect on the next restart or upgrade");
     }
-    
-    // Validate field lengths to prevent buffer overflows
-    const char *username = json_object_get_string(username_obj);
-    const char *timestamp_str = json_object_get_string(timestamp_obj);
-    const char *nonce = json_object_get_string(nonce_obj);
-    const char *hmac = json_object_get_string(hmac_obj);
-    
-    if (strlen(username) > 64 || strlen(timestamp_str) > 20 || 
-        strlen(nonce) > 64 || strlen(hmac) > 128) {
-        syslog(LOG_ERR, "Authentication request fields too long");
-        json_object_put(json_obj);
-        return 0;
-    }
-    
-    // Clean up
-    json_object_put(json_obj);
-    
-    syslog(LOG_INFO, "Authentication request format validation passed");
-    return 1;
 }
 
 /*
- * Function to send data to the helper daemon via Unix socket
+ * Function to reload the config file on SIGHUP
+ * A file that does not load leaves the running configuration in place
  */
-int send_to_helper_daemon(const char* data) {
-    int sock;
-    struct sockaddr_un addr;
-    int result;
-    char response[32];
-    ssize_t bytes_received;
-    
-    // Create socket
-    sock = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (sock < 0) {
-        syslog(LOG_ERR, "Failed to create Unix socket for helper daemon communication: %s", strerror(errno));
-        return 0;
-    }
-    
-    // Setup address structure
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, SOCKET_PATH, sizeof(addr.sun_path) - 1);
-    
-    // Connect to the helper daemon
-    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        syslog(LOG_ERR, "Failed to connect to helper daemon socket: %s", strerror(errno));
-        close(sock);
-        return 0;
-    }
-    
-    // Send the data
-    if (write(sock, data, strlen(data)) < 0) {
-        syslog(LOG_ERR, "Failed to send data to helper daemon: %s", strerror(errno));
-        close(sock);
-        return 0;
-    }
-    
-    // Receive response
-    bytes_received = read(sock, response, sizeof(response) - 1);
-    if (bytes_received < 0) {
-        syslog(LOG_ERR, "Failed to read response from helper daemon: %s", strerror(errno));
-        close(sock);
-        return 0;
-    }
-    
-    response[bytes_received] = '\0';
-    
-    // Close socket
-    close(sock);
-    
-    // Check response
-    if (strncmp(response, "OK", 2) == 0) {
-        syslog(LOG_INFO, "Helper daemon processed authentication request successfully");
-        return 1; // Success
+void reload_config(const char* config_path, const daemon_config_t* overrides) {
+    const daemon_config_t *old = daemon_config();
+    const daemon_config_t *config;
+    
+    service_notify("RELOADING=1");
+    config = daemon_config_load(config_path, overrides);
+    if (config) {
+        apply_config(old, config);
+        async_log(LOG_INFO, "Reloaded %s", config_path);
     } else {
-        syslog(LOG_ERR, "Helper daemon failed to process authentication request: %s", response);
-        return 0; // Failure
+        async_log(LOG_ERR, "Keeping the running configuration");
     }
+    service_notify("READY=1");
 }
 
 /*
- * Function to process received authentication data
- * Forwards the data to the helper daemon via Unix socket
+ * Function to hand the listening socket to a new build of this daemon
+ * Sessions in progress finish first; phones that connect meanwhile wait
+ * in the backlog for the new build to accept them
+ * Returns only if the new build could not be started
  */
-int process_auth_data(const char* data) {
-    // Log the received data
-    syslog(LOG_INFO, "Received authentication data: %s", data);
-    
-    // Validate the authentication request format
-    if (!validate_auth_request_format(data)) {
-        syslog(LOG_ERR, "Authentication request format validation failed");
-        return 0;
+void upgrade_in_place(int sock) {
+    async_log(LOG_INFO, "Upgrading in place, waiting for running sessions");
+    service_notify("RELOADING=1");
+    phone_session_finish();
+    
+    if (live_upgrade_put_listener(sock)) {
+        // Nothing may be left in the ring when the process is replaced
+        async_log_stop();
+        live_upgrade_exec();
     }
+}
+
+/*
+ * Function to accept every pending phone connection
+ * The listening socket is non-blocking, so this stops once the backlog is empty
+ */
+void accept_phones(int sock) {
+    char client_address[PEER_ADDRESS_LENGTH];
+    
+    for (;;) {
+        int client_sock = active_transport->accept(sock, client_address, sizeof(client_address));
+        if (client_sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                async_log(LOG_ERR, "Failed to accept connection: %s", strerror(errno));
+            }
+            return;
+        }
     
-    // Forward to helper daemon via Unix socket
-    return send_to_helper_daemon(data);
+        // Hand the session to a worker, or turn the phone away if the queue is full
+        phone_session_submit(client_sock, client_address);
+    }
 }
 
 /*
  * Main function for the Bluetooth listener daemon
+ * Accepts connections and hands them to the session pool
  */
 int main(int argc, char *argv[]) {
-    int sock, client_sock;
-    struct sockaddr_rc addr = {0}, client_addr = {0};
-    socklen_t opt = sizeof(client_addr);
-    char buffer[MAX_BUFFER_SIZE];
-    int bytes_read;
+    static const struct option long_options[] = {
+        { "config", required_argument, NULL, 'C' },
+        { "transport", required_argument, NULL, 't' },
+        { "backlog", required_argument, NULL, 'b' },
+        { "workers", required_argument, NULL, 'w' },
+        { "queue", required_argument, NULL, 'q' },
+        { "session-timeout", required_argument, NULL, 's' },
+        { "keepalive", required_argument, NULL, 'K' },
+        { "bluez-dir", required_argument, NULL, 'd' },
+        { "pairing-fallback", required_argument, NULL, 'f' },
+        { "stats-socket", required_argument, NULL, 'm' },
+        { "log-level", required_argument, NULL, 'l' },
+        { "device-rate", required_argument, NULL, 'D' },
+        { "device-burst", required_argument, NULL, 'E' },
+        { "user-rate", required_argument, NULL, 'U' },
+        { "user-burst", required_argument, NULL, 'V' },
+        { "challenge", no_argument, NULL, 'c' },
+        { "helper-socket", required_argument, NULL, 'H' },
+        { NULL, 0, NULL, 0 }
+    };
+    session_pool_config_t pool_config = { DEFAULT_WORKERS, DEFAULT_QUEUE_SIZE, 0, 0 };
+    daemon_config_t overrides;
+    const daemon_config_t *config;
+    const char *config_path = DAEMON_CONFIG_FILE;
+    const char *transport_address = NULL;
+    char rfcomm_channel[16];
+    const char *bluez_dir = BLUEZ_STORAGE_DIR;
+    const char *stats_socket = DEFAULT_STATS_SOCKET;
+    pairing_fallback_t pairing_fallback = PAIRING_FALLBACK_BLUETOOTHCTL;
+    int backlog = DEFAULT_LISTEN_BACKLOG;
+    int challenge = 0, upgrading = 0;
+    int sock, signal_fd, opt;
+    
+    // An upgrade runs this binary again with the same arguments
+    live_upgrade_init(argv);
+    daemon_config_unset(&overrides);
+    
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'C':
+            config_path = optarg;
+            break;
+        case 't':
+            if (strncmp(optarg, "unix:", 5) == 0 && optarg[5] != '\0') {
+                active_transport = &unix_transport;
+                transport_address = optarg + 5;
+            } else if (strcmp(optarg, "rfcomm") == 0) {
+                active_transport = &rfcomm_transport;
+                transport_address = NULL;
+            } else {
+                print_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'b':
+            backlog = atoi(optarg);
+            break;
+        case 'w':
+            pool_config.workers = atoi(optarg);
+            break;
+        case 'q':
+            pool_config.queue_size = atoi(optarg);
+            break;
+        case 's':
+            overrides.session_timeout_ms = atoi(optarg);
+            break;
+        case 'K':
+            overrides.keepalive_ms = atoi(optarg);
+            break;
+        case 'd':
+            bluez_dir = optarg;
+            break;
+        case 'f':
+            if (strcmp(optarg, "bluetoothctl") == 0) {
+                pairing_fallback = PAIRING_FALLBACK_BLUETOOTHCTL;
+            } else if (strcmp(optarg, "none") == 0) {
+                pairing_fallback = PAIRING_FALLBACK_NONE;
+            } else {
+                print_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'm':
+            stats_socket = optarg;
+            break;
+        case 'l':
+            overrides.log_level = async_log_level_from_name(optarg);
+            if (overrides.log_level < 0) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'D':
+            overrides.admission.device_rate = atoi(optarg);
+            break;
+        case 'E':
+            overrides.admission.device_burst = atoi(optarg);
+            break;
+        case 'U':
+            overrides.admission.user_rate = atoi(optarg);
+            break;
+        case 'V':
+            overrides.admission.user_burst = atoi(optarg);
+            break;
+        case 'c':
+            challenge = 1;
+            break;
+        case 'H':
+            if (strlen(optarg) >= sizeof(overrides.helper_socket)) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            strcpy(overrides.helper_socket, optarg);
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (backlog <= 0 || pool_config.workers <= 0 || pool_config.queue_size <= 0 ||
+        daemon_config_invalid(&overrides)) {
+        print_usage(argv[0]);
+        return 1;
+    }
     
     // Open syslog
     openlog("tapin_bluetooth", LOG_PID, LOG_DAEMON);
     
-    syslog(LOG_INFO, "TapIn Bluetooth Listener Daemon starting");
+    // The command line wins over the file, now and on every reload
+    config = daemon_config_load(config_path, &overrides);
+    if (!config) {
+        closelog();
+        return 1;
+    }
+    async_log_level = config->log_level;
+    pool_config.session_timeout_ms = config->session_timeout_ms;
+    pool_config.keepalive_ms = config->keepalive_ms;
+    if (!transport_address) {
+        snprintf(rfcomm_channel, sizeof(rfcomm_channel), "%d", config->rfcomm_channel);
+        transport_address = rfcomm_channel;
+    }
     
-    // Set up signal handlers
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
+    async_log(LOG_INFO, "TapIn Bluetooth Listener Daemon starting");
     
-    // Create socket
-    sock = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
-    if (sock < 0) {
-        syslog(LOG_ERR, "Failed to create Bluetooth socket: %s", strerror(errno));
+    // The main loop waits for shutdown signals alongside phones; every
+    // thread started from here on inherits the mask
+    signal_fd = service_signal_fd();
+    if (signal_fd < 0) {
         closelog();
         return 1;
     }
     
-    // Bind socket to port 1
-    addr.rc_family = AF_BLUETOOTH;
-    addr.rc_bdaddr = *BDADDR_ANY;
-    addr.rc_channel = 1;
+    // A phone that drops mid-reply must not kill the daemon
+    signal(SIGPIPE, SIG_IGN);
     
-    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        syslog(LOG_ERR, "Failed to bind Bluetooth socket: %s", strerror(errno));
-        close(sock);
+    // Create the listening socket, or take the one a socket unit or the
+    // image this one upgraded from made
+    service_listen_start();
+    live_upgrade_resume();
+    sock = active_transport->open(transport_address, backlog);
+    live_upgrade_finish();
+    if (sock < 0) {
+        close(signal_fd);
+        daemon_config_free();
         closelog();
         return 1;
     }
+    service_listen_finish();
+    
+    // The main loop must never block in accept()
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    
+    // Load paired devices up front so sessions never shell out on the hot path
+    if (active_transport->check_pairing && !device_allowlist_start(bluez_dir, pairing_fallback)) {
+        async_log(LOG_WARNING, "Paired device list is not being kept up to date");
+    }
+    
+    helper_channel_start(config->helper_socket);
     
-    // Start listening
-    if (listen(sock, 1) < 0) {
-        syslog(LOG_ERR, "Failed to listen on Bluetooth socket: %s", strerror(errno));
-        close(sock);
+    // Rate limits apply from the first session
+    admission_configure(&config->admission);
+    
+    if (!phone_session_start(active_transport, &pool_config, forward_to_helper, challenge)) {
+        async_log(LOG_ERR, "Failed to start session workers");
+        device_allowlist_stop();
+        active_transport->close(sock, transport_address);
+        close(signal_fd);
+        daemon_config_free();
         closelog();
         return 1;
     }
+    phone_session_configure(config->session_timeout_ms, config->keepalive_ms, config->max_message_length);
+    
+    // Metrics are optional; an empty path turns them off
+    stats_server_t *stats_server = NULL;
+    if (stats_socket[0] != '\0') {
+        stats_server = stats_server_start(stats_socket, &phone_session_stats);
+        if (!stats_server) {
+            async_log(LOG_WARNING, "Stats socket %s is not available", stats_socket);
+        }
+    }
     
-    syslog(LOG_INFO, "TapIn Bluetooth Listener listening on channel 1");
+    // From here on, sessions log through the ring
+    async_log_start();
     
-    // Main daemon loop
-    while (running) {
-        // Accept a connection
-        client_sock = accept(sock, (struct sockaddr *)&client_addr, &opt);
-        
-        if (client_sock < 0) {
-            if (running) {  // Only log error if not shutting down
-                syslog(LOG_ERR, "Failed to accept Bluetooth connection: %s", strerror(errno));
+    async_log(LOG_INFO, "TapIn Bluetooth Listener listening on %s %s (%d workers, backlog %d%s)",
+              active_transport->name, transport_address, pool_config.workers, backlog,
+              challenge ? ", challenging phones" : "");
+    
+    // Units ordered after this one may start now
+    service_notify("READY=1");
+    
+    // Main daemon loop: sleeps until a phone connects or a signal arrives
+    struct pollfd fds[2] = { { sock, POLLIN, 0 }, { signal_fd, POLLIN, 0 } };
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno != EINTR) {
+                async_log(LOG_ERR, "poll error: %s", strerror(errno));
             }
             continue;
         }
-        
-        // Get the client's Bluetooth address
-        char client_address[18];
-        ba2str(&client_addr.rc_bdaddr, client_address);
-        syslog(LOG_INFO, "Connection accepted from: %s", client_address);
-        
-        // Verify that the connecting device is paired/trusted
-        if (!is_device_paired(client_address)) {
-            syslog(LOG_WARNING, "Unpaired device attempted connection: %s", client_address);
-            close(client_sock);
-            continue;  // Skip processing for unpaired devices
-        }
-        
-        syslog(LOG_INFO, "Paired device verified: %s", client_address);
-        
-        // Read data from the client
-        memset(buffer, 0, sizeof(buffer));
-        bytes_read = read(client_sock, buffer, sizeof(buffer) - 1);
-        
-        if (bytes_read > 0) {
-            buffer[bytes_read] = '\0';
-            syslog(LOG_INFO, "Received %d bytes from %s", bytes_read, client_address);
-            
-            // Process the received authentication data
-            if (process_auth_data(buffer)) {
-                syslog(LOG_INFO, "Authentication data processed successfully");
-                
-                // Send acknowledgment back to client
-                const char* ack_msg = "ACK";
-                write(client_sock, ack_msg, strlen(ack_msg));
-            } else {
-                syslog(LOG_ERR, "Failed to process authentication data");
-                
-                // Send error message back to client
-                const char* error_msg = "ERR";
-                write(client_sock, error_msg, strlen(error_msg));
+        if (fds[1].revents & POLLIN) {
+            int signal_number = service_signal_read(signal_fd);
+            if (signal_number == SIGHUP) {
+                reload_config(config_path, &overrides);
+            } else if (signal_number == SIGUSR2) {
+                // The new image reads the config file again, and would stop at a
+                // broken one
+                if (live_upgrade_available() && daemon_config_load(config_path, &overrides)) {
+                    upgrading = 1;
+                    break;
+                } else {
+                    async_log(LOG_ERR, "Not upgrading; this image keeps running");
+                }
+            } else if (signal_number > 0) {
+                break;
             }
-        } else if (bytes_read == 0) {
-            syslog(LOG_INFO, "Client disconnected: %s", client_address);
-        } else {
-            syslog(LOG_ERR, "Error reading from client %s: %s", client_address, strerror(errno));
         }
-        
-        // Close client socket
-        close(client_sock);
+        if (fds[0].revents & POLLIN) {
+            accept_phones(sock);
+        }
     }
     
-    // Close server socket
-    close(sock);
+    // Only comes back if the new build did not start; the service manager
+    // restarts the daemon instead
+    if (upgrading) {
+        upgrade_in_place(sock);
+        async_log_start();
+        async_log(LOG_ERR, "Upgrade failed, shutting down");
+    }
+    
+    service_notify("STOPPING=1");
     
-    syslog(LOG_INFO, "TapIn Bluetooth Listener Daemon stopping");
+    // Close server socket
+    active_transport->close(sock, transport_address);
+    close(signal_fd);
+    
+    // Let running sessions finish
+    phone_session_stop();
+    stats_server_stop(stats_server);
+    helper_channel_stop();
+    device_allowlist_stop();
+    
+    session_pool_stats_t stats;
+    session_pool_get_stats(&stats);
+    async_log(LOG_INFO, "TapIn Bluetooth Listener Daemon stopping (%lu sessions completed, %lu rejected)",
+              stats.completed, stats.rejected);
+    async_log_stop();
+    daemon_config_free();
     closelog();
     
-    return 0;
-}
\ No newline at end of file
+    return upgrading ? 1 : 0;
+}
@@ -0,0 +1,282 @@
+/*
+ * TapIn Daemon Configuration
+ * Config file parsing and atomically published snapshots
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include "daemon_config.h"
+#include "auth_core.h"
+#include "replay_cache.h"
+#include "session_frame.h"
+#include "async_log.h"
+#include "tapin_broker.h"
+
+#define DEFAULT_SESSION_TIMEOUT_MS 10000
+#define DEFAULT_KEEPALIVE_MS 60000
+#define DEFAULT_IDLE_TIMEOUT_MS 5000
+#define DEFAULT_RFCOMM_CHANNEL 1
+#define DEFAULT_HELPER_SOCKET "/tmp/tapin_helper.sock"
+#define MAX_LINE_LENGTH 512
+
+typedef enum {
+    KEY_NUMBER,
+    KEY_LOG_LEVEL,
+    KEY_PATH
+} key_kind_t;
+
+typedef struct {
+    const char *name;
+    size_t offset;
+    key_kind_t kind;
+    int min, max;
+} config_key_t;
+
+static const config_key_t keys[] = {
+    { "token_expiry_seconds", offsetof(daemon_config_t, token_expiry_seconds), KEY_NUMBER, 1, 3600 },
+    { "timestamp_window_seconds", offsetof(daemon_config_t, timestamp_window_seconds), KEY_NUMBER, 1, 3600 },
+    { "replay_rate", offsetof(daemon_config_t, replay_rate), KEY_NUMBER, 1, 1 << 20 },
+    { "max_message_length", offsetof(daemon_config_t, max_message_length), KEY_NUMBER, 64, SESSION_FRAME_MAX },
+    { "session_timeout_ms", offsetof(daemon_config_t, session_timeout_ms), KEY_NUMBER, 1, INT_MAX },
+    { "keepalive_ms", offsetof(daemon_config_t, keepalive_ms), KEY_NUMBER, 0, INT_MAX },
+    { "idle_timeout_ms", offsetof(daemon_config_t, idle_timeout_ms), KEY_NUMBER, 1, INT_MAX },
+    { "device_rate", offsetof(daemon_config_t, admission.device_rate), KEY_NUMBER, 0, INT_MAX },
+    { "device_burst", offsetof(daemon_config_t, admission.device_burst), KEY_NUMBER, 1, INT_MAX },
+    { "user_rate", offsetof(daemon_config_t, admission.user_rate), KEY_NUMBER, 0, INT_MAX },
+    { "user_burst", offsetof(daemon_config_t, admission.user_burst), KEY_NUMBER, 1, INT_MAX },
+    { "log_level", offsetof(daemon_config_t, log_level), KEY_LOG_LEVEL, 0, 0 },
+    { "rfcomm_channel", offsetof(daemon_config_t, rfcomm_channel), KEY_NUMBER, 1, 30 },
+    { "helper_socket", offsetof(daemon_config_t, helper_socket), KEY_PATH, 0, 0 },
+    { "broker_socket", offsetof(daemon_config_t, broker_socket), KEY_PATH, 0, 0 },
+};
+
+#define KEY_COUNT (sizeof(keys) / sizeof(keys[0]))
+
+static const daemon_config_t defaults = {
+    .token_expiry_seconds = AUTH_CORE_TOKEN_EXPIRY_SECONDS,
+    .timestamp_window_seconds = AUTH_CORE_TIMESTAMP_WINDOW_SECONDS,
+    .replay_rate = REPLAY_CACHE_DEFAULT_RATE,
+    .max_message_length = SESSION_FRAME_MAX,
+    .session_timeout_ms = DEFAULT_SESSION_TIMEOUT_MS,
+    .keepalive_ms = DEFAULT_KEEPALIVE_MS,
+    .idle_timeout_ms = DEFAULT_IDLE_TIMEOUT_MS,
+    .admission = { ADMISSION_DEFAULT_RATE, ADMISSION_DEFAULT_BURST, ADMISSION_DEFAULT_RATE, ADMISSION_DEFAULT_BURST },
+    .log_level = LOG_INFO,
+    .rfcomm_channel = DEFAULT_RFCOMM_CHANNEL,
+    .helper_socket = DEFAULT_HELPER_SOCKET,
+    .broker_socket = TAPIN_BROKER_SOCKET_PATH,
+};
+
+// Every snapshot ever published, newest first
+typedef struct snapshot {
+    daemon_config_t config;
+    struct snapshot *older;
+} snapshot_t;
+
+static const daemon_config_t *current = &defaults;
+static snapshot_t *snapshots = NULL;
+
+const daemon_config_t *daemon_config(void) {
+    return __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+}
+
+void daemon_config_unset(daemon_config_t *overrides) {
+    size_t i;
+    
+    memset(overrides, 0, sizeof(*overrides));
+    for (i = 0; i < KEY_COUNT; i++) {
+        if (keys[i].kind != KEY_PATH) {
+            *(int *)((char *)overrides + keys[i].offset) = DAEMON_CONFIG_UNSET;
+        }
+    }
+}
+
+const char *daemon_config_invalid(const daemon_config_t *overrides) {
+    size_t i;
+    
+    for (i = 0; i < KEY_COUNT; i++) {
+        if (keys[i].kind == KEY_NUMBER) {
+            int value = *(const int *)((const char *)overrides + keys[i].offset);
+            if (value != DAEMON_CONFIG_UNSET && (value < keys[i].min || value > keys[i].max)) {
+                return keys[i].name;
+            }
+        } else if (keys[i].kind == KEY_PATH) {
+            const char *path = (const char *)overrides + keys[i].offset;
+            if (path[0] != '\0' && path[0] != '/') {
+                return keys[i].name;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function to strip leading and trailing whitespace in place
+ */
+static char *trim(char *text) {
+    char *end;
+    
+    while (*text == ' ' || *text == '\t') {
+        text++;
+    }
+    end = text + strlen(text);
+    while (end > text && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' || end[-1] == '\n')) {
+        end--;
+    }
+    *end = '\0';
+    return text;
+}
+
+/*
+ * Function to set one key from its text
+ * Returns NULL on success, or what is wrong with the value
+ */
+static const char *set_key(daemon_config_t *config, const config_key_t *key, const char *value) {
+    void *field = (char *)config + key->offset;
+    char *end;
+    long number;
+    
+    switch (key->kind) {
+    case KEY_NUMBER:
+        errno = 0;
+        number = strtol(value, &end, 10);
+        if (errno != 0 || end == value || *end != '\0') {
+            return "is not a number";
+        }
+        if (number < key->min || number > key->max) {
+            return "is out of range";
+        }
+        *(int *)field = (int)number;
+        return NULL;
+    case KEY_LOG_LEVEL:
+        number = async_log_level_from_name(value);
+        if (number < 0) {
+            return "is not err, warning, notice, info or debug";
+        }
+        *(int *)field = (int)number;
+        return NULL;
+    default:
+        if (value[0] != '/' || strlen(value) >= DAEMON_CONFIG_PATH_LENGTH) {
+            return "is not an absolute path short enough for a socket";
+        }
+        strcpy(field, value);
+        return NULL;
+    }
+}
+
+/*
+ * Function to parse a config file over what config already holds
+ * Returns 1 on success (a missing file is no error), 0 on the first error
+ */
+static int parse_file(const char *path, daemon_config_t *config) {
+    char line[MAX_LINE_LENGTH];
+    int line_number = 0, ok = 1;
+    FILE *file = fopen(path, "re");
+    
+    if (!file) {
+        if (errno == ENOENT) {
+            return 1;
+        }
+        async_log(LOG_ERR, "Could not read %s: %s", path, strerror(errno));
+        return 0;
+    }
+    
+    while (ok && fgets(line, sizeof(line), file)) {
+        char *text, *equals, *name, *value;
+        const char *problem = "names no known setting";
+        size_t i;
+    
+        line_number++;
+        if (!strchr(line, '\n') && !feof(file)) {
+            async_log(LOG_ERR, "%s:%d: line is too long", path, line_number);
+            ok = 0;
+            break;
+        }
+    
+        text = trim(line);
+        if (text[0] == '\0' || text[0] == '#') {
+            continue;
+        }
+    
+        equals = strchr(text, '=');
+        if (!equals) {
+            async_log(LOG_ERR, "%s:%d: expected \"key = value\"", path, line_number);
+            ok = 0;
+            break;
+        }
+        *equals = '\0';
+        name = trim(text);
+        value = trim(equals + 1);
+    
+        for (i = 0; i < KEY_COUNT; i++) {
+            if (strcmp(name, keys[i].name) == 0) {
+                problem = set_key(config, &keys[i], value);
+                break;
+            }
+        }
+        if (problem) {
+            async_log(LOG_ERR, "%s:%d: %s %s", path, line_number, name, problem);
+            ok = 0;
+        }
+    }
+    
+    fclose(file);
+    return ok;
+}
+
+/*
+ * Function to copy every option given on the command line over config
+ */
+static void apply_overrides(daemon_config_t *config, const daemon_config_t *overrides) {
+    size_t i;
+    
+    for (i = 0; i < KEY_COUNT; i++) {
+        const char *from = (const char *)overrides + keys[i].offset;
+        char *to = (char *)config + keys[i].offset;
+    
+        if (keys[i].kind == KEY_PATH) {
+            if (from[0] != '\0') {
+                strcpy(to, from);
+            }
+        } else if (*(const int *)from != DAEMON_CONFIG_UNSET) {
+            *(int *)to = *(const int *)from;
+        }
+    }
+}
+
+const daemon_config_t *daemon_config_load(const char *path, const daemon_config_t *overrides) {
+    snapshot_t *snapshot = malloc(sizeof(*snapshot));
+    
+    if (!snapshot) {
+        async_log(LOG_ERR, "Out of memory loading %s", path);
+        return NULL;
+    }
+    
+    snapshot->config = defaults;
+    if (!parse_file(path, &snapshot->config)) {
+        free(snapshot);
+        return NULL;
+    }
+    if (overrides) {
+        apply_overrides(&snapshot->config, overrides);
+    }
+    
+    // Readers may still hold the old snapshot, so it is kept
+    snapshot->older = snapshots;
+    snapshots = snapshot;
+    __atomic_store_n(&current, &snapshot->config, __ATOMIC_RELEASE);
+    return &snapshot->config;
+}
+
+void daemon_config_free(void) {
+    __atomic_store_n(&current, &defaults, __ATOMIC_RELEASE);
+    while (snapshots) {
+        snapshot_t *older = snapshots->older;
+        free(snapshots);
+        snapshots = older;
+    }
+}
@@ -0,0 +1,70 @@
+/*
+ * TapIn Daemon Configuration
+ * Tunables read from /etc/tapin/tapin.conf, reloaded on SIGHUP
+ *
+ * The file holds "key = value" lines; blank lines and lines starting with
+ * '#' are ignored, and keys left out keep their built-in defaults. Both
+ * daemons read the same file and each uses the keys that concern it. A
+ * missing file means all defaults.
+ *
+ * The file is parsed once into a snapshot that is never modified again.
+ * Loading publishes a new snapshot with one atomic store, so any thread
+ * may read daemon_config() and see one whole configuration or the other,
+ * never a mix. Old snapshots stay allocated until daemon_config_free(),
+ * so a pointer taken before a reload stays valid.
+ *
+ * Command-line options override the file, on every reload: a daemon keeps
+ * what it was given on the command line in an overrides structure, with
+ * DAEMON_CONFIG_UNSET (or an empty path) for options it was not given.
+ * A file that does not parse, or names a key nobody knows, is rejected
+ * as a whole and the running configuration stays in force.
+ */
+
+#ifndef TAPIN_DAEMON_CONFIG_H
+#define TAPIN_DAEMON_CONFIG_H
+
+#include "admission.h"
+
+#define DAEMON_CONFIG_FILE "/etc/tapin/tapin.conf"
+#define DAEMON_CONFIG_PATH_LENGTH 108   // sun_path
+#define DAEMON_CONFIG_UNSET -1
+
+typedef struct {
+    int token_expiry_seconds;       // How long an issued token waits for PAM
+    int timestamp_window_seconds;   // Clock skew accepted either side of now
+    int replay_rate;                // Requests per second the replay cache holds
+    int max_message_length;         // Longest phone message, up to SESSION_FRAME_MAX
+    int session_timeout_ms;         // See session_pool.h
+    int keepalive_ms;
+    int idle_timeout_ms;            // Helper connections with a partial request
+    admission_config_t admission;   // Rate limits, see admission.h
+    int log_level;                  // A syslog priority
+    int rfcomm_channel;             // Taken at startup only
+    char helper_socket[DAEMON_CONFIG_PATH_LENGTH];   // Taken at startup only
+    char broker_socket[DAEMON_CONFIG_PATH_LENGTH];   // Taken at startup only
+} daemon_config_t;
+
+// The current snapshot; the built-in defaults until something is loaded
+const daemon_config_t *daemon_config(void);
+
+// Mark every option as not given on the command line
+void daemon_config_unset(daemon_config_t *overrides);
+
+/*
+ * Check the options given on the command line
+ * Returns the name of the first out-of-range option, or NULL if all are fine
+ */
+const char *daemon_config_invalid(const daemon_config_t *overrides);
+
+/*
+ * Parse path over the defaults, apply overrides (may be NULL) and publish
+ * the result
+ * Returns the new snapshot, or NULL with the error logged and the current
+ * snapshot left in place. Load from one thread at a time
+ */
+const daemon_config_t *daemon_config_load(const char *path, const daemon_config_t *overrides);
+
+// Free every snapshot; only once no thread can still be reading one
+void daemon_config_free(void);
+
+#endif /* TAPIN_DAEMON_CONFIG_H */
@@ -0,0 +1,760 @@
+/*
+ * TapIn Paired Device Allowlist
+ * Hash set of paired device addresses fed by BlueZ's store and inotify
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include "device_allowlist.h"
+#include "session_pool.h"
+#include "async_log.h"
+
+// Slots in the address set (must be a power of two)
+#define ALLOWLIST_CAPACITY 4096
+#define SLOT_MASK (ALLOWLIST_CAPACITY - 1)
+
+#define MAX_PENDING_CHECKS 16
+#define RESULT_CACHE_SIZE 64
+#define POSITIVE_RESULT_TTL_MS 60000
+#define NEGATIVE_RESULT_TTL_MS 10000
+
+// Address set; refs counts the adapters a device is paired with
+typedef struct {
+    uint64_t address;
+    int refs;
+} allow_slot_t;
+
+static allow_slot_t allow_slots[ALLOWLIST_CAPACITY];
+static int allow_count = 0;
+static pthread_rwlock_t allow_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Directories being watched, owned by the watcher thread
+typedef enum {
+    WATCH_ROOT,
+    WATCH_ADAPTER,
+    WATCH_DEVICE
+} watch_kind_t;
+
+typedef struct {
+    int wd;
+    watch_kind_t kind;
+    int allowed;          // Device entries: currently counted in the set
+    uint64_t device;
+    char path[PATH_MAX];
+} watch_entry_t;
+
+static watch_entry_t *watches = NULL;
+static int watch_count = 0;
+static int watch_capacity = 0;
+
+static char store_root[PATH_MAX];
+static int inotify_fd = -1;
+static int stop_fd = -1;
+static pthread_t watcher_thread;
+static int watcher_running = 0;
+
+// Fallback checks for devices missing from the set
+typedef enum {
+    CHECK_FREE,
+    CHECK_QUEUED,
+    CHECK_RUNNING,
+    CHECK_DONE
+} check_state_t;
+
+typedef struct {
+    uint64_t address;
+    char text[18];
+    check_state_t state;
+    int result;
+    int waiters;
+} pending_check_t;
+
+typedef struct {
+    uint64_t address;
+    int result;
+    long long expires_ms;
+} cached_result_t;
+
+static pairing_fallback_t fallback_mode = PAIRING_FALLBACK_NONE;
+static pending_check_t checks[MAX_PENDING_CHECKS];
+static cached_result_t result_cache[RESULT_CACHE_SIZE];
+static pthread_mutex_t check_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t check_done_cond;
+static pthread_cond_t check_queued_cond;
+static pthread_t fallback_thread;
+static int fallback_running = 0;
+static int fallback_stopping = 0;
+
+/*
+ * Function to parse "XX:XX:XX:XX:XX:XX" into a 48-bit integer
+ * Anything else (including BlueZ's "cache" directory) is rejected
+ */
+static int parse_address(const char *text, uint64_t *address) {
+    uint64_t value = 0;
+    int i;
+    
+    if (strlen(text) != 17) {
+        return 0;
+    }
+    
+    for (i = 0; i < 17; i++) {
+        if (i % 3 == 2) {
+            if (text[i] != ':') {
+                return 0;
+            }
+            continue;
+        }
+        if (!isxdigit((unsigned char)text[i])) {
+            return 0;
+        }
+        int c = tolower((unsigned char)text[i]);
+        value = (value << 4) | (uint64_t)(isdigit(c) ? c - '0' : c - 'a' + 10);
+    }
+    
+    *address = value;
+    return 1;
+}
+
+static size_t address_slot(uint64_t address) {
+    return (size_t)((address * 0x9E3779B97F4A7C15ull) >> 52) & SLOT_MASK;
+}
+
+static size_t find_address(uint64_t address) {
+    size_t i = address_slot(address);
+    
+    while (allow_slots[i].refs > 0) {
+        if (allow_slots[i].address == address) {
+            return i;
+        }
+        i = (i + 1) & SLOT_MASK;
+    }
+    return ALLOWLIST_CAPACITY;
+}
+
+// Caller holds the write lock
+static void set_add(uint64_t address) {
+    size_t i = find_address(address);
+    
+    if (i < ALLOWLIST_CAPACITY) {
+        allow_slots[i].refs++;
+        return;
+    }
+    
+    if (allow_count + 1 >= ALLOWLIST_CAPACITY) {
+        async_log(LOG_ERR, "Paired device allowlist is full");
+        return;
+    }
+    
+    i = address_slot(address);
+    while (allow_slots[i].refs > 0) {
+        i = (i + 1) & SLOT_MASK;
+    }
+    allow_slots[i].address = address;
+    allow_slots[i].refs = 1;
+    allow_count++;
+}
+
+// Caller holds the write lock; uses backward-shift deletion
+static void set_release(uint64_t address) {
+    size_t hole = find_address(address);
+    size_t i;
+    
+    if (hole == ALLOWLIST_CAPACITY || --allow_slots[hole].refs > 0) {
+        return;
+    }
+    
+    allow_count--;
+    i = hole;
+    for (;;) {
+        i = (i + 1) & SLOT_MASK;
+        if (allow_slots[i].refs == 0) {
+            break;
+        }
+        size_t home = address_slot(allow_slots[i].address);
+        if (((i - home) & SLOT_MASK) >= ((i - hole) & SLOT_MASK)) {
+            allow_slots[hole] = allow_slots[i];
+            allow_slots[i].refs = 0;
+            hole = i;
+        }
+    }
+}
+
+/*
+ * Function to decide from a BlueZ info file whether a device is paired
+ * Paired devices carry link keys; blocked devices are never allowed
+ */
+static int read_device_info(const char *device_path) {
+    char path[PATH_MAX + 8], line[256], section[64] = "";
+    int has_key = 0, blocked = 0;
+    FILE *file;
+    
+    snprintf(path, sizeof(path), "%s/info", device_path);
+    file = fopen(path, "re");
+    if (!file) {
+        return 0;
+    }
+    
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        
+        if (line[0] == '[') {
+            snprintf(section, sizeof(section), "%.*s", (int)strcspn(line + 1, "]"), line + 1);
+            if (strcmp(section, "LinkKey") == 0 || strcmp(section, "LongTermKey") == 0 ||
+                strcmp(section, "PeripheralLongTermKey") == 0 || strcmp(section, "SlaveLongTermKey") == 0) {
+                has_key = 1;
+            }
+        } else if (strcmp(section, "General") == 0 && strcmp(line, "Blocked=true") == 0) {
+            blocked = 1;
+        }
+    }
+    
+    fclose(file);
+    return has_key && !blocked;
+}
+
+/*
+ * Watch table helpers (watcher thread only)
+ */
+static int find_watch_by_wd(int wd) {
+    int i;
+    for (i = 0; i < watch_count; i++) {
+        if (watches[i].wd == wd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int find_watch_by_path(const char *path) {
+    int i;
+    for (i = 0; i < watch_count; i++) {
+        if (strcmp(watches[i].path, path) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int add_watch(const char *path, watch_kind_t kind, uint32_t mask) {
+    int wd = inotify_fd >= 0 ? inotify_add_watch(inotify_fd, path, mask | IN_ONLYDIR) : -1;
+    int index = find_watch_by_path(path);
+    
+    if (index >= 0) {
+        watches[index].wd = wd;
+        return index;
+    }
+    
+    if (watch_count == watch_capacity) {
+        int capacity = watch_capacity ? watch_capacity * 2 : 64;
+        watch_entry_t *grown = realloc(watches, capacity * sizeof(*watches));
+        if (!grown) {
+            if (wd >= 0) {
+                inotify_rm_watch(inotify_fd, wd);
+            }
+            return -1;
+        }
+        watches = grown;
+        watch_capacity = capacity;
+    }
+    
+    index = watch_count++;
+    memset(&watches[index], 0, sizeof(watches[index]));
+    watches[index].wd = wd;
+    watches[index].kind = kind;
+    snprintf(watches[index].path, sizeof(watches[index].path), "%s", path);
+    return index;
+}
+
+static void drop_watch(int index, int remove_watch) {
+    if (watches[index].kind == WATCH_DEVICE && watches[index].allowed) {
+        pthread_rwlock_wrlock(&allow_lock);
+        set_release(watches[index].device);
+        pthread_rwlock_unlock(&allow_lock);
+    }
+    if (remove_watch && watches[index].wd >= 0) {
+        inotify_rm_watch(inotify_fd, watches[index].wd);
+    }
+    watches[index] = watches[--watch_count];
+}
+
+/*
+ * Function to re-read one device's info file and update the set
+ */
+static void update_device(int index) {
+    int allowed = read_device_info(watches[index].path);
+    
+    if (allowed == watches[index].allowed) {
+        return;
+    }
+    
+    pthread_rwlock_wrlock(&allow_lock);
+    if (allowed) {
+        set_add(watches[index].device);
+    } else {
+        set_release(watches[index].device);
+    }
+    pthread_rwlock_unlock(&allow_lock);
+    
+    watches[index].allowed = allowed;
+}
+
+static void scan_device(const char *adapter_path, const char *name) {
+    char path[PATH_MAX];
+    uint64_t address;
+    
+    if (!parse_address(name, &address)) {
+        return;
+    }
+    
+    if (snprintf(path, sizeof(path), "%s/%s", adapter_path, name) >= (int)sizeof(path)) {
+        return;
+    }
+    int index = add_watch(path, WATCH_DEVICE, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM);
+    if (index < 0) {
+        return;
+    }
+    
+    watches[index].device = address;
+    update_device(index);
+}
+
+static void scan_adapter(const char *name) {
+    char path[PATH_MAX];
+    struct dirent *entry;
+    uint64_t address;
+    DIR *dir;
+    
+    if (!parse_address(name, &address)) {
+        return;
+    }
+    
+    if (snprintf(path, sizeof(path), "%s/%s", store_root, name) >= (int)sizeof(path)) {
+        return;
+    }
+    if (add_watch(path, WATCH_ADAPTER, IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM) < 0) {
+        return;
+    }
+    
+    dir = opendir(path);
+    if (!dir) {
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        scan_device(path, entry->d_name);
+    }
+    closedir(dir);
+}
+
+/*
+ * Function to (re)build the whole set from the store
+ */
+static void full_load(void) {
+    struct dirent *entry;
+    DIR *dir;
+    
+    while (watch_count > 0) {
+        drop_watch(watch_count - 1, 1);
+    }
+    
+    add_watch(store_root, WATCH_ROOT, IN_CREATE | IN_MOVED_TO);
+    
+    dir = opendir(store_root);
+    if (!dir) {
+        async_log(LOG_WARNING, "Could not open Bluetooth device store %s: %s", store_root, strerror(errno));
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        scan_adapter(entry->d_name);
+    }
+    closedir(dir);
+}
+
+static void handle_watch_event(const struct inotify_event *event) {
+    char path[PATH_MAX];
+    int index, child;
+    
+    if (event->mask & IN_Q_OVERFLOW) {
+        async_log(LOG_WARNING, "Bluetooth device store watch overflowed, reloading");
+        full_load();
+        return;
+    }
+    
+    index = find_watch_by_wd(event->wd);
+    if (index < 0) {
+        return;
+    }
+    
+    // The watched directory itself is gone
+    if (event->mask & IN_IGNORED) {
+        drop_watch(index, 0);
+        return;
+    }
+    
+    switch (watches[index].kind) {
+    case WATCH_ROOT:
+        if ((event->mask & IN_ISDIR) && event->len > 0) {
+            scan_adapter(event->name);
+        }
+        break;
+    case WATCH_ADAPTER:
+        if (!(event->mask & IN_ISDIR) || event->len == 0) {
+            break;
+        }
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            snprintf(path, sizeof(path), "%s", watches[index].path);
+            scan_device(path, event->name);
+        } else {
+            int length = snprintf(path, sizeof(path), "%s/%s", watches[index].path, event->name);
+            child = length < (int)sizeof(path) ? find_watch_by_path(path) : -1;
+            if (child >= 0) {
+                drop_watch(child, 1);
+            }
+        }
+        break;
+    case WATCH_DEVICE:
+        if (event->len > 0 && strcmp(event->name, "info") == 0) {
+            update_device(index);
+        }
+        break;
+    }
+}
+
+static void *watcher_main(void *arg) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    (void)arg;
+    
+    for (;;) {
+        struct pollfd fds[2] = { { inotify_fd, POLLIN, 0 }, { stop_fd, POLLIN, 0 } };
+        
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents) {
+            break;
+        }
+        
+        ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+        if (length <= 0) {
+            continue;
+        }
+        
+        char *p = buffer;
+        while (p < buffer + length) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            handle_watch_event(event);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    
+    return NULL;
+}
+
+/*
+ * Function to ask bluetoothctl whether a device is paired (slow path)
+ * The address has already been validated, so it is safe in a command line.
+ * This thread has the daemon's shutdown signals blocked, and popen() would
+ * pass that on, leaving timeout(1) unable to stop a hung bluetoothctl; the
+ * command is spawned with nothing blocked instead
+ */
+static int bluetoothctl_reports_paired(const char *address) {
+    char command[128];
+    char result_str[10];
+    char *argv[] = { "sh", "-c", command, NULL };
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t none;
+    int fds[2], status, spawned, result = 0;
+    ssize_t length;
+    pid_t pid;
+    
+    snprintf(command, sizeof(command),
+             "timeout 5 bluetoothctl info %s 2>/dev/null | grep -q 'Paired: yes' && echo 1 || echo 0",
+             address);
+    
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        async_log(LOG_ERR, "Failed to execute bluetoothctl command: %s", strerror(errno));
+        return 0;
+    }
+    
+    sigemptyset(&none);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    spawned = posix_spawn(&pid, "/bin/sh", &actions, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(fds[1]);
+    if (spawned != 0) {
+        async_log(LOG_ERR, "Failed to execute bluetoothctl command: %s", strerror(spawned));
+        close(fds[0]);
+        return 0;
+    }
+    
+    length = read(fds[0], result_str, sizeof(result_str) - 1);
+    if (length > 0) {
+        result_str[length] = '\0';
+        result = atoi(result_str);
+    }
+    close(fds[0]);
+    
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    return result;
+}
+
+// Caller holds check_lock
+static int cached_result(uint64_t address, long long now, int *result) {
+    int i;
+    for (i = 0; i < RESULT_CACHE_SIZE; i++) {
+        if (result_cache[i].expires_ms > now && result_cache[i].address == address) {
+            *result = result_cache[i].result;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Caller holds check_lock
+static void cache_result(uint64_t address, int result, long long now) {
+    int i, victim = 0;
+    
+    // Reuse this address's slot, else an expired one, else the oldest
+    for (i = 0; i < RESULT_CACHE_SIZE; i++) {
+        if (result_cache[i].address == address) {
+            victim = i;
+            break;
+        }
+        if (result_cache[i].expires_ms < result_cache[victim].expires_ms) {
+            victim = i;
+        }
+    }
+    
+    result_cache[victim].address = address;
+    result_cache[victim].result = result;
+    result_cache[victim].expires_ms = now + (result ? POSITIVE_RESULT_TTL_MS : NEGATIVE_RESULT_TTL_MS);
+}
+
+static void *fallback_main(void *arg) {
+    char address[18];
+    int i;
+    (void)arg;
+    
+    pthread_mutex_lock(&check_lock);
+    for (;;) {
+        for (i = 0; i < MAX_PENDING_CHECKS; i++) {
+            if (checks[i].state == CHECK_QUEUED) {
+                break;
+            }
+        }
+        
+        if (i == MAX_PENDING_CHECKS) {
+            if (fallback_stopping) {
+                break;
+            }
+            pthread_cond_wait(&check_queued_cond, &check_lock);
+            continue;
+        }
+        
+        checks[i].state = CHECK_RUNNING;
+        memcpy(address, checks[i].text, sizeof(address));
+        pthread_mutex_unlock(&check_lock);
+        
+        int result = bluetoothctl_reports_paired(address);
+        
+        pthread_mutex_lock(&check_lock);
+        cache_result(checks[i].address, result, session_clock_ms());
+        checks[i].result = result;
+        checks[i].state = checks[i].waiters > 0 ? CHECK_DONE : CHECK_FREE;
+        pthread_cond_broadcast(&check_done_cond);
+    }
+    pthread_mutex_unlock(&check_lock);
+    
+    return NULL;
+}
+
+/*
+ * Function to run the fallback check for a device missing from the set
+ */
+static int fallback_check(uint64_t address, const char *text, long long deadline_ms) {
+    struct timespec until;
+    int i, slot = -1, result = 0;
+    
+    pthread_mutex_lock(&check_lock);
+    
+    if (cached_result(address, session_clock_ms(), &result)) {
+        pthread_mutex_unlock(&check_lock);
+        return result;
+    }
+    
+    // Join a check already running for this device, or start one
+    for (i = 0; i < MAX_PENDING_CHECKS; i++) {
+        if (checks[i].state != CHECK_FREE && checks[i].address == address) {
+            slot = i;
+            break;
+        }
+        if (slot < 0 && checks[i].state == CHECK_FREE) {
+            slot = i;
+        }
+    }
+    if (slot < 0) {
+        pthread_mutex_unlock(&check_lock);
+        async_log(LOG_WARNING, "Too many pairing checks in progress, rejecting %s", text);
+        return 0;
+    }
+    
+    if (checks[slot].state == CHECK_FREE) {
+        checks[slot].address = address;
+        memcpy(checks[slot].text, text, sizeof(checks[slot].text));
+        checks[slot].state = CHECK_QUEUED;
+        checks[slot].waiters = 0;
+        pthread_cond_signal(&check_queued_cond);
+    }
+    checks[slot].waiters++;
+    
+    until.tv_sec = deadline_ms / 1000;
+    until.tv_nsec = (deadline_ms % 1000) * 1000000;
+    while (checks[slot].state != CHECK_DONE) {
+        if (pthread_cond_timedwait(&check_done_cond, &check_lock, &until) == ETIMEDOUT) {
+            break;
+        }
+    }
+    
+    if (checks[slot].state == CHECK_DONE) {
+        result = checks[slot].result;
+    }
+    if (--checks[slot].waiters == 0 && checks[slot].state == CHECK_DONE) {
+        checks[slot].state = CHECK_FREE;
+    }
+    
+    pthread_mutex_unlock(&check_lock);
+    return result;
+}
+
+int device_allowlist_check(const char *address, long long deadline_ms) {
+    uint64_t value;
+    int found;
+    
+    if (!parse_address(address, &value)) {
+        return 0;
+    }
+    
+    pthread_rwlock_rdlock(&allow_lock);
+    found = find_address(value) < ALLOWLIST_CAPACITY;
+    pthread_rwlock_unlock(&allow_lock);
+    
+    if (found || fallback_mode == PAIRING_FALLBACK_NONE) {
+        return found;
+    }
+    
+    return fallback_check(value, address, deadline_ms);
+}
+
+int device_allowlist_count(void) {
+    int count;
+    
+    pthread_rwlock_rdlock(&allow_lock);
+    count = allow_count;
+    pthread_rwlock_unlock(&allow_lock);
+    return count;
+}
+
+int device_allowlist_start(const char *store_dir, pairing_fallback_t fallback) {
+    pthread_condattr_t attr;
+    int ok = 1;
+    
+    snprintf(store_root, sizeof(store_root), "%s", store_dir);
+    fallback_mode = fallback;
+    
+    // Fallback waits use the session clock
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&check_done_cond, &attr);
+    pthread_cond_init(&check_queued_cond, NULL);
+    pthread_condattr_destroy(&attr);
+    
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        async_log(LOG_ERR, "Failed to watch Bluetooth device store: %s", strerror(errno));
+        ok = 0;
+    }
+    
+    full_load();
+    async_log(LOG_INFO, "Loaded %d paired devices from %s", device_allowlist_count(), store_root);
+    
+    if (inotify_fd >= 0) {
+        stop_fd = eventfd(0, EFD_CLOEXEC);
+        if (stop_fd < 0 || pthread_create(&watcher_thread, NULL, watcher_main, NULL) != 0) {
+            async_log(LOG_ERR, "Failed to start Bluetooth device store watcher");
+            ok = 0;
+        } else {
+            watcher_running = 1;
+        }
+    }
+    
+    if (fallback_mode != PAIRING_FALLBACK_NONE) {
+        fallback_stopping = 0;
+        if (pthread_create(&fallback_thread, NULL, fallback_main, NULL) != 0) {
+            async_log(LOG_ERR, "Failed to start pairing fallback thread");
+            fallback_mode = PAIRING_FALLBACK_NONE;
+            ok = 0;
+        } else {
+            fallback_running = 1;
+        }
+    }
+    
+    return ok;
+}
+
+void device_allowlist_stop(void) {
+    if (watcher_running) {
+        uint64_t one = 1;
+        if (write(stop_fd, &one, sizeof(one)) == sizeof(one)) {
+            pthread_join(watcher_thread, NULL);
+        }
+        watcher_running = 0;
+    }
+    
+    if (fallback_running) {
+        pthread_mutex_lock(&check_lock);
+        fallback_stopping = 1;
+        pthread_cond_broadcast(&check_queued_cond);
+        pthread_mutex_unlock(&check_lock);
+        pthread_join(fallback_thread, NULL);
+        fallback_running = 0;
+    }
+    
+    if (stop_fd >= 0) {
+        close(stop_fd);
+        stop_fd = -1;
+    }
+    if (inotify_fd >= 0) {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+    
+    free(watches);
+    watches = NULL;
+    watch_count = watch_capacity = 0;
+}
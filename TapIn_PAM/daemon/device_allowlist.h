@@ -0,0 +1,46 @@
+/*
+ * TapIn Paired Device Allowlist
+ * In-memory set of Bluetooth devices allowed to start a session
+ *
+ * The set is loaded at startup from BlueZ's device store
+ * (<store>/<adapter>/<device>/info) and kept current with inotify, so the
+ * per-connection pairing check is a hash lookup instead of a bluetoothctl
+ * fork. A device counts as paired when its info file holds link keys and
+ * it is not blocked.
+ *
+ * When a device is missing from the set (e.g. BlueZ has not flushed its
+ * store yet), an optional fallback asks bluetoothctl on a background
+ * thread. Results are cached briefly so a flood of unknown devices cannot
+ * turn into a flood of forks.
+ */
+
+#ifndef TAPIN_DEVICE_ALLOWLIST_H
+#define TAPIN_DEVICE_ALLOWLIST_H
+
+#define BLUEZ_STORAGE_DIR "/var/lib/bluetooth"
+
+typedef enum {
+    PAIRING_FALLBACK_NONE,
+    PAIRING_FALLBACK_BLUETOOTHCTL
+} pairing_fallback_t;
+
+/*
+ * Load the store and start watching it
+ * Returns 1 on success, 0 if the watcher could not be started (lookups
+ * still work against whatever was loaded)
+ */
+int device_allowlist_start(const char *store_dir, pairing_fallback_t fallback);
+
+void device_allowlist_stop(void);
+
+/*
+ * Check whether a device (in "XX:XX:XX:XX:XX:XX" form) may connect
+ * On a miss with the fallback enabled, waits for the background check
+ * until deadline_ms on the session clock
+ */
+int device_allowlist_check(const char *address, long long deadline_ms);
+
+// Number of devices currently in the set
+int device_allowlist_count(void);
+
+#endif /* TAPIN_DEVICE_ALLOWLIST_H */
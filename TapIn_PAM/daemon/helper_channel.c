@@ -0,0 +1,350 @@
+/*
+ * TapIn Helper Channel
+ * One framed connection to the helper shared by all session workers
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "tapin_channel.h"
+#include "helper_channel.h"
+#include "async_log.h"
+
+// Writes happen under the channel lock, so never let one block for long
+#define CHANNEL_SEND_TIMEOUT_MS 1000
+
+// A request waiting for its reply; lives on the waiting worker's stack
+typedef struct pending_reply {
+    uint32_t request_id;
+    unsigned generation;
+    int done;
+    int status;
+    struct pending_reply *next;
+} pending_reply_t;
+
+typedef struct {
+    int fd;
+    unsigned generation;
+} reader_arg_t;
+
+static pthread_mutex_t channel_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reply_cond;
+static char channel_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+// Current connection; each one gets a new generation and its own reader
+static int channel_fd = -1;
+static unsigned channel_generation = 0;
+static uint32_t next_request_id = 0;
+static pending_reply_t *pending_head = NULL;
+static int reader_count = 0;
+static int channel_stopping = 0;
+
+// Caller holds channel_lock
+static void complete_pending(uint32_t request_id, int status) {
+    pending_reply_t **link;
+    
+    for (link = &pending_head; *link; link = &(*link)->next) {
+        if ((*link)->request_id == request_id) {
+            pending_reply_t *pending = *link;
+            *link = pending->next;
+            pending->status = status;
+            pending->done = 1;
+            return;
+        }
+    }
+}
+
+// Caller holds channel_lock
+static void fail_pending(unsigned generation) {
+    pending_reply_t **link = &pending_head;
+    
+    while (*link) {
+        pending_reply_t *pending = *link;
+        if (pending->generation == generation) {
+            *link = pending->next;
+            pending->status = HELPER_CHANNEL_UNAVAILABLE;
+            pending->done = 1;
+        } else {
+            link = &pending->next;
+        }
+    }
+}
+
+// Caller holds channel_lock
+static void remove_pending(pending_reply_t *target) {
+    pending_reply_t **link;
+    
+    for (link = &pending_head; *link; link = &(*link)->next) {
+        if (*link == target) {
+            *link = target->next;
+            return;
+        }
+    }
+}
+
+/*
+ * Reader thread: hands replies on one connection to their waiters, and
+ * fails everything still outstanding on it once the connection drops
+ */
+static void *reader_main(void *arg) {
+    reader_arg_t self = *(reader_arg_t *)arg;
+    char buffer[sizeof(tapin_channel_header_t) + TAPIN_CHANNEL_MAX_PAYLOAD];
+    tapin_channel_header_t header;
+    size_t length = 0;
+    
+    free(arg);
+    
+    for (;;) {
+        ssize_t n = read(self.fd, buffer + length, sizeof(buffer) - length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        length += n;
+    
+        // Dispatch every complete reply in the batch under one lock
+        size_t offset = 0;
+        int bad_frame = 0;
+        pthread_mutex_lock(&channel_lock);
+        while (length - offset >= sizeof(header)) {
+            memcpy(&header, buffer + offset, sizeof(header));
+            if (header.magic != TAPIN_CHANNEL_MAGIC || header.length > TAPIN_CHANNEL_MAX_PAYLOAD) {
+                bad_frame = 1;
+                break;
+            }
+            if (length - offset < sizeof(header) + header.length) {
+                break;
+            }
+            offset += sizeof(header) + header.length;
+    
+            if (header.type == TAPIN_CHANNEL_AUTH_REPLY) {
+                complete_pending(header.request_id, header.status);
+            }
+        }
+        pthread_cond_broadcast(&reply_cond);
+        pthread_mutex_unlock(&channel_lock);
+    
+        if (bad_frame) {
+            async_log(LOG_ERR, "Malformed frame from helper daemon, reconnecting");
+            break;
+        }
+    
+        memmove(buffer, buffer + offset, length - offset);
+        length -= offset;
+    }
+    
+    pthread_mutex_lock(&channel_lock);
+    if (channel_generation == self.generation && channel_fd == self.fd) {
+        channel_fd = -1;
+    }
+    fail_pending(self.generation);
+    close(self.fd);
+    reader_count--;
+    pthread_cond_broadcast(&reply_cond);
+    pthread_mutex_unlock(&channel_lock);
+    
+    return NULL;
+}
+
+/*
+ * Function to open a new connection to the helper and start its reader
+ * Caller holds channel_lock. Returns 1 on success, 0 on failure
+ */
+static int connect_channel(void) {
+    struct sockaddr_un addr;
+    struct timeval timeout = { CHANNEL_SEND_TIMEOUT_MS / 1000, (CHANNEL_SEND_TIMEOUT_MS % 1000) * 1000 };
+    pthread_attr_t attr;
+    pthread_t thread;
+    sigset_t all, old;
+    reader_arg_t *arg;
+    int sock, started;
+    
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        async_log(LOG_ERR, "Failed to create Unix socket for helper daemon communication: %s", strerror(errno));
+        return 0;
+    }
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, channel_path, sizeof(addr.sun_path));
+    
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        async_log(LOG_ERR, "Failed to connect to helper daemon socket: %s", strerror(errno));
+        close(sock);
+        return 0;
+    }
+    
+    arg = malloc(sizeof(*arg));
+    if (!arg) {
+        close(sock);
+        return 0;
+    }
+    arg->fd = sock;
+    arg->generation = ++channel_generation;
+    
+    // The reader leaves signal handling to the accept loop
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    started = pthread_create(&thread, &attr, reader_main, arg) == 0;
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    
+    if (!started) {
+        async_log(LOG_ERR, "Failed to start helper channel reader");
+        free(arg);
+        close(sock);
+        return 0;
+    }
+    
+    channel_fd = sock;
+    reader_count++;
+    async_log(LOG_INFO, "Connected to helper daemon at %s", channel_path);
+    return 1;
+}
+
+/*
+ * Function to write a whole frame, resuming after partial writes
+ */
+static int send_frame(int sock, const tapin_channel_header_t *header, const void *payload, size_t length) {
+    struct iovec iov[2] = {
+        { (void *)header, sizeof(*header) },
+        { (void *)payload, length }
+    };
+    struct msghdr msg;
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = length > 0 ? 2 : 1;
+    
+    while (msg.msg_iovlen > 0) {
+        ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+    
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    
+    return 1;
+}
+
+void helper_channel_start(const char *path) {
+    pthread_condattr_t attr;
+    
+    snprintf(channel_path, sizeof(channel_path), "%s", path);
+    
+    // Reply waits use the session clock
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&reply_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+int helper_channel_request(uint16_t type, const void *payload, size_t length, long long deadline_ms) {
+    tapin_channel_header_t header;
+    pending_reply_t pending;
+    struct timespec until;
+    int attempt, sent = 0, status;
+    
+    if (length > TAPIN_CHANNEL_MAX_PAYLOAD) {
+        async_log(LOG_ERR, "Request of %zu bytes is too large for the helper channel", length);
+        return HELPER_CHANNEL_UNAVAILABLE;
+    }
+    
+    memset(&pending, 0, sizeof(pending));
+    
+    pthread_mutex_lock(&channel_lock);
+    
+    // A frame that failed to go out was never seen by the helper, so it
+    // is safe to resend once on a fresh connection
+    for (attempt = 0; attempt < 2 && !channel_stopping; attempt++) {
+        if (channel_fd < 0 && !connect_channel()) {
+            break;
+        }
+    
+        header.magic = TAPIN_CHANNEL_MAGIC;
+        header.request_id = ++next_request_id;
+        header.type = type;
+        header.status = 0;
+        header.length = (uint32_t)length;
+    
+        if (send_frame(channel_fd, &header, payload, length)) {
+            sent = 1;
+            break;
+        }
+    
+        async_log(LOG_WARNING, "Lost connection to helper daemon: %s", strerror(errno));
+        shutdown(channel_fd, SHUT_RDWR);
+        channel_fd = -1;
+    }
+    
+    if (!sent) {
+        pthread_mutex_unlock(&channel_lock);
+        return HELPER_CHANNEL_UNAVAILABLE;
+    }
+    
+    pending.request_id = header.request_id;
+    pending.generation = channel_generation;
+    pending.next = pending_head;
+    pending_head = &pending;
+    
+    until.tv_sec = deadline_ms / 1000;
+    until.tv_nsec = (deadline_ms % 1000) * 1000000;
+    while (!pending.done) {
+        if (pthread_cond_timedwait(&reply_cond, &channel_lock, &until) == ETIMEDOUT) {
+            break;
+        }
+    }
+    
+    if (pending.done) {
+        status = pending.status;
+    } else {
+        remove_pending(&pending);
+        async_log(LOG_ERR, "Helper daemon did not answer request %u in time", pending.request_id);
+        status = HELPER_CHANNEL_UNAVAILABLE;
+    }
+    
+    pthread_mutex_unlock(&channel_lock);
+    return status;
+}
+
+void helper_channel_stop(void) {
+    pthread_mutex_lock(&channel_lock);
+    channel_stopping = 1;
+    if (channel_fd >= 0) {
+        // Wakes the reader, which closes the socket on its way out
+        shutdown(channel_fd, SHUT_RDWR);
+        channel_fd = -1;
+    }
+    while (reader_count > 0) {
+        pthread_cond_wait(&reply_cond, &channel_lock);
+    }
+    pthread_mutex_unlock(&channel_lock);
+}
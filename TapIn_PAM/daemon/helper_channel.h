@@ -0,0 +1,38 @@
+/*
+ * TapIn Helper Channel
+ * Persistent, pipelined connection from the Bluetooth listener to the helper
+ *
+ * All session workers share one connection to the helper socket. Each
+ * request is framed (see tapin_channel.h) and tagged with an ID; a reader
+ * thread matches replies to the waiting workers in whatever order they
+ * arrive. The connection is opened on first use and reopened after the
+ * helper restarts.
+ */
+
+#ifndef TAPIN_HELPER_CHANNEL_H
+#define TAPIN_HELPER_CHANNEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Returned by helper_channel_request when no reply could be obtained
+#define HELPER_CHANNEL_UNAVAILABLE -1
+
+/*
+ * Set up the channel to the helper socket at path
+ * Nothing is connected until the first request
+ */
+void helper_channel_start(const char *path);
+
+/*
+ * Send one request frame and wait for its reply until deadline_ms (on the
+ * session clock). Returns the reply's TAPIN_CHANNEL_* status, or
+ * HELPER_CHANNEL_UNAVAILABLE if the helper could not be reached or did
+ * not answer in time. Safe to call from any number of threads.
+ */
+int helper_channel_request(uint16_t type, const void *payload, size_t length, long long deadline_ms);
+
+// Close the connection and wait for the reader thread to exit
+void helper_channel_stop(void);
+
+#endif /* TAPIN_HELPER_CHANNEL_H */
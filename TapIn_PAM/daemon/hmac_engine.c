@@ -0,0 +1,107 @@
+/*
+ * TapIn HMAC Engine
+ * EVP_MAC on OpenSSL 3, HMAC_CTX on older releases
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/opensslv.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#else
+#include <openssl/hmac.h>
+#endif
+#include "hmac_engine.h"
+
+struct hmac_engine {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    EVP_MAC *mac;
+    EVP_MAC_CTX *keyed;      // Initialised with the key, never finalised
+#else
+    HMAC_CTX *keyed;
+#endif
+};
+
+hmac_engine_t *hmac_engine_new(const void *secret, size_t secret_length) {
+    hmac_engine_t *engine = calloc(1, sizeof(*engine));
+    
+    if (!engine) {
+        return NULL;
+    }
+    
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+        OSSL_PARAM_construct_end()
+    };
+    
+    engine->mac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+    engine->keyed = engine->mac ? EVP_MAC_CTX_new(engine->mac) : NULL;
+    if (!engine->keyed || !EVP_MAC_init(engine->keyed, secret, secret_length, params)) {
+        hmac_engine_free(engine);
+        return NULL;
+    }
+#else
+    engine->keyed = HMAC_CTX_new();
+    if (!engine->keyed || !HMAC_Init_ex(engine->keyed, secret, (int)secret_length, EVP_sha256(), NULL)) {
+        hmac_engine_free(engine);
+        return NULL;
+    }
+#endif
+    
+    return engine;
+}
+
+void hmac_engine_free(hmac_engine_t *engine) {
+    if (!engine) {
+        return;
+    }
+    
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    EVP_MAC_CTX_free(engine->keyed);
+    EVP_MAC_free(engine->mac);
+#else
+    HMAC_CTX_free(engine->keyed);
+#endif
+    free(engine);
+}
+
+int hmac_engine_sign(const hmac_engine_t *engine, const void *data, size_t length, uint8_t *mac) {
+    int ok;
+    
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    size_t mac_length = 0;
+    
+    // Clone the keyed state rather than re-deriving it from the key
+    EVP_MAC_CTX *ctx = EVP_MAC_CTX_dup(engine->keyed);
+    ok = ctx && EVP_MAC_update(ctx, data, length) &&
+         EVP_MAC_final(ctx, mac, &mac_length, HMAC_ENGINE_MAC_LENGTH) &&
+         mac_length == HMAC_ENGINE_MAC_LENGTH;
+    EVP_MAC_CTX_free(ctx);
+#else
+    unsigned int mac_length = 0;
+    
+    HMAC_CTX *ctx = HMAC_CTX_new();
+    ok = ctx && HMAC_CTX_copy(ctx, engine->keyed) &&
+         HMAC_Update(ctx, data, length) &&
+         HMAC_Final(ctx, mac, &mac_length) &&
+         mac_length == HMAC_ENGINE_MAC_LENGTH;
+    HMAC_CTX_free(ctx);
+#endif
+    
+    return ok;
+}
+
+int hmac_engine_verify(const hmac_engine_t *engine, const void *data, size_t length, const uint8_t *mac) {
+    uint8_t expected[HMAC_ENGINE_MAC_LENGTH];
+    int ok;
+    
+    ok = hmac_engine_sign(engine, data, length, expected) &&
+         CRYPTO_memcmp(expected, mac, HMAC_ENGINE_MAC_LENGTH) == 0;
+    
+    OPENSSL_cleanse(expected, sizeof(expected));
+    return ok;
+}
@@ -0,0 +1,42 @@
+/*
+ * TapIn HMAC Engine
+ * Keyed HMAC-SHA256 contexts prepared once per secret
+ *
+ * Setting up an HMAC key means hashing the padded key into inner and outer
+ * states. An engine does that once when it is created; every verification
+ * clones the prepared state, so the per-request cost is just the message
+ * and the final compression. Engines are immutable after creation and may
+ * be shared between threads.
+ */
+
+#ifndef TAPIN_HMAC_ENGINE_H
+#define TAPIN_HMAC_ENGINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HMAC_ENGINE_MAC_LENGTH 32
+
+typedef struct hmac_engine hmac_engine_t;
+
+/*
+ * Prepare an engine for the given secret
+ * Returns NULL on failure
+ */
+hmac_engine_t *hmac_engine_new(const void *secret, size_t secret_length);
+
+void hmac_engine_free(hmac_engine_t *engine);
+
+/*
+ * Compute the MAC of data into mac (HMAC_ENGINE_MAC_LENGTH bytes)
+ * Returns 1 on success, 0 on failure
+ */
+int hmac_engine_sign(const hmac_engine_t *engine, const void *data, size_t length, uint8_t *mac);
+
+/*
+ * Check a received MAC against data, comparing in constant time
+ * Returns 1 if it matches, 0 otherwise
+ */
+int hmac_engine_verify(const hmac_engine_t *engine, const void *data, size_t length, const uint8_t *mac);
+
+#endif /* TAPIN_HMAC_ENGINE_H */
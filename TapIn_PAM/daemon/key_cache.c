@@ -0,0 +1,313 @@
+/*
+ * TapIn Key Cache
+ * Keystore mapping, lazily keyed HMAC engines and the inotify watch
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <syslog.h>
+#include <libgen.h>
+#include <sys/inotify.h>
+#include <openssl/crypto.h>
+#include "keystore.h"
+#include "hmac_engine.h"
+#include "key_cache.h"
+#include "async_log.h"
+
+// Bounds the HMACs one request can cost when a user has several phones
+#define MAX_KEY_ATTEMPTS 8
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+
+static char keystore_file[PATH_MAX];
+static char secret_file[PATH_MAX];
+
+// Current keys: a mapped keystore, or else the shared secret
+static keystore_t *keystore = NULL;
+static hmac_engine_t **engines = NULL;      // One per entry, keyed on first use
+static hmac_engine_t *secret_engine = NULL;
+
+static int watch_fd = -1;
+static int keystore_watch = -1;
+static int secret_watch = -1;
+
+/*
+ * Function to prepare an engine from the shared secret file
+ */
+static hmac_engine_t *load_shared_secret(void) {
+    char secret[256];
+    hmac_engine_t *engine;
+    FILE *file;
+    size_t len;
+    
+    file = fopen(secret_file, "r");
+    if (!file) {
+        async_log(LOG_ERR, "Could not open shared secret file: %s", strerror(errno));
+        return NULL;
+    }
+    
+    if (fgets(secret, sizeof(secret), file) == NULL) {
+        fclose(file);
+        async_log(LOG_ERR, "Could not read shared secret from file");
+        return NULL;
+    }
+    
+    fclose(file);
+    
+    // Remove trailing newline if present
+    len = strlen(secret);
+    if (len > 0 && secret[len-1] == '\n') {
+        secret[--len] = '\0';
+    }
+    
+    engine = hmac_engine_new(secret, len);
+    OPENSSL_cleanse(secret, sizeof(secret));
+    if (!engine) {
+        async_log(LOG_ERR, "Could not prepare HMAC key from shared secret");
+    }
+    return engine;
+}
+
+static void free_engines(void) {
+    size_t i;
+    
+    if (engines) {
+        for (i = 0; i < keystore_count(keystore); i++) {
+            hmac_engine_free(engines[i]);
+        }
+        free(engines);
+        engines = NULL;
+    }
+}
+
+/*
+ * Function to load the current keys, keeping the old ones if the new
+ * keystore is unusable
+ */
+static void reload_keys(void) {
+    keystore_t *loaded = keystore_open(keystore_file);
+    
+    if (loaded) {
+        hmac_engine_t **loaded_engines = calloc(keystore_count(loaded) + 1, sizeof(*loaded_engines));
+        if (!loaded_engines) {
+            async_log(LOG_ERR, "Out of memory loading keystore %s", keystore_file);
+            keystore_close(loaded);
+            return;
+        }
+    
+        free_engines();
+        keystore_close(keystore);
+        hmac_engine_free(secret_engine);
+        secret_engine = NULL;
+        keystore = loaded;
+        engines = loaded_engines;
+        async_log(LOG_INFO, "Loaded keystore %s with %zu entries", keystore_file, keystore_count(keystore));
+        return;
+    }
+    
+    if (errno != ENOENT) {
+        if (keystore) {
+            async_log(LOG_WARNING, "Keeping the previous keystore");
+        }
+        return;
+    }
+    
+    // No keystore: fall back to the single shared secret
+    hmac_engine_t *engine = load_shared_secret();
+    if (!engine && keystore) {
+        async_log(LOG_WARNING, "Keystore %s removed and no shared secret, keeping the previous keys", keystore_file);
+        return;
+    }
+    
+    free_engines();
+    keystore_close(keystore);
+    keystore = NULL;
+    hmac_engine_free(secret_engine);
+    secret_engine = engine;
+    if (engine) {
+        async_log(LOG_INFO, "No keystore at %s, using shared secret %s", keystore_file, secret_file);
+    }
+}
+
+/*
+ * Function to watch the directory holding path, since files in it are
+ * replaced by rename
+ */
+static int watch_directory(const char *path) {
+    char directory[PATH_MAX];
+    int wd;
+    
+    snprintf(directory, sizeof(directory), "%s", path);
+    wd = inotify_add_watch(watch_fd, dirname(directory), WATCH_EVENTS);
+    if (wd < 0) {
+        async_log(LOG_WARNING, "Could not watch %s for key changes: %s", directory, strerror(errno));
+    }
+    return wd;
+}
+
+int key_cache_start(const char *keystore_path, const char *secret_path) {
+    snprintf(keystore_file, sizeof(keystore_file), "%s", keystore_path);
+    snprintf(secret_file, sizeof(secret_file), "%s", secret_path);
+    
+    // Watch before loading so a change in between is not missed
+    watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch_fd < 0) {
+        async_log(LOG_WARNING, "inotify unavailable, key changes need a restart: %s", strerror(errno));
+    } else {
+        keystore_watch = watch_directory(keystore_file);
+        secret_watch = watch_directory(secret_file);
+    }
+    
+    reload_keys();
+    if (!keystore && !secret_engine) {
+        async_log(LOG_WARNING, "No keys loaded; authentication requests will be rejected");
+    }
+    
+    return watch_fd >= 0 && keystore_watch >= 0 && secret_watch >= 0;
+}
+
+void key_cache_stop(void) {
+    free_engines();
+    keystore_close(keystore);
+    keystore = NULL;
+    hmac_engine_free(secret_engine);
+    secret_engine = NULL;
+    
+    if (watch_fd >= 0) {
+        close(watch_fd);
+        watch_fd = -1;
+    }
+}
+
+int key_cache_watch_fd(void) {
+    return watch_fd;
+}
+
+void key_cache_handle_events(void) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char name_buffer[PATH_MAX];
+    const char *keystore_name, *secret_name;
+    int changed = 0;
+    ssize_t length;
+    
+    snprintf(name_buffer, sizeof(name_buffer), "%s", keystore_file);
+    keystore_name = basename(name_buffer);
+    secret_name = strrchr(secret_file, '/') ? strrchr(secret_file, '/') + 1 : secret_file;
+    
+    while ((length = read(watch_fd, buffer, sizeof(buffer))) > 0) {
+        char *p = buffer;
+        while (p < buffer + length) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+    
+            if (event->len > 0 &&
+                ((event->wd == keystore_watch && strcmp(event->name, keystore_name) == 0) ||
+                 (event->wd == secret_watch && strcmp(event->name, secret_name) == 0))) {
+                changed = 1;
+            }
+            if (event->mask & IN_Q_OVERFLOW) {
+                changed = 1;
+            }
+    
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    
+    // One reload covers a whole burst of events
+    if (changed) {
+        reload_keys();
+    }
+}
+
+/*
+ * Function to check a MAC against one keystore entry
+ */
+static int verify_entry(size_t index, const void *data, size_t length, const uint8_t *mac) {
+    if (!engines[index]) {
+        const keystore_entry_t *entry = keystore_entry(keystore, index);
+        engines[index] = hmac_engine_new(entry->secret, entry->secret_length);
+        if (!engines[index]) {
+            async_log(LOG_ERR, "Could not prepare HMAC key for %s", entry->username);
+            return 0;
+        }
+    }
+    
+    return hmac_engine_verify(engines[index], data, length, mac);
+}
+
+int key_cache_preload(void) {
+    size_t i;
+    
+    if (!keystore) {
+        return secret_engine != NULL;
+    }
+    
+    for (i = 0; i < keystore_count(keystore); i++) {
+        const keystore_entry_t *entry = keystore_entry(keystore, i);
+        if (!engines[i]) {
+            engines[i] = hmac_engine_new(entry->secret, entry->secret_length);
+            if (!engines[i]) {
+                async_log(LOG_ERR, "Could not prepare HMAC key for %s", entry->username);
+                return 0;
+            }
+        }
+    }
+    
+    return 1;
+}
+
+/*
+ * Function to try a user's entries, skipping phones other than the one
+ * the request came from
+ */
+static int verify_user(const char *username, const tapin_auth_record_t *record,
+                       const void *data, size_t length, int *attempts) {
+    size_t count, i;
+    long first = keystore_find_user(keystore, username, &count);
+    
+    if (first < 0) {
+        return 0;
+    }
+    
+    for (i = 0; i < count && *attempts < MAX_KEY_ATTEMPTS; i++) {
+        const keystore_entry_t *entry = keystore_entry(keystore, first + i);
+        if ((record->flags & TAPIN_AUTH_HAS_DEVICE) && entry->has_device &&
+            memcmp(entry->device, record->device, sizeof(entry->device)) != 0) {
+            continue;
+        }
+        (*attempts)++;
+        if (verify_entry(first + i, data, length, record->mac)) {
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+int key_cache_verify(const tapin_auth_record_t *record, const void *data, size_t length) {
+    int attempts = 0;
+    
+    if (!keystore) {
+        return secret_engine && hmac_engine_verify(secret_engine, data, length, record->mac);
+    }
+    
+    // An enrolled phone may only sign for its own user
+    if (record->flags & TAPIN_AUTH_HAS_DEVICE) {
+        long index = keystore_find_device(keystore, record->device);
+        if (index >= 0) {
+            const keystore_entry_t *entry = keystore_entry(keystore, index);
+            if (strcmp(entry->username, record->username) != 0 &&
+                strcmp(entry->username, KEYSTORE_ANY_USER) != 0) {
+                async_log(LOG_WARNING, "Device is enrolled for another user than %s", record->username);
+                return 0;
+            }
+            return verify_entry(index, data, length, record->mac);
+        }
+    }
+    
+    return verify_user(record->username, record, data, length, &attempts) ||
+           verify_user(KEYSTORE_ANY_USER, record, data, length, &attempts);
+}
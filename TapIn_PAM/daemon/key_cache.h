@@ -0,0 +1,49 @@
+/*
+ * TapIn Key Cache
+ * The helper's view of the keystore, kept current with inotify
+ *
+ * The helper maps the keystore (see keystore.h) at startup and swaps in a
+ * new mapping whenever tapinctl renames a fresh file over it. HMAC keys
+ * are prepared on first use and kept until the next swap, so a request
+ * costs index lookups and one HMAC, never file I/O.
+ *
+ * Hosts without a keystore keep working from the old single shared
+ * secret file, which is re-read only when it changes.
+ */
+
+#ifndef TAPIN_KEY_CACHE_H
+#define TAPIN_KEY_CACHE_H
+
+#include <stddef.h>
+#include "tapin_channel.h"
+
+/*
+ * Load the keystore (or the shared secret) and start watching for changes
+ * Returns 1 on success, 0 if changes cannot be watched (the keys loaded
+ * now are still used)
+ */
+int key_cache_start(const char *keystore_path, const char *secret_path);
+
+void key_cache_stop(void);
+
+// inotify descriptor to poll for changes, or -1
+int key_cache_watch_fd(void);
+
+// Reload whatever changed; call when key_cache_watch_fd() is readable
+void key_cache_handle_events(void);
+
+/*
+ * Prepare the HMAC key of every entry now instead of on first use, so
+ * key_cache_verify() may run on several threads at once until the next
+ * reload. Returns 1 on success, 0 if no keys are loaded or one failed
+ */
+int key_cache_preload(void);
+
+/*
+ * Check the MAC on a record against the keys enrolled for its user and
+ * device. data is the signed text (see auth_record_signed_data)
+ * Returns 1 if a key matches, 0 otherwise
+ */
+int key_cache_verify(const tapin_auth_record_t *record, const void *data, size_t length);
+
+#endif /* TAPIN_KEY_CACHE_H */
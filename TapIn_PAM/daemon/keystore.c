@@ -0,0 +1,345 @@
+/*
+ * TapIn Keystore
+ * Memory-mapped keystore files and the writer used by tapinctl
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "keystore.h"
+#include "async_log.h"
+
+#define MIN_INDEX_SIZE 16
+
+struct keystore {
+    void *map;
+    size_t map_size;
+    const keystore_header_t *header;
+    const keystore_entry_t *entries;
+    const uint32_t *user_index;       // Entry number + 1; 0 marks an empty slot
+    const uint32_t *device_index;
+};
+
+/*
+ * FNV-1a, over a username or a device address
+ */
+static uint32_t hash_bytes(const void *data, size_t length) {
+    const unsigned char *p = data;
+    uint32_t hash = 2166136261u;
+    
+    while (length-- > 0) {
+        hash ^= *p++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int is_power_of_two(uint64_t value) {
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+/*
+ * Function to check that a region of count elements lies inside the file
+ */
+static int region_fits(uint64_t offset, uint64_t count, uint64_t element, uint64_t file_size) {
+    return offset % 8 == 0 && offset <= file_size && count <= (file_size - offset) / element;
+}
+
+/*
+ * Function to check the header, entries and indexes of a mapped file
+ */
+static int keystore_valid(const keystore_t *keystore) {
+    const keystore_header_t *header = keystore->header;
+    uint32_t i;
+    
+    if (header->magic != KEYSTORE_MAGIC || header->version != KEYSTORE_VERSION ||
+        header->entry_size != sizeof(keystore_entry_t) || header->file_size != keystore->map_size ||
+        header->entry_count > KEYSTORE_MAX_ENTRIES || !is_power_of_two(header->index_size) ||
+        header->index_size <= header->entry_count ||
+        !region_fits(header->entries_offset, header->entry_count, sizeof(keystore_entry_t), header->file_size) ||
+        !region_fits(header->user_index_offset, header->index_size, sizeof(uint32_t), header->file_size) ||
+        !region_fits(header->device_index_offset, header->index_size, sizeof(uint32_t), header->file_size)) {
+        return 0;
+    }
+    
+    for (i = 0; i < header->entry_count; i++) {
+        const keystore_entry_t *entry = &keystore->entries[i];
+        if (entry->username[0] == '\0' || !memchr(entry->username, '\0', sizeof(entry->username)) ||
+            entry->secret_length == 0 || entry->secret_length > KEYSTORE_SECRET_MAX) {
+            return 0;
+        }
+    }
+    
+    for (i = 0; i < header->index_size; i++) {
+        if (keystore->user_index[i] > header->entry_count || keystore->device_index[i] > header->entry_count) {
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+keystore_t *keystore_open(const char *path) {
+    keystore_t *keystore;
+    struct stat st;
+    int fd;
+    
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            async_log(LOG_ERR, "Could not open keystore %s: %s", path, strerror(errno));
+        }
+        return NULL;
+    }
+    
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(keystore_header_t)) {
+        async_log(LOG_ERR, "Keystore %s is too short", path);
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    
+    // Secrets must not be replaceable by anyone but the owner
+    if (st.st_mode & (S_IWGRP | S_IWOTH)) {
+        async_log(LOG_ERR, "Keystore %s is writable by group or others, refusing it", path);
+        close(fd);
+        errno = EPERM;
+        return NULL;
+    }
+    
+    keystore = calloc(1, sizeof(*keystore));
+    if (!keystore) {
+        close(fd);
+        return NULL;
+    }
+    
+    keystore->map_size = st.st_size;
+    keystore->map = mmap(NULL, keystore->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (keystore->map == MAP_FAILED) {
+        async_log(LOG_ERR, "Could not map keystore %s: %s", path, strerror(errno));
+        free(keystore);
+        return NULL;
+    }
+    
+    keystore->header = keystore->map;
+    keystore->entries = (const keystore_entry_t *)((const char *)keystore->map + keystore->header->entries_offset);
+    keystore->user_index = (const uint32_t *)((const char *)keystore->map + keystore->header->user_index_offset);
+    keystore->device_index = (const uint32_t *)((const char *)keystore->map + keystore->header->device_index_offset);
+    
+    if (!keystore_valid(keystore)) {
+        async_log(LOG_ERR, "Keystore %s is malformed", path);
+        keystore_close(keystore);
+        errno = EINVAL;
+        return NULL;
+    }
+    
+    return keystore;
+}
+
+void keystore_close(keystore_t *keystore) {
+    if (!keystore) {
+        return;
+    }
+    
+    munmap(keystore->map, keystore->map_size);
+    free(keystore);
+}
+
+size_t keystore_count(const keystore_t *keystore) {
+    return keystore->header->entry_count;
+}
+
+const keystore_entry_t *keystore_entry(const keystore_t *keystore, size_t index) {
+    return &keystore->entries[index];
+}
+
+long keystore_find_device(const keystore_t *keystore, const uint8_t *device) {
+    uint32_t mask = keystore->header->index_size - 1;
+    uint32_t slot = hash_bytes(device, 6) & mask;
+    uint32_t probes;
+    
+    for (probes = 0; probes <= mask && keystore->device_index[slot]; probes++) {
+        const keystore_entry_t *entry = &keystore->entries[keystore->device_index[slot] - 1];
+        if (entry->has_device && memcmp(entry->device, device, 6) == 0) {
+            return keystore->device_index[slot] - 1;
+        }
+        slot = (slot + 1) & mask;
+    }
+    
+    return -1;
+}
+
+long keystore_find_user(const keystore_t *keystore, const char *username, size_t *count) {
+    uint32_t mask = keystore->header->index_size - 1;
+    uint32_t slot = hash_bytes(username, strlen(username)) & mask;
+    uint32_t probes;
+    
+    for (probes = 0; probes <= mask && keystore->user_index[slot]; probes++) {
+        uint32_t first = keystore->user_index[slot] - 1;
+        if (strcmp(keystore->entries[first].username, username) == 0) {
+            uint32_t last = first + 1;
+            while (last < keystore->header->entry_count &&
+                   strcmp(keystore->entries[last].username, username) == 0) {
+                last++;
+            }
+            *count = last - first;
+            return first;
+        }
+        slot = (slot + 1) & mask;
+    }
+    
+    return -1;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const keystore_entry_t *left = a, *right = b;
+    int order = strcmp(left->username, right->username);
+    
+    if (order != 0) {
+        return order;
+    }
+    if (left->has_device != right->has_device) {
+        return left->has_device - right->has_device;
+    }
+    return memcmp(left->device, right->device, sizeof(left->device));
+}
+
+/*
+ * Function to write a whole buffer, resuming after partial writes
+ */
+static int write_all(int fd, const void *data, size_t length) {
+    const char *p = data;
+    
+    while (length > 0) {
+        ssize_t n = write(fd, p, length);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        p += n;
+        length -= n;
+    }
+    return 1;
+}
+
+int keystore_write(const char *path, keystore_entry_t *entries, size_t count) {
+    keystore_header_t header;
+    uint32_t *user_index, *device_index;
+    uint32_t index_size = MIN_INDEX_SIZE;
+    char temp_path[4096], dir_path[4096];
+    size_t i;
+    int fd, ok;
+    
+    if (count > KEYSTORE_MAX_ENTRIES) {
+        errno = EFBIG;
+        return 0;
+    }
+    
+    qsort(entries, count, sizeof(*entries), compare_entries);
+    
+    // At most half full, so probes stay short
+    while (index_size < count * 2) {
+        index_size <<= 1;
+    }
+    
+    user_index = calloc(index_size, sizeof(uint32_t));
+    device_index = calloc(index_size, sizeof(uint32_t));
+    if (!user_index || !device_index) {
+        free(user_index);
+        free(device_index);
+        errno = ENOMEM;
+        return 0;
+    }
+    
+    for (i = 0; i < count; i++) {
+        uint32_t mask = index_size - 1;
+        uint32_t slot;
+    
+        // A user's first entry stands for the whole run
+        if (i == 0 || strcmp(entries[i].username, entries[i - 1].username) != 0) {
+            slot = hash_bytes(entries[i].username, strlen(entries[i].username)) & mask;
+            while (user_index[slot]) {
+                slot = (slot + 1) & mask;
+            }
+            user_index[slot] = (uint32_t)i + 1;
+        }
+    
+        if (entries[i].has_device) {
+            slot = hash_bytes(entries[i].device, 6) & mask;
+            while (device_index[slot]) {
+                if (memcmp(entries[device_index[slot] - 1].device, entries[i].device, 6) == 0) {
+                    // One phone cannot carry two secrets
+                    free(user_index);
+                    free(device_index);
+                    errno = EEXIST;
+                    return 0;
+                }
+                slot = (slot + 1) & mask;
+            }
+            device_index[slot] = (uint32_t)i + 1;
+        }
+    }
+    
+    memset(&header, 0, sizeof(header));
+    header.magic = KEYSTORE_MAGIC;
+    header.version = KEYSTORE_VERSION;
+    header.entry_size = sizeof(keystore_entry_t);
+    header.entry_count = (uint32_t)count;
+    header.index_size = index_size;
+    header.entries_offset = sizeof(header);
+    header.user_index_offset = header.entries_offset + count * sizeof(keystore_entry_t);
+    header.device_index_offset = header.user_index_offset + index_size * sizeof(uint32_t);
+    header.file_size = header.device_index_offset + index_size * sizeof(uint32_t);
+    
+    // Build next to the target and rename over it
+    if (snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", path) >= (int)sizeof(temp_path)) {
+        free(user_index);
+        free(device_index);
+        errno = ENAMETOOLONG;
+        return 0;
+    }
+    
+    fd = mkstemp(temp_path);
+    if (fd < 0) {
+        free(user_index);
+        free(device_index);
+        return 0;
+    }
+    
+    ok = fchmod(fd, 0600) == 0 &&
+         write_all(fd, &header, sizeof(header)) &&
+         write_all(fd, entries, count * sizeof(keystore_entry_t)) &&
+         write_all(fd, user_index, index_size * sizeof(uint32_t)) &&
+         write_all(fd, device_index, index_size * sizeof(uint32_t)) &&
+         fsync(fd) == 0;
+    close(fd);
+    free(user_index);
+    free(device_index);
+    
+    if (!ok || rename(temp_path, path) != 0) {
+        int saved = errno;
+        unlink(temp_path);
+        errno = saved;
+        return 0;
+    }
+    
+    // Make the rename itself durable
+    snprintf(dir_path, sizeof(dir_path), "%s", path);
+    fd = open(dirname(dir_path), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    
+    return 1;
+}
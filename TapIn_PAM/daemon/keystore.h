@@ -0,0 +1,87 @@
+/*
+ * TapIn Keystore
+ * Compiled file of per-user and per-device HMAC secrets
+ *
+ * The keystore replaces the single shared secret. Each entry enrolls one
+ * phone for one user: a username, optionally the phone's Bluetooth
+ * address, and the secret the phone signs with. The username "*" matches
+ * any user and stands in for the old shared secret.
+ *
+ * The file is built by tapinctl and memory-mapped by the helper as is:
+ * a header, the entries sorted by username, and two open-addressing
+ * indexes (by username and by device address) holding entry numbers.
+ * Lookups touch a handful of cache lines and never read the file. The
+ * file is replaced by renaming a new one over it, so a reader never sees
+ * a half-written keystore.
+ */
+
+#ifndef TAPIN_KEYSTORE_H
+#define TAPIN_KEYSTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "tapin_channel.h"
+
+#define KEYSTORE_PATH "/etc/tapin/keystore"
+#define KEYSTORE_MAGIC 0x4b504154     // "TAPK" in little-endian byte order
+#define KEYSTORE_VERSION 1
+#define KEYSTORE_SECRET_MAX 128
+#define KEYSTORE_MAX_ENTRIES 1000000
+#define KEYSTORE_ANY_USER "*"
+
+// File header, in host byte order (the file is built on the host)
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t entry_size;
+    uint32_t entry_count;
+    uint32_t index_size;              // Slots per index, a power of two
+    uint64_t entries_offset;
+    uint64_t user_index_offset;       // uint32_t[index_size]
+    uint64_t device_index_offset;     // uint32_t[index_size]
+    uint64_t file_size;
+} keystore_header_t;
+
+typedef struct {
+    char username[TAPIN_AUTH_USERNAME_LENGTH + 1];
+    uint8_t has_device;
+    uint8_t device[6];                // Most significant byte first, as printed
+    uint8_t secret_length;
+    uint8_t reserved[7];
+    uint8_t secret[KEYSTORE_SECRET_MAX];
+} keystore_entry_t;
+
+typedef struct keystore keystore_t;
+
+/*
+ * Map and check a keystore file
+ * Returns NULL if it is missing or malformed (errno is ENOENT if missing)
+ */
+keystore_t *keystore_open(const char *path);
+
+void keystore_close(keystore_t *keystore);
+
+size_t keystore_count(const keystore_t *keystore);
+
+const keystore_entry_t *keystore_entry(const keystore_t *keystore, size_t index);
+
+/*
+ * Find the entry enrolled for a device
+ * Returns its index, or -1 if the device is not enrolled
+ */
+long keystore_find_device(const keystore_t *keystore, const uint8_t *device);
+
+/*
+ * Find a user's entries, which are stored next to each other
+ * Returns the index of the first one and sets *count, or -1 if the user
+ * has none
+ */
+long keystore_find_user(const keystore_t *keystore, const char *username, size_t *count);
+
+/*
+ * Sort entries, build the indexes and write a keystore file, replacing
+ * path atomically. Returns 1 on success, 0 on failure (errno is set)
+ */
+int keystore_write(const char *path, keystore_entry_t *entries, size_t count);
+
+#endif /* TAPIN_KEYSTORE_H */
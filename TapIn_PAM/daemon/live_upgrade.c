@@ -0,0 +1,294 @@
+/*
+ * TapIn Live Upgrade
+ * State records in a memfd, and exec in place
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "live_upgrade.h"
+#include "service_manager.h"
+#include "async_log.h"
+
+#define STATE_MAGIC "TAPINUP1"
+#define STATE_MAGIC_LENGTH 8
+#define RECORD_ALIGN 8
+
+// Each record's payload follows its header, padded to RECORD_ALIGN
+typedef struct {
+    uint32_t type;
+    int32_t fd;             // -1 if the record has none
+    uint32_t length;        // Payload bytes, before padding
+    uint32_t taken;         // Set once the new image has used the record
+} record_header_t;
+
+/*
+ * Function to find how far a record reaches, header and padding included
+ */
+static size_t record_size(const record_header_t *header) {
+    return sizeof(*header) + ((header->length + RECORD_ALIGN - 1) & ~(size_t)(RECORD_ALIGN - 1));
+}
+
+static char exe_path[PATH_MAX];
+static char **exe_argv = NULL;
+
+// Records being written, or read back
+static char *state = NULL;
+static size_t state_length = 0;
+static size_t state_capacity = 0;
+
+void live_upgrade_init(char *argv[]) {
+    ssize_t n = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+    
+    exe_path[n > 0 ? n : 0] = '\0';
+    exe_argv = argv;
+}
+
+int live_upgrade_available(void) {
+    if (exe_path[0] == '\0' || !exe_argv) {
+        async_log(LOG_ERR, "Cannot upgrade: the daemon's own path is not known");
+        return 0;
+    }
+    if (access(exe_path, X_OK) < 0) {
+        async_log(LOG_ERR, "Cannot upgrade: %s: %s", exe_path, strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Function to wipe and free the records
+ */
+static void discard_state(void) {
+    if (state) {
+        explicit_bzero(state, state_length);
+        free(state);
+    }
+    state = NULL;
+    state_length = 0;
+    state_capacity = 0;
+}
+
+int live_upgrade_put(upgrade_record_type_t type, int fd, const void *data, size_t length) {
+    size_t padded = (length + RECORD_ALIGN - 1) & ~(size_t)(RECORD_ALIGN - 1);
+    size_t needed = state_length + sizeof(record_header_t) + padded;
+    record_header_t header = { type, fd, (uint32_t)length, 0 };
+    
+    if (state_length == 0) {
+        needed += RECORD_ALIGN;
+    }
+    if (needed > state_capacity) {
+        size_t capacity = state_capacity ? state_capacity : 4096;
+        char *grown;
+    
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        // Copy by hand rather than realloc(), so no token is left behind
+        // in a freed block
+        grown = malloc(capacity);
+        if (!grown) {
+            async_log(LOG_ERR, "Out of memory saving state for the upgrade");
+            return 0;
+        }
+        if (state) {
+            memcpy(grown, state, state_length);
+            explicit_bzero(state, state_length);
+            free(state);
+        }
+        state = grown;
+        state_capacity = capacity;
+    }
+    
+    if (state_length == 0) {
+        memcpy(state, STATE_MAGIC, STATE_MAGIC_LENGTH);
+        state_length = RECORD_ALIGN;
+    }
+    memcpy(state + state_length, &header, sizeof(header));
+    memcpy(state + state_length + sizeof(header), data, length);
+    memset(state + state_length + sizeof(header) + length, 0, padded - length);
+    state_length += sizeof(header) + padded;
+    
+    // The descriptor has to outlive exec
+    if (fd >= 0) {
+        fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) & ~FD_CLOEXEC);
+    }
+    return 1;
+}
+
+int live_upgrade_put_listener(int fd) {
+    int32_t from_unit = service_socket_inherited(fd);
+    return live_upgrade_put(UPGRADE_LISTENER, fd, &from_unit, sizeof(from_unit));
+}
+
+/*
+ * Function to close every record's descriptor on exec again, so that
+ * nothing started later inherits it
+ */
+static void close_records_on_exec(void) {
+    size_t offset = RECORD_ALIGN;
+    
+    while (state && offset < state_length) {
+        record_header_t *header = (record_header_t *)(state + offset);
+        if (header->fd >= 0) {
+            fcntl(header->fd, F_SETFD, fcntl(header->fd, F_GETFD) | FD_CLOEXEC);
+        }
+        offset += record_size(header);
+    }
+}
+
+void live_upgrade_exec(void) {
+    char number[16];
+    size_t written = 0;
+    int fd;
+    
+    // Not MFD_CLOEXEC: the new image reads it
+    fd = memfd_create("tapin-upgrade", 0);
+    if (fd < 0) {
+        async_log(LOG_ERR, "Failed to create upgrade state: %s", strerror(errno));
+        close_records_on_exec();
+        discard_state();
+        return;
+    }
+    
+    while (written < state_length) {
+        ssize_t n = write(fd, state + written, state_length - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            async_log(LOG_ERR, "Failed to write upgrade state: %s", strerror(errno));
+            break;
+        }
+        written += n;
+    }
+    
+    if (written == state_length) {
+        snprintf(number, sizeof(number), "%d", fd);
+        setenv(LIVE_UPGRADE_ENV, number, 1);
+        execv(exe_path, exe_argv);
+        async_log(LOG_ERR, "Failed to run %s: %s", exe_path, strerror(errno));
+        unsetenv(LIVE_UPGRADE_ENV);
+    }
+    
+    close(fd);
+    close_records_on_exec();
+    discard_state();
+}
+
+/*
+ * Function to check that the records read back are whole
+ */
+static int state_valid(void) {
+    size_t offset = RECORD_ALIGN;
+    
+    if (state_length < RECORD_ALIGN || memcmp(state, STATE_MAGIC, STATE_MAGIC_LENGTH) != 0) {
+        return 0;
+    }
+    while (offset < state_length) {
+        const record_header_t *header = (const record_header_t *)(state + offset);
+        if (state_length - offset < sizeof(*header) || header->length > state_length - offset - sizeof(*header)) {
+            return 0;
+        }
+        offset += record_size(header);
+    }
+    return offset == state_length;
+}
+
+static void adopt_listener(const void *data, size_t length, int fd, void *arg) {
+    int32_t from_unit = 0;
+    (void)arg;
+    
+    if (length == sizeof(from_unit)) {
+        memcpy(&from_unit, data, sizeof(from_unit));
+    }
+    if (fd >= 0 && !service_adopt_socket(fd, from_unit)) {
+        close(fd);
+    }
+}
+
+int live_upgrade_resume(void) {
+    const char *value = getenv(LIVE_UPGRADE_ENV);
+    struct stat st;
+    size_t got = 0;
+    char *end;
+    int fd;
+    
+    if (!value) {
+        return 0;
+    }
+    fd = (int)strtol(value, &end, 10);
+    if (*end != '\0' || fd < 0 || fstat(fd, &st) < 0) {
+        async_log(LOG_ERR, "Upgrade state %s is not readable", value);
+        unsetenv(LIVE_UPGRADE_ENV);
+        return 0;
+    }
+    unsetenv(LIVE_UPGRADE_ENV);
+    
+    state = malloc(st.st_size > 0 ? st.st_size : 1);
+    if (!state) {
+        async_log(LOG_ERR, "Out of memory reading upgrade state");
+        close(fd);
+        return 0;
+    }
+    state_capacity = st.st_size;
+    while (got < (size_t)st.st_size) {
+        ssize_t n = pread(fd, state + got, st.st_size - got, got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+    }
+    close(fd);
+    state_length = got;
+    
+    if (!state_valid()) {
+        // Without the records there is no knowing which descriptors are ours
+        async_log(LOG_ERR, "Upgrade state is damaged, starting afresh");
+        discard_state();
+        return 0;
+    }
+    
+    async_log(LOG_INFO, "Resuming from the previous image (%zu bytes of state)", state_length);
+    close_records_on_exec();
+    live_upgrade_each(UPGRADE_LISTENER, adopt_listener, NULL);
+    return 1;
+}
+
+void live_upgrade_each(upgrade_record_type_t type, void (*fn)(const void *data, size_t length, int fd, void *arg),
+                       void *arg) {
+    size_t offset = RECORD_ALIGN;
+    
+    while (state && offset < state_length) {
+        record_header_t *header = (record_header_t *)(state + offset);
+        if (header->type == (uint32_t)type && !header->taken) {
+            header->taken = 1;
+            fn(state + offset + sizeof(*header), header->length, header->fd, arg);
+        }
+        offset += record_size(header);
+    }
+}
+
+void live_upgrade_finish(void) {
+    size_t offset = RECORD_ALIGN;
+    
+    while (state && offset < state_length) {
+        record_header_t *header = (record_header_t *)(state + offset);
+        if (!header->taken && header->fd >= 0) {
+            async_log(LOG_WARNING, "Closing descriptor %d from the previous image that this build does not use",
+                      header->fd);
+            close(header->fd);
+        }
+        offset += record_size(header);
+    }
+    discard_state();
+}
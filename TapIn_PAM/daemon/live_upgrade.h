@@ -0,0 +1,81 @@
+/*
+ * TapIn Live Upgrade
+ * Replacing a running daemon with a new build without failing a request
+ *
+ * On SIGUSR2 a daemon stops accepting, lets the requests in progress
+ * finish, writes what it must not lose into a memfd and execs the binary
+ * now installed at its own path, in the same process. systemd sees the
+ * same main PID throughout, and the listening sockets stay open with the
+ * same descriptors, so phones and PAM requests connecting meanwhile wait
+ * in the backlog instead of being refused.
+ *
+ * The new image finds the state through LIVE_UPGRADE_ENV. Its listening
+ * sockets go to the service manager code and are taken back exactly like
+ * sockets from a socket unit (see service_manager.h); everything else is a
+ * list of typed records, each of which may carry a descriptor that stays
+ * open across exec. Records a build does not know are skipped and their
+ * descriptors closed, so a record whose layout changes gets a new type and
+ * builds either side of the change still upgrade to each other, losing
+ * only that state. The state may hold tokens; it never touches the disk
+ * and is wiped once read.
+ */
+
+#ifndef TAPIN_LIVE_UPGRADE_H
+#define TAPIN_LIVE_UPGRADE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LIVE_UPGRADE_ENV "TAPIN_UPGRADE_STATE"
+
+typedef enum {
+    UPGRADE_LISTENER = 1,   // Listening socket, handed to the service manager code
+    UPGRADE_TOKEN,          // Pending token: token_entry_t
+    UPGRADE_REPLAY,         // Request the replay cache remembers: upgrade_replay_t
+    UPGRADE_CONNECTION      // Helper client connection, as tapin_helper describes it
+} upgrade_record_type_t;
+
+typedef struct {
+    int64_t timestamp;
+    uint8_t digest[8];
+} upgrade_replay_t;
+
+// Remember how this process was started, so it can start again; call
+// first thing in main
+void live_upgrade_init(char *argv[]);
+
+// Whether the binary at this process's path can be run, logging why not
+int live_upgrade_available(void);
+
+/*
+ * Add a record for the new image; fd, unless -1, stays open across exec
+ * Returns 1 on success, 0 if out of memory
+ */
+int live_upgrade_put(upgrade_record_type_t type, int fd, const void *data, size_t length);
+
+// Add a listening socket, remembering whether a socket unit made it
+int live_upgrade_put_listener(int fd);
+
+/*
+ * Run the new binary with the same arguments and the records added so far
+ * Returns only if that failed; the records are then discarded and their
+ * descriptors closed on exec again
+ */
+void live_upgrade_exec(void);
+
+/*
+ * In the new image: read the state the old one left, if any, and offer its
+ * listening sockets to the service manager code. Call after
+ * service_listen_start()
+ * Returns 1 if there was state, 0 if the process started afresh
+ */
+int live_upgrade_resume(void);
+
+// Call fn for each record of a type, in the order they were added
+void live_upgrade_each(upgrade_record_type_t type, void (*fn)(const void *data, size_t length, int fd, void *arg),
+                       void *arg);
+
+// Close the descriptors of records nothing took, and wipe the state
+void live_upgrade_finish(void);
+
+#endif /* TAPIN_LIVE_UPGRADE_H */
@@ -0,0 +1,492 @@
+/*
+ * TapIn Phone Sessions
+ * Session handling shared by the Bluetooth listener and the combined daemon
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include "phone_session.h"
+#include "admission.h"
+#include "device_allowlist.h"
+#include "helper_channel.h"
+#include "auth_record.h"
+#include "random_pool.h"
+#include "session_frame.h"
+#include "async_log.h"
+
+#define CHALLENGE_BYTES (TAPIN_AUTH_NONCE_LENGTH / 2)   // Sent in hex
+#define CHALLENGE_REFRESH_SECONDS 15                    // Half the helper's timestamp window
+#define IDLE_CHECK_MS 250                               // How often idle sessions look for waiting ones
+
+// Stages of a session, timed from the moment it was accepted
+enum {
+    STAGE_QUEUE,
+    STAGE_PAIRING,
+    STAGE_READ,
+    STAGE_PARSE,
+    STAGE_HELPER,
+    STAGE_SESSION,
+    STAGE_COUNT
+};
+
+static stats_histogram_t stages[STAGE_COUNT] = {
+    [STAGE_QUEUE] = { "queue" },
+    [STAGE_PAIRING] = { "pairing" },
+    [STAGE_READ] = { "read" },
+    [STAGE_PARSE] = { "parse" },
+    [STAGE_HELPER] = { "helper" },
+    [STAGE_SESSION] = { "session" },
+};
+
+// How requests and sessions end
+enum {
+    RESULT_ACCEPTED,
+    RESULT_UNPAIRED,
+    RESULT_READ_FAILED,
+    RESULT_DISCONNECTED,
+    RESULT_MALFORMED,
+    RESULT_REJECTED,
+    RESULT_HELPER_UNAVAILABLE,
+    RESULT_QUEUE_FULL,
+    RESULT_DEVICE_LIMITED,
+    RESULT_USER_LIMITED,
+    RESULT_BAD_CHALLENGE,
+    RESULT_KEPT_ALIVE,
+    RESULT_IDLE_TIMEOUT,
+    RESULT_YIELDED,
+    RESULT_COUNT
+};
+
+static stats_counter_t results[RESULT_COUNT] = {
+    [RESULT_ACCEPTED] = { "accepted" },
+    [RESULT_UNPAIRED] = { "unpaired" },
+    [RESULT_READ_FAILED] = { "read_failed" },
+    [RESULT_DISCONNECTED] = { "disconnected" },
+    [RESULT_MALFORMED] = { "malformed" },
+    [RESULT_REJECTED] = { "rejected" },
+    [RESULT_HELPER_UNAVAILABLE] = { "helper_unavailable" },
+    [RESULT_QUEUE_FULL] = { "queue_full" },
+    [RESULT_DEVICE_LIMITED] = { "device_limited" },
+    [RESULT_USER_LIMITED] = { "user_limited" },
+    [RESULT_BAD_CHALLENGE] = { "bad_challenge" },
+    [RESULT_KEPT_ALIVE] = { "kept_alive" },
+    [RESULT_IDLE_TIMEOUT] = { "idle_timeout" },
+    [RESULT_YIELDED] = { "yielded" },
+};
+
+const stats_registry_t phone_session_stats = {
+    "tapin_listener", stages, STAGE_COUNT, results, RESULT_COUNT
+};
+
+// Replies to the phone
+static const char reply_ack[] = "ACK";
+static const char reply_err[] = "ERR";
+static const char reply_busy[] = "BUSY";     // Over a rate limit or out of workers; try later
+static const char reply_pong[] = "PONG";
+static const char challenge_prefix[] = "CHALLENGE ";
+
+// Commands from the phone
+static const char command_keepalive[] = "KEEPALIVE";
+static const char command_ping[] = "PING";
+
+// Transport phones connect over, and where their requests go
+static const listener_transport_t *active_transport = &rfcomm_transport;
+static phone_session_forward_t forward_request = NULL;
+static int send_challenges = 0;
+
+// Limits set by phone_session_configure(); each session reads them as it
+// starts and keeps them to the end
+static int session_timeout_ms = 0;
+static int keepalive_ms = 0;
+static int max_message_length = SESSION_FRAME_MAX;
+
+/*
+ * Function to send a decoded request to the helper
+ * Through the helper channel, or straight to the auth core in the
+ * combined daemon
+ */
+static int send_to_helper_daemon(const tapin_auth_record_t* record) {
+    long long started_us = session_clock_us();
+    int status = forward_request(record);
+    
+    stats_record(&stages[STAGE_HELPER], session_clock_us() - started_us);
+    
+    if (status == TAPIN_CHANNEL_OK) {
+        async_log(LOG_INFO, "Helper daemon processed authentication request successfully");
+        stats_count(&results[RESULT_ACCEPTED]);
+        return 1; // Success
+    }
+    
+    if (status != HELPER_CHANNEL_UNAVAILABLE) {
+        async_log(LOG_ERR, "Helper daemon rejected authentication request (status %d)", status);
+        stats_count(&results[RESULT_REJECTED]);
+    } else {
+        stats_count(&results[RESULT_HELPER_UNAVAILABLE]);
+    }
+    return 0; // Failure
+}
+
+/*
+ * Function to send a paired phone a fresh challenge to sign
+ * The line is "CHALLENGE <hex>\n"; the hex goes in challenge and the time
+ * it was sent in *issued
+ * Returns 1 on success, 0 on failure
+ */
+static int send_challenge(int client_sock, char* challenge, int64_t* issued) {
+    static const char hex[] = "0123456789abcdef";
+    char line[sizeof(challenge_prefix) + TAPIN_AUTH_NONCE_LENGTH + 1];
+    uint8_t bytes[CHALLENGE_BYTES];
+    size_t length = sizeof(challenge_prefix) - 1;
+    int i;
+    
+    if (!random_bytes(bytes, sizeof(bytes))) {
+        async_log(LOG_ERR, "Could not generate a challenge");
+        return 0;
+    }
+    for (i = 0; i < CHALLENGE_BYTES; i++) {
+        challenge[i * 2] = hex[bytes[i] >> 4];
+        challenge[i * 2 + 1] = hex[bytes[i] & 0x0f];
+    }
+    challenge[TAPIN_AUTH_NONCE_LENGTH] = '\0';
+    explicit_bzero(bytes, sizeof(bytes));
+    
+    memcpy(line, challenge_prefix, length);
+    memcpy(line + length, challenge, TAPIN_AUTH_NONCE_LENGTH);
+    length += TAPIN_AUTH_NONCE_LENGTH;
+    line[length++] = '\n';
+    
+    *issued = time(NULL);
+    return send(client_sock, line, length, MSG_NOSIGNAL) == (ssize_t)length;
+}
+
+/*
+ * Function to process received authentication data
+ * Decodes the phone's JSON or binary message once and forwards the record
+ * to the helper, tagged with the phone's address so the helper can pick
+ * its key. A challenge response must answer the challenge this session
+ * sent (NULL if none), and is stamped with the time it was sent
+ * Returns the reply for the phone
+ */
+static const char *process_auth_data(const char* data, size_t length, const char* client_address,
+                                     const char* challenge, int64_t issued) {
+    tapin_auth_record_t record;
+    long long started_us = session_clock_us();
+    int parsed;
+    
+    // Validate the authentication request format; the first byte says
+    // whether it is JSON or binary
+    parsed = auth_record_from_message(data, length, &record);
+    stats_record(&stages[STAGE_PARSE], session_clock_us() - started_us);
+    if (!parsed) {
+        async_log(LOG_ERR, "Authentication request format validation failed");
+        stats_count(&results[RESULT_MALFORMED]);
+        return reply_err;
+    }
+    
+    // The helper checks the challenge's age against our clock, never the
+    // phone's, so a phone with a wrong clock still gets in. JSON responses
+    // echo the challenge; binary ones leave it implied
+    if (record.flags & TAPIN_AUTH_CHALLENGE) {
+        if (!challenge || (record.nonce_length != 0 && strcmp(record.nonce, challenge) != 0)) {
+            async_log(LOG_ERR, "Challenge response from %s does not answer its challenge", client_address);
+            stats_count(&results[RESULT_BAD_CHALLENGE]);
+            memset(&record, 0, sizeof(record));
+            return reply_err;
+        }
+        memcpy(record.nonce, challenge, TAPIN_AUTH_NONCE_LENGTH + 1);
+        record.nonce_length = TAPIN_AUTH_NONCE_LENGTH;
+        record.timestamp = issued;
+    }
+    
+    // Spend the user's token before the helper spends an HMAC
+    if (!admission_allow_user(client_address, record.username)) {
+        async_log(LOG_NOTICE, "Rate limit reached for user: %s", record.username);
+        stats_count(&results[RESULT_USER_LIMITED]);
+        memset(&record, 0, sizeof(record));
+        return reply_busy;
+    }
+    
+    // Peers on the Unix transport have no Bluetooth address
+    if (auth_device_from_text(client_address, record.device)) {
+        record.flags |= TAPIN_AUTH_HAS_DEVICE;
+    }
+    
+    // Forward to helper daemon
+    int result = send_to_helper_daemon(&record);
+    memset(&record, 0, sizeof(record));
+    return result ? reply_ack : reply_err;
+}
+
+/*
+ * Function to send a reply; in a kept-alive session replies are lines
+ */
+static void send_reply(int client_sock, const char* reply, int keepalive) {
+    char line[16];
+    size_t length = strlen(reply);
+    
+    memcpy(line, reply, length);
+    if (keepalive) {
+        line[length++] = '\n';
+    }
+    send(client_sock, line, length, MSG_NOSIGNAL);
+}
+
+/*
+ * Function to wait for a kept-alive phone's next message
+ * Every IDLE_CHECK_MS of quiet, checks whether another session needs the
+ * worker
+ * Returns 1 once something arrives, 0 if the phone stayed idle for
+ * idle_ms, -1 if the worker is wanted elsewhere
+ */
+static int wait_for_message(int client_sock, const session_reader_t* reader, int idle_ms) {
+    long long idle_deadline_ms = session_clock_ms() + idle_ms;
+    
+    // A phone may send its next message along with the last one
+    if (session_reader_pending(reader)) {
+        return 1;
+    }
+    
+    for (;;) {
+        long long remaining = idle_deadline_ms - session_clock_ms();
+        if (remaining <= 0) {
+            return 0;
+        }
+    
+        struct pollfd pfd = { client_sock, POLLIN, 0 };
+        int ready = poll(&pfd, 1, remaining < IDLE_CHECK_MS ? (int)remaining : IDLE_CHECK_MS);
+        if (ready > 0 || (ready < 0 && errno != EINTR)) {
+            return 1;  // Reading says what it was
+        }
+    
+        // Only a phone that has gone quiet gives its worker up, so one
+        // with its next request on the way does not lose it
+        if (session_pool_contended()) {
+            return -1;
+        }
+    }
+}
+
+/*
+ * Function to run a command from the phone
+ * "KEEPALIVE" keeps the session open for more requests, if allowed, and
+ * "PING" is a heartbeat for a kept-alive session; a heartbeat also
+ * replaces a challenge that is getting old. *keepalive is how long a
+ * kept-alive session may stay idle, or 0
+ * Returns 1 if the session goes on, 0 if it should end
+ */
+static int run_command(int client_sock, const char* command, const char* client_address, int* keepalive,
+                       int idle_ms, char* challenge, int64_t* issued) {
+    if (strcmp(command, command_keepalive) == 0 && idle_ms > 0) {
+        char line[32];
+        int length = snprintf(line, sizeof(line), "%s %d\n", command_keepalive, idle_ms);
+    
+        async_log(LOG_INFO, "Keeping session with %s alive", client_address);
+        if (!*keepalive) {
+            stats_count(&results[RESULT_KEPT_ALIVE]);
+        }
+        *keepalive = idle_ms;
+        return send(client_sock, line, length, MSG_NOSIGNAL) == length;
+    }
+    
+    if (strcmp(command, command_ping) == 0 && *keepalive) {
+        if (send_challenges && time(NULL) - *issued >= CHALLENGE_REFRESH_SECONDS &&
+            !send_challenge(client_sock, challenge, issued)) {
+            return 0;
+        }
+        send_reply(client_sock, reply_pong, 1);
+        return 1;
+    }
+    
+    async_log(LOG_ERR, "Unknown command from %s", client_address);
+    stats_count(&results[RESULT_MALFORMED]);
+    send_reply(client_sock, reply_err, *keepalive);
+    return *keepalive != 0;
+}
+
+/*
+ * Function to run one phone session on a worker thread
+ * Answers one request, or with KEEPALIVE as many as the phone sends
+ * until it hangs up or goes idle. The session pool closes the client
+ * socket afterwards
+ */
+static void handle_session(int client_sock, const char* client_address, long long deadline_ms,
+                    long long accepted_us) {
+    session_reader_t reader;
+    char challenge[TAPIN_AUTH_NONCE_LENGTH + 1];
+    int64_t issued = 0;
+    const char* message;
+    size_t length;
+    session_frame_result_t framed;
+    int keepalive = 0, requests = 0, waited;
+    int timeout_ms = __atomic_load_n(&session_timeout_ms, __ATOMIC_RELAXED);
+    int idle_ms = __atomic_load_n(&keepalive_ms, __ATOMIC_RELAXED);
+    size_t longest = (size_t)__atomic_load_n(&max_message_length, __ATOMIC_RELAXED);
+    long long stage_us = session_clock_us();
+    long long now_us;
+    
+    stats_record(&stages[STAGE_QUEUE], stage_us - accepted_us);
+    async_log(LOG_INFO, "Connection accepted from: %s", client_address);
+    
+    // Verify that the connecting device is paired/trusted
+    if (active_transport->check_pairing) {
+        int paired = device_allowlist_check(client_address, deadline_ms);
+        now_us = session_clock_us();
+        stats_record(&stages[STAGE_PAIRING], now_us - stage_us);
+        stage_us = now_us;
+    
+        if (!paired) {
+            async_log(LOG_WARNING, "Unpaired device attempted connection: %s", client_address);
+            stats_count(&results[RESULT_UNPAIRED]);
+            stats_record(&stages[STAGE_SESSION], now_us - accepted_us);
+            return;  // Skip processing for unpaired devices
+        }
+    
+        async_log(LOG_INFO, "Paired device verified: %s", client_address);
+    }
+    
+    // Challenge the phone straight away, so it can sign while the user is
+    // still at the fingerprint prompt
+    if (send_challenges && !send_challenge(client_sock, challenge, &issued)) {
+        async_log(LOG_ERR, "Could not send a challenge to %s: %s", client_address, strerror(errno));
+        stats_count(&results[RESULT_DISCONNECTED]);
+        stats_record(&stages[STAGE_SESSION], session_clock_us() - accepted_us);
+        return;
+    }
+    
+    session_reader_init(&reader);
+    for (;;) {
+        // Read until a whole message is in, however it was split up
+        framed = session_read_frame(&reader, client_sock, deadline_ms, &message, &length);
+        stats_record(&stages[STAGE_READ], session_clock_us() - stage_us);
+    
+        if (framed == SESSION_FRAME_MALFORMED || (framed == SESSION_FRAME_OK && length > longest)) {
+            async_log(LOG_ERR, "Unreadable message from %s", client_address);
+            stats_count(&results[RESULT_MALFORMED]);
+            send_reply(client_sock, reply_err, keepalive);
+            break;
+        }
+        if (framed == SESSION_FRAME_CLOSED) {
+            // Hanging up between requests is how a kept-alive phone leaves
+            if (requests == 0 || session_reader_pending(&reader)) {
+                async_log(LOG_INFO, "Client disconnected: %s", client_address);
+                stats_count(&results[RESULT_DISCONNECTED]);
+            } else {
+                async_log(LOG_INFO, "Client %s closed its session after %d requests", client_address, requests);
+            }
+            break;
+        }
+        if (framed != SESSION_FRAME_OK) {
+            async_log(LOG_ERR, "Error reading from client %s: %s", client_address, strerror(errno));
+            stats_count(&results[RESULT_READ_FAILED]);
+            break;
+        }
+        async_log(LOG_INFO, "Received %zu bytes from %s", length, client_address);
+    
+        if (message[0] >= 'A' && message[0] <= 'Z') {
+            if (!run_command(client_sock, message, client_address, &keepalive, idle_ms, challenge, &issued)) {
+                break;
+            }
+        } else {
+            const char* reply;
+    
+            // The connection paid for its first request; later ones pay
+            // as they come
+            if (requests++ > 0 && !admission_allow_device(client_address)) {
+                async_log(LOG_NOTICE, "Rate limit reached for device: %s", client_address);
+                stats_count(&results[RESULT_DEVICE_LIMITED]);
+                reply = reply_busy;
+            } else {
+                // Process the received authentication data
+                reply = process_auth_data(message, length, client_address, send_challenges ? challenge : NULL,
+                                          issued);
+                if (reply == reply_ack) {
+                    async_log(LOG_INFO, "Authentication data processed successfully");
+                } else if (reply == reply_err) {
+                    async_log(LOG_ERR, "Failed to process authentication data");
+                }
+            }
+    
+            // A challenge is good for one request; a kept-alive phone gets
+            // its next one ahead of the reply
+            if (keepalive && send_challenges && !send_challenge(client_sock, challenge, &issued)) {
+                async_log(LOG_ERR, "Could not send a challenge to %s: %s", client_address, strerror(errno));
+                stats_count(&results[RESULT_DISCONNECTED]);
+                break;
+            }
+    
+            // Send acknowledgment, error or BUSY back to client
+            send_reply(client_sock, reply, keepalive);
+            if (!keepalive) {
+                break;
+            }
+        }
+    
+        waited = wait_for_message(client_sock, &reader, keepalive);
+        if (waited <= 0) {
+            async_log(LOG_INFO, "Closing %s session with %s", waited == 0 ? "idle" : "kept-alive",
+                      client_address);
+            stats_count(&results[waited == 0 ? RESULT_IDLE_TIMEOUT : RESULT_YIELDED]);
+            break;
+        }
+    
+        // Each further message gets a full session timeout once it starts
+        stage_us = session_clock_us();
+        deadline_ms = stage_us / 1000 + timeout_ms;
+    }
+    
+    stats_record(&stages[STAGE_SESSION], session_clock_us() - accepted_us);
+}
+
+int phone_session_start(const listener_transport_t *transport, const session_pool_config_t *config,
+                        phone_session_forward_t forward, int challenge) {
+    active_transport = transport;
+    forward_request = forward;
+    send_challenges = challenge;
+    session_timeout_ms = config->session_timeout_ms;
+    keepalive_ms = config->keepalive_ms;
+    return session_pool_start(config, handle_session);
+}
+
+void phone_session_configure(int timeout_ms, int idle_ms, int longest) {
+    __atomic_store_n(&session_timeout_ms, timeout_ms, __ATOMIC_RELAXED);
+    __atomic_store_n(&keepalive_ms, idle_ms, __ATOMIC_RELAXED);
+    __atomic_store_n(&max_message_length, longest, __ATOMIC_RELAXED);
+    session_pool_set_timeout(timeout_ms);
+}
+
+void phone_session_stop(void) {
+    session_pool_stop();
+}
+
+void phone_session_finish(void) {
+    session_pool_finish();
+}
+
+void phone_session_submit(int client_sock, const char *client_address) {
+    // A phone over its rate costs nothing but this lookup
+    if (!admission_allow_device(client_address)) {
+        async_log(LOG_NOTICE, "Rate limit reached for device: %s", client_address);
+        send(client_sock, reply_busy, strlen(reply_busy), MSG_NOSIGNAL);
+        close(client_sock);
+        stats_count(&results[RESULT_DEVICE_LIMITED]);
+        return;
+    }
+    
+    // Hand the session to a worker; if they are all busy and the
+    // queue is full, turn the phone away rather than stall accept()
+    if (!session_pool_submit(client_sock, client_address)) {
+        session_pool_stats_t stats;
+        session_pool_get_stats(&stats);
+        async_log(LOG_WARNING, "Session queue full (%d in flight, %d queued), rejecting %s",
+                  stats.in_flight, stats.queued, client_address);
+        send(client_sock, reply_busy, strlen(reply_busy), MSG_NOSIGNAL);
+        close(client_sock);
+        stats_count(&results[RESULT_QUEUE_FULL]);
+    }
+}
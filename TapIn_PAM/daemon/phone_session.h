@@ -0,0 +1,63 @@
+/*
+ * TapIn Phone Sessions
+ * One phone connection, from the pairing check to ACK or ERR
+ *
+ * Sessions run on the session pool's workers: check that the peer is a
+ * paired device, read the phone's request (JSON or binary), decode it into
+ * a record and hand the record to a forwarder. The Bluetooth listener
+ * forwards over the helper channel; the combined daemon validates the
+ * request and issues the token in-process.
+ *
+ * A phone that sends "KEEPALIVE\n" first is answered "KEEPALIVE <ms>\n"
+ * and may then send request after request on the same connection, each
+ * answered with a line, instead of reconnecting for every unlock. It
+ * sends "PING\n" (answered "PONG\n") if it has been quiet for nearly that
+ * many milliseconds; a session idle for longer is closed, and so is an
+ * idle one whose worker another phone is waiting for.
+ */
+
+#ifndef TAPIN_PHONE_SESSION_H
+#define TAPIN_PHONE_SESSION_H
+
+#include "tapin_channel.h"
+#include "transport.h"
+#include "session_pool.h"
+#include "stats.h"
+
+// Hands a decoded record on; returns a TAPIN_CHANNEL_* status, or
+// HELPER_CHANNEL_UNAVAILABLE if nobody answered
+typedef int (*phone_session_forward_t)(const tapin_auth_record_t *record);
+
+// Stage timings and outcomes, exported as "tapin_listener"
+extern const stats_registry_t phone_session_stats;
+
+/*
+ * Start the session workers for phones on the given transport
+ * With challenge set, each paired phone is sent a fresh challenge as soon
+ * as it connects ("CHALLENGE <hex>\n") and may answer it instead of
+ * sending a timestamped request. A kept-alive phone gets its next
+ * challenge just before each reply, and a new one before PONG once the
+ * last is getting old
+ * Returns 1 on success, 0 on failure
+ */
+int phone_session_start(const listener_transport_t *transport, const session_pool_config_t *config,
+                        phone_session_forward_t forward, int challenge);
+
+/*
+ * Change the session timeout, the keep-alive idle time and the longest
+ * message a phone may send (up to SESSION_FRAME_MAX) while sessions run;
+ * sessions that have already started keep the limits they started with
+ */
+void phone_session_configure(int timeout_ms, int idle_ms, int longest);
+
+// Let running sessions finish and stop the workers
+void phone_session_stop(void);
+
+// Run the sessions still queued as well, then stop the workers
+void phone_session_finish(void);
+
+// Queue an accepted phone connection, or answer BUSY if the phone is over
+// its rate (see admission.h) or the queue is full
+void phone_session_submit(int client_sock, const char *client_address);
+
+#endif /* TAPIN_PHONE_SESSION_H */
@@ -0,0 +1,131 @@
+/*
+ * TapIn Random Pool
+ * Per-thread buffer refilled from getrandom()
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/syscall.h>
+#include "random_pool.h"
+#include "async_log.h"
+
+static const char token_charset[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+#define TOKEN_CHARSET_SIZE (sizeof(token_charset) - 1)
+
+// Largest multiple of the charset size that fits in a byte; bytes at or
+// above it are rejected so every character is equally likely
+#define TOKEN_ACCEPT_LIMIT (256 - 256 % TOKEN_CHARSET_SIZE)
+
+static __thread unsigned char pool[RANDOM_POOL_SIZE];
+static __thread size_t pool_available = 0;
+
+/*
+ * Function to read length bytes straight from the kernel
+ * Uses the getrandom system call, or /dev/urandom on kernels without it
+ */
+static int kernel_random(unsigned char *out, size_t length) {
+    size_t filled = 0;
+    int fd;
+    
+    while (filled < length) {
+        long n = syscall(SYS_getrandom, out + filled, length - filled, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ENOSYS) {
+                break;
+            }
+            async_log(LOG_ERR, "getrandom failed: %s", strerror(errno));
+            return 0;
+        }
+        filled += n;
+    }
+    
+    if (filled == length) {
+        return 1;
+    }
+    
+    fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        async_log(LOG_ERR, "No source of randomness: %s", strerror(errno));
+        return 0;
+    }
+    while (filled < length) {
+        ssize_t n = read(fd, out + filled, length - filled);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            async_log(LOG_ERR, "Could not read /dev/urandom: %s", n < 0 ? strerror(errno) : "end of file");
+            close(fd);
+            return 0;
+        }
+        filled += n;
+    }
+    close(fd);
+    return 1;
+}
+
+int random_bytes(void *out, size_t length) {
+    unsigned char *dest = out;
+    
+    // Requests bigger than the pool would only churn it
+    if (length > RANDOM_POOL_SIZE) {
+        return kernel_random(dest, length);
+    }
+    
+    while (length > 0) {
+        if (pool_available == 0) {
+            if (!kernel_random(pool, sizeof(pool))) {
+                return 0;
+            }
+            pool_available = sizeof(pool);
+        }
+    
+        // Hand out from the end of the pool and wipe what was taken
+        size_t take = length < pool_available ? length : pool_available;
+        pool_available -= take;
+        memcpy(dest, pool + pool_available, take);
+        explicit_bzero(pool + pool_available, take);
+        dest += take;
+        length -= take;
+    }
+    
+    return 1;
+}
+
+int random_token(char *token, size_t size) {
+    unsigned char bytes[64];
+    size_t filled = 0;
+    
+    if (size == 0) {
+        return 0;
+    }
+    
+    while (filled < size - 1) {
+        size_t want = size - 1 - filled;
+        size_t i;
+    
+        if (want > sizeof(bytes)) {
+            want = sizeof(bytes);
+        }
+        if (!random_bytes(bytes, want)) {
+            explicit_bzero(token, size);
+            return 0;
+        }
+    
+        for (i = 0; i < want; i++) {
+            if (bytes[i] < TOKEN_ACCEPT_LIMIT) {
+                token[filled++] = token_charset[bytes[i] % TOKEN_CHARSET_SIZE];
+            }
+        }
+    }
+    
+    explicit_bzero(bytes, sizeof(bytes));
+    token[size - 1] = '\0';
+    return 1;
+}
@@ -0,0 +1,33 @@
+/*
+ * TapIn Random Pool
+ * Buffered getrandom() output for tokens and nonces
+ *
+ * Each thread keeps its own buffer of kernel randomness and refills it in
+ * bulk, so most tokens cost no system call at all. Bytes are wiped from
+ * the buffer as they are handed out. There is no fallback: if the kernel
+ * cannot supply randomness the call fails rather than return anything
+ * predictable.
+ */
+
+#ifndef TAPIN_RANDOM_POOL_H
+#define TAPIN_RANDOM_POOL_H
+
+#include <stddef.h>
+
+// Bytes fetched from the kernel per refill
+#define RANDOM_POOL_SIZE 4096
+
+/*
+ * Fill out with length random bytes
+ * Returns 1 on success, 0 if no randomness is available
+ */
+int random_bytes(void *out, size_t length);
+
+/*
+ * Fill token with size - 1 characters drawn uniformly from [A-Za-z0-9]
+ * and a terminating NUL
+ * Returns 1 on success, 0 if no randomness is available
+ */
+int random_token(char *token, size_t size);
+
+#endif /* TAPIN_RANDOM_POOL_H */
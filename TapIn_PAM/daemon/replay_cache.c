@@ -0,0 +1,207 @@
+/*
+ * TapIn Replay Cache
+ * Per-second open-addressing tables with whole-bucket expiry
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "replay_cache.h"
+
+// A slot is live only while it carries its bucket's current second, so
+// moving a bucket to a new second discards every entry without a sweep
+typedef struct {
+    uint64_t key;
+    int64_t second;
+} replay_slot_t;
+
+typedef struct {
+    int64_t second;
+    unsigned count;
+    replay_slot_t *slots;
+} replay_bucket_t;
+
+typedef struct {
+    replay_bucket_t *buckets;
+    replay_slot_t *arena;
+    size_t bucket_count;
+    size_t slots_per_bucket;
+    unsigned bucket_limit;
+} replay_table_t;
+
+static replay_table_t cache;
+
+/*
+ * Function to allocate an empty table for the window and rate
+ * Returns 1 on success, 0 on failure
+ */
+static int table_alloc(replay_table_t *table, int window_seconds, unsigned max_rate) {
+    size_t i;
+    
+    if (window_seconds < 0 || max_rate == 0) {
+        return 0;
+    }
+    
+    // Two timestamps that share a bucket are at least one window apart,
+    // so they can never both be acceptable at the same time
+    table->bucket_count = (size_t)window_seconds * 2 + 1;
+    
+    // Keep the load under 80% so probe sequences stay short
+    table->slots_per_bucket = 1;
+    while (table->slots_per_bucket < (size_t)max_rate + max_rate / 4) {
+        table->slots_per_bucket <<= 1;
+    }
+    table->bucket_limit = max_rate;
+    
+    // Timestamps are positive, so a zeroed slot never looks live
+    table->buckets = calloc(table->bucket_count, sizeof(*table->buckets));
+    table->arena = calloc(table->bucket_count * table->slots_per_bucket, sizeof(*table->arena));
+    if (!table->buckets || !table->arena) {
+        free(table->buckets);
+        free(table->arena);
+        memset(table, 0, sizeof(*table));
+        return 0;
+    }
+    
+    for (i = 0; i < table->bucket_count; i++) {
+        table->buckets[i].second = -1;
+        table->buckets[i].slots = table->arena + i * table->slots_per_bucket;
+    }
+    
+    return 1;
+}
+
+static void table_free(replay_table_t *table) {
+    free(table->buckets);
+    free(table->arena);
+    memset(table, 0, sizeof(*table));
+}
+
+/*
+ * Function to check a key against a table, remembering it if it is new
+ */
+static replay_result_t table_check(replay_table_t *table, int64_t timestamp, uint64_t key) {
+    replay_bucket_t *bucket = &table->buckets[(uint64_t)timestamp % table->bucket_count];
+    size_t mask = table->slots_per_bucket - 1;
+    size_t i;
+    
+    if (bucket->second != timestamp) {
+        bucket->second = timestamp;
+        bucket->count = 0;
+    }
+    
+    // Entries are never removed within a second, so a probe can stop at
+    // the first slot that is not live
+    for (i = key & mask; bucket->slots[i].second == timestamp; i = (i + 1) & mask) {
+        if (bucket->slots[i].key == key) {
+            return REPLAY_SEEN;
+        }
+    }
+    
+    if (bucket->count >= table->bucket_limit) {
+        return REPLAY_FULL;
+    }
+    
+    bucket->slots[i].key = key;
+    bucket->slots[i].second = timestamp;
+    bucket->count++;
+    return REPLAY_FRESH;
+}
+
+/*
+ * Function to call fn for every live entry of a table whose second is
+ * within window_seconds of now
+ */
+static void table_each(const replay_table_t *table, int64_t now, int64_t window_seconds,
+                       void (*fn)(int64_t timestamp, uint64_t key, void *arg), void *arg) {
+    size_t b, i;
+    
+    for (b = 0; b < table->bucket_count; b++) {
+        const replay_bucket_t *bucket = &table->buckets[b];
+        if (bucket->second < now - window_seconds || bucket->second > now + window_seconds) {
+            continue;
+        }
+        for (i = 0; i < table->slots_per_bucket; i++) {
+            if (bucket->slots[i].second == bucket->second) {
+                fn(bucket->second, bucket->slots[i].key, arg);
+            }
+        }
+    }
+}
+
+int replay_cache_init(int window_seconds, unsigned max_rate) {
+    replay_table_t table;
+    
+    if (!table_alloc(&table, window_seconds, max_rate)) {
+        return 0;
+    }
+    table_free(&cache);
+    cache = table;
+    return 1;
+}
+
+static void migrate_entry(int64_t timestamp, uint64_t key, void *arg) {
+    table_check(arg, timestamp, key);
+}
+
+int replay_cache_resize(int window_seconds, unsigned max_rate, int64_t now) {
+    replay_table_t table;
+    unsigned busiest = max_rate;
+    size_t b;
+    
+    // A second may already hold more than the new rate allows, and every
+    // one of its entries has to fit: dropping one would let it be replayed
+    for (b = 0; b < cache.bucket_count; b++) {
+        if (cache.buckets[b].second >= now - window_seconds && cache.buckets[b].second <= now + window_seconds &&
+            cache.buckets[b].count > busiest) {
+            busiest = cache.buckets[b].count;
+        }
+    }
+    if (!table_alloc(&table, window_seconds, busiest)) {
+        return 0;
+    }
+    
+    // Only entries still inside the new window may move: an older one
+    // would share a bucket with a second that is acceptable now
+    table_each(&cache, now, window_seconds, migrate_entry, &table);
+    table.bucket_limit = max_rate;
+    table_free(&cache);
+    cache = table;
+    return 1;
+}
+
+replay_result_t replay_cache_check(int64_t timestamp, const uint8_t *digest) {
+    uint64_t key;
+    
+    // The MAC is already uniformly distributed; its prefix is the hash
+    memcpy(&key, digest, sizeof(key));
+    return table_check(&cache, timestamp, key);
+}
+
+typedef struct {
+    void (*fn)(int64_t timestamp, const uint8_t *digest, void *arg);
+    void *arg;
+} each_call_t;
+
+static void call_with_digest(int64_t timestamp, uint64_t key, void *arg) {
+    const each_call_t *call = arg;
+    uint8_t digest[sizeof(key)];
+    
+    memcpy(digest, &key, sizeof(key));
+    call->fn(timestamp, digest, call->arg);
+}
+
+void replay_cache_each(int64_t now, void (*fn)(int64_t timestamp, const uint8_t *digest, void *arg), void *arg) {
+    each_call_t call = { fn, arg };
+    
+    if (cache.bucket_count > 0) {
+        table_each(&cache, now, (int64_t)(cache.bucket_count - 1) / 2, call_with_digest, &call);
+    }
+}
+
+size_t replay_cache_memory(void) {
+    return cache.bucket_count * (sizeof(replay_bucket_t) + cache.slots_per_bucket * sizeof(replay_slot_t));
+}
+
+void replay_cache_free(void) {
+    table_free(&cache);
+}
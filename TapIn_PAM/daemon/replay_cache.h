@@ -0,0 +1,59 @@
+/*
+ * TapIn Replay Cache
+ * Remembers every accepted request until its timestamp leaves the window
+ *
+ * A request is identified by its MAC: it covers username, timestamp and
+ * nonce, so a replayed packet carries the same MAC while any fresh request
+ * gets an unrelated one. The cache has one bucket per second of the
+ * timestamp window, each an open-addressing table of MAC prefixes. A
+ * request only ever touches the bucket for its own timestamp, and a bucket
+ * is emptied in one step when its second is reused. All memory is
+ * allocated up front; a second that sees more requests than the configured
+ * rate is refused rather than grown. Changing the window or the rate
+ * builds a new cache and moves across what the old one remembers.
+ */
+
+#ifndef TAPIN_REPLAY_CACHE_H
+#define TAPIN_REPLAY_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define REPLAY_CACHE_DEFAULT_RATE 1024
+
+typedef enum {
+    REPLAY_FRESH = 0,    // Not seen before; now remembered
+    REPLAY_SEEN,         // Already accepted once
+    REPLAY_FULL          // Too many requests for this second
+} replay_result_t;
+
+/*
+ * Size the cache for timestamps up to window_seconds either side of now
+ * and up to max_rate accepted requests per second
+ * Returns 1 on success, 0 on failure
+ */
+int replay_cache_init(int window_seconds, unsigned max_rate);
+
+/*
+ * Check a request whose timestamp is already known to be in the window,
+ * remembering it if it is fresh. digest is the request's MAC (at least
+ * 8 bytes)
+ */
+replay_result_t replay_cache_check(int64_t timestamp, const uint8_t *digest);
+
+/*
+ * Rebuild the cache for a new window and rate, keeping the entries whose
+ * timestamps are within the new window of now
+ * Returns 1 on success, 0 if the old cache is kept
+ */
+int replay_cache_resize(int window_seconds, unsigned max_rate, int64_t now);
+
+// Call fn for every request remembered with a timestamp within the window of now
+void replay_cache_each(int64_t now, void (*fn)(int64_t timestamp, const uint8_t *digest, void *arg), void *arg);
+
+// Bytes reserved for the cache
+size_t replay_cache_memory(void);
+
+void replay_cache_free(void);
+
+#endif /* TAPIN_REPLAY_CACHE_H */
@@ -0,0 +1,270 @@
+/*
+ * TapIn Service Manager
+ * The sd_listen_fds() and sd_notify() protocols, and signalfd shutdown
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/rfcomm.h>
+#include "service_manager.h"
+#include "async_log.h"
+
+typedef struct {
+    int fd;
+    int taken;
+    int from_unit;      // Made by a socket unit, rather than by an earlier image of this daemon
+} inherited_socket_t;
+
+static inherited_socket_t inherited[SERVICE_MAX_LISTEN_FDS];
+static int inherited_count = 0;
+
+/*
+ * Function to read a decimal environment variable
+ * Returns -1 if it is unset or not a number
+ */
+static long env_number(const char *name) {
+    const char *value = getenv(name);
+    char *end;
+    long number;
+    
+    if (!value || *value == '\0') {
+        return -1;
+    }
+    errno = 0;
+    number = strtol(value, &end, 10);
+    return errno == 0 && *end == '\0' ? number : -1;
+}
+
+int service_listen_start(void) {
+    long pid = env_number("LISTEN_PID");
+    long count = env_number("LISTEN_FDS");
+    int i;
+    
+    // The variables describe this process only, not anything it starts
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    
+    inherited_count = 0;
+    if (pid != (long)getpid() || count <= 0) {
+        return 0;
+    }
+    if (count > SERVICE_MAX_LISTEN_FDS) {
+        async_log(LOG_WARNING, "Passed %ld sockets, using the first %d", count, SERVICE_MAX_LISTEN_FDS);
+        count = SERVICE_MAX_LISTEN_FDS;
+    }
+    
+    for (i = 0; i < count; i++) {
+        int fd = SERVICE_LISTEN_FDS_START + i;
+        int flags = fcntl(fd, F_GETFD);
+        if (flags < 0) {
+            continue;
+        }
+        fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+        inherited[inherited_count].fd = fd;
+        inherited[inherited_count].taken = 0;
+        inherited[inherited_count].from_unit = 1;
+        inherited_count++;
+    }
+    
+    return inherited_count;
+}
+
+int service_adopt_socket(int fd, int from_unit) {
+    if (inherited_count == SERVICE_MAX_LISTEN_FDS) {
+        return 0;
+    }
+    fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+    inherited[inherited_count].fd = fd;
+    inherited[inherited_count].taken = 0;
+    inherited[inherited_count].from_unit = from_unit;
+    inherited_count++;
+    return 1;
+}
+
+/*
+ * Function to check that an inherited socket is a listening stream socket
+ */
+static int listening_stream(int fd) {
+    socklen_t option_length;
+    int type, listening;
+    
+    option_length = sizeof(type);
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &option_length) < 0 || type != SOCK_STREAM) {
+        return 0;
+    }
+    option_length = sizeof(listening);
+    return getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &option_length) == 0 && listening;
+}
+
+/*
+ * Function to check that an inherited socket is a listening stream socket
+ * bound to path
+ */
+static int listens_on_path(int fd, const char *path) {
+    struct sockaddr_un addr;
+    socklen_t length = sizeof(addr);
+    
+    memset(&addr, 0, sizeof(addr));
+    if (getsockname(fd, (struct sockaddr *)&addr, &length) < 0 || addr.sun_family != AF_UNIX ||
+        length <= offsetof(struct sockaddr_un, sun_path)) {
+        return 0;
+    }
+    
+    return listening_stream(fd) && strncmp(addr.sun_path, path, sizeof(addr.sun_path)) == 0;
+}
+
+/*
+ * Function to check that an inherited socket is a listening RFCOMM socket
+ * on channel
+ */
+static int listens_on_channel(int fd, int channel) {
+    struct sockaddr_rc addr;
+    socklen_t length = sizeof(addr);
+    
+    memset(&addr, 0, sizeof(addr));
+    if (getsockname(fd, (struct sockaddr *)&addr, &length) < 0 || addr.rc_family != AF_BLUETOOTH) {
+        return 0;
+    }
+    
+    return listening_stream(fd) && addr.rc_channel == channel;
+}
+
+/*
+ * Function to mark an inherited socket as taken and say where it came from
+ */
+static int take_socket(int i, const char *name) {
+    inherited[i].taken = 1;
+    async_log(LOG_INFO, "Using socket %s passed in by the %s", name,
+              inherited[i].from_unit ? "service manager" : "previous image");
+    return inherited[i].fd;
+}
+
+int service_take_unix_socket(const char *path) {
+    int i;
+    
+    for (i = 0; i < inherited_count; i++) {
+        if (!inherited[i].taken && listens_on_path(inherited[i].fd, path)) {
+            return take_socket(i, path);
+        }
+    }
+    return -1;
+}
+
+int service_take_rfcomm_socket(int channel) {
+    char name[32];
+    int i;
+    
+    for (i = 0; i < inherited_count; i++) {
+        if (!inherited[i].taken && listens_on_channel(inherited[i].fd, channel)) {
+            snprintf(name, sizeof(name), "for RFCOMM channel %d", channel);
+            return take_socket(i, name);
+        }
+    }
+    return -1;
+}
+
+int service_socket_inherited(int fd) {
+    int i;
+    
+    for (i = 0; i < inherited_count; i++) {
+        if (inherited[i].fd == fd) {
+            return inherited[i].from_unit;
+        }
+    }
+    return 0;
+}
+
+void service_listen_finish(void) {
+    int i;
+    
+    for (i = 0; i < inherited_count; i++) {
+        if (!inherited[i].taken) {
+            async_log(LOG_WARNING, "Closing passed-in socket %d that this configuration does not use",
+                      inherited[i].fd);
+            close(inherited[i].fd);
+            inherited[i].fd = -1;
+            inherited[i].taken = 1;
+        }
+    }
+}
+
+int service_signal_fd(void) {
+    sigset_t mask;
+    int fd;
+    
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR2);
+    
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+        async_log(LOG_ERR, "Failed to block service signals: %s", strerror(errno));
+        return -1;
+    }
+    
+    fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0) {
+        async_log(LOG_ERR, "Failed to create signalfd: %s", strerror(errno));
+        sigprocmask(SIG_UNBLOCK, &mask, NULL);
+        return -1;
+    }
+    return fd;
+}
+
+int service_signal_read(int fd) {
+    struct signalfd_siginfo info;
+    ssize_t n;
+    
+    do {
+        n = read(fd, &info, sizeof(info));
+    } while (n < 0 && errno == EINTR);
+    
+    return n == sizeof(info) ? (int)info.ssi_signo : 0;
+}
+
+void service_notify(const char *state) {
+    const char *path = getenv("NOTIFY_SOCKET");
+    struct sockaddr_un addr;
+    size_t length;
+    int sock;
+    
+    // Only filesystem and abstract ("@...") sockets are spoken here
+    if (!path || (path[0] != '/' && path[0] != '@')) {
+        return;
+    }
+    length = strlen(path);
+    if (length >= sizeof(addr.sun_path)) {
+        async_log(LOG_WARNING, "NOTIFY_SOCKET path is too long");
+        return;
+    }
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, length);
+    if (addr.sun_path[0] == '@') {
+        addr.sun_path[0] = '\0';
+    }
+    
+    sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        async_log(LOG_WARNING, "Could not notify the service manager: %s", strerror(errno));
+        return;
+    }
+    if (sendto(sock, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr *)&addr,
+               (socklen_t)(offsetof(struct sockaddr_un, sun_path) + length)) < 0) {
+        async_log(LOG_WARNING, "Could not notify the service manager: %s", strerror(errno));
+    }
+    close(sock);
+}
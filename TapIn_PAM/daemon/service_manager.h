@@ -0,0 +1,74 @@
+/*
+ * TapIn Service Manager
+ * Socket activation, readiness and shutdown signals under systemd
+ *
+ * With a .socket unit, systemd creates a daemon's Unix sockets at boot and
+ * passes them in (LISTEN_FDS) when the first client connects, so no client
+ * ever finds a socket missing and the daemon costs nothing until it is
+ * needed. A daemon takes the sockets it expects by path and creates any
+ * it was not given, so it runs the same way by hand.
+ *
+ * With Type=notify, systemd holds back units ordered after a daemon until
+ * it reports READY=1 (NOTIFY_SOCKET), which it does once it is serving.
+ *
+ * Shutdown, reload (SIGHUP) and upgrade (SIGUSR2) signals are blocked
+ * and read from a signalfd in the daemon's event loop, so an idle daemon
+ * sleeps with no timeout at all. No libsystemd is needed, and without
+ * systemd none of this does anything.
+ *
+ * A daemon upgrading in place (see live_upgrade.h) passes its listening
+ * sockets to the new image the same way, and they are taken just like
+ * the ones systemd made.
+ */
+
+#ifndef TAPIN_SERVICE_MANAGER_H
+#define TAPIN_SERVICE_MANAGER_H
+
+#define SERVICE_LISTEN_FDS_START 3
+#define SERVICE_MAX_LISTEN_FDS 16
+
+/*
+ * Collect the listening sockets passed in by the service manager and clear
+ * the variables describing them, so children don't think they are theirs
+ * Returns the number of sockets
+ */
+int service_listen_start(void);
+
+/*
+ * Take the inherited stream socket listening on a Unix socket path
+ * Returns its fd, or -1 if there is none and the caller must create it
+ */
+int service_take_unix_socket(const char *path);
+
+// The same for an RFCOMM socket listening on channel
+int service_take_rfcomm_socket(int channel);
+
+/*
+ * Offer a listening socket passed on by an earlier image of the daemon,
+ * which a socket unit made if from_unit is set. Call after
+ * service_listen_start()
+ * Returns 1, or 0 if there are already SERVICE_MAX_LISTEN_FDS sockets
+ */
+int service_adopt_socket(int fd, int from_unit);
+
+// Whether fd came from a socket unit; its socket file belongs to systemd, not us
+int service_socket_inherited(int fd);
+
+// Close inherited sockets that nothing took, with a warning for each
+void service_listen_finish(void);
+
+/*
+ * Block SIGINT, SIGTERM, SIGHUP and SIGUSR2 and return a signalfd that
+ * reads them
+ * Call before starting any thread, so every thread inherits the mask
+ * Returns the fd, or -1 on failure
+ */
+int service_signal_fd(void);
+
+// Read one pending signal; returns its number, or 0 if none was pending
+int service_signal_read(int fd);
+
+// Report a state such as "READY=1" or "STOPPING=1" to the service manager
+void service_notify(const char *state);
+
+#endif /* TAPIN_SERVICE_MANAGER_H */
@@ -0,0 +1,213 @@
+/*
+ * TapIn Session Framing
+ * Message boundaries and per-session receive buffers
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include "session_frame.h"
+#include "session_pool.h"
+#include "auth_record.h"
+
+static int is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/*
+ * Function to find the brace that closes a JSON object
+ * Only strings need care: braces inside them do not count
+ * Returns the offset just past it, or 0 if it is not in data
+ */
+static size_t json_object_end(const char *data, size_t length) {
+    int depth = 0, in_string = 0, escaped = 0;
+    size_t i;
+    
+    for (i = 0; i < length; i++) {
+        char c = data[i];
+    
+        if (in_string) {
+            if (escaped) {
+                escaped = 0;
+            } else if (c == '\\') {
+                escaped = 1;
+            } else if (c == '"') {
+                in_string = 0;
+            }
+        } else if (c == '"') {
+            in_string = 1;
+        } else if (c == '{' || c == '[') {
+            depth++;
+        } else if ((c == '}' || c == ']') && --depth == 0) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+session_frame_result_t session_frame_find(const char *data, size_t length, size_t *start, size_t *end) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    size_t i = 0, available, size = 0;
+    
+    while (i < length && is_space(data[i])) {
+        i++;
+    }
+    *start = i;
+    if (i == length) {
+        return SESSION_FRAME_PARTIAL;
+    }
+    
+    // Nothing may run past SESSION_FRAME_MAX, so look no further
+    available = length - i;
+    if (available > SESSION_FRAME_MAX) {
+        available = SESSION_FRAME_MAX;
+    }
+    
+    if (bytes[i] == '{') {
+        size = json_object_end(data + i, available);
+    } else if ((bytes[i] & 0xF0) == 0xB0) {
+        // Only a version we know says how long it is
+        if (bytes[i] != AUTH_WIRE_BINARY_V1) {
+            return SESSION_FRAME_MALFORMED;
+        }
+        if (available >= 4) {
+            size_t needed = AUTH_WIRE_HEADER_LENGTH + bytes[i + 2] + bytes[i + 3];
+            size = available >= needed ? needed : 0;
+        }
+    } else if (bytes[i] >= 'A' && bytes[i] <= 'Z') {
+        const char *newline = memchr(data + i, '\n', available);
+        size = newline ? (size_t)(newline - (data + i)) + 1 : 0;
+    } else {
+        return SESSION_FRAME_MALFORMED;
+    }
+    
+    if (size > 0) {
+        *end = i + size;
+        return SESSION_FRAME_OK;
+    }
+    return available == SESSION_FRAME_MAX ? SESSION_FRAME_MALFORMED : SESSION_FRAME_PARTIAL;
+}
+
+void session_reader_init(session_reader_t *reader) {
+    reader->length = 0;
+    reader->consumed = 0;
+    reader->saved = '\0';
+}
+
+int session_reader_pending(const session_reader_t *reader) {
+    size_t i;
+    
+    for (i = reader->consumed; i < reader->length; i++) {
+        // The byte under the last message's NUL is still buffered
+        char c = reader->consumed > 0 && i == reader->consumed ? reader->saved : reader->buffer[i];
+        if (!is_space(c)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Function to put back what the last message's NUL covered and drop that
+ * message, so the buffer starts with whatever follows it
+ */
+static void reader_compact(session_reader_t *reader) {
+    if (reader->consumed > 0) {
+        reader->buffer[reader->consumed] = reader->saved;
+        reader->length -= reader->consumed;
+        memmove(reader->buffer, reader->buffer + reader->consumed, reader->length);
+        reader->consumed = 0;
+    }
+}
+
+session_frame_result_t session_reader_next(session_reader_t *reader, const char **message, size_t *length) {
+    session_frame_result_t result;
+    size_t start, end, message_end;
+    
+    reader_compact(reader);
+    result = session_frame_find(reader->buffer, reader->length, &start, &end);
+    if (result == SESSION_FRAME_PARTIAL && start > 0) {
+        reader->length -= start;
+        memmove(reader->buffer, reader->buffer + start, reader->length);
+    }
+    if (result != SESSION_FRAME_OK) {
+        return result;
+    }
+    
+    // Commands are handed out without their line ending
+    message_end = end;
+    if ((unsigned char)reader->buffer[start] >= 'A' && (unsigned char)reader->buffer[start] <= 'Z') {
+        message_end--;
+        if (message_end > start && reader->buffer[message_end - 1] == '\r') {
+            message_end--;
+        }
+    }
+    
+    reader->saved = reader->buffer[end];
+    reader->buffer[message_end] = '\0';
+    reader->consumed = end;
+    *message = reader->buffer + start;
+    *length = message_end - start;
+    return SESSION_FRAME_OK;
+}
+
+int session_reader_fill(session_reader_t *reader, int fd, long long deadline_ms) {
+    size_t room;
+    
+    reader_compact(reader);
+    room = SESSION_FRAME_MAX - reader->length;
+    
+    // session_reader_next() reports a full buffer as malformed first
+    if (room == 0) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    
+    for (;;) {
+        long long remaining = deadline_ms - session_clock_ms();
+        if (remaining <= 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, (int)remaining);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (ready == 0) {
+            continue;
+        }
+    
+        ssize_t n = read(fd, reader->buffer + reader->length, room);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n > 0) {
+            reader->length += n;
+        }
+        return (int)n;
+    }
+}
+
+session_frame_result_t session_read_frame(session_reader_t *reader, int fd, long long deadline_ms,
+                                          const char **message, size_t *length) {
+    for (;;) {
+        session_frame_result_t result = session_reader_next(reader, message, length);
+        if (result != SESSION_FRAME_PARTIAL) {
+            return result;
+        }
+    
+        int n = session_reader_fill(reader, fd, deadline_ms);
+        if (n == 0) {
+            return SESSION_FRAME_CLOSED;
+        }
+        if (n < 0) {
+            return SESSION_FRAME_ERROR;
+        }
+    }
+}
@@ -0,0 +1,77 @@
+/*
+ * TapIn Session Framing
+ * Finding whole messages in what a phone has sent so far
+ *
+ * RFCOMM delivers a stream, and a request may arrive split over several
+ * reads or share a read with the next one. Every message a phone sends
+ * says where it ends, so the listener needs no length prefix and older
+ * apps, which send one bare request per connection, are framed the same
+ * way:
+ *
+ *   '{' ...          a JSON request, ending with the brace that closes it
+ *   0xB0-0xBF ...    a binary request, as long as its header says
+ *   A-Z ... '\n'     a command line such as "KEEPALIVE" or "PING"
+ *
+ * Whitespace between messages is skipped. Anything else, or a message
+ * longer than SESSION_FRAME_MAX, cannot be framed and ends the session.
+ *
+ * A session reader buffers one phone's bytes and hands out each message
+ * in place, NUL-terminated.
+ */
+
+#ifndef TAPIN_SESSION_FRAME_H
+#define TAPIN_SESSION_FRAME_H
+
+#include <stddef.h>
+
+#define SESSION_FRAME_MAX 1024
+
+typedef enum {
+    SESSION_FRAME_OK,           // A whole message
+    SESSION_FRAME_PARTIAL,      // More bytes are needed
+    SESSION_FRAME_MALFORMED,    // Cannot be framed, or too long
+    SESSION_FRAME_CLOSED,       // The phone disconnected
+    SESSION_FRAME_ERROR         // Read failed or the deadline passed (errno says which)
+} session_frame_result_t;
+
+typedef struct {
+    char buffer[SESSION_FRAME_MAX + 1];
+    size_t length;              // Bytes buffered
+    size_t consumed;            // Bytes already handed out
+    char saved;                 // Byte overwritten by the last message's NUL
+} session_reader_t;
+
+/*
+ * Find the first message in data
+ * On SESSION_FRAME_OK it lies at [*start, *end); on SESSION_FRAME_PARTIAL
+ * the whitespace before *start can be dropped
+ */
+session_frame_result_t session_frame_find(const char *data, size_t length, size_t *start, size_t *end);
+
+void session_reader_init(session_reader_t *reader);
+
+// Whether bytes of another message are already buffered
+int session_reader_pending(const session_reader_t *reader);
+
+/*
+ * Take the next buffered message, valid until the next call on reader
+ * Returns SESSION_FRAME_OK, SESSION_FRAME_PARTIAL or SESSION_FRAME_MALFORMED
+ */
+session_frame_result_t session_reader_next(session_reader_t *reader, const char **message, size_t *length);
+
+/*
+ * Read whatever the phone has sent, waiting until deadline_ms on the
+ * session clock for the first byte
+ * Returns the number of bytes read, 0 on disconnect, -1 on error or timeout
+ */
+int session_reader_fill(session_reader_t *reader, int fd, long long deadline_ms);
+
+/*
+ * Read until a whole message has arrived or deadline_ms passes
+ * Returns one of session_frame_result_t; only SESSION_FRAME_OK sets
+ * *message and *length
+ */
+session_frame_result_t session_read_frame(session_reader_t *reader, int fd, long long deadline_ms,
+                                          const char **message, size_t *length);
+
+#endif /* TAPIN_SESSION_FRAME_H */
@@ -0,0 +1,211 @@
+/*
+ * TapIn Session Pool
+ * Fixed worker threads fed from a bounded queue of accepted sessions
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <syslog.h>
+#include "session_pool.h"
+#include "async_log.h"
+
+typedef struct {
+    int fd;
+    char peer[PEER_ADDRESS_LENGTH];
+    long long deadline_ms;
+    long long accepted_us;
+} pending_session_t;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+static session_pool_config_t pool_config;
+static session_handler_t pool_handler;
+static pthread_t *pool_threads;
+static int pool_thread_count;
+static int pool_stopping;
+static int pool_waiting;             // Workers with nothing to do
+
+// Ring buffer of accepted sessions
+static pending_session_t *queue;
+static int queue_head;
+static int queue_count;
+
+static session_pool_stats_t pool_stats;
+
+long long session_clock_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long long session_clock_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void *worker_main(void *arg) {
+    pending_session_t session;
+    (void)arg;
+    
+    for (;;) {
+        pthread_mutex_lock(&pool_lock);
+        while (queue_count == 0 && !pool_stopping) {
+            pool_waiting++;
+            pthread_cond_wait(&pool_cond, &pool_lock);
+            pool_waiting--;
+        }
+        if (queue_count == 0) {
+            pthread_mutex_unlock(&pool_lock);
+            break;
+        }
+        
+        session = queue[queue_head];
+        queue_head = (queue_head + 1) % pool_config.queue_size;
+        queue_count--;
+        pool_stats.queued = queue_count;
+        pool_stats.in_flight++;
+        pthread_mutex_unlock(&pool_lock);
+        
+        pool_handler(session.fd, session.peer, session.deadline_ms, session.accepted_us);
+        close(session.fd);
+        
+        pthread_mutex_lock(&pool_lock);
+        pool_stats.in_flight--;
+        pool_stats.completed++;
+        pthread_mutex_unlock(&pool_lock);
+    }
+    
+    return NULL;
+}
+
+int session_pool_start(const session_pool_config_t *config, session_handler_t handler) {
+    sigset_t all, old;
+    int i;
+    
+    pool_config = *config;
+    pool_handler = handler;
+    pool_stopping = 0;
+    pool_waiting = 0;
+    memset(&pool_stats, 0, sizeof(pool_stats));
+    
+    queue = calloc(config->queue_size, sizeof(*queue));
+    pool_threads = calloc(config->workers, sizeof(*pool_threads));
+    if (!queue || !pool_threads) {
+        free(queue);
+        free(pool_threads);
+        return 0;
+    }
+    
+    // Workers leave signal handling to the accept loop
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    
+    for (i = 0; i < config->workers; i++) {
+        if (pthread_create(&pool_threads[i], NULL, worker_main, NULL) != 0) {
+            async_log(LOG_ERR, "Failed to start session worker %d", i);
+            break;
+        }
+    }
+    pool_thread_count = i;
+    
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    
+    if (pool_thread_count == 0) {
+        free(queue);
+        free(pool_threads);
+        return 0;
+    }
+    return 1;
+}
+
+int session_pool_submit(int client_sock, const char *peer) {
+    pthread_mutex_lock(&pool_lock);
+    
+    if (pool_stopping || queue_count == pool_config.queue_size) {
+        pool_stats.rejected++;
+        pthread_mutex_unlock(&pool_lock);
+        return 0;
+    }
+    
+    pending_session_t *session = &queue[(queue_head + queue_count) % pool_config.queue_size];
+    session->fd = client_sock;
+    strncpy(session->peer, peer, sizeof(session->peer) - 1);
+    session->peer[sizeof(session->peer) - 1] = '\0';
+    session->accepted_us = session_clock_us();
+    session->deadline_ms = session->accepted_us / 1000 + pool_config.session_timeout_ms;
+    queue_count++;
+    pool_stats.queued = queue_count;
+    
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+    return 1;
+}
+
+void session_pool_set_timeout(int session_timeout_ms) {
+    pthread_mutex_lock(&pool_lock);
+    pool_config.session_timeout_ms = session_timeout_ms;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/*
+ * Function to stop the workers, once they have run the queued sessions
+ * too unless those are to be dropped
+ */
+static void stop_pool(int drop_queued) {
+    int i;
+    
+    pthread_mutex_lock(&pool_lock);
+    pool_stopping = 1;
+    
+    // Anything left in the queue is run by the workers before they leave
+    while (drop_queued && queue_count > 0) {
+        close(queue[queue_head].fd);
+        queue_head = (queue_head + 1) % pool_config.queue_size;
+        queue_count--;
+    }
+    pool_stats.queued = queue_count;
+    
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+    
+    for (i = 0; i < pool_thread_count; i++) {
+        pthread_join(pool_threads[i], NULL);
+    }
+    
+    free(pool_threads);
+    free(queue);
+    pool_threads = NULL;
+    queue = NULL;
+    pool_thread_count = 0;
+}
+
+void session_pool_stop(void) {
+    // Sessions nobody has started on are dropped
+    stop_pool(1);
+}
+
+void session_pool_finish(void) {
+    stop_pool(0);
+}
+
+void session_pool_get_stats(session_pool_stats_t *stats) {
+    pthread_mutex_lock(&pool_lock);
+    *stats = pool_stats;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+int session_pool_contended(void) {
+    int contended;
+    
+    pthread_mutex_lock(&pool_lock);
+    // A worker that is waiting will take the queued session soon enough
+    contended = pool_stopping || queue_count > pool_waiting;
+    pthread_mutex_unlock(&pool_lock);
+    return contended;
+}
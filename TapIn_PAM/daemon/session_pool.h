@@ -0,0 +1,72 @@
+/*
+ * TapIn Session Pool
+ * Bounded worker pool for phone sessions in the Bluetooth listener
+ *
+ * The accept loop submits each connected socket with its peer address; a
+ * fixed set of worker threads runs the session handler on it. Sessions that
+ * cannot be queued are rejected immediately instead of stalling the accept
+ * loop, and every session carries a deadline measured from accept time.
+ * A session a phone keeps alive holds its worker only until someone else
+ * is waiting for one.
+ */
+
+#ifndef TAPIN_SESSION_POOL_H
+#define TAPIN_SESSION_POOL_H
+
+#include "transport.h"
+
+typedef struct {
+    int workers;              // Sessions handled concurrently
+    int queue_size;           // Accepted sessions waiting for a worker
+    int session_timeout_ms;   // Deadline for a session's first request, and for each later
+                              // one once it starts arriving
+    int keepalive_ms;         // Idle time before a kept-alive session is closed; 0 for none
+} session_pool_config_t;
+
+typedef struct {
+    int in_flight;            // Sessions being handled by a worker
+    int queued;               // Sessions waiting for a worker
+    unsigned long completed;  // Sessions finished
+    unsigned long rejected;   // Sessions turned away because the queue was full
+} session_pool_stats_t;
+
+// Runs one session on a connected socket; the pool closes the socket after.
+// accepted_us is when the session was queued, on the session clock
+typedef void (*session_handler_t)(int client_sock, const char *peer, long long deadline_ms,
+                                  long long accepted_us);
+
+/*
+ * Start the worker threads
+ * Returns 1 on success, 0 on failure
+ */
+int session_pool_start(const session_pool_config_t *config, session_handler_t handler);
+
+/*
+ * Queue a connected socket for a worker; ownership of the socket passes
+ * to the pool. Returns 1 if queued, 0 if the pool is full (the caller
+ * still owns the socket).
+ */
+int session_pool_submit(int client_sock, const char *peer);
+
+// Stop accepting work, close queued sessions and wait for running ones
+void session_pool_stop(void);
+
+// Stop accepting work and wait for queued and running sessions to finish
+void session_pool_finish(void);
+
+// Deadline for sessions queued from now on
+void session_pool_set_timeout(int session_timeout_ms);
+
+void session_pool_get_stats(session_pool_stats_t *stats);
+
+// Whether sessions are waiting with no worker free for them, or the pool
+// is stopping, so an idle kept-alive session should give its worker up
+int session_pool_contended(void);
+
+// Milliseconds on the monotonic clock, the base for session deadlines
+long long session_clock_ms(void);
+
+// The same clock in microseconds, for timing session stages
+long long session_clock_us(void);
+
+#endif /* TAPIN_SESSION_POOL_H */
@@ -0,0 +1,384 @@
+/*
+ * TapIn Stats
+ * Lock-free histograms and the stats socket thread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <libgen.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "stats.h"
+#include "async_log.h"
+
+#define STATS_REQUEST_MAX 512
+#define STATS_RESPONSE_MAX 65536
+#define STATS_CLIENT_TIMEOUT_MS 1000
+
+static const double quantiles[] = { 0.5, 0.9, 0.99 };
+#define QUANTILE_COUNT (sizeof(quantiles) / sizeof(quantiles[0]))
+
+struct stats_server {
+    const stats_registry_t *registry;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    int fd;
+    int stop_pipe[2];
+    pthread_t thread;
+    char response[STATS_RESPONSE_MAX];
+};
+
+static size_t bucket_index(uint64_t value) {
+    int exponent;
+    size_t index;
+    
+    if (value < STATS_SUB_BUCKETS) {
+        return (size_t)value;
+    }
+    
+    exponent = 63 - __builtin_clzll(value);
+    index = (size_t)(exponent - STATS_SUB_BUCKET_BITS + 1) * STATS_SUB_BUCKETS +
+            ((value >> (exponent - STATS_SUB_BUCKET_BITS)) & (STATS_SUB_BUCKETS - 1));
+    return index < STATS_BUCKETS ? index : STATS_BUCKETS - 1;
+}
+
+// Largest value that falls in a bucket
+static uint64_t bucket_limit(size_t index) {
+    size_t octave = index / STATS_SUB_BUCKETS;
+    uint64_t sub = index % STATS_SUB_BUCKETS;
+    int shift;
+    
+    if (octave == 0) {
+        return sub;
+    }
+    shift = (int)octave - 1;
+    return ((STATS_SUB_BUCKETS + sub) << shift) + ((uint64_t)1 << shift) - 1;
+}
+
+void stats_record(stats_histogram_t *histogram, uint64_t microseconds) {
+    uint64_t seen = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    
+    __atomic_fetch_add(&histogram->buckets[bucket_index(microseconds)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum, microseconds, __ATOMIC_RELAXED);
+    
+    while (microseconds > seen &&
+           !__atomic_compare_exchange_n(&histogram->max, &seen, microseconds, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void stats_count(stats_counter_t *counter) {
+    __atomic_fetch_add(&counter->value, 1, __ATOMIC_RELAXED);
+}
+
+// A consistent-enough copy of one histogram for reporting
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t quantile[QUANTILE_COUNT];
+} stats_summary_t;
+
+static void summarize(const stats_histogram_t *histogram, stats_summary_t *summary) {
+    uint64_t buckets[STATS_BUCKETS];
+    uint64_t total = 0, seen = 0;
+    size_t i, q = 0;
+    
+    // Quantiles come from the bucket copy alone, so they agree with each
+    // other even while other threads keep recording
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        buckets[i] = __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+        total += buckets[i];
+    }
+    summary->count = total;
+    summary->sum = __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED);
+    summary->max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    memset(summary->quantile, 0, sizeof(summary->quantile));
+    
+    for (i = 0; i < STATS_BUCKETS && q < QUANTILE_COUNT && total > 0; i++) {
+        seen += buckets[i];
+        while (q < QUANTILE_COUNT && (double)seen >= quantiles[q] * (double)total) {
+            uint64_t limit = bucket_limit(i);
+            summary->quantile[q++] = limit < summary->max ? limit : summary->max;
+        }
+    }
+}
+
+/*
+ * Function to append formatted text, tracking how much fitted
+ */
+static void append(char *out, size_t size, size_t *length, const char *format, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static void append(char *out, size_t size, size_t *length, const char *format, ...) {
+    va_list args;
+    int n;
+    
+    if (*length >= size) {
+        return;
+    }
+    
+    va_start(args, format);
+    n = vsnprintf(out + *length, size - *length, format, args);
+    va_end(args);
+    
+    if (n < 0) {
+        return;
+    }
+    *length = (size_t)n < size - *length ? *length + n : size - 1;
+}
+
+size_t stats_format_prometheus(const stats_registry_t *registry, char *out, size_t size) {
+    const char *prefix = registry->prefix;
+    stats_summary_t summary;
+    size_t length = 0, i, q;
+    
+    if (size == 0) {
+        return 0;
+    }
+    out[0] = '\0';
+    
+    append(out, size, &length, "# HELP %s_stage_seconds Time spent in each stage of a request\n", prefix);
+    append(out, size, &length, "# TYPE %s_stage_seconds summary\n", prefix);
+    for (i = 0; i < registry->stage_count; i++) {
+        const char *stage = registry->stages[i].name;
+        summarize(&registry->stages[i], &summary);
+        for (q = 0; q < QUANTILE_COUNT; q++) {
+            append(out, size, &length, "%s_stage_seconds{stage=\"%s\",quantile=\"%g\"} %.6f\n",
+                   prefix, stage, quantiles[q], summary.quantile[q] / 1e6);
+        }
+        append(out, size, &length, "%s_stage_seconds_sum{stage=\"%s\"} %.6f\n", prefix, stage, summary.sum / 1e6);
+        append(out, size, &length, "%s_stage_seconds_count{stage=\"%s\"} %llu\n", prefix, stage,
+               (unsigned long long)summary.count);
+    }
+    
+    append(out, size, &length, "# HELP %s_stage_max_seconds Longest time seen in each stage\n", prefix);
+    append(out, size, &length, "# TYPE %s_stage_max_seconds gauge\n", prefix);
+    for (i = 0; i < registry->stage_count; i++) {
+        append(out, size, &length, "%s_stage_max_seconds{stage=\"%s\"} %.6f\n", prefix, registry->stages[i].name,
+               __atomic_load_n(&registry->stages[i].max, __ATOMIC_RELAXED) / 1e6);
+    }
+    
+    append(out, size, &length, "# HELP %s_requests_total Requests by outcome\n", prefix);
+    append(out, size, &length, "# TYPE %s_requests_total counter\n", prefix);
+    for (i = 0; i < registry->result_count; i++) {
+        append(out, size, &length, "%s_requests_total{result=\"%s\"} %llu\n", prefix, registry->results[i].name,
+               (unsigned long long)__atomic_load_n(&registry->results[i].value, __ATOMIC_RELAXED));
+    }
+    
+    return length;
+}
+
+size_t stats_format_json(const stats_registry_t *registry, char *out, size_t size) {
+    stats_summary_t summary;
+    size_t length = 0, i;
+    
+    if (size == 0) {
+        return 0;
+    }
+    out[0] = '\0';
+    
+    append(out, size, &length, "{\"stages\":{");
+    for (i = 0; i < registry->stage_count; i++) {
+        summarize(&registry->stages[i], &summary);
+        append(out, size, &length,
+               "%s\"%s\":{\"count\":%llu,\"sum_us\":%llu,\"p50_us\":%llu,\"p90_us\":%llu,"
+               "\"p99_us\":%llu,\"max_us\":%llu}",
+               i ? "," : "", registry->stages[i].name, (unsigned long long)summary.count,
+               (unsigned long long)summary.sum, (unsigned long long)summary.quantile[0],
+               (unsigned long long)summary.quantile[1], (unsigned long long)summary.quantile[2],
+               (unsigned long long)summary.max);
+    }
+    append(out, size, &length, "},\"results\":{");
+    for (i = 0; i < registry->result_count; i++) {
+        append(out, size, &length, "%s\"%s\":%llu", i ? "," : "", registry->results[i].name,
+               (unsigned long long)__atomic_load_n(&registry->results[i].value, __ATOMIC_RELAXED));
+    }
+    append(out, size, &length, "}}\n");
+    
+    return length;
+}
+
+static int write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        data += n;
+        length -= n;
+    }
+    return 1;
+}
+
+/*
+ * Function to answer one stats client
+ */
+static void serve_client(stats_server_t *server, int client) {
+    char *response = server->response;
+    char request[STATS_REQUEST_MAX + 1];
+    struct timeval timeout = { STATS_CLIENT_TIMEOUT_MS / 1000, (STATS_CLIENT_TIMEOUT_MS % 1000) * 1000 };
+    char header[160];
+    size_t length = 0, body;
+    int json, http, header_length;
+    
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    
+    // Only the first line matters
+    while (length < STATS_REQUEST_MAX && !memchr(request, '\n', length)) {
+        ssize_t n = recv(client, request + length, STATS_REQUEST_MAX - length, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        length += n;
+    }
+    request[length] = '\0';
+    
+    http = strncmp(request, "GET ", 4) == 0;
+    json = http ? strncmp(request + 4, "/json", 5) == 0 : strncmp(request, "json", 4) == 0;
+    
+    if (json) {
+        body = stats_format_json(server->registry, response, sizeof(server->response));
+    } else {
+        body = stats_format_prometheus(server->registry, response, sizeof(server->response));
+    }
+    
+    if (http) {
+        header_length = snprintf(header, sizeof(header),
+                                 "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+                                 "Connection: close\r\n\r\n",
+                                 json ? "application/json" : "text/plain; version=0.0.4", body);
+        if (!write_all(client, header, header_length)) {
+            return;
+        }
+    }
+    write_all(client, response, body);
+}
+
+static void *server_main(void *arg) {
+    stats_server_t *server = arg;
+    struct pollfd fds[2];
+    
+    fds[0].fd = server->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = server->stop_pipe[0];
+    fds[1].events = POLLIN;
+    
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            async_log(LOG_ERR, "Stats socket poll failed: %s", strerror(errno));
+            break;
+        }
+        if (fds[1].revents) {
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            int client = accept4(server->fd, NULL, NULL, SOCK_CLOEXEC);
+            if (client >= 0) {
+                serve_client(server, client);
+                close(client);
+            }
+        }
+    }
+    
+    return NULL;
+}
+
+stats_server_t *stats_server_start(const char *path, const stats_registry_t *registry) {
+    struct sockaddr_un addr;
+    stats_server_t *server;
+    char directory[sizeof(addr.sun_path)];
+    sigset_t all, old;
+    int started;
+    
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        async_log(LOG_ERR, "Stats socket path too long: %s", path);
+        return NULL;
+    }
+    server = calloc(1, sizeof(*server));
+    if (!server) {
+        async_log(LOG_ERR, "Failed to allocate stats server");
+        return NULL;
+    }
+    snprintf(server->path, sizeof(server->path), "%s", path);
+    snprintf(directory, sizeof(directory), "%s", path);
+    mkdir(dirname(directory), 0755);
+    server->registry = registry;
+    
+    server->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server->fd < 0) {
+        async_log(LOG_ERR, "Failed to create stats socket: %s", strerror(errno));
+        free(server);
+        return NULL;
+    }
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, server->path, sizeof(addr.sun_path));
+    unlink(server->path);
+    
+    if (bind(server->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        chmod(server->path, 0600) < 0 || listen(server->fd, 8) < 0 ||
+        pipe2(server->stop_pipe, O_CLOEXEC) < 0) {
+        async_log(LOG_ERR, "Failed to set up stats socket %s: %s", server->path, strerror(errno));
+        close(server->fd);
+        unlink(server->path);
+        free(server);
+        return NULL;
+    }
+    
+    // The stats thread leaves signal handling to the main loop
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    started = pthread_create(&server->thread, NULL, server_main, server) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    
+    if (!started) {
+        async_log(LOG_ERR, "Failed to start stats thread");
+        close(server->stop_pipe[0]);
+        close(server->stop_pipe[1]);
+        close(server->fd);
+        unlink(server->path);
+        free(server);
+        return NULL;
+    }
+    
+    async_log(LOG_INFO, "Serving stats on %s", server->path);
+    return server;
+}
+
+void stats_server_stop(stats_server_t *server) {
+    if (!server) {
+        return;
+    }
+    
+    if (write(server->stop_pipe[1], "x", 1) < 0) {
+        async_log(LOG_WARNING, "Could not wake stats thread: %s", strerror(errno));
+    }
+    pthread_join(server->thread, NULL);
+    
+    close(server->stop_pipe[0]);
+    close(server->stop_pipe[1]);
+    close(server->fd);
+    unlink(server->path);
+    free(server);
+}
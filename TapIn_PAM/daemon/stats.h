@@ -0,0 +1,77 @@
+/*
+ * TapIn Stats
+ * Per-stage latency histograms and result counters, served on a socket
+ *
+ * Each daemon times the stages of a request on the monotonic clock and
+ * records the durations in log-linear histograms: eight linear buckets per
+ * power of two of microseconds, so any recorded value is reported within
+ * 12.5%. Recording is a few relaxed atomic adds with no locks, cheap
+ * enough to leave on in production.
+ *
+ * A background thread answers on a Unix socket. A client sends one line,
+ * either an HTTP request ("GET /metrics" for Prometheus text, "GET /json")
+ * or a bare "metrics" or "json", and gets the current figures back:
+ *
+ *   curl --unix-socket /run/tapin/helper-stats.sock http://localhost/metrics
+ */
+
+#ifndef TAPIN_STATS_H
+#define TAPIN_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define STATS_SUB_BUCKET_BITS 3
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BUCKET_BITS)
+#define STATS_MAX_EXPONENT 40   // Values up to 2^40 us (about 12 days)
+#define STATS_BUCKETS ((STATS_MAX_EXPONENT - STATS_SUB_BUCKET_BITS + 2) * STATS_SUB_BUCKETS)
+
+// Durations of one stage, in microseconds
+typedef struct {
+    const char *name;
+    uint64_t buckets[STATS_BUCKETS];
+    uint64_t sum;
+    uint64_t max;
+} stats_histogram_t;
+
+// How many requests ended a given way
+typedef struct {
+    const char *name;
+    uint64_t value;
+} stats_counter_t;
+
+// Everything one daemon exports
+typedef struct {
+    const char *prefix;              // Metric name prefix, e.g. "tapin_helper"
+    stats_histogram_t *stages;
+    size_t stage_count;
+    stats_counter_t *results;
+    size_t result_count;
+} stats_registry_t;
+
+// A stats socket and the thread answering on it
+typedef struct stats_server stats_server_t;
+
+// Record one duration; safe from any thread
+void stats_record(stats_histogram_t *histogram, uint64_t microseconds);
+
+// Count one result; safe from any thread
+void stats_count(stats_counter_t *counter);
+
+/*
+ * Write the registry in Prometheus text format or as JSON
+ * Returns the length written, truncated to fit size
+ */
+size_t stats_format_prometheus(const stats_registry_t *registry, char *out, size_t size);
+size_t stats_format_json(const stats_registry_t *registry, char *out, size_t size);
+
+/*
+ * Serve the registry on a Unix socket at path from a background thread
+ * Returns the server, or NULL on failure
+ */
+stats_server_t *stats_server_start(const char *path, const stats_registry_t *registry);
+
+// Stop serving and remove the socket; NULL is ignored
+void stats_server_stop(stats_server_t *server);
+
+#endif /* TAPIN_STATS_H */
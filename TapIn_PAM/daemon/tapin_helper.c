@@ -3,8 +3,12 @@
  * Processes authentication requests and generates temporary tokens
  * 
  * This daemon receives authentication data from the Bluetooth listener,
- * validates it, and creates a temporary authentication token file
- * that the PAM module can use for authentication.
+ * validates it, and keeps a temporary authentication token in memory
+ * that the PAM module fetches over the token broker socket.
+ *
+ * With --transport it is the combined daemon: it accepts phones itself,
+ * and its session workers validate requests and issue tokens in-process,
+ * with no listener and no helper socket in between.
  */
 
 #include <stdio.h>
@@ -18,310 +22,1421 @@
 #include <errno.h>
 #include <signal.h>
 #include <syslog.h>
-#include <json-c/json.h>
-#include <openssl/hmac.h>
-#include <openssl/sha.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/un.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <pwd.h>
+#include <libgen.h>
+#include <getopt.h>
+#include "tapin_broker.h"
+#include "tapin_channel.h"
+#include "token_store.h"
+#include "auth_record.h"
+#include "auth_core.h"
+#include "auth_batch.h"
+#include "audit_journal.h"
+#include "verify_pool.h"
+#include "key_cache.h"
+#include "keystore.h"
+#include "replay_cache.h"
+#include "transport.h"
+#include "session_pool.h"
+#include "phone_session.h"
+#include "admission.h"
+#include "device_allowlist.h"
+#include "stats.h"
+#include "session_frame.h"
+#include "service_manager.h"
+#include "daemon_config.h"
+#include "live_upgrade.h"
+#include "async_log.h"
 
-#define TOKEN_FILE "/var/run/tapin_auth.token"
-#define SHARED_SECRET_FILE "/etc/tapin/shared_secret"
 #define MAX_USERNAME_LENGTH 64
-#define MAX_TOKEN_LENGTH 64
-#define MAX_JSON_LENGTH 512
-#define TOKEN_EXPIRY_SECONDS 20
-#define SOCKET_PATH "/tmp/tapin_helper.sock"
+#define DEFAULT_STATS_SOCKET "/run/tapin/helper-stats.sock"
+#define DEFAULT_LISTENER_STATS_SOCKET "/run/tapin/listener-stats.sock"
+#define MAX_BROKER_WAITERS 64
+#define MAX_BROKER_WAITERS_PER_UID 4
+#define DEFAULT_LISTEN_BACKLOG 128
+#define MAX_EVENTS 64
+#define MAX_QUEUED_REPLIES 64
+#define DEFAULT_WORKERS 8
+#define DEFAULT_QUEUE_SIZE 32
 
-// Global flag for signal handling
-static volatile sig_atomic_t running = 1;
+// Kinds of descriptors registered with epoll
+typedef enum {
+    CONN_HELPER_LISTEN,   // Listening socket for the Bluetooth listener
+    CONN_BROKER_LISTEN,   // Listening socket for the PAM module
+    CONN_HELPER,          // Framed channel from the Bluetooth listener
+    CONN_BROKER,          // Request from the PAM module
+    CONN_KEY_WATCH,       // inotify watch on the keystore
+    CONN_PHONE_LISTEN,    // Phones, in combined mode
+    CONN_TOKEN_WAKE,      // Tokens issued by session workers, in combined mode
+    CONN_VERIFIED,        // Results from the verification workers
+    CONN_SIGNAL           // signalfd for shutdown signals
+} conn_kind_t;
 
-// Signal handler to gracefully stop the daemon
-void signal_handler(int sig) {
-    running = 0;
+typedef struct connection_list connection_list_t;
+
+// Per-connection read state
+typedef struct connection {
+    int fd;
+    conn_kind_t kind;
+    int parked;              // Broker wait request parked until a token arrives
+    int closed;              // Closed, waiting to be freed
+    int writing;             // Channel waiting for room to send replies
+    int pending;             // Channel requests out with verification workers
+    uid_t peer_uid;          // Broker peer, when parked
+    long long deadline_ms;   // Idle timeout, or wait deadline when parked
+    connection_list_t *list;
+    struct connection *prev, *next;
+    
+    // Bytes received so far; room for one whole frame plus a terminator
+    size_t length;
+    union {
+        char data[sizeof(tapin_channel_header_t) + TAPIN_CHANNEL_MAX_PAYLOAD + 1];
+        tapin_broker_request_t request;
+    } buffer;
+    
+    // Channel replies not yet written
+    size_t out_length;
+    char out[MAX_QUEUED_REPLIES * sizeof(tapin_channel_header_t)];
+} connection_t;
+
+struct connection_list {
+    connection_t *head, *tail;
+};
+
+// A client connection handed to a new image; the bytes it has read and
+// the replies it has not sent yet follow
+typedef struct {
+    int32_t kind;
+    int32_t parked;
+    int64_t wait_ms;         // Left of a parked request's wait
+    uint32_t length;
+    uint32_t out_length;
+} saved_connection_t;
+
+// Cleared when a shutdown signal arrives
+static int running = 1;
+
+// Reading connections ordered by idle deadline, parked wait requests in
+// arrival order, and listener channels with no partial frame outstanding
+static connection_list_t idle_list;
+static connection_list_t waiter_list;
+static connection_list_t channel_list;
+static connection_list_t closed_list;
+static int waiter_count = 0;
+static int active_connections = 0;
+static int idle_timeout_ms;
+static int epoll_fd = -1;
+
+// Combined mode only
+static const listener_transport_t *phone_transport = NULL;
+static int token_wake_fd = -1;
+
+/*
+ * Function to create and listen on a Unix domain socket, or take the one
+ * a socket unit made for path
+ * The socket is non-blocking so the event loop can drain accept() bursts
+ */
+int setup_unix_socket(const char* path, mode_t mode, int backlog) {
+    int sock;
+    struct sockaddr_un addr;
+    
+    // The socket unit sets its permissions and backlog
+    sock = service_take_unix_socket(path);
+    if (sock >= 0) {
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+        return sock;
+    }
+    
+    // Remove existing socket if it exists
+    unlink(path);
+    
+    // Create socket
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        async_log(LOG_ERR, "Failed to create Unix socket: %s", strerror(errno));
+        return -1;
+    }
+    
+    // Setup address structure
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    
+    // Bind socket
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        async_log(LOG_ERR, "Failed to bind Unix socket: %s", strerror(errno));
+        close(sock);
+        return -1;
+    }
+    
+    // Listen for connections
+    if (listen(sock, backlog) < 0) {
+        async_log(LOG_ERR, "Failed to listen on Unix socket: %s", strerror(errno));
+        close(sock);
+        unlink(path);
+        return -1;
+    }
+    
+    // Set socket permissions
+    chmod(path, mode);
+    
+    return sock;
 }
 
 /*
- * Function to read the shared secret for HMAC verification
+ * Function to close a socket from setup_unix_socket()
+ * A socket unit's socket file stays, so clients can start us again
  */
-char* read_shared_secret() {
-    FILE *file;
-    static char secret[256];
-    size_t len;
+void close_unix_socket(int sock, const char* path) {
+    if (!service_socket_inherited(sock)) {
+        unlink(path);
+    }
+    close(sock);
+}
+
+/*
+ * Function to read the uid of a broker peer
+ * Returns 0 on success, -1 on error
+ */
+int broker_peer_uid(int client_sock, uid_t* uid) {
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
     
-    file = fopen(SHARED_SECRET_FILE, "r");
-    if (!file) {
-        syslog(LOG_ERR, "Could not open shared secret file: %s", strerror(errno));
-        return NULL;
+    if (getsockopt(client_sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0) {
+        async_log(LOG_ERR, "Could not read broker peer credentials: %s", strerror(errno));
+        return -1;
     }
     
-    if (fgets(secret, sizeof(secret), file) == NULL) {
-        fclose(file);
-        syslog(LOG_ERR, "Could not read shared secret from file");
-        return NULL;
+    *uid = cred.uid;
+    return 0;
+}
+
+/*
+ * Function to check whether a broker peer may consume tokens for a user
+ * Root may consume any token; other callers (e.g. a screen locker running
+ * as the user) only their own
+ */
+int broker_peer_allowed(int client_sock, const char* username) {
+    struct passwd pwd, *result = NULL;
+    char pwbuf[1024];
+    uid_t uid;
+    
+    if (broker_peer_uid(client_sock, &uid) < 0) {
+        return 0;
     }
     
-    fclose(file);
+    if (uid == 0) {
+        return 1;
+    }
     
-    // Remove trailing newline if present
-    len = strlen(secret);
-    if (len > 0 && secret[len-1] == '\n') {
-        secret[len-1] = '\0';
+    if (getpwnam_r(username, &pwd, pwbuf, sizeof(pwbuf), &result) != 0 || !result) {
+        return 0;
     }
     
-    return secret;
+    return result->pw_uid == uid;
 }
 
 /*
- * Function to validate the HMAC signature
+ * Function to read the monotonic clock in milliseconds
  */
-int validate_hmac(const char* data, const char* received_hmac, const char* secret) {
-    unsigned char* result;
-    unsigned int len = EVP_MAX_MD_SIZE;
-    char hex_result[EVP_MAX_MD_SIZE * 2 + 1];
-    int i;
+long long monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Connection list helpers
+ */
+void list_append(connection_list_t* list, connection_t* conn) {
+    conn->prev = list->tail;
+    conn->next = NULL;
+    if (list->tail) {
+        list->tail->next = conn;
+    } else {
+        list->head = conn;
+    }
+    list->tail = conn;
+    conn->list = list;
+}
+
+void list_remove(connection_list_t* list, connection_t* conn) {
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        list->head = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    } else {
+        list->tail = conn->prev;
+    }
+    conn->prev = conn->next = NULL;
+    conn->list = NULL;
+}
+
+/*
+ * Function to close a client connection
+ * Its state is freed after the current batch of events, since a later
+ * event in the same batch may still point at it
+ */
+void close_connection(connection_t* conn) {
+    if (conn->list) {
+        list_remove(conn->list, conn);
+    }
+    if (conn->parked) {
+        waiter_count--;
+    }
     
-    result = HMAC(EVP_sha256(), secret, strlen(secret), (unsigned char*)data, strlen(data), NULL, &len);
+    // Closing the descriptor also removes it from the epoll set
+    close(conn->fd);
+    conn->fd = -1;
+    conn->closed = 1;
+    list_append(&closed_list, conn);
+    active_connections--;
+}
+
+/*
+ * Function to free connections closed during the last batch of events
+ * A channel stays until the verification workers are done with its requests
+ */
+void free_closed_connections() {
+    connection_t *conn, *next_conn;
     
-    // Convert to hex string
-    for (i = 0; i < len; i++) {
-        sprintf(hex_result + (i * 2), "%02x", result[i]);
+    for (conn = closed_list.head; conn; conn = next_conn) {
+        next_conn = conn->next;
+        if (conn->pending > 0) {
+            continue;
+        }
+        list_remove(&closed_list, conn);
+    
+        // Requests may carry usernames and MACs
+        memset(conn, 0, sizeof(*conn));
+        free(conn);
     }
-    hex_result[len * 2] = '\0';
+}
+
+/*
+ * Function to push a connection's idle deadline forward
+ * Every reading connection gets the same timeout, so appending to the tail
+ * keeps the idle list sorted by deadline
+ */
+void touch_connection(connection_t* conn) {
+    if (conn->list) {
+        list_remove(conn->list, conn);
+    }
+    conn->deadline_ms = monotonic_ms() + idle_timeout_ms;
+    list_append(&idle_list, conn);
+}
+
+/*
+ * Function to send a token broker response
+ */
+void send_broker_response(int client_sock, int status, const token_entry_t* entry) {
+    tapin_broker_response_t response;
+    
+    memset(&response, 0, sizeof(response));
+    response.version = TAPIN_BROKER_VERSION;
+    response.status = status;
+    if (entry) {
+        response.expiry = entry->expiry;
+        memcpy(response.token, entry->token, sizeof(response.token));
+    }
+    
+    send(client_sock, &response, sizeof(response), MSG_NOSIGNAL);
+    
+    // Don't leave the token lying around in stack memory
+    memset(&response, 0, sizeof(response));
+}
+
+/*
+ * Function to answer and close a parked wait request
+ */
+void release_broker_waiter(connection_t* conn, int status, const token_entry_t* entry) {
+    send_broker_response(conn->fd, status, entry);
+    close_connection(conn);
+}
+
+/*
+ * Function to give a freshly issued token to the oldest request waiting for it
+ */
+void wake_broker_waiters(const char* username) {
+    const tapin_broker_request_t* request;
+    token_entry_t entry;
+    connection_t* conn;
+    
+    for (conn = waiter_list.head; conn; conn = conn->next) {
+        request = &conn->buffer.request;
+        if (strcmp(request->username, username) != 0) {
+            continue;
+        }
     
-    // Use constant-time comparison to prevent timing attacks
-    size_t hmac_len = strlen(received_hmac);
-    if (strlen(hex_result) != hmac_len) {
-        return 0; // Different lengths, not equal
+        if (token_store_take(request->username, request->service, request->tty, &entry)) {
+            async_log(LOG_INFO, "Authentication token consumed for user: %s (service: %s)", username,
+                      request->service[0] ? request->service : "unknown");
+            release_broker_waiter(conn, TAPIN_BROKER_OK, &entry);
+            memset(&entry, 0, sizeof(entry));
+        }
+        return;
     }
+}
+
+/*
+ * Function to give every waiting request a token, if one is pending for it
+ */
+void serve_broker_waiters() {
+    const tapin_broker_request_t* request;
+    token_entry_t entry;
+    connection_t *conn, *next_conn;
     
-    // Perform constant-time comparison
-    unsigned char result = 0;
-    for (i = 0; i < hmac_len; i++) {
-        result |= hex_result[i] ^ received_hmac[i];
+    // Oldest first, so each user's token goes to their longest wait
+    for (conn = waiter_list.head; conn; conn = next_conn) {
+        next_conn = conn->next;
+        request = &conn->buffer.request;
+        if (token_store_take(request->username, request->service, request->tty, &entry)) {
+            async_log(LOG_INFO, "Authentication token consumed for user: %s (service: %s)", request->username,
+                      request->service[0] ? request->service : "unknown");
+            release_broker_waiter(conn, TAPIN_BROKER_OK, &entry);
+            memset(&entry, 0, sizeof(entry));
+        }
     }
-    return result == 0;
 }
 
 /*
- * Function to validate the authentication request
+ * Function to give tokens issued by session workers to waiting requests
+ * Workers only bump the eventfd, so check every waiter; there are few
  */
-int validate_auth_request(struct json_object* json_obj) {
-    struct json_object *username_obj, *timestamp_obj, *nonce_obj, *hmac_obj;
-    const char *username, *timestamp_str, *nonce, *hmac, *secret;
-    long timestamp, current_time;
-    char data_to_verify[256];
+void handle_token_wake(int fd) {
+    uint64_t count;
     
-    // Extract fields from JSON
-    if (!json_object_object_get_ex(json_obj, "username", &username_obj) ||
-        !json_object_object_get_ex(json_obj, "timestamp", &timestamp_obj) ||
-        !json_object_object_get_ex(json_obj, "nonce", &nonce_obj) ||
-        !json_object_object_get_ex(json_obj, "hmac", &hmac_obj)) {
-        syslog(LOG_ERR, "Missing required fields in authentication request");
-        return 0;
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        async_log(LOG_ERR, "Failed to read token wakeup: %s", strerror(errno));
     }
+    serve_broker_waiters();
+}
+
+/*
+ * Function to close timed-out connections and return the number of
+ * milliseconds until the next deadline (or -1 if there is none)
+ */
+long long expire_connections(long long now) {
+    long long next = -1;
+    connection_t *conn, *next_conn;
     
-    username = json_object_get_string(username_obj);
-    timestamp_str = json_object_get_string(timestamp_obj);
-    nonce = json_object_get_string(nonce_obj);
-    hmac = json_object_get_string(hmac_obj);
+    // Idle list is sorted, so stop at the first live connection
+    while (idle_list.head && idle_list.head->deadline_ms <= now) {
+        close_connection(idle_list.head);
+    }
+    if (idle_list.head) {
+        next = idle_list.head->deadline_ms - now;
+    }
     
-    if (!username || !timestamp_str || !nonce || !hmac) {
-        syslog(LOG_ERR, "Invalid field types in authentication request");
-        return 0;
+    // Waiters have individual timeouts; there are few of them
+    for (conn = waiter_list.head; conn; conn = next_conn) {
+        next_conn = conn->next;
+        if (conn->deadline_ms <= now) {
+            release_broker_waiter(conn, TAPIN_BROKER_NO_TOKEN, NULL);
+        } else if (next < 0 || conn->deadline_ms - now < next) {
+            next = conn->deadline_ms - now;
+        }
     }
     
-    // Convert timestamp to long
-    timestamp = atol(timestamp_str);
+    return next;
+}
+
+/*
+ * Function to count the parked requests from one peer uid
+ */
+int count_uid_waiters(uid_t uid) {
+    const connection_t* conn;
+    int count = 0;
+    
+    for (conn = waiter_list.head; conn; conn = conn->next) {
+        if (conn->peer_uid == uid) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/*
+ * Function to park a wait request until a token arrives or it times out
+ * Each uid but root gets a few of the slots, so one local user cannot
+ * fill them all; root is the login services themselves
+ * Returns 1 if the request was parked, 0 if there is no room
+ */
+int park_broker_waiter(connection_t* conn) {
+    const tapin_broker_request_t* request = &conn->buffer.request;
+    uint32_t wait_ms = request->wait_ms;
+    uid_t uid;
     
-    // Check timestamp validity (within 30 seconds)
-    time(&current_time);
-    if (abs(current_time - timestamp) > 30) {
-        syslog(LOG_ERR, "Authentication request timestamp is too old or in the future");
+    if (waiter_count == MAX_BROKER_WAITERS) {
+        async_log(LOG_WARNING, "Too many PAM requests waiting for a tap, rejecting wait for user: %s", request->username);
         return 0;
     }
     
-    // Read shared secret
-    secret = read_shared_secret();
-    if (!secret) {
-        syslog(LOG_ERR, "Could not read shared secret for HMAC validation");
+    if (broker_peer_uid(conn->fd, &uid) < 0) {
+        return 0;
+    }
+    if (uid != 0 && count_uid_waiters(uid) >= MAX_BROKER_WAITERS_PER_UID) {
+        async_log(LOG_WARNING, "Too many PAM requests waiting for a tap from uid %u, rejecting wait for user: %s",
+                  (unsigned int)uid, request->username);
         return 0;
     }
     
-    // Prepare data for HMAC verification (username:timestamp:nonce)
-    snprintf(data_to_verify, sizeof(data_to_verify), "%s:%s:%s", username, timestamp_str, nonce);
+    if (wait_ms > TAPIN_BROKER_MAX_WAIT_MS) {
+        wait_ms = TAPIN_BROKER_MAX_WAIT_MS;
+    }
     
-    // Validate HMAC
-    if (!validate_hmac(data_to_verify, hmac, secret)) {
-        syslog(LOG_ERR, "HMAC validation failed for authentication request");
-        return 0;
+    list_remove(&idle_list, conn);
+    conn->parked = 1;
+    conn->peer_uid = uid;
+    conn->deadline_ms = monotonic_ms() + wait_ms;
+    list_append(&waiter_list, conn);
+    waiter_count++;
+    
+    // Tell the PAM module to prompt the user while it waits
+    send_broker_response(conn->fd, TAPIN_BROKER_PENDING, NULL);
+    return 1;
+}
+
+/*
+ * Function to serve one complete token broker request from the PAM module
+ * Returns 1 if the connection was parked as a waiter and must stay open
+ */
+int handle_broker_request(connection_t* conn) {
+    tapin_broker_request_t* request = &conn->buffer.request;
+    token_entry_t entry;
+    int status = TAPIN_BROKER_BAD_REQUEST;
+    
+    // Terminate all strings regardless of what the client sent
+    request->username[sizeof(request->username) - 1] = '\0';
+    request->service[sizeof(request->service) - 1] = '\0';
+    request->tty[sizeof(request->tty) - 1] = '\0';
+    
+    memset(&entry, 0, sizeof(entry));
+    
+    if (request->version != TAPIN_BROKER_VERSION ||
+        (request->op != TAPIN_BROKER_OP_CONSUME && request->op != TAPIN_BROKER_OP_WAIT) ||
+        request->username[0] == '\0') {
+        async_log(LOG_ERR, "Malformed token broker request");
+    } else if (!broker_peer_allowed(conn->fd, request->username)) {
+        async_log(LOG_WARNING, "Token broker request for user %s denied by peer credentials", request->username);
+        status = TAPIN_BROKER_DENIED;
+    } else if (token_store_take(request->username, request->service, request->tty, &entry)) {
+        status = TAPIN_BROKER_OK;
+        async_log(LOG_INFO, "Authentication token consumed for user: %s (service: %s)", request->username,
+                  request->service[0] ? request->service : "unknown");
+    } else if (request->op == TAPIN_BROKER_OP_WAIT && request->wait_ms > 0) {
+        if (park_broker_waiter(conn)) {
+            return 1;
+        }
+        status = TAPIN_BROKER_BUSY;
+    } else {
+        status = TAPIN_BROKER_NO_TOKEN;
     }
     
-    syslog(LOG_INFO, "Authentication request validated successfully for user: %s", username);
+    send_broker_response(conn->fd, status, status == TAPIN_BROKER_OK ? &entry : NULL);
+    
+    // Don't leave the token lying around in stack memory
+    memset(&entry, 0, sizeof(entry));
+    return 0;
+}
+
+/*
+ * Function to queue a reply frame on a listener channel
+ */
+void queue_channel_reply(connection_t* conn, uint32_t request_id, int status) {
+    tapin_channel_header_t reply;
+    
+    reply.magic = TAPIN_CHANNEL_MAGIC;
+    reply.request_id = request_id;
+    reply.type = TAPIN_CHANNEL_AUTH_REPLY;
+    reply.status = status;
+    reply.length = 0;
+    
+    memcpy(conn->out + conn->out_length, &reply, sizeof(reply));
+    conn->out_length += sizeof(reply);
+}
+
+/*
+ * Function to write queued channel replies without blocking
+ * Returns 1 once all are written, 0 if the socket is full, -1 on error
+ */
+int flush_channel_replies(connection_t* conn) {
+    while (conn->out_length > 0) {
+        ssize_t n = send(conn->fd, conn->out, conn->out_length, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        memmove(conn->out, conn->out + n, conn->out_length - n);
+        conn->out_length -= n;
+    }
     return 1;
 }
 
 /*
- * Function to generate a random authentication token using /dev/urandom
+ * Function to answer every complete frame buffered on a listener channel
+ * Requests go to the verification workers when there are any, and are
+ * answered when they come back. Stops early while the reply queue, counting
+ * replies still with the workers, is full; returns 0 on a malformed frame
  */
-void generate_auth_token(char* token, size_t size) {
-    const char charset[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
-    FILE *urandom;
-    int i;
-    int random_byte;
+int process_channel_frames(connection_t* conn) {
+    tapin_channel_header_t header;
+    size_t offset = 0;
+    int ok = 1;
+    
+    while (conn->length - offset >= sizeof(header) &&
+           conn->out_length + (conn->pending + 1) * sizeof(header) <= sizeof(conn->out)) {
+        memcpy(&header, conn->buffer.data + offset, sizeof(header));
+        if (header.magic != TAPIN_CHANNEL_MAGIC || header.length > TAPIN_CHANNEL_MAX_PAYLOAD) {
+            async_log(LOG_ERR, "Malformed frame on helper channel");
+            ok = 0;
+            break;
+        }
+        if (conn->length - offset < sizeof(header) + header.length) {
+            break;
+        }
+    
+        char* payload = conn->buffer.data + offset + sizeof(header);
+        int status = TAPIN_CHANNEL_BAD_FRAME;
+    
+        if (header.type == TAPIN_CHANNEL_AUTH_REQUEST) {
+            // Records may sit unaligned in the buffer
+            tapin_auth_record_t record;
+            if (header.length == sizeof(record)) {
+                memcpy(&record, payload, sizeof(record));
+                if (verify_pool_submit(conn, header.request_id, &record)) {
+                    memset(&record, 0, sizeof(record));
+                    conn->pending++;
+                    offset += sizeof(header) + header.length;
+                    continue;
+                }
     
-    // Open /dev/urandom for cryptographically secure random data
-    urandom = fopen("/dev/urandom", "r");
-    if (!urandom) {
-        // Fallback to less secure method if /dev/urandom is not available
-        syslog(LOG_WARNING, "Could not open /dev/urandom, using less secure random");
-        time_t t;
-        srand((unsigned) time(&t));
-        
-        for (i = 0; i < size - 1; i++) {
-            int key = rand() % (int)(sizeof charset - 1);
-            token[i] = charset[key];
+                // No workers, or all of them are backed up: verify here
+                status = TAPIN_CHANNEL_REJECTED;
+                if (process_auth_request(&record, sizeof(record))) {
+                    // Hand the token straight to a PAM request waiting for this user
+                    wake_broker_waiters(record.username);
+                    status = TAPIN_CHANNEL_OK;
+                }
+                memset(&record, 0, sizeof(record));
+            }
         }
-        token[size - 1] = '\0';
+    
+        queue_channel_reply(conn, header.request_id, status);
+        offset += sizeof(header) + header.length;
+    }
+    
+    memmove(conn->buffer.data, conn->buffer.data + offset, conn->length - offset);
+    conn->length -= offset;
+    return ok;
+}
+
+/*
+ * Function to flush a listener channel and decide what it waits for next
+ * A channel between frames may stay open indefinitely; one with a partial
+ * frame or unsent replies is subject to the idle timeout
+ */
+void settle_channel(connection_t* conn) {
+    int flushed = flush_channel_replies(conn);
+    
+    if (flushed < 0) {
+        close_connection(conn);
         return;
     }
     
-    for (i = 0; i < size - 1; i++) {
-        // Read a random byte and use it as an index
-        if (fread(&random_byte, sizeof(random_byte), 1, urandom) == 1) {
-            // Use the random byte to select a character from the charset
-            int key = (unsigned char)random_byte % (int)(sizeof charset - 1);
-            token[i] = charset[key];
-        } else {
-            // Fallback to a predictable character if random read fails
-            token[i] = 'x';
-        }
+    // Stop reading while replies are backed up
+    if (conn->writing != !flushed) {
+        struct epoll_event event;
+        event.events = flushed ? EPOLLIN | EPOLLRDHUP : EPOLLOUT;
+        event.data.ptr = conn;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+        conn->writing = !flushed;
     }
     
-    fclose(urandom);
-    token[size - 1] = '\0';
+    if (conn->writing || conn->length > 0) {
+        touch_connection(conn);
+    } else if (conn->list != &channel_list) {
+        list_remove(conn->list, conn);
+        list_append(&channel_list, conn);
+    }
 }
 
 /*
- * Function to create the authentication token file
+ * Function to read and answer frames from the Bluetooth listener
+ * Any number of requests may be pipelined, split across reads as they come
  */
-int create_auth_token_file(const char* username) {
-    FILE *file;
-    char token[MAX_TOKEN_LENGTH];
-    time_t expiry_time;
+void handle_channel_readable(connection_t* conn) {
+    size_t capacity = sizeof(conn->buffer.data) - 1;
     
-    // Generate random token
-    generate_auth_token(token, sizeof(token));
+    for (;;) {
+        if (!process_channel_frames(conn)) {
+            close_connection(conn);
+            return;
+        }
     
-    // Calculate expiry time
-    time(&expiry_time);
-    expiry_time += TOKEN_EXPIRY_SECONDS;
+        if (conn->length == capacity) {
+            // Input is backed up behind replies the listener hasn't read
+            int flushed = flush_channel_replies(conn);
+            if (flushed < 0) {
+                close_connection(conn);
+                return;
+            }
+            if (flushed == 0) {
+                break;
+            }
+            continue;
+        }
     
-    // Create token file
-    file = fopen(TOKEN_FILE, "w");
-    if (!file) {
-        syslog(LOG_ERR, "Could not create token file: %s", strerror(errno));
-        return 0;
+        ssize_t n = read(conn->fd, conn->buffer.data + conn->length, capacity - conn->length);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            close_connection(conn);
+            return;
+        }
+        if (n == 0) {
+            close_connection(conn);
+            return;
+        }
+    
+        conn->length += n;
+    }
+    
+    settle_channel(conn);
+}
+
+/*
+ * Function to resume a listener channel once its replies can be sent, or
+ * once verification workers have answered some of its requests
+ */
+void handle_connection_writable(connection_t* conn) {
+    if (flush_channel_replies(conn) < 0 || !process_channel_frames(conn)) {
+        close_connection(conn);
+        return;
     }
+    settle_channel(conn);
+}
+
+/*
+ * Function to send the verification workers' answers back down the
+ * channels their requests came from
+ * Replies for one channel usually come in a run, so each run is flushed
+ * with one write
+ */
+void handle_verified(void) {
+    connection_t *conn, *last = NULL;
+    verify_job_t job;
     
-    fprintf(file, "%s:%s:%ld\n", username, token, expiry_time);
-    fclose(file);
+    while (verify_pool_collect(&job)) {
+        conn = job.owner;
+        conn->pending--;
     
-    // Set appropriate permissions (only root can read)
-    chmod(TOKEN_FILE, 0600);
+        // Hand the token straight to a PAM request waiting for this user
+        if (job.status == TAPIN_CHANNEL_OK) {
+            wake_broker_waiters(job.record.username);
+        }
+        memset(&job.record, 0, sizeof(job.record));
     
-    syslog(LOG_INFO, "Authentication token created for user: %s, expires at: %ld", username, expiry_time);
-    return 1;
+        // A channel that has gone away is freed once nothing is pending
+        if (conn->closed) {
+            continue;
+        }
+        if (last && last != conn && !last->closed) {
+            handle_connection_writable(last);
+        }
+        queue_channel_reply(conn, job.request_id, job.status);
+        last = conn;
+    }
+    
+    if (last && !last->closed) {
+        handle_connection_writable(last);
+    }
 }
 
 /*
- * Main processing function
+ * Function to read whatever is available on a client connection and act
+ * on it once a complete request has arrived
+ * Requests may arrive split across any number of reads
  */
-int process_auth_request(const char* json_data) {
-    struct json_object *json_obj;
-    struct json_object *username_obj;
-    const char *username;
+void handle_connection_readable(connection_t* conn) {
+    size_t capacity = sizeof(conn->buffer.request);
     
-    // Parse JSON
-    json_obj = json_tokener_parse(json_data);
-    if (!json_obj) {
-        syslog(LOG_ERR, "Invalid JSON data received");
-        return 0;
+    if (conn->kind == CONN_HELPER) {
+        handle_channel_readable(conn);
+        return;
     }
     
-    // Validate the request
-    if (!validate_auth_request(json_obj)) {
-        json_object_put(json_obj);
-        return 0;
+    // A parked waiter only becomes readable when its client hangs up
+    if (conn->parked) {
+        close_connection(conn);
+        return;
+    }
+    
+    for (;;) {
+        ssize_t n = read(conn->fd, conn->buffer.data + conn->length, capacity - conn->length);
+    
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Wait for the rest of the request
+                touch_connection(conn);
+                return;
+            }
+            close_connection(conn);
+            return;
+        }
+    
+        if (n == 0) {
+            close_connection(conn);
+            return;
+        }
+    
+        conn->length += n;
+    
+        if (conn->length == capacity) {
+            if (!handle_broker_request(conn)) {
+                close_connection(conn);
+            }
+            return;
+        }
     }
+}
+
+/*
+ * Function to accept every pending connection on a listening socket
+ */
+void accept_connections(connection_t* listener) {
+    conn_kind_t kind = listener->kind == CONN_BROKER_LISTEN ? CONN_BROKER : CONN_HELPER;
     
-    // Extract username for token creation
-    json_object_object_get_ex(json_obj, "username", &username_obj);
-    username = json_object_get_string(username_obj);
+    for (;;) {
+        int client_sock = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE) {
+                // Out of descriptors: shed the oldest idle connection so the
+                // level-triggered listener doesn't spin
+                async_log(LOG_ERR, "Accept error: %s", strerror(errno));
+                if (idle_list.head) {
+                    close_connection(idle_list.head);
+                    continue;
+                }
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                async_log(LOG_ERR, "Accept error: %s", strerror(errno));
+            }
+            return;
+        }
     
-    // Create authentication token file
-    int result = create_auth_token_file(username);
+        connection_t* conn = calloc(1, sizeof(*conn));
+        if (!conn) {
+            close(client_sock);
+            continue;
+        }
+        conn->fd = client_sock;
+        conn->kind = kind;
     
-    // Clean up
-    json_object_put(json_obj);
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.ptr = conn;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_sock, &event) < 0) {
+            async_log(LOG_ERR, "Failed to watch client connection: %s", strerror(errno));
+            close(client_sock);
+            free(conn);
+            continue;
+        }
     
-    return result;
+        conn->deadline_ms = monotonic_ms() + idle_timeout_ms;
+        list_append(&idle_list, conn);
+        active_connections++;
+    }
 }
 
 /*
- * Function to create and listen on a Unix domain socket
+ * Function to validate a phone's request on a session worker, in combined mode
+ * Waiting PAM requests belong to the event loop, so it is woken to serve them
  */
-int setup_unix_socket() {
-    int sock;
+int forward_in_process(const tapin_auth_record_t* record) {
+    uint64_t one = 1;
+    
+    if (!process_auth_request(record, sizeof(*record))) {
+        return TAPIN_CHANNEL_REJECTED;
+    }
+    if (write(token_wake_fd, &one, sizeof(one)) < 0) {
+        async_log(LOG_ERR, "Failed to wake the event loop: %s", strerror(errno));
+    }
+    return TAPIN_CHANNEL_OK;
+}
+
+/*
+ * Function to accept every pending phone connection, in combined mode
+ * The listening socket is non-blocking, so this stops once the backlog is empty
+ */
+void accept_phones(connection_t* listener) {
+    char client_address[PEER_ADDRESS_LENGTH];
+    
+    for (;;) {
+        int client_sock = phone_transport->accept(listener->fd, client_address, sizeof(client_address));
+        if (client_sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                async_log(LOG_ERR, "Failed to accept connection: %s", strerror(errno));
+            }
+            return;
+        }
+    
+        phone_session_submit(client_sock, client_address);
+    }
+}
+
+/*
+ * Function to hand a single request to the running daemon
+ * Tokens live in the daemon's memory, so issuing one from a separate
+ * process means going through the daemon's socket
+ */
+int forward_to_daemon(const char* json_data) {
     struct sockaddr_un addr;
+    tapin_channel_header_t header;
+    tapin_auth_record_t record;
+    struct iovec iov[2];
+    size_t length = sizeof(record);
     
-    // Remove existing socket if it exists
-    unlink(SOCKET_PATH);
+    // Decode here, as the listener would
+    if (!auth_record_from_json(json_data, strlen(json_data), &record)) {
+        fprintf(stderr, "Malformed authentication request\n");
+        return 0;
+    }
     
-    // Create socket
-    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
     if (sock < 0) {
-        syslog(LOG_ERR, "Failed to create Unix socket: %s", strerror(errno));
-        return -1;
+        return 0;
     }
     
-    // Setup address structure
     memset(&addr, 0, sizeof(addr));
     addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, SOCKET_PATH, sizeof(addr.sun_path) - 1);
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", daemon_config()->helper_socket);
     
-    // Bind socket
-    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        syslog(LOG_ERR, "Failed to bind Unix socket: %s", strerror(errno));
+    header.magic = TAPIN_CHANNEL_MAGIC;
+    header.request_id = 1;
+    header.type = TAPIN_CHANNEL_AUTH_REQUEST;
+    header.status = 0;
+    header.length = (uint32_t)length;
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = &record;
+    iov[1].iov_len = length;
+    
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        writev(sock, iov, 2) != (ssize_t)(sizeof(header) + length)) {
+        fprintf(stderr, "Could not reach the helper daemon at %s: %s\n", addr.sun_path, strerror(errno));
         close(sock);
+        return 0;
+    }
+    
+    ssize_t bytes_received = recv(sock, &header, sizeof(header), MSG_WAITALL);
+    close(sock);
+    
+    return bytes_received == sizeof(header) && header.magic == TAPIN_CHANNEL_MAGIC &&
+           header.request_id == 1 && header.status == TAPIN_CHANNEL_OK;
+}
+
+/*
+ * Function to take phone connections in this process (combined mode)
+ * Returns the non-blocking listening socket, or -1 on failure
+ */
+int start_phones(const char* address, int backlog, const session_pool_config_t* pool_config,
+                 const char* bluez_dir, pairing_fallback_t pairing_fallback, int challenge) {
+    int sock = phone_transport->open(address, backlog);
+    if (sock < 0) {
         return -1;
     }
     
-    // Listen for connections
-    if (listen(sock, 5) < 0) {
-        syslog(LOG_ERR, "Failed to listen on Unix socket: %s", strerror(errno));
-        close(sock);
-        unlink(SOCKET_PATH);
+    // The event loop must never block in accept()
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    
+    token_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (token_wake_fd < 0) {
+        async_log(LOG_ERR, "Failed to create token wakeup: %s", strerror(errno));
+        phone_transport->close(sock, address);
         return -1;
     }
     
-    // Set secure permissions for socket - only root and the daemon user can access
-    chmod(SOCKET_PATH, 0600);
+    // Load paired devices up front so sessions never shell out on the hot path
+    if (phone_transport->check_pairing && !device_allowlist_start(bluez_dir, pairing_fallback)) {
+        async_log(LOG_WARNING, "Paired device list is not being kept up to date");
+    }
+    
+    if (!phone_session_start(phone_transport, pool_config, forward_in_process, challenge)) {
+        async_log(LOG_ERR, "Failed to start session workers");
+        device_allowlist_stop();
+        close(token_wake_fd);
+        token_wake_fd = -1;
+        phone_transport->close(sock, address);
+        return -1;
+    }
     
     return sock;
 }
 
+/*
+ * Function to stop taking phones and let running sessions finish
+ */
+void stop_phones(int sock, const char* address) {
+    phone_transport->close(sock, address);
+    phone_session_stop();
+    device_allowlist_stop();
+    close(token_wake_fd);
+    token_wake_fd = -1;
+}
+
+/*
+ * Function to put a new configuration into effect
+ * Requests and sessions already running keep the limits they started with
+ */
+void apply_config(const daemon_config_t* old, const daemon_config_t* config) {
+    connection_t* conn;
+    
+    __atomic_store_n(&async_log_level, config->log_level, __ATOMIC_RELAXED);
+    
+    // Pull in deadlines past a shorter timeout; capping them all at the
+    // same time keeps the idle list sorted
+    if (config->idle_timeout_ms < idle_timeout_ms) {
+        long long latest = monotonic_ms() + config->idle_timeout_ms;
+        for (conn = idle_list.head; conn; conn = conn->next) {
+            if (conn->deadline_ms > latest) {
+                conn->deadline_ms = latest;
+            }
+        }
+    }
+    idle_timeout_ms = config->idle_timeout_ms;
+    
+    auth_core_configure(config->timestamp_window_seconds, config->token_expiry_seconds, config->replay_rate);
+    
+    if (phone_transport) {
+        phone_session_configure(config->session_timeout_ms, config->keepalive_ms, config->max_message_length);
+    
+        // New limits start every phone over with a full bucket
+        if (memcmp(&old->admission, &config->admission, sizeof(config->admission)) != 0) {
+            admission_configure(&config->admission);
+        }
+    }
+    
+    if (strcmp(old->helper_socket, config->helper_socket) != 0 ||
+        strcmp(old->broker_socket, config->broker_socket) != 0 || old->rfcomm_channel != config->rfcomm_channel) {
+        async_log(LOG_NOTICE, "New socket settings take effect on the next restart or upgrade");
+    }
+}
+
+/*
+ * Function to reload the config file on SIGHUP
+ * A file that does not load leaves the running configuration in place
+ */
+void reload_config(const char* config_path, const daemon_config_t* overrides) {
+    const daemon_config_t *old = daemon_config();
+    const daemon_config_t *config;
+    
+    service_notify("RELOADING=1");
+    config = daemon_config_load(config_path, overrides);
+    if (config) {
+        apply_config(old, config);
+        async_log(LOG_INFO, "Reloaded %s", config_path);
+    } else {
+        async_log(LOG_ERR, "Keeping the running configuration");
+    }
+    service_notify("READY=1");
+}
+
+/*
+ * Callbacks handing pending tokens and remembered requests to a new image
+ */
+void save_token(const token_entry_t* entry, void* arg) {
+    (void)arg;
+    live_upgrade_put(UPGRADE_TOKEN, -1, entry, sizeof(*entry));
+}
+
+void save_replay(int64_t timestamp, const uint8_t* digest, void* arg) {
+    upgrade_replay_t replay;
+    (void)arg;
+    
+    replay.timestamp = timestamp;
+    memcpy(replay.digest, digest, sizeof(replay.digest));
+    live_upgrade_put(UPGRADE_REPLAY, -1, &replay, sizeof(replay));
+}
+
+/*
+ * Function to hand a list of client connections to a new image
+ * Verification workers must be done with them, so nothing is pending
+ */
+void save_connections(const connection_list_t* list, long long now) {
+    static char record[sizeof(saved_connection_t) + sizeof(((connection_t*)0)->buffer) +
+                       sizeof(((connection_t*)0)->out)];
+    saved_connection_t saved;
+    const connection_t* conn;
+    
+    for (conn = list->head; conn; conn = conn->next) {
+        memset(&saved, 0, sizeof(saved));
+        saved.kind = conn->kind;
+        saved.parked = conn->parked;
+        saved.wait_ms = conn->parked && conn->deadline_ms > now ? conn->deadline_ms - now : 0;
+        saved.length = (uint32_t)conn->length;
+        saved.out_length = (uint32_t)conn->out_length;
+    
+        memcpy(record, &saved, sizeof(saved));
+        memcpy(record + sizeof(saved), conn->buffer.data, conn->length);
+        memcpy(record + sizeof(saved) + conn->length, conn->out, conn->out_length);
+        live_upgrade_put(UPGRADE_CONNECTION, conn->fd, record, sizeof(saved) + conn->length + conn->out_length);
+    }
+    
+    // Requests may carry usernames and MACs
+    memset(record, 0, sizeof(record));
+}
+
+/*
+ * Callbacks taking back the tokens and remembered requests the previous
+ * image handed over; tokens that expired meanwhile are dropped
+ */
+void restore_token(const void* data, size_t length, int fd, void* arg) {
+    token_entry_t entry;
+    (void)fd;
+    
+    if (length != sizeof(entry)) {
+        return;
+    }
+    memcpy(&entry, data, sizeof(entry));
+    if (entry.expiry > *(const time_t*)arg) {
+        token_store_put(entry.username, entry.service, entry.tty, entry.token, entry.expiry);
+    }
+    memset(&entry, 0, sizeof(entry));
+}
+
+void restore_replay(const void* data, size_t length, int fd, void* arg) {
+    upgrade_replay_t replay;
+    (void)fd;
+    (void)arg;
+    
+    if (length == sizeof(replay)) {
+        memcpy(&replay, data, sizeof(replay));
+        auth_core_restore_replay(replay.timestamp, replay.digest);
+    }
+}
+
+/*
+ * Function to take back a client connection the previous image was serving
+ * Parked requests keep what was left of their wait; the idle timeout of
+ * any other connection starts over
+ */
+void restore_connection(const void* data, size_t length, int fd, void* arg) {
+    saved_connection_t saved;
+    struct epoll_event event;
+    connection_t* conn;
+    (void)arg;
+    
+    if (fd < 0) {
+        return;
+    }
+    conn = calloc(1, sizeof(*conn));
+    if (length >= sizeof(saved)) {
+        memcpy(&saved, data, sizeof(saved));
+    }
+    if (!conn || length < sizeof(saved) || (saved.kind != CONN_HELPER && saved.kind != CONN_BROKER) ||
+        saved.length >= sizeof(conn->buffer) || saved.out_length > sizeof(conn->out) ||
+        length != sizeof(saved) + saved.length + saved.out_length) {
+        async_log(LOG_ERR, "Dropping a connection the previous image described wrongly");
+        close(fd);
+        free(conn);
+        return;
+    }
+    
+    conn->fd = fd;
+    conn->kind = saved.kind;
+    conn->length = saved.length;
+    conn->out_length = saved.out_length;
+    memcpy(conn->buffer.data, (const char*)data + sizeof(saved), saved.length);
+    memcpy(conn->out, (const char*)data + sizeof(saved) + saved.length, saved.out_length);
+    
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        async_log(LOG_ERR, "Failed to watch client connection: %s", strerror(errno));
+        close(fd);
+        memset(conn, 0, sizeof(*conn));
+        free(conn);
+        return;
+    }
+    active_connections++;
+    
+    if (saved.parked) {
+        // The peer is still there; its uid need not be handed over
+        if (broker_peer_uid(fd, &conn->peer_uid) < 0) {
+            conn->peer_uid = 0;
+        }
+        conn->parked = 1;
+        conn->deadline_ms = monotonic_ms() + saved.wait_ms;
+        list_append(&waiter_list, conn);
+        waiter_count++;
+    } else if (conn->kind == CONN_HELPER) {
+        // Send what the previous image could not, and answer any whole
+        // frames it had read
+        touch_connection(conn);
+        handle_connection_writable(conn);
+    } else {
+        touch_connection(conn);
+    }
+}
+
+/*
+ * Function to replace this process with the binary now installed, handing
+ * it the listening sockets, client connections and everything pending
+ * Verification workers and session workers must have finished
+ * Returns only if the new binary could not be started
+ */
+void upgrade_in_place(const connection_t* helper_listener, const connection_t* broker_listener,
+                      const connection_t* phone_listener) {
+    long long now = monotonic_ms();
+    
+    if (helper_listener->fd >= 0) {
+        live_upgrade_put_listener(helper_listener->fd);
+    }
+    live_upgrade_put_listener(broker_listener->fd);
+    if (phone_listener->fd >= 0) {
+        live_upgrade_put_listener(phone_listener->fd);
+    }
+    
+    // Tokens before connections, so restored waiters find them
+    token_store_each(save_token, NULL);
+    auth_core_each_replay(save_replay, NULL);
+    save_connections(&waiter_list, now);
+    save_connections(&idle_list, now);
+    save_connections(&channel_list, now);
+    
+    // Sealed segments are indexed, and nothing is left in the ring
+    audit_journal_close();
+    async_log_stop();
+    live_upgrade_exec();
+}
+
+void print_usage(const char* program) {
+    fprintf(stderr, "Usage: %s [--config PATH] [--backlog N] [--idle-timeout MS] [--replay-rate N] [--keystore PATH]\n"
+                    "          [--stats-socket PATH] [--log-level err|warning|notice|info|debug]\n"
+                    "          [--helper-socket PATH] [--broker-socket PATH]\n"
+                    "          [--verify-workers N] [--pin-workers] [--audit-dir PATH] [--audit-segments N]\n"
+                    "          [--audit-segment-records N]\n"
+                    "          [--transport rfcomm|unix:PATH [--workers N] [--queue N] [--session-timeout MS]\n"
+                    "           [--keepalive MS] [--bluez-dir PATH] [--pairing-fallback bluetoothctl|none]\n"
+                    "           [--listener-stats-socket PATH] [--device-rate N] [--device-burst N]\n"
+                    "           [--user-rate N] [--user-burst N] [--challenge]]\n", program);
+    fprintf(stderr, "       %s --process-auth-request < request.json\n", program);
+    fprintf(stderr, "       %s --process-auth-request --batch [--input FILE] [-j|--jobs N] [--keystore PATH]\n"
+                    "          [--replay-rate N] [--any-time]\n", program);
+}
+
+/*
+ * Function to check a file or stream of requests in this process
+ * Nothing is sent to the daemon and no tokens are issued; each request gets
+ * a result line on stdout (see auth_batch.h)
+ * Returns the exit status: 0 if every request was valid
+ */
+int run_batch(const char* program, int argc, char *argv[]) {
+    static const struct option batch_options[] = {
+        { "batch", no_argument, NULL, 'B' },
+        { "input", required_argument, NULL, 'I' },
+        { "jobs", required_argument, NULL, 'j' },
+        { "keystore", required_argument, NULL, 'k' },
+        { "replay-rate", required_argument, NULL, 'r' },
+        { "any-time", no_argument, NULL, 'a' },
+        { NULL, 0, NULL, 0 }
+    };
+    auth_batch_config_t config = { (int)sysconf(_SC_NPROCESSORS_ONLN), 1 };
+    const daemon_config_t *settings;
+    daemon_config_t overrides;
+    const char *keystore_path = KEYSTORE_PATH;
+    const char *input = NULL;
+    int batch = 0, fd = STDIN_FILENO, ok, opt;
+    
+    daemon_config_unset(&overrides);
+    
+    // argv[0] is --process-auth-request here, so report errors with the usage
+    opterr = 0;
+    while ((opt = getopt_long(argc, argv, "j:", batch_options, NULL)) != -1) {
+        switch (opt) {
+        case 'B':
+            batch = 1;
+            break;
+        case 'I':
+            input = optarg;
+            break;
+        case 'j':
+            config.jobs = atoi(optarg);
+            break;
+        case 'k':
+            keystore_path = optarg;
+            break;
+        case 'r':
+            overrides.replay_rate = atoi(optarg);
+            break;
+        case 'a':
+            // Captured traffic is older than the timestamp window
+            config.check_timestamps = 0;
+            break;
+        default:
+            print_usage(program);
+            return 1;
+        }
+    }
+    if (!batch || optind < argc || config.jobs <= 0 || daemon_config_invalid(&overrides)) {
+        print_usage(program);
+        return 1;
+    }
+    if (config.jobs > AUTH_BATCH_MAX_JOBS) {
+        config.jobs = AUTH_BATCH_MAX_JOBS;
+    }
+    
+    if (input) {
+        fd = open(input, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "Could not open %s: %s\n", input, strerror(errno));
+            return 1;
+        }
+    }
+    
+    // Key errors go to stderr too; per-request results are printed, and the
+    // decoder's complaints about bad lines are not logged at all
+    openlog("tapin_helper", LOG_PID | LOG_PERROR, LOG_DAEMON);
+    
+    // The same window and replay cache as the daemon
+    settings = daemon_config_load(DAEMON_CONFIG_FILE, &overrides);
+    async_log_level = LOG_CRIT;
+    if (!settings || !auth_core_configure(settings->timestamp_window_seconds, settings->token_expiry_seconds,
+                                          settings->replay_rate) ||
+        !auth_core_start(keystore_path, settings->replay_rate)) {
+        if (input) {
+            close(fd);
+        }
+        daemon_config_free();
+        closelog();
+        return 1;
+    }
+    
+    // Workers share the prepared keys without taking a lock
+    if (!key_cache_preload()) {
+        fprintf(stderr, "No usable keys in %s or %s\n", keystore_path, AUTH_CORE_SHARED_SECRET_FILE);
+        auth_core_stop();
+        if (input) {
+            close(fd);
+        }
+        daemon_config_free();
+        closelog();
+        return 1;
+    }
+    
+    ok = auth_batch_run(fd, stdout, &config);
+    
+    auth_core_stop();
+    if (input) {
+        close(fd);
+    }
+    daemon_config_free();
+    closelog();
+    return ok ? 0 : 1;
+}
+
 /*
  * Main function for the helper daemon
- * Listens for requests from the Bluetooth daemon via Unix socket
+ * Serves the Bluetooth listener (or, in combined mode, phones) and the PAM
+ * module from a single epoll loop
  */
 int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "config", required_argument, NULL, 'C' },
+        { "backlog", required_argument, NULL, 'b' },
+        { "idle-timeout", required_argument, NULL, 'i' },
+        { "replay-rate", required_argument, NULL, 'r' },
+        { "keystore", required_argument, NULL, 'k' },
+        { "stats-socket", required_argument, NULL, 'm' },
+        { "log-level", required_argument, NULL, 'l' },
+        { "transport", required_argument, NULL, 't' },
+        { "workers", required_argument, NULL, 'w' },
+        { "queue", required_argument, NULL, 'q' },
+        { "session-timeout", required_argument, NULL, 's' },
+        { "keepalive", required_argument, NULL, 'K' },
+        { "bluez-dir", required_argument, NULL, 'd' },
+        { "pairing-fallback", required_argument, NULL, 'f' },
+        { "listener-stats-socket", required_argument, NULL, 'n' },
+        { "device-rate", required_argument, NULL, 'D' },
+        { "device-burst", required_argument, NULL, 'E' },
+        { "user-rate", required_argument, NULL, 'U' },
+        { "user-burst", required_argument, NULL, 'V' },
+        { "verify-workers", required_argument, NULL, 'W' },
+        { "pin-workers", no_argument, NULL, 'P' },
+        { "audit-dir", required_argument, NULL, 'a' },
+        { "audit-segments", required_argument, NULL, 'A' },
+        { "audit-segment-records", required_argument, NULL, 'R' },
+        { "challenge", no_argument, NULL, 'c' },
+        { "helper-socket", required_argument, NULL, 'H' },
+        { "broker-socket", required_argument, NULL, 'B' },
+        { NULL, 0, NULL, 0 }
+    };
+    session_pool_config_t pool_config = { DEFAULT_WORKERS, DEFAULT_QUEUE_SIZE, 0, 0 };
+    daemon_config_t overrides;
+    const daemon_config_t *config;
+    const char *config_path = DAEMON_CONFIG_FILE;
+    const char *helper_socket, *broker_socket;
+    char rfcomm_channel[16], run_dir[DAEMON_CONFIG_PATH_LENGTH];
+    int backlog = DEFAULT_LISTEN_BACKLOG;
+    const char *keystore_path = KEYSTORE_PATH;
+    const char *stats_socket = DEFAULT_STATS_SOCKET;
+    const char *listener_stats_socket = DEFAULT_LISTENER_STATS_SOCKET;
+    const char *phone_address = NULL;
+    const char *bluez_dir = BLUEZ_STORAGE_DIR;
+    pairing_fallback_t pairing_fallback = PAIRING_FALLBACK_BLUETOOTHCTL;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int verify_workers = cpus > 1 ? (cpus < VERIFY_POOL_MAX_WORKERS ? cpus : VERIFY_POOL_MAX_WORKERS) : 0;
+    int pin_workers = 0;
+    const char *audit_dir = AUDIT_JOURNAL_DIR;
+    int audit_segments = AUDIT_DEFAULT_SEGMENTS;
+    long audit_segment_records = AUDIT_DEFAULT_SEGMENT_RECORDS;
+    int challenge = 0, upgrading = 0, status = 0;
+    int opt;
+    
     // Check if we're running in process mode (for direct execution from Bluetooth daemon)
     if (argc > 1 && strcmp(argv[1], "--process-auth-request") == 0) {
+        // Any further option selects batch mode
+        if (argc > 2) {
+            return run_batch(argv[0], argc - 1, argv + 1);
+        }
+    
+        // The daemon's socket and message limit come from its config file
+        openlog("tapin_helper", LOG_PID | LOG_PERROR, LOG_DAEMON);
+        if (!daemon_config_load(DAEMON_CONFIG_FILE, NULL)) {
+            return 1;
+        }
+    
         // Read JSON from stdin
-        char buffer[MAX_JSON_LENGTH];
+        char buffer[SESSION_FRAME_MAX + 1];
         if (fgets(buffer, sizeof(buffer), stdin) != NULL) {
-            if (process_auth_request(buffer)) {
+            if (strlen(buffer) > (size_t)daemon_config()->max_message_length) {
+                printf("Authentication request is too long\n");
+                return 1;
+            }
+            if (forward_to_daemon(buffer)) {
                 printf("Authentication processed successfully\n");
                 return 0;
             } else {
@@ -332,79 +1447,478 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     
+    // An upgrade runs this binary again with the same arguments
+    live_upgrade_init(argv);
+    daemon_config_unset(&overrides);
+    
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'C':
+            config_path = optarg;
+            break;
+        case 'b':
+            backlog = atoi(optarg);
+            break;
+        case 'i':
+            overrides.idle_timeout_ms = atoi(optarg);
+            break;
+        case 'r':
+            overrides.replay_rate = atoi(optarg);
+            break;
+        case 'k':
+            keystore_path = optarg;
+            break;
+        case 'm':
+            stats_socket = optarg;
+            break;
+        case 'l':
+            overrides.log_level = async_log_level_from_name(optarg);
+            if (overrides.log_level < 0) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 't':
+            if (strncmp(optarg, "unix:", 5) == 0 && optarg[5] != '\0') {
+                phone_transport = &unix_transport;
+                phone_address = optarg + 5;
+            } else if (strcmp(optarg, "rfcomm") == 0) {
+                phone_transport = &rfcomm_transport;
+                phone_address = NULL;
+            } else {
+                print_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'w':
+            pool_config.workers = atoi(optarg);
+            break;
+        case 'q':
+            pool_config.queue_size = atoi(optarg);
+            break;
+        case 's':
+            overrides.session_timeout_ms = atoi(optarg);
+            break;
+        case 'K':
+            overrides.keepalive_ms = atoi(optarg);
+            break;
+        case 'd':
+            bluez_dir = optarg;
+            break;
+        case 'f':
+            if (strcmp(optarg, "bluetoothctl") == 0) {
+                pairing_fallback = PAIRING_FALLBACK_BLUETOOTHCTL;
+            } else if (strcmp(optarg, "none") == 0) {
+                pairing_fallback = PAIRING_FALLBACK_NONE;
+            } else {
+                print_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'n':
+            listener_stats_socket = optarg;
+            break;
+        case 'D':
+            overrides.admission.device_rate = atoi(optarg);
+            break;
+        case 'E':
+            overrides.admission.device_burst = atoi(optarg);
+            break;
+        case 'U':
+            overrides.admission.user_rate = atoi(optarg);
+            break;
+        case 'V':
+            overrides.admission.user_burst = atoi(optarg);
+            break;
+        case 'W':
+            verify_workers = atoi(optarg);
+            break;
+        case 'P':
+            pin_workers = 1;
+            break;
+        case 'a':
+            audit_dir = optarg;
+            break;
+        case 'A':
+            audit_segments = atoi(optarg);
+            break;
+        case 'R':
+            audit_segment_records = atol(optarg);
+            break;
+        case 'c':
+            challenge = 1;
+            break;
+        case 'H':
+            if (strlen(optarg) >= sizeof(overrides.helper_socket)) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            strcpy(overrides.helper_socket, optarg);
+            break;
+        case 'B':
+            if (strlen(optarg) >= sizeof(overrides.broker_socket)) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            strcpy(overrides.broker_socket, optarg);
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (backlog <= 0 || pool_config.workers <= 0 || pool_config.queue_size <= 0 || daemon_config_invalid(&overrides) ||
+        verify_workers < 0 || verify_workers > VERIFY_POOL_MAX_WORKERS ||
+        audit_segments <= 0 || audit_segment_records <= 0 || audit_segment_records > AUDIT_MAX_SEGMENT_RECORDS) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
     // Open syslog
     openlog("tapin_helper", LOG_PID, LOG_DAEMON);
     
-    syslog(LOG_INFO, "TapIn Helper Daemon starting");
+    // The command line wins over the file, now and on every reload
+    config = daemon_config_load(config_path, &overrides);
+    if (!config) {
+        closelog();
+        return 1;
+    }
+    async_log_level = config->log_level;
+    idle_timeout_ms = config->idle_timeout_ms;
+    pool_config.session_timeout_ms = config->session_timeout_ms;
+    pool_config.keepalive_ms = config->keepalive_ms;
+    if (phone_transport && !phone_address) {
+        snprintf(rfcomm_channel, sizeof(rfcomm_channel), "%d", config->rfcomm_channel);
+        phone_address = rfcomm_channel;
+    }
     
-    // Set up signal handlers
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
+    // A reload may name other sockets; these are what get cleaned up
+    helper_socket = config->helper_socket;
+    broker_socket = config->broker_socket;
+    
+    async_log(LOG_INFO, "TapIn Helper Daemon starting%s", phone_transport ? " in combined mode" : "");
+    
+    // Sockets systemd made for us, if it started us through a socket unit,
+    // and what the image this one upgraded from left
+    service_listen_start();
+    live_upgrade_resume();
+    
+    // A phone that drops mid-reply must not kill the daemon
+    signal(SIGPIPE, SIG_IGN);
+    
+    // Replay cache and keys
+    auth_core_configure(config->timestamp_window_seconds, config->token_expiry_seconds, config->replay_rate);
+    if (!auth_core_start(keystore_path, config->replay_rate)) {
+        daemon_config_free();
+        closelog();
+        return 1;
+    }
+    
+    // Tokens still waiting for PAM, and requests that must not be accepted
+    // again, from the previous image
+    time_t started = time(NULL);
+    live_upgrade_each(UPGRADE_TOKEN, restore_token, &started);
+    live_upgrade_each(UPGRADE_REPLAY, restore_replay, NULL);
+    
+    // Without a journal requests are still served, just not recorded
+    if (audit_dir[0] != '\0' && !audit_journal_open(audit_dir, audit_segment_records, audit_segments)) {
+        async_log(LOG_WARNING, "Running without an audit journal");
+    }
     
     // Setup Unix socket for communication with Bluetooth daemon
-    int unix_sock = setup_unix_socket();
-    if (unix_sock < 0) {
-        syslog(LOG_ERR, "Failed to setup Unix socket");
+    // Only root and the daemon user can access it; the combined daemon
+    // takes phones itself and does not open it
+    connection_t helper_listener = { .kind = CONN_HELPER_LISTEN, .fd = -1 };
+    if (!phone_transport) {
+        helper_listener.fd = setup_unix_socket(helper_socket, 0600, backlog);
+        if (helper_listener.fd < 0) {
+            async_log(LOG_ERR, "Failed to setup Unix socket");
+            audit_journal_close();
+            auth_core_stop();
+            daemon_config_free();
+            closelog();
+            return 1;
+        }
+    }
+    
+    // Setup the token broker socket for the PAM module
+    // Anyone may connect; access is checked per request with SO_PEERCRED
+    snprintf(run_dir, sizeof(run_dir), "%s", broker_socket);
+    mkdir(dirname(run_dir), 0755);
+    connection_t broker_listener = { .kind = CONN_BROKER_LISTEN };
+    broker_listener.fd = setup_unix_socket(broker_socket, 0666, backlog);
+    if (broker_listener.fd < 0) {
+        async_log(LOG_ERR, "Failed to setup token broker socket");
+        if (helper_listener.fd >= 0) {
+            close_unix_socket(helper_listener.fd, helper_socket);
+        }
+        audit_journal_close();
+        auth_core_stop();
+        daemon_config_free();
+        closelog();
+        return 1;
+    }
+    
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        async_log(LOG_ERR, "Failed to create epoll instance: %s", strerror(errno));
+    }
+    
+    // Shutdown signals arrive as events, so the loop never has to wake up
+    // to look for them; threads started from here on inherit the mask
+    connection_t signals = { .kind = CONN_SIGNAL, .fd = epoll_fd >= 0 ? service_signal_fd() : -1 };
+    if (signals.fd < 0) {
+        if (epoll_fd >= 0) {
+            close(epoll_fd);
+        }
+        if (helper_listener.fd >= 0) {
+            close_unix_socket(helper_listener.fd, helper_socket);
+        }
+        close_unix_socket(broker_listener.fd, broker_socket);
+        audit_journal_close();
+        auth_core_stop();
+        daemon_config_free();
         closelog();
         return 1;
     }
     
-    syslog(LOG_INFO, "TapIn Helper Daemon listening on Unix socket: %s", SOCKET_PATH);
+    // Phones, their session workers and the wakeup they send tokens through
+    connection_t phone_listener = { .kind = CONN_PHONE_LISTEN, .fd = -1 };
+    if (phone_transport) {
+        admission_configure(&config->admission);
+        phone_listener.fd = start_phones(phone_address, backlog, &pool_config, bluez_dir, pairing_fallback,
+                                          challenge);
+        phone_session_configure(config->session_timeout_ms, config->keepalive_ms, config->max_message_length);
+        if (phone_listener.fd < 0) {
+            close(signals.fd);
+            close(epoll_fd);
+            close_unix_socket(broker_listener.fd, broker_socket);
+            audit_journal_close();
+            auth_core_stop();
+            daemon_config_free();
+            closelog();
+            return 1;
+        }
+    }
+    
+    // Anything passed in that this layout doesn't listen on
+    service_listen_finish();
+    
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &signals;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signals.fd, &event);
+    event.data.ptr = &broker_listener;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, broker_listener.fd, &event);
+    
+    if (helper_listener.fd >= 0) {
+        event.data.ptr = &helper_listener;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, helper_listener.fd, &event);
+    }
+    
+    connection_t token_wake = { .kind = CONN_TOKEN_WAKE, .fd = token_wake_fd };
+    if (phone_listener.fd >= 0) {
+        event.data.ptr = &phone_listener;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, phone_listener.fd, &event);
+        event.data.ptr = &token_wake;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, token_wake.fd, &event);
+    }
+    
+    // Listener requests are verified on worker threads; combined mode has
+    // its session workers for that
+    connection_t verified = { .kind = CONN_VERIFIED, .fd = -1 };
+    if (!phone_transport && verify_workers > 0) {
+        if (verify_pool_start(verify_workers, pin_workers)) {
+            verified.fd = verify_pool_fd();
+            event.data.ptr = &verified;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, verified.fd, &event);
+        } else {
+            async_log(LOG_WARNING, "Verifying requests on the event loop instead");
+        }
+    }
+    
+    // Connections the previous image was serving, now that there are
+    // workers to verify their requests
+    live_upgrade_each(UPGRADE_CONNECTION, restore_connection, NULL);
+    live_upgrade_finish();
+    serve_broker_waiters();
+    free_closed_connections();
+    
+    connection_t key_watch = { .kind = CONN_KEY_WATCH, .fd = auth_core_watch_fd() };
+    if (key_watch.fd >= 0) {
+        event.data.ptr = &key_watch;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, key_watch.fd, &event);
+    }
+    
+    // Metrics are optional; an empty path turns them off
+    stats_server_t *stats_server = NULL;
+    stats_server_t *listener_stats_server = NULL;
+    if (stats_socket[0] != '\0') {
+        stats_server = stats_server_start(stats_socket, &auth_core_stats);
+        if (!stats_server) {
+            async_log(LOG_WARNING, "Stats socket %s is not available", stats_socket);
+        }
+    }
+    
+    // Session figures stay on the listener's socket, as if it were separate
+    if (phone_transport && listener_stats_socket[0] != '\0') {
+        listener_stats_server = stats_server_start(listener_stats_socket, &phone_session_stats);
+        if (!listener_stats_server) {
+            async_log(LOG_WARNING, "Stats socket %s is not available", listener_stats_socket);
+        }
+    }
+    
+    // From here on, requests log through the ring
+    async_log_start();
+    
+    if (phone_transport) {
+        async_log(LOG_INFO, "TapIn Helper Daemon taking phones on %s %s (%d workers, backlog %d)",
+                  phone_transport->name, phone_address, pool_config.workers, backlog);
+    } else {
+        async_log(LOG_INFO, "TapIn Helper Daemon listening on Unix socket: %s (backlog %d, %d verification workers)",
+                  helper_socket, backlog, verified.fd >= 0 ? verify_workers : 0);
+    }
+    async_log(LOG_INFO, "TapIn token broker listening on Unix socket: %s", broker_socket);
+    
+    // Units ordered after this one may start now
+    service_notify("READY=1");
     
-    fd_set readfds;
+    struct epoll_event events[MAX_EVENTS];
     
     // Main daemon loop
     while (running) {
-        FD_ZERO(&readfds);
-        FD_SET(unix_sock, &readfds);
-        
-        struct timeval timeout;
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-        
-        int activity = select(unix_sock + 1, &readfds, NULL, NULL, &timeout);
-        
-        if (activity < 0) {
-            if (errno != EINTR) {  // EINTR is expected during signal handling
-                syslog(LOG_ERR, "Select error: %s", strerror(errno));
+        // Drop tokens nobody came to collect, then sleep until the next
+        // connection deadline or token expiry; with neither, sleep until
+        // something happens
+        time_t now = time(NULL);
+        time_t next_expiry = token_store_expire(now);
+        long long timeout = expire_connections(monotonic_ms());
+        if (next_expiry > 0) {
+            // A token expires once the clock has passed its expiry second
+            long long until_expiry = ((long long)(next_expiry - now) + 1) * 1000;
+            if (timeout < 0 || until_expiry < timeout) {
+                timeout = until_expiry;
+            }
+        }
+    
+        int count = epoll_wait(epoll_fd, events, MAX_EVENTS, (int)timeout);
+    
+        if (count < 0) {
+            if (errno != EINTR) {
+                async_log(LOG_ERR, "epoll_wait error: %s", strerror(errno));
             }
             continue;
         }
-        
-        if (FD_ISSET(unix_sock, &readfds)) {
-            // Accept connection
-            int client_sock = accept(unix_sock, NULL, NULL);
-            if (client_sock < 0) {
-                syslog(LOG_ERR, "Accept error: %s", strerror(errno));
+    
+        for (int i = 0; i < count; i++) {
+            connection_t* conn = events[i].data.ptr;
+    
+            if (conn->closed) {
                 continue;
             }
-            
-            // Read data from client
-            char buffer[MAX_JSON_LENGTH];
-            int bytes_read = read(client_sock, buffer, sizeof(buffer) - 1);
-            if (bytes_read > 0) {
-                buffer[bytes_read] = '\0';
-                
-                // Process the authentication request
-                if (process_auth_request(buffer)) {
-                    // Send success response
-                    write(client_sock, "OK", 2);
-                } else {
-                    // Send error response
-                    write(client_sock, "ERR", 3);
+            if (conn->kind == CONN_SIGNAL) {
+                int signal_number = service_signal_read(conn->fd);
+                if (signal_number == SIGHUP) {
+                    reload_config(config_path, &overrides);
+                } else if (signal_number == SIGUSR2) {
+                    // The new image reads the config file again, and would stop at a
+                    // broken one
+                    if (live_upgrade_available() && daemon_config_load(config_path, &overrides)) {
+                        upgrading = 1;
+                        running = 0;
+                    } else {
+                        async_log(LOG_ERR, "Not upgrading; this image keeps running");
+                    }
+                } else if (signal_number > 0) {
+                    running = 0;
                 }
+            } else if (conn->kind == CONN_HELPER_LISTEN || conn->kind == CONN_BROKER_LISTEN) {
+                accept_connections(conn);
+            } else if (conn->kind == CONN_PHONE_LISTEN) {
+                accept_phones(conn);
+            } else if (conn->kind == CONN_TOKEN_WAKE) {
+                handle_token_wake(conn->fd);
+            } else if (conn->kind == CONN_VERIFIED) {
+                handle_verified();
+            } else if (conn->kind == CONN_KEY_WATCH) {
+                auth_core_handle_key_events();
+            } else if (events[i].events & EPOLLOUT) {
+                handle_connection_writable(conn);
+            } else {
+                handle_connection_readable(conn);
             }
-            
-            close(client_sock);
         }
+    
+        free_closed_connections();
     }
     
+    // Finish what is in flight and hand the rest to the new binary; this
+    // only comes back if it could not be started, and the service manager
+    // restarts the daemon instead
+    if (upgrading) {
+        async_log(LOG_INFO, "Upgrading in place, waiting for running requests");
+        service_notify("RELOADING=1");
+        if (phone_listener.fd >= 0) {
+            phone_session_finish();
+            serve_broker_waiters();
+        }
+        if (verified.fd >= 0) {
+            verify_pool_finish();
+            handle_verified();
+            verified.fd = -1;
+        }
+        free_closed_connections();
+        stats_server_stop(listener_stats_server);
+        stats_server_stop(stats_server);
+        listener_stats_server = stats_server = NULL;
+    
+        upgrade_in_place(&helper_listener, &broker_listener, &phone_listener);
+        async_log_start();
+        async_log(LOG_ERR, "Upgrade failed, shutting down");
+        status = 1;
+    }
+    
+    service_notify("STOPPING=1");
+    
+    // Let running sessions finish before the state they use goes away
+    if (phone_listener.fd >= 0) {
+        stop_phones(phone_listener.fd, phone_address);
+    }
+    
+    // Answer whatever the verification workers still hold
+    if (verified.fd >= 0) {
+        verify_pool_stop();
+        handle_verified();
+    }
+    
+    // Let any waiting PAM clients fall back to other methods
+    while (waiter_list.head) {
+        release_broker_waiter(waiter_list.head, TAPIN_BROKER_NO_TOKEN, NULL);
+    }
+    while (idle_list.head) {
+        close_connection(idle_list.head);
+    }
+    while (channel_list.head) {
+        close_connection(channel_list.head);
+    }
+    free_closed_connections();
+    
     // Cleanup
-    close(unix_sock);
-    unlink(SOCKET_PATH);
+    close(signals.fd);
+    close(epoll_fd);
+    if (helper_listener.fd >= 0) {
+        close_unix_socket(helper_listener.fd, helper_socket);
+    }
+    close_unix_socket(broker_listener.fd, broker_socket);
+    stats_server_stop(listener_stats_server);
+    stats_server_stop(stats_server);
+    audit_journal_close();
+    auth_core_stop();
     
-    syslog(LOG_INFO, "TapIn Helper Daemon stopping");
+    async_log(LOG_INFO, "TapIn Helper Daemon stopping");
+    async_log_stop();
+    daemon_config_free();
     closelog();
     
-    return 0;
-}
\ No newline at end of file
+    return status;
+}
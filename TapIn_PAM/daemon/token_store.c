@@ -0,0 +1,227 @@
+/*
+ * TapIn Token Store
+ * Open-addressing hash table of pending authentication tokens
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "token_store.h"
+
+#define SLOT_MASK (TOKEN_STORE_CAPACITY - 1)
+
+typedef struct {
+    token_entry_t entry;
+    uint32_t hash;
+    int in_use;
+} token_slot_t;
+
+static token_slot_t slots[TOKEN_STORE_CAPACITY];
+static size_t slot_count = 0;
+
+// The helper's event loop and, in the combined daemon, session workers
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * FNV-1a over username, service and tty (separated by NUL)
+ */
+static uint32_t hash_key(const char *username, const char *service, const char *tty) {
+    const char *parts[3] = { username, service, tty };
+    uint32_t hash = 2166136261u;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        const unsigned char *p = (const unsigned char *)parts[i];
+        while (*p) {
+            hash ^= *p++;
+            hash *= 16777619u;
+        }
+        hash *= 16777619u;  // NUL separator
+    }
+
+    return hash;
+}
+
+static int slot_matches(const token_slot_t *slot, uint32_t hash, const char *username,
+                        const char *service, const char *tty) {
+    return slot->in_use && slot->hash == hash &&
+           strcmp(slot->entry.username, username) == 0 &&
+           strcmp(slot->entry.service, service) == 0 &&
+           strcmp(slot->entry.tty, tty) == 0;
+}
+
+static size_t find_slot(uint32_t hash, const char *username, const char *service, const char *tty) {
+    size_t i = hash & SLOT_MASK;
+
+    while (slots[i].in_use) {
+        if (slot_matches(&slots[i], hash, username, service, tty)) {
+            return i;
+        }
+        i = (i + 1) & SLOT_MASK;
+    }
+
+    return TOKEN_STORE_CAPACITY;
+}
+
+/*
+ * Remove a slot using backward-shift deletion so that probe chains
+ * stay intact without tombstones
+ */
+static void remove_slot(size_t hole) {
+    size_t i = hole;
+
+    slots[hole].in_use = 0;
+    slot_count--;
+
+    for (;;) {
+        i = (i + 1) & SLOT_MASK;
+        if (!slots[i].in_use) {
+            break;
+        }
+
+        // Move the entry back if its home slot is not in (hole, i]
+        size_t home = slots[i].hash & SLOT_MASK;
+        if (((i - home) & SLOT_MASK) >= ((i - hole) & SLOT_MASK)) {
+            slots[hole] = slots[i];
+            slots[i].in_use = 0;
+            hole = i;
+        }
+    }
+
+    memset(&slots[hole].entry, 0, sizeof(slots[hole].entry));
+}
+
+// Returns the soonest expiry left, or 0 if the table is empty
+static time_t expire_locked(time_t now) {
+    time_t next = 0;
+    size_t i = 0;
+
+    while (i < TOKEN_STORE_CAPACITY) {
+        if (slots[i].in_use && slots[i].entry.expiry < now) {
+            // Backward shift may pull a later entry into this slot, so recheck it
+            remove_slot(i);
+            continue;
+        }
+        if (slots[i].in_use && (next == 0 || slots[i].entry.expiry < next)) {
+            next = slots[i].entry.expiry;
+        }
+        i++;
+    }
+    return next;
+}
+
+static void copy_field(char *dest, size_t size, const char *src) {
+    strncpy(dest, src ? src : "", size - 1);
+    dest[size - 1] = '\0';
+}
+
+int token_store_put(const char *username, const char *service, const char *tty,
+                    const char *token, time_t expiry) {
+    token_entry_t entry;
+    uint32_t hash;
+    size_t i;
+
+    memset(&entry, 0, sizeof(entry));
+    copy_field(entry.username, sizeof(entry.username), username);
+    copy_field(entry.service, sizeof(entry.service), service);
+    copy_field(entry.tty, sizeof(entry.tty), tty);
+    copy_field(entry.token, sizeof(entry.token), token);
+    entry.expiry = expiry;
+
+    hash = hash_key(entry.username, entry.service, entry.tty);
+
+    pthread_mutex_lock(&store_lock);
+
+    // Replace the pending token for the same key
+    i = find_slot(hash, entry.username, entry.service, entry.tty);
+    if (i < TOKEN_STORE_CAPACITY) {
+        slots[i].entry = entry;
+        pthread_mutex_unlock(&store_lock);
+        return 1;
+    }
+
+    // Keep at least one free slot so probe loops terminate
+    if (slot_count + 1 >= TOKEN_STORE_CAPACITY) {
+        expire_locked(time(NULL));
+        if (slot_count + 1 >= TOKEN_STORE_CAPACITY) {
+            pthread_mutex_unlock(&store_lock);
+            return 0;
+        }
+    }
+
+    i = hash & SLOT_MASK;
+    while (slots[i].in_use) {
+        i = (i + 1) & SLOT_MASK;
+    }
+
+    slots[i].entry = entry;
+    slots[i].hash = hash;
+    slots[i].in_use = 1;
+    slot_count++;
+
+    pthread_mutex_unlock(&store_lock);
+    return 1;
+}
+
+int token_store_take(const char *username, const char *service, const char *tty,
+                     token_entry_t *out) {
+    time_t now = time(NULL);
+    size_t i;
+
+    service = service ? service : "";
+    tty = tty ? tty : "";
+
+    pthread_mutex_lock(&store_lock);
+
+    // Prefer a token bound to this service/tty, then an unbound one
+    i = find_slot(hash_key(username, service, tty), username, service, tty);
+    if (i == TOKEN_STORE_CAPACITY && (service[0] || tty[0])) {
+        i = find_slot(hash_key(username, "", ""), username, "", "");
+    }
+
+    if (i == TOKEN_STORE_CAPACITY) {
+        pthread_mutex_unlock(&store_lock);
+        return 0;
+    }
+
+    int valid = slots[i].entry.expiry >= now;
+    if (valid && out) {
+        *out = slots[i].entry;
+    }
+
+    // Expired or not, the token is gone after this call
+    remove_slot(i);
+
+    pthread_mutex_unlock(&store_lock);
+    return valid;
+}
+
+time_t token_store_expire(time_t now) {
+    time_t next;
+
+    pthread_mutex_lock(&store_lock);
+    next = expire_locked(now);
+    pthread_mutex_unlock(&store_lock);
+    return next;
+}
+
+size_t token_store_count(void) {
+    size_t count;
+
+    pthread_mutex_lock(&store_lock);
+    count = slot_count;
+    pthread_mutex_unlock(&store_lock);
+    return count;
+}
+
+void token_store_each(void (*fn)(const token_entry_t *entry, void *arg), void *arg) {
+    size_t i;
+
+    pthread_mutex_lock(&store_lock);
+    for (i = 0; i < TOKEN_STORE_CAPACITY; i++) {
+        if (slots[i].in_use) {
+            fn(&slots[i].entry, arg);
+        }
+    }
+    pthread_mutex_unlock(&store_lock);
+}
@@ -0,0 +1,56 @@
+/*
+ * TapIn Token Store
+ * In-memory table of pending authentication tokens
+ *
+ * Tokens are keyed by username and by the PAM service/tty they are bound to.
+ * A token issued from the phone carries an empty service and tty and matches
+ * any login for that user. Taking a token removes it from the table, so each
+ * token can be handed out exactly once. All functions are thread-safe.
+ */
+
+#ifndef TAPIN_TOKEN_STORE_H
+#define TAPIN_TOKEN_STORE_H
+
+#include <stddef.h>
+#include <time.h>
+#include "tapin_broker.h"
+
+// Number of slots in the table (must be a power of two)
+#define TOKEN_STORE_CAPACITY 1024
+
+typedef struct {
+    char username[TAPIN_BROKER_USERNAME_LENGTH + 1];
+    char service[TAPIN_BROKER_SERVICE_LENGTH];
+    char tty[TAPIN_BROKER_TTY_LENGTH];
+    char token[TAPIN_BROKER_TOKEN_LENGTH];
+    time_t expiry;
+} token_entry_t;
+
+/*
+ * Store a token, replacing any pending token with the same key.
+ * Returns 1 on success, 0 if the table is full.
+ */
+int token_store_put(const char *username, const char *service, const char *tty,
+                    const char *token, time_t expiry);
+
+/*
+ * Atomically look up and remove the token for a login. An exact
+ * service/tty match is preferred over an unbound token for the user.
+ * Returns 1 and fills `out` if an unexpired token was found, 0 otherwise.
+ */
+int token_store_take(const char *username, const char *service, const char *tty,
+                     token_entry_t *out);
+
+/*
+ * Drop every token that has expired by `now`
+ * Returns the expiry of the soonest token left, or 0 if there is none
+ */
+time_t token_store_expire(time_t now);
+
+// Number of pending tokens
+size_t token_store_count(void);
+
+// Call fn for every pending token, with the store locked
+void token_store_each(void (*fn)(const token_entry_t *entry, void *arg), void *arg);
+
+#endif /* TAPIN_TOKEN_STORE_H */
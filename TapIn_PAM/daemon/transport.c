@@ -0,0 +1,154 @@
+/*
+ * TapIn Listener Transports
+ * RFCOMM for phones, AF_UNIX for testing without Bluetooth hardware
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/rfcomm.h>
+#include "transport.h"
+#include "service_manager.h"
+#include "async_log.h"
+
+/*
+ * RFCOMM transport: `address` is the channel number
+ */
+static int rfcomm_open(const char *address, int backlog) {
+    struct sockaddr_rc addr = {0};
+    int sock;
+    
+    // An upgrade keeps the socket open, so phones connecting meanwhile wait
+    sock = service_take_rfcomm_socket(atoi(address));
+    if (sock >= 0) {
+        return sock;
+    }
+    
+    sock = socket(AF_BLUETOOTH, SOCK_STREAM | SOCK_CLOEXEC, BTPROTO_RFCOMM);
+    if (sock < 0) {
+        async_log(LOG_ERR, "Failed to create Bluetooth socket: %s", strerror(errno));
+        return -1;
+    }
+    
+    addr.rc_family = AF_BLUETOOTH;
+    addr.rc_bdaddr = *BDADDR_ANY;
+    addr.rc_channel = (uint8_t)atoi(address);
+    
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        async_log(LOG_ERR, "Failed to bind Bluetooth socket: %s", strerror(errno));
+        close(sock);
+        return -1;
+    }
+    
+    if (listen(sock, backlog) < 0) {
+        async_log(LOG_ERR, "Failed to listen on Bluetooth socket: %s", strerror(errno));
+        close(sock);
+        return -1;
+    }
+    
+    return sock;
+}
+
+static int rfcomm_accept(int listen_fd, char *peer, size_t peer_size) {
+    struct sockaddr_rc client_addr = {0};
+    socklen_t opt = sizeof(client_addr);
+    char address[18];
+    
+    int client_sock = accept4(listen_fd, (struct sockaddr *)&client_addr, &opt, SOCK_CLOEXEC);
+    if (client_sock < 0) {
+        return -1;
+    }
+    
+    // Get the client's Bluetooth address
+    ba2str(&client_addr.rc_bdaddr, address);
+    snprintf(peer, peer_size, "%s", address);
+    return client_sock;
+}
+
+static void rfcomm_close(int listen_fd, const char *address) {
+    (void)address;
+    close(listen_fd);
+}
+
+/*
+ * Unix transport: `address` is the socket path
+ * Access is limited by the socket's file permissions
+ */
+static int unix_open(const char *address, int backlog) {
+    struct sockaddr_un addr;
+    int sock;
+    
+    // A socket unit already made it, with the permissions it should have
+    sock = service_take_unix_socket(address);
+    if (sock >= 0) {
+        return sock;
+    }
+    
+    unlink(address);
+    
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        async_log(LOG_ERR, "Failed to create Unix socket: %s", strerror(errno));
+        return -1;
+    }
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, address, sizeof(addr.sun_path) - 1);
+    
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        async_log(LOG_ERR, "Failed to bind Unix socket %s: %s", address, strerror(errno));
+        close(sock);
+        return -1;
+    }
+    
+    if (listen(sock, backlog) < 0) {
+        async_log(LOG_ERR, "Failed to listen on Unix socket %s: %s", address, strerror(errno));
+        close(sock);
+        unlink(address);
+        return -1;
+    }
+    
+    chmod(address, 0600);
+    return sock;
+}
+
+static int unix_accept(int listen_fd, char *peer, size_t peer_size) {
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    
+    int client_sock = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (client_sock < 0) {
+        return -1;
+    }
+    
+    // Identify local peers by process ID
+    if (getsockopt(client_sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == 0) {
+        snprintf(peer, peer_size, "unix:%d", (int)cred.pid);
+    } else {
+        snprintf(peer, peer_size, "unix:unknown");
+    }
+    return client_sock;
+}
+
+static void unix_close(int listen_fd, const char *address) {
+    if (!service_socket_inherited(listen_fd)) {
+        unlink(address);
+    }
+    close(listen_fd);
+}
+
+const listener_transport_t rfcomm_transport = {
+    "rfcomm", 1, rfcomm_open, rfcomm_accept, rfcomm_close
+};
+
+const listener_transport_t unix_transport = {
+    "unix", 0, unix_open, unix_accept, unix_close
+};
@@ -0,0 +1,37 @@
+/*
+ * TapIn Listener Transports
+ * Where the Bluetooth listener accepts phone connections from
+ *
+ * The session engine only sees connected stream sockets and a peer address
+ * string, so the same engine runs over RFCOMM in production and over an
+ * AF_UNIX socket (or a socketpair) when no Bluetooth hardware is present.
+ */
+
+#ifndef TAPIN_TRANSPORT_H
+#define TAPIN_TRANSPORT_H
+
+#include <stddef.h>
+
+// Large enough for "XX:XX:XX:XX:XX:XX" and "unix:<pid>"
+#define PEER_ADDRESS_LENGTH 24
+
+typedef struct {
+    const char *name;
+    
+    // Peers must be paired Bluetooth devices
+    int check_pairing;
+    
+    // Create a listening socket; returns the fd or -1
+    int (*open)(const char *address, int backlog);
+    
+    // Accept a connection and describe its peer; returns the fd or -1
+    int (*accept)(int listen_fd, char *peer, size_t peer_size);
+    
+    // Release anything open() created
+    void (*close)(int listen_fd, const char *address);
+} listener_transport_t;
+
+extern const listener_transport_t rfcomm_transport;
+extern const listener_transport_t unix_transport;
+
+#endif /* TAPIN_TRANSPORT_H */
@@ -0,0 +1,300 @@
+/*
+ * TapIn Verification Pool
+ * Job and result rings between the event loop and the verification workers
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <syslog.h>
+#include <sys/eventfd.h>
+#include "verify_pool.h"
+#include "auth_core.h"
+#include "async_log.h"
+
+// A ring slot; sequence says whether it is free or filled for a lap
+typedef struct {
+    uint64_t sequence;
+    verify_job_t job;
+} verify_cell_t;
+
+// Bounded ring; positions sit on their own cache lines so the producing
+// and consuming sides don't share one
+typedef struct {
+    verify_cell_t cells[VERIFY_POOL_QUEUE_SIZE];
+    uint64_t enqueue_position __attribute__((aligned(64)));
+    uint64_t dequeue_position __attribute__((aligned(64)));
+} verify_ring_t;
+
+static verify_ring_t jobs;            // Event loop to workers
+static verify_ring_t results;         // Workers to event loop
+static sem_t jobs_ready;
+static pthread_t threads[VERIFY_POOL_MAX_WORKERS];
+static int worker_count = 0;
+static int stopping = 0;
+static int wake_fd = -1;
+static int wake_pending = 0;          // A worker has written wake_fd since the last collect
+static int in_flight = 0;             // Submitted and not yet collected; event loop only
+
+static void ring_init(verify_ring_t *ring) {
+    uint64_t i;
+    
+    for (i = 0; i < VERIFY_POOL_QUEUE_SIZE; i++) {
+        ring->cells[i].sequence = i;
+    }
+    ring->enqueue_position = ring->dequeue_position = 0;
+}
+
+/*
+ * Function to copy a job into the next free slot
+ * Returns 0 if the ring is full
+ */
+static int ring_push(verify_ring_t *ring, const verify_job_t *job) {
+    uint64_t position = __atomic_load_n(&ring->enqueue_position, __ATOMIC_RELAXED);
+    verify_cell_t *cell;
+    
+    // Claim a slot: its sequence equals our position when it is free
+    for (;;) {
+        cell = &ring->cells[position & (VERIFY_POOL_QUEUE_SIZE - 1)];
+        int64_t lag = (int64_t)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - position);
+        if (lag == 0) {
+            if (__atomic_compare_exchange_n(&ring->enqueue_position, &position, position + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (lag < 0) {
+            return 0;
+        } else {
+            position = __atomic_load_n(&ring->enqueue_position, __ATOMIC_RELAXED);
+        }
+    }
+    
+    cell->job = *job;
+    __atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*
+ * Function to copy out the oldest filled slot and free it
+ * Returns 0 if the ring is empty
+ */
+static int ring_pop(verify_ring_t *ring, verify_job_t *job) {
+    uint64_t position = __atomic_load_n(&ring->dequeue_position, __ATOMIC_RELAXED);
+    verify_cell_t *cell;
+    
+    // A slot is filled for our lap when its sequence is one past our position
+    for (;;) {
+        cell = &ring->cells[position & (VERIFY_POOL_QUEUE_SIZE - 1)];
+        int64_t lag = (int64_t)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - (position + 1));
+        if (lag == 0) {
+            if (__atomic_compare_exchange_n(&ring->dequeue_position, &position, position + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (lag < 0) {
+            return 0;
+        } else {
+            position = __atomic_load_n(&ring->dequeue_position, __ATOMIC_RELAXED);
+        }
+    }
+    
+    *job = cell->job;
+    
+    // Requests carry usernames and MACs
+    memset(&cell->job.record, 0, sizeof(cell->job.record));
+    __atomic_store_n(&cell->sequence, position + VERIFY_POOL_QUEUE_SIZE, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*
+ * Function to hand a finished job back and wake the event loop, unless a
+ * wakeup it has not yet seen is already on its way
+ */
+static void return_job(const verify_job_t *job) {
+    uint64_t one = 1;
+    
+    // Never full: no more jobs are in flight than the ring holds
+    ring_push(&results, job);
+    
+    if (!__atomic_exchange_n(&wake_pending, 1, __ATOMIC_ACQ_REL) &&
+        write(wake_fd, &one, sizeof(one)) < 0) {
+        async_log(LOG_ERR, "Failed to wake the event loop: %s", strerror(errno));
+    }
+}
+
+static void *worker_main(void *arg) {
+    verify_job_t job;   // This worker's scratch; records never touch the heap
+    (void)arg;
+    
+    for (;;) {
+        while (sem_wait(&jobs_ready) < 0 && errno == EINTR) {
+        }
+        if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        if (!ring_pop(&jobs, &job)) {
+            continue;
+        }
+    
+        job.status = process_auth_request(&job.record, sizeof(job.record)) ? TAPIN_CHANNEL_OK
+                                                                          : TAPIN_CHANNEL_REJECTED;
+        return_job(&job);
+        memset(&job, 0, sizeof(job));
+    }
+    
+    return NULL;
+}
+
+int verify_pool_start(int workers, int pin) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_attr_t attr;
+    sigset_t all, old;
+    
+    if (workers <= 0 || workers > VERIFY_POOL_MAX_WORKERS) {
+        return 0;
+    }
+    
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        async_log(LOG_ERR, "Failed to create verification wakeup: %s", strerror(errno));
+        return 0;
+    }
+    if (sem_init(&jobs_ready, 0, 0) < 0) {
+        async_log(LOG_ERR, "Failed to create verification semaphore: %s", strerror(errno));
+        close(wake_fd);
+        wake_fd = -1;
+        return 0;
+    }
+    
+    ring_init(&jobs);
+    ring_init(&results);
+    stopping = 0;
+    wake_pending = 0;
+    in_flight = 0;
+    
+    // Workers leave signal handling to the event loop
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    
+    for (worker_count = 0; worker_count < workers; worker_count++) {
+        pthread_attr_init(&attr);
+        if (pin && cpus > 0) {
+            cpu_set_t cpu;
+            CPU_ZERO(&cpu);
+            CPU_SET(worker_count % cpus, &cpu);
+            pthread_attr_setaffinity_np(&attr, sizeof(cpu), &cpu);
+        }
+        int created = pthread_create(&threads[worker_count], &attr, worker_main, NULL) == 0;
+        pthread_attr_destroy(&attr);
+        if (!created) {
+            break;
+        }
+    }
+    
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    
+    if (worker_count < workers) {
+        async_log(LOG_ERR, "Failed to start verification worker %d of %d", worker_count + 1, workers);
+        verify_pool_stop();
+        return 0;
+    }
+    
+    return 1;
+}
+
+/*
+ * Function to stop the workers, and validate here whatever none of them
+ * got to unless that is to be rejected
+ */
+static void stop_pool(int reject_queued) {
+    verify_job_t job;
+    int i;
+    
+    if (wake_fd < 0) {
+        return;
+    }
+    
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < worker_count; i++) {
+        sem_post(&jobs_ready);
+    }
+    for (i = 0; i < worker_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    worker_count = 0;
+    
+    while (ring_pop(&jobs, &job)) {
+        if (reject_queued) {
+            job.status = TAPIN_CHANNEL_REJECTED;
+        } else {
+            job.status = process_auth_request(&job.record, sizeof(job.record)) ? TAPIN_CHANNEL_OK
+                                                                              : TAPIN_CHANNEL_REJECTED;
+        }
+        ring_push(&results, &job);
+        memset(&job, 0, sizeof(job));
+    }
+    
+    sem_destroy(&jobs_ready);
+    close(wake_fd);
+    wake_fd = -1;
+}
+
+void verify_pool_stop(void) {
+    // Whatever no worker got to is answered as rejected
+    stop_pool(1);
+}
+
+void verify_pool_finish(void) {
+    stop_pool(0);
+}
+
+int verify_pool_fd(void) {
+    return wake_fd;
+}
+
+int verify_pool_submit(void *owner, uint32_t request_id, const tapin_auth_record_t *record) {
+    verify_job_t job;
+    
+    if (wake_fd < 0 || in_flight == VERIFY_POOL_QUEUE_SIZE) {
+        return 0;
+    }
+    
+    job.owner = owner;
+    job.request_id = request_id;
+    job.status = TAPIN_CHANNEL_REJECTED;
+    job.record = *record;
+    ring_push(&jobs, &job);
+    memset(&job, 0, sizeof(job));
+    
+    in_flight++;
+    sem_post(&jobs_ready);
+    return 1;
+}
+
+int verify_pool_collect(verify_job_t *job) {
+    uint64_t count;
+    
+    if (ring_pop(&results, job)) {
+        in_flight--;
+        return 1;
+    }
+    
+    // Empty: re-arm the wakeup, then look once more for results from
+    // workers that saw it still armed and didn't write
+    if (wake_fd >= 0 && read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        async_log(LOG_ERR, "Failed to read verification wakeup: %s", strerror(errno));
+    }
+    __atomic_exchange_n(&wake_pending, 0, __ATOMIC_ACQ_REL);
+    
+    if (ring_pop(&results, job)) {
+        in_flight--;
+        return 1;
+    }
+    return 0;
+}
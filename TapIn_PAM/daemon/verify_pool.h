@@ -0,0 +1,61 @@
+/*
+ * TapIn Verification Pool
+ * Worker threads that validate requests for the helper's event loop
+ *
+ * The event loop submits each decoded record read from the listener
+ * channel; a worker validates it and issues the token (process_auth_request)
+ * and hands the outcome back. Both directions go through bounded lock-free
+ * rings of fixed-size jobs, so nothing is allocated per request: the event
+ * loop is the only producer of jobs and the only consumer of results.
+ * Workers sleep on a semaphore; the event loop is woken through an eventfd,
+ * once per batch of results rather than once per result.
+ */
+
+#ifndef TAPIN_VERIFY_POOL_H
+#define TAPIN_VERIFY_POOL_H
+
+#include <stdint.h>
+#include "tapin_channel.h"
+
+#define VERIFY_POOL_MAX_WORKERS 64
+#define VERIFY_POOL_QUEUE_SIZE 256     // Jobs in flight at once, a power of two
+
+typedef struct {
+    void *owner;                  // Where the reply goes, for the caller
+    uint32_t request_id;
+    int status;                   // TAPIN_CHANNEL_OK or TAPIN_CHANNEL_REJECTED
+    tapin_auth_record_t record;
+} verify_job_t;
+
+/*
+ * Start the workers, each pinned to its own CPU in turn if pin is set
+ * Returns 1 on success, 0 on failure
+ */
+int verify_pool_start(int workers, int pin);
+
+/*
+ * Stop the workers once their current jobs are done
+ * Jobs never started come back from verify_pool_collect() rejected
+ */
+void verify_pool_stop(void);
+
+// Stop the workers once every job submitted has been validated
+void verify_pool_finish(void);
+
+// eventfd that is readable when results are waiting, or -1
+int verify_pool_fd(void);
+
+/*
+ * Queue a record for validation; event loop only
+ * Returns 1 if queued, 0 if VERIFY_POOL_QUEUE_SIZE jobs are already in flight
+ */
+int verify_pool_submit(void *owner, uint32_t request_id, const tapin_auth_record_t *record);
+
+/*
+ * Take the next finished job; event loop only. Call until it returns 0
+ * each time verify_pool_fd() is readable
+ * Returns 1 if a job was taken, 0 if there are none
+ */
+int verify_pool_collect(verify_job_t *job);
+
+#endif /* TAPIN_VERIFY_POOL_H */
@@ -0,0 +1,229 @@
+/*
+ * TapIn Auth Request Parser Fuzzer
+ * Feeds arbitrary bytes to the in-place request parser and the binary
+ * decoder and checks their invariants: spans stay inside the input,
+ * accepted fields respect their limits, and every accepted request becomes
+ * a well-formed record.
+ *
+ * The same bytes also go through session framing twice: found in the whole
+ * input at once, and read by a session reader from a socketpair one byte
+ * per read, as a phone's stream might arrive. Both must find the same
+ * messages.
+ *
+ * Built with -DTAPIN_LIBFUZZER this is a libFuzzer target. Otherwise it is
+ * a replay driver that runs each file given on the command line, and with
+ * -m N also runs N random mutations of them, so the corpus can be checked
+ * under ASan/UBSan without clang.
+ *
+ * Usage: auth_request_replay [-m mutations] [-s seed] file...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "auth_record.h"
+#include "session_frame.h"
+#include "session_pool.h"
+
+static void check_span(const auth_field_span_t *span, const uint8_t *data, size_t size) {
+    if (span->start < (const char *)data || span->start + span->length > (const char *)data + size) {
+        abort();
+    }
+}
+
+/*
+ * Function to check that framing does not depend on how bytes arrive
+ * Each byte is its own packet on a SOCK_SEQPACKET pair, so every read the
+ * reader makes returns exactly one byte
+ */
+static void check_framing(const uint8_t *data, size_t size) {
+    static int pair[2] = { -1, -1 };
+    session_reader_t reader;
+    session_frame_result_t expected = SESSION_FRAME_PARTIAL, result;
+    const char *message;
+    size_t offset = 0, start = 0, end = 0, length, fed;
+    
+    if (pair[0] < 0 && socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+    session_reader_init(&reader);
+    
+    for (fed = 0; fed < size; fed++) {
+        if (write(pair[1], data + fed, 1) != 1 ||
+            session_reader_fill(&reader, pair[0], session_clock_ms() + 1000) != 1) {
+            abort();
+        }
+    
+        while ((result = session_reader_next(&reader, &message, &length)) != SESSION_FRAME_PARTIAL) {
+            // What the whole input says comes next
+            expected = session_frame_find((const char *)data + offset, size - offset, &start, &end);
+            if (result != expected) {
+                abort();
+            }
+            if (result == SESSION_FRAME_MALFORMED) {
+                return;
+            }
+    
+            // Commands come without their line ending
+            size_t trimmed = end - start - length;
+            if (memcmp(message, data + offset + start, length) != 0 || message[length] != '\0' ||
+                trimmed > 2 || (trimmed > 0) != (data[offset + start] >= 'A' && data[offset + start] <= 'Z')) {
+                abort();
+            }
+            offset += end;
+        }
+    }
+    
+    // Whatever is left over must be an unfinished message to both
+    if (session_frame_find((const char *)data + offset, size - offset, &start, &end) != SESSION_FRAME_PARTIAL) {
+        abort();
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    auth_request_spans_t spans;
+    tapin_auth_record_t record;
+    
+    // Rejections are logged; keep that out of the way
+    setlogmask(LOG_UPTO(LOG_EMERG));
+    
+    if (auth_request_parse((const char *)data, size, &spans) == AUTH_PARSE_OK) {
+        // Timestamped requests have no challenge, challenge responses
+        // no timestamp or nonce
+        check_span(&spans.username, data, size);
+        check_span(&spans.hmac, data, size);
+        if (spans.challenge.start) {
+            check_span(&spans.challenge, data, size);
+        } else {
+            check_span(&spans.timestamp, data, size);
+            check_span(&spans.nonce, data, size);
+        }
+    }
+    
+    if (auth_record_from_json((const char *)data, size, &record) &&
+        !auth_record_valid(&record, sizeof(record))) {
+        abort();
+    }
+    
+    // Binary challenge responses are valid once the session adds the
+    // challenge it sent
+    if (auth_record_from_message(data, size, &record)) {
+        if ((record.flags & TAPIN_AUTH_CHALLENGE) && record.nonce_length == 0) {
+            memset(record.nonce, 'a', TAPIN_AUTH_NONCE_LENGTH);
+            record.nonce_length = TAPIN_AUTH_NONCE_LENGTH;
+        }
+        if (!auth_record_valid(&record, sizeof(record))) {
+            abort();
+        }
+    }
+    
+    check_framing(data, size);
+    return 0;
+}
+
+#ifndef TAPIN_LIBFUZZER
+
+#define MAX_INPUT_SIZE 4096
+
+static size_t read_file(const char *path, uint8_t *buffer, size_t size) {
+    FILE *file = fopen(path, "rb");
+    size_t length;
+    
+    if (!file) {
+        perror(path);
+        exit(1);
+    }
+    length = fread(buffer, 1, size, file);
+    fclose(file);
+    return length;
+}
+
+/*
+ * Function to apply a few random edits: flip, insert, delete or truncate
+ */
+static size_t mutate(uint8_t *buffer, size_t length, size_t size) {
+    static const char interesting[] = "{}[]\":,\\u0 \t\n-.eE";
+    int edits = 1 + rand() % 4;
+    
+    while (edits-- > 0) {
+        size_t at = length ? (size_t)rand() % length : 0;
+    
+        switch (rand() % 5) {
+        case 0:
+            if (length) {
+                buffer[at] ^= (uint8_t)(1 << (rand() % 8));
+            }
+            break;
+        case 1:
+            if (length < size) {
+                memmove(buffer + at + 1, buffer + at, length - at);
+                buffer[at] = (uint8_t)interesting[rand() % (sizeof(interesting) - 1)];
+                length++;
+            }
+            break;
+        case 2:
+            if (length) {
+                memmove(buffer + at, buffer + at + 1, length - at - 1);
+                length--;
+            }
+            break;
+        case 3:
+            length = at;
+            break;
+        default:
+            if (length) {
+                buffer[at] = (uint8_t)rand();
+            }
+            break;
+        }
+    }
+    return length;
+}
+
+int main(int argc, char *argv[]) {
+    static uint8_t buffer[MAX_INPUT_SIZE];
+    long mutations = 0, i;
+    unsigned int seed = 1;
+    int opt, f;
+    
+    while ((opt = getopt(argc, argv, "m:s:")) != -1) {
+        switch (opt) {
+        case 'm': mutations = atol(optarg); break;
+        case 's': seed = (unsigned int)atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-m mutations] [-s seed] file...\n", argv[0]);
+            return 1;
+        }
+    }
+    srand(seed);
+    
+    for (f = optind; f < argc; f++) {
+        size_t length = read_file(argv[f], buffer, sizeof(buffer));
+    
+        // Run from an exact-size copy so ASan sees any overread
+        uint8_t *copy = malloc(length ? length : 1);
+        memcpy(copy, buffer, length);
+        LLVMFuzzerTestOneInput(copy, length);
+        free(copy);
+    
+        for (i = 0; i < mutations; i++) {
+            uint8_t scratch[MAX_INPUT_SIZE];
+            memcpy(scratch, buffer, length);
+            size_t mutated = mutate(scratch, length, sizeof(scratch));
+            copy = malloc(mutated ? mutated : 1);
+            memcpy(copy, scratch, mutated);
+            LLVMFuzzerTestOneInput(copy, mutated);
+            free(copy);
+        }
+    }
+    
+    printf("%d inputs, %ld mutations each: no failures\n", argc - optind, mutations);
+    return 0;
+}
+
+#endif
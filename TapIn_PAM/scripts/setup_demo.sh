@@ -26,16 +26,20 @@ generate_shared_secret() {
 }
 
 # Function to create a test token (for demonstration purposes)
+# Tokens live in the helper daemon's memory, so this signs a request the
+# same way the mobile app does and hands it to the running helper
 create_test_token() {
     echo "Creating a test authentication token..."
     USERNAME="${1:-$(whoami)}"
-    TOKEN=$(openssl rand -hex 16)
-    EXPIRY=$(($(date +%s) + 120))  # 2 minutes from now
+    TIMESTAMP=$(date +%s)
+    NONCE=$(openssl rand -hex 16)
+    SECRET=$(cat /etc/tapin/shared_secret)
+    HMAC=$(printf '%s' "$USERNAME:$TIMESTAMP:$NONCE" | openssl dgst -sha256 -hmac "$SECRET" | awk '{print $NF}')
     
-    echo "$USERNAME:$TOKEN:$EXPIRY" > /var/run/tapin_auth.token
-    chmod 600 /var/run/tapin_auth.token
-    echo "Test token created for user: $USERNAME"
-    echo "Token will expire at: $(date -d @$EXPIRY)"
+    printf '{"username":"%s","timestamp":"%s","nonce":"%s","hmac":"%s"}\n' \
+        "$USERNAME" "$TIMESTAMP" "$NONCE" "$HMAC" | tapin_helper --process-auth-request
+    echo "Test token requested for user: $USERNAME"
+    echo "Token will expire at: $(date -d @$((TIMESTAMP + 20)))"
 }
 
 # Function to test PAM module (basic test)
@@ -55,7 +59,7 @@ show_status() {
     echo "System Status:"
     echo "- PAM module: $(if [ -f /lib/security/libtapin_pam.so ]; then echo "INSTALLED"; else echo "NOT INSTALLED"; fi)"
     echo "- Shared secret: $(if [ -f /etc/tapin/shared_secret ]; then echo "CONFIGURED"; else echo "NOT CONFIGURED"; fi)"
-    echo "- Test token: $(if [ -f /var/run/tapin_auth.token ]; then echo "PRESENT"; else echo "NOT PRESENT"; fi)"
+    echo "- Token broker: $(if [ -S /run/tapin/broker.sock ]; then echo "LISTENING"; else echo "NOT LISTENING"; fi)"
     echo "- Bluetooth service: $(if systemctl is-active --quiet bluetooth; then echo "RUNNING"; else echo "NOT RUNNING"; fi)"
 }
 
@@ -102,7 +106,7 @@ while true; do
         6)
             check_root
             echo "Cleaning up test files..."
-            rm -f /var/run/tapin_auth.token
+            # Test tokens are held in memory by the helper and expire on their own
             echo "Test files cleaned up."
             ;;
         7)
@@ -2,145 +2,247 @@
  * TapIn PAM Module
  * Provides passwordless authentication via Bluetooth fingerprint verification
  * 
- * This module checks for a valid authentication token generated by the
- * TapIn mobile application after successful fingerprint verification.
+ * This module fetches a valid authentication token, issued by the helper
+ * daemon after the TapIn mobile application verified a fingerprint, from
+ * the helper's token broker socket.
+ *
+ * Module options:
+ *   wait=<duration>  If no token is pending, prompt the user to tap their
+ *                    phone and wait up to <duration> (e.g. 5s, 1500ms)
+ *                    for one to arrive.
+ *   socket=<path>    Reach the helper's token broker at <path> instead of
+ *                    /run/tapin/broker.sock; must match its broker_socket.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/types.h>
-#include <sys/stat.h>
-#include <sys/file.h>
-#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
 #include <time.h>
 #include <security/pam_appl.h>
 #include <security/pam_modules.h>
 #include <security/pam_ext.h>
+#include <syslog.h>
+#include "tapin_broker.h"
 
-#define TOKEN_FILE "/var/run/tapin_auth.token"
-#define MAX_LINE_LENGTH 256
-#define TOKEN_EXPIRY_SECONDS 20
+// How long to wait for the helper to answer a request
+#define BROKER_REPLY_TIMEOUT_MS 2000
 
 // Structure to hold token data
 typedef struct {
-    char username[64];
-    char token[64];
+    char username[TAPIN_BROKER_USERNAME_LENGTH + 1];
+    char token[TAPIN_BROKER_TOKEN_LENGTH];
     time_t expiry;
     int valid;
 } token_data_t;
 
+// Module options parsed from the PAM configuration line
+typedef struct {
+    unsigned int wait_ms;
+    const char *socket_path;
+} module_options_t;
+
 /*
- * Function to read and validate the authentication token
+ * Function to parse module arguments
  */
-static int read_auth_token(token_data_t *token) {
-    FILE *file;
-    char line[MAX_LINE_LENGTH];
-    char *username, *token_str, *expiry_str;
-    time_t current_time;
+static void parse_module_options(pam_handle_t *pamh, int argc, const char **argv, module_options_t *options) {
+    int i;
     
-    // Check if token file exists and is readable
-    if (access(TOKEN_FILE, R_OK) == -1) {
-        return PAM_AUTH_ERR;
-    }
+    options->wait_ms = 0;
+    options->socket_path = TAPIN_BROKER_SOCKET_PATH;
     
-    // Open the token file
-    file = fopen(TOKEN_FILE, "r");
-    if (!file) {
-        return PAM_AUTH_ERR;
+    for (i = 0; i < argc; i++) {
+        if (strncmp(argv[i], "wait=", 5) == 0) {
+            char *end;
+            unsigned long value;
+            
+            // strtoul() would quietly wrap a negative number
+            errno = 0;
+            value = strtoul(argv[i] + 5, &end, 10);
+            if (argv[i][5] == '-' || errno == ERANGE || end == argv[i] + 5) {
+                pam_syslog(pamh, LOG_ERR, "Invalid wait option: %s", argv[i]);
+                continue;
+            }
+            
+            // Plain numbers and "s" are seconds, "ms" is milliseconds;
+            // clamped before scaling so nothing wraps
+            if (strcmp(end, "ms") == 0) {
+                if (value > TAPIN_BROKER_MAX_WAIT_MS) {
+                    value = TAPIN_BROKER_MAX_WAIT_MS;
+                }
+                options->wait_ms = (unsigned int)value;
+            } else if (*end == '\0' || strcmp(end, "s") == 0) {
+                if (value > TAPIN_BROKER_MAX_WAIT_MS / 1000) {
+                    value = TAPIN_BROKER_MAX_WAIT_MS / 1000;
+                }
+                options->wait_ms = (unsigned int)value * 1000;
+            } else {
+                pam_syslog(pamh, LOG_ERR, "Invalid wait option: %s", argv[i]);
+            }
+        } else if (strncmp(argv[i], "socket=", 7) == 0) {
+            if (argv[i][7] != '/' || strlen(argv[i] + 7) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+                pam_syslog(pamh, LOG_ERR, "Invalid socket option: %s", argv[i]);
+                continue;
+            }
+            options->socket_path = argv[i] + 7;
+        } else {
+            pam_syslog(pamh, LOG_ERR, "Unknown module option: %s", argv[i]);
+        }
     }
+}
+
+/*
+ * Function to read one complete broker response, giving up after
+ * timeout_ms milliseconds
+ * Blocks in poll(), so waiting for a tap costs no CPU
+ */
+static int read_broker_response(int sock, tapin_broker_response_t *response, int timeout_ms) {
+    struct timespec start, now;
+    size_t received = 0;
     
-    // Read the token line
-    if (fgets(line, sizeof(line), file) == NULL) {
-        fclose(file);
-        return PAM_AUTH_ERR;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    while (received < sizeof(*response)) {
+        struct pollfd pfd = { sock, POLLIN, 0 };
+        
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int remaining = timeout_ms - (int)((now.tv_sec - start.tv_sec) * 1000 +
+                                           (now.tv_nsec - start.tv_nsec) / 1000000);
+        if (remaining < 0) {
+            return 0;
+        }
+        
+        int ready = poll(&pfd, 1, remaining);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready <= 0) {
+            return 0;
+        }
+        
+        ssize_t n = read(sock, (char *)response + received, sizeof(*response) - received);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        received += n;
     }
     
-    // Immediately close the file and attempt to delete it (atomic read and delete)
-    fclose(file);
+    return response->version == TAPIN_BROKER_VERSION;
+}
+
+/*
+ * Function to copy an optional PAM string item into a fixed-size field
+ */
+static void copy_pam_item(pam_handle_t *pamh, int item_type, char *dest, size_t size) {
+    const void *item = NULL;
     
-    // Verify the file still exists (to prevent race conditions)
-    struct stat token_stat;
-    if (stat(TOKEN_FILE, &token_stat) != 0) {
-        // File was already deleted by another process
-        return PAM_AUTH_ERR;
+    dest[0] = '\0';
+    if (pam_get_item(pamh, item_type, &item) == PAM_SUCCESS && item) {
+        strncpy(dest, (const char *)item, size - 1);
+        dest[size - 1] = '\0';
     }
+}
+
+/*
+ * Function to fetch and consume the authentication token for a user
+ * The helper daemon removes the token as part of answering, so a single
+ * request both reads and consumes it. With a wait set, the helper holds
+ * the request open until the user taps their phone or the wait expires.
+ */
+static int fetch_auth_token(pam_handle_t *pamh, const char *username, int flags,
+                            const module_options_t *options, token_data_t *token) {
+    unsigned int wait_ms = options->wait_ms;
+    tapin_broker_request_t request;
+    tapin_broker_response_t response;
+    struct sockaddr_un addr;
+    int sock;
+    time_t current_time;
     
-    // Try to open and lock the file for exclusive access
-    int fd = open(TOKEN_FILE, O_RDONLY);
-    if (fd == -1) {
+    if (strlen(username) > TAPIN_BROKER_USERNAME_LENGTH) {
         return PAM_AUTH_ERR;
     }
     
-    // Attempt to lock the file to prevent concurrent access
-    if (flock(fd, LOCK_SH | LOCK_NB) == -1) {
-        close(fd);
-        return PAM_AUTH_ERR; // Another process is already handling this token
+    // Build the request
+    memset(&request, 0, sizeof(request));
+    request.version = TAPIN_BROKER_VERSION;
+    request.op = wait_ms > 0 ? TAPIN_BROKER_OP_WAIT : TAPIN_BROKER_OP_CONSUME;
+    request.wait_ms = wait_ms;
+    strcpy(request.username, username);
+    copy_pam_item(pamh, PAM_SERVICE, request.service, sizeof(request.service));
+    copy_pam_item(pamh, PAM_TTY, request.tty, sizeof(request.tty));
+    
+    // Connect to the token broker in the helper daemon
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return PAM_AUTH_ERR;
     }
     
-    // Re-read the file content while locked
-    FILE *reopened_file = fdopen(fd, "r");
-    if (!reopened_file) {
-        close(fd);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, options->socket_path, sizeof(addr.sun_path) - 1);
+    
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        // Helper not running: no token available
+        close(sock);
         return PAM_AUTH_ERR;
     }
     
-    // Read the token line again to make sure it's still valid
-    if (fgets(line, sizeof(line), reopened_file) == NULL) {
-        fclose(reopened_file);
+    if (send(sock, &request, sizeof(request), MSG_NOSIGNAL) != (ssize_t)sizeof(request)) {
+        close(sock);
         return PAM_AUTH_ERR;
     }
     
-    // Close file but keep the fd open for the lock
-    fclose(reopened_file);
+    // Read the response
+    if (!read_broker_response(sock, &response, BROKER_REPLY_TIMEOUT_MS)) {
+        close(sock);
+        return PAM_AUTH_ERR;
+    }
     
-    // Parse the line: username:token:expiry
-    char temp_line[MAX_LINE_LENGTH];
-    strncpy(temp_line, line, sizeof(temp_line) - 1);
-    temp_line[sizeof(temp_line) - 1] = '\0';
+    // No token yet: the helper parked the request until the user taps
+    if (response.status == TAPIN_BROKER_PENDING) {
+        if (!(flags & PAM_SILENT)) {
+            pam_info(pamh, "Tap your phone to log in with TapIn...");
+        }
+        
+        // Allow a little slack over the helper's own deadline
+        if (!read_broker_response(sock, &response, (int)wait_ms + 1000)) {
+            close(sock);
+            return PAM_AUTH_ERR;
+        }
+    }
     
-    username = strtok(temp_line, ":");
-    token_str = strtok(NULL, ":");
-    expiry_str = strtok(NULL, ":");
+    close(sock);
     
-    if (!username || !token_str || !expiry_str) {
-        close(fd);
+    if (response.status != TAPIN_BROKER_OK) {
         return PAM_AUTH_ERR;
     }
     
-    // Copy parsed values
-    strncpy(token->username, username, sizeof(token->username) - 1);
-    token->username[sizeof(token->username) - 1] = '\0';
-    
-    strncpy(token->token, token_str, sizeof(token->token) - 1);
+    // Copy returned values
+    strcpy(token->username, username);
+    memcpy(token->token, response.token, sizeof(token->token));
     token->token[sizeof(token->token) - 1] = '\0';
-    
-    token->expiry = atol(expiry_str);
+    token->expiry = response.expiry;
     token->valid = 1;
     
+    memset(&response, 0, sizeof(response));
+    
     // Check if token is expired
     time(&current_time);
     if (current_time > token->expiry) {
-        // Token expired, remove it
-        unlink(TOKEN_FILE);
-        close(fd);
         return PAM_AUTH_ERR;
     }
     
-    // Release the lock and close the file descriptor
-    close(fd);
-    
     return PAM_SUCCESS;
 }
 
-/*
- * Function to remove the token file after use (one-time use)
- */
-static void consume_token() {
-    unlink(TOKEN_FILE);
-}
-
 /*
  * PAM authentication function
  * This is the main entry point for PAM authentication
@@ -148,32 +250,29 @@ static void consume_token() {
 PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc, const char **argv) {
     const char *username;
     token_data_t token;
+    module_options_t options;
     int retval;
     
+    parse_module_options(pamh, argc, argv, &options);
+    
     // Get the username being authenticated
     retval = pam_get_user(pamh, &username, NULL);
     if (retval != PAM_SUCCESS) {
         return PAM_USER_UNKNOWN;
     }
     
-    // Read and validate the authentication token
-    retval = read_auth_token(&token);
+    // Fetch and consume the authentication token for this user
+    retval = fetch_auth_token(pamh, username, flags, &options, &token);
+    
+    // Don't leave the token lying around in memory
+    memset(&token, 0, sizeof(token));
+    
     if (retval != PAM_SUCCESS) {
         // No valid token found, continue with other authentication methods
         return PAM_AUTH_ERR;
     }
     
-    // Check if the token username matches the requested username
-    if (strcmp(token.username, username) != 0) {
-        // Token is for a different user
-        consume_token(); // Consume the token anyway to prevent reuse
-        return PAM_AUTH_ERR;
-    }
-    
     // Authentication successful
-    // Consume the token so it can't be reused
-    consume_token();
-    
     return PAM_SUCCESS;
 }
 
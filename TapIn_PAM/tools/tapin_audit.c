@@ -0,0 +1,427 @@
+/*
+ * TapIn Audit Tool
+ * Answers questions from the helper's audit journal
+ *
+ * Segments are mapped read-only and never parsed as a whole: a time range
+ * is found by binary search, first over the index's block times and then
+ * over the records themselves, which the helper appends in time order. A
+ * user is found through the index's sorted (hash, block) pairs, so only
+ * blocks that hold the user are read. Records past a segment's index (the
+ * segment the helper is still filling) are searched the same way for time
+ * and scanned for users. --scan reads every record instead, for comparison.
+ *
+ * Usage: tapin-audit [--dir DIR] [--since TIME] [--until TIME] [--user NAME]
+ *                    [--rejected] [--count] [--scan]
+ *
+ * TIME is "YYYY-MM-DD [HH:MM[:SS]]" or "HH:MM[:SS]" today, in local time,
+ * or "@SECONDS[.FRACTION]" since the epoch; --since is inclusive, --until
+ * is not.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "audit_journal.h"
+
+#define PATH_LENGTH 4096
+
+// A mapped segment and, if it has one, its index
+typedef struct {
+    void *map;
+    size_t map_size;
+    const audit_segment_header_t *header;
+    const audit_record_t *records;
+    uint32_t count;                   // Records readable now
+    void *index_map;
+    size_t index_size;
+    const audit_index_header_t *index;
+    const int64_t *block_times;
+    const audit_user_entry_t *users;
+} segment_t;
+
+typedef struct {
+    int64_t since_us;
+    int64_t until_us;                 // 0 for no end
+    const char *user;
+    int rejected_only;
+    int count_only;
+    int full_scan;                    // Read every record, for comparison
+    unsigned long matched;
+    unsigned long examined;           // Records read
+} query_t;
+
+static void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [--dir DIR] [--since TIME] [--until TIME] [--user NAME]\n"
+                    "          [--rejected] [--count] [--scan]\n", program);
+    fprintf(stderr, "TIME is \"YYYY-MM-DD [HH:MM[:SS]]\", \"HH:MM[:SS]\" today or \"@SECONDS\"\n");
+}
+
+/*
+ * Function to read a point in local time
+ * Returns 1 and sets *time_us on success, 0 if the text is not a time
+ */
+static int parse_time(const char *text, int64_t *time_us) {
+    static const char *const dated[] = {
+        "%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%dT%H:%M", "%Y-%m-%d"
+    };
+    static const char *const undated[] = { "%H:%M:%S", "%H:%M" };
+    time_t now = time(NULL);
+    struct tm tm;
+    const char *end;
+    char *number_end;
+    size_t i;
+    
+    if (text[0] == '@') {
+        double seconds = strtod(text + 1, &number_end);
+        if (number_end == text + 1 || *number_end != '\0') {
+            return 0;
+        }
+        *time_us = (int64_t)(seconds * 1e6);
+        return 1;
+    }
+    
+    for (i = 0; i < sizeof(dated) / sizeof(dated[0]); i++) {
+        memset(&tm, 0, sizeof(tm));
+        end = strptime(text, dated[i], &tm);
+        if (end && *end == '\0') {
+            tm.tm_isdst = -1;
+            *time_us = (int64_t)mktime(&tm) * 1000000;
+            return 1;
+        }
+    }
+    for (i = 0; i < sizeof(undated) / sizeof(undated[0]); i++) {
+        localtime_r(&now, &tm);
+        tm.tm_sec = 0;
+        end = strptime(text, undated[i], &tm);
+        if (end && *end == '\0') {
+            tm.tm_isdst = -1;
+            *time_us = (int64_t)mktime(&tm) * 1000000;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *map_file(const char *path, size_t *size) {
+    struct stat st;
+    void *map;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    
+    *size = st.st_size;
+    map = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+/*
+ * Function to map a segment and its index
+ * Returns 1 on success, 0 if the segment is missing or malformed; a
+ * missing or stale index just leaves segment->index NULL
+ */
+static int open_segment(segment_t *segment, const char *dir, uint32_t sequence, int ignore_index) {
+    char path[PATH_LENGTH];
+    
+    memset(segment, 0, sizeof(*segment));
+    audit_segment_path(path, sizeof(path), dir, sequence);
+    segment->map = map_file(path, &segment->map_size);
+    if (!segment->map) {
+        return 0;
+    }
+    segment->header = segment->map;
+    if (!audit_segment_valid(segment->header, segment->map_size)) {
+        fprintf(stderr, "tapin-audit: %s is malformed, skipping it\n", path);
+        munmap(segment->map, segment->map_size);
+        return 0;
+    }
+    segment->records = (const audit_record_t *)(segment->header + 1);
+    segment->count = __atomic_load_n(&segment->header->count, __ATOMIC_ACQUIRE);
+    
+    if (ignore_index) {
+        return 1;
+    }
+    audit_index_path(path, sizeof(path), dir, sequence);
+    segment->index_map = map_file(path, &segment->index_size);
+    if (!segment->index_map) {
+        return 1;
+    }
+    segment->index = segment->index_map;
+    if (!audit_index_valid(segment->index, segment->index_size) ||
+        segment->index->record_count > segment->count) {
+        munmap(segment->index_map, segment->index_size);
+        segment->index_map = NULL;
+        segment->index = NULL;
+        return 1;
+    }
+    segment->block_times = (const int64_t *)(segment->index + 1);
+    segment->users = (const audit_user_entry_t *)(segment->block_times + segment->index->block_count);
+    return 1;
+}
+
+static void close_segment(segment_t *segment) {
+    if (segment->index_map) {
+        munmap(segment->index_map, segment->index_size);
+    }
+    munmap(segment->map, segment->map_size);
+}
+
+/*
+ * Function to find the first record stamped at or after time_us
+ * Returns its number, or the record count if there is none
+ */
+static uint32_t find_time(const segment_t *segment, int64_t time_us, query_t *query) {
+    uint32_t low = 0, high = segment->count;
+    
+    // Narrow to the one block that can hold the boundary
+    if (segment->index) {
+        uint32_t blocks = segment->index->block_count, block_low = 0, block_high = blocks;
+        while (block_low < block_high) {
+            uint32_t middle = block_low + (block_high - block_low) / 2;
+            if (segment->block_times[middle] < time_us) {
+                block_low = middle + 1;
+            } else {
+                block_high = middle;
+            }
+        }
+        if (block_low > 0) {
+            low = (block_low - 1) * AUDIT_INDEX_BLOCK;
+        }
+        if (block_low < blocks) {
+            high = block_low * AUDIT_INDEX_BLOCK;
+        }
+    }
+    
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        query->examined++;
+        if (segment->records[middle].time_us < time_us) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static void print_record(const audit_record_t *record) {
+    time_t seconds = record->time_us / 1000000;
+    const unsigned char *p = (const unsigned char *)record->username;
+    char when[32];
+    struct tm tm;
+    
+    localtime_r(&seconds, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%s.%06lld ", when, (long long)(record->time_us % 1000000));
+    
+    // Usernames are whatever the phone claimed
+    if (*p == '\0') {
+        putchar('-');
+    }
+    for (; *p && p < (const unsigned char *)record->username + sizeof(record->username); p++) {
+        putchar(isgraph(*p) ? *p : '?');
+    }
+    
+    if (record->has_device) {
+        printf(" %02X:%02X:%02X:%02X:%02X:%02X", record->device[0], record->device[1], record->device[2],
+               record->device[3], record->device[4], record->device[5]);
+    } else {
+        printf(" -");
+    }
+    printf(" %s total=%uus mac=%uus replay=%uus token=%uus\n", audit_outcome_name(record->outcome),
+           record->total_us, record->mac_us, record->replay_us, record->token_us);
+}
+
+/*
+ * Function to check and report records first to end - 1
+ */
+static void scan_records(const segment_t *segment, uint32_t first, uint32_t end, query_t *query) {
+    uint32_t i;
+    
+    for (i = first; i < end; i++) {
+        const audit_record_t *record = &segment->records[i];
+        query->examined++;
+        if (record->time_us < query->since_us || (query->until_us && record->time_us >= query->until_us)) {
+            continue;
+        }
+        if (query->user && strncmp(record->username, query->user, sizeof(record->username)) != 0) {
+            continue;
+        }
+        if (query->rejected_only && record->outcome == AUDIT_ACCEPTED) {
+            continue;
+        }
+        query->matched++;
+        if (!query->count_only) {
+            print_record(record);
+        }
+    }
+}
+
+/*
+ * Function to report a user's records in first to end - 1, reading only
+ * the index blocks that hold them, then whatever the index does not cover
+ */
+static void scan_user_blocks(const segment_t *segment, uint32_t first, uint32_t end, query_t *query) {
+    uint32_t hash = audit_user_hash(query->user);
+    uint32_t low = 0, high = segment->index->user_count, indexed = segment->index->record_count;
+    
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (segment->users[middle].hash < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    
+    // A user's blocks follow each other in order
+    for (; low < segment->index->user_count && segment->users[low].hash == hash; low++) {
+        uint32_t block_first = segment->users[low].block * AUDIT_INDEX_BLOCK;
+        uint32_t block_end = block_first + AUDIT_INDEX_BLOCK;
+        if (block_end > indexed) {
+            block_end = indexed;
+        }
+        if (block_first < first) {
+            block_first = first;
+        }
+        if (block_end > end) {
+            block_end = end;
+        }
+        if (block_first < block_end) {
+            scan_records(segment, block_first, block_end, query);
+        }
+    }
+    
+    if (end > indexed) {
+        scan_records(segment, first > indexed ? first : indexed, end, query);
+    }
+}
+
+static void query_segment(const segment_t *segment, query_t *query) {
+    uint32_t first = 0, end = segment->count;
+    
+    if (segment->count == 0) {
+        return;
+    }
+    if (query->full_scan) {
+        scan_records(segment, 0, segment->count, query);
+        return;
+    }
+    
+    // Whole segments outside the range are skipped on their first and
+    // last records
+    if ((query->until_us && segment->records[0].time_us >= query->until_us) ||
+        segment->records[segment->count - 1].time_us < query->since_us) {
+        return;
+    }
+    
+    if (query->since_us) {
+        first = find_time(segment, query->since_us, query);
+    }
+    if (query->until_us) {
+        end = find_time(segment, query->until_us, query);
+    }
+    if (first >= end) {
+        return;
+    }
+    
+    if (query->user && segment->index) {
+        scan_user_blocks(segment, first, end, query);
+    } else {
+        scan_records(segment, first, end, query);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "dir", required_argument, NULL, 'd' },
+        { "since", required_argument, NULL, 's' },
+        { "until", required_argument, NULL, 'u' },
+        { "user", required_argument, NULL, 'U' },
+        { "rejected", no_argument, NULL, 'r' },
+        { "count", no_argument, NULL, 'c' },
+        { "scan", no_argument, NULL, 'S' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char *dir = AUDIT_JOURNAL_DIR;
+    query_t query;
+    uint32_t *sequences;
+    int opt, count, i;
+    
+    memset(&query, 0, sizeof(query));
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            dir = optarg;
+            break;
+        case 's':
+            if (!parse_time(optarg, &query.since_us)) {
+                fprintf(stderr, "tapin-audit: invalid time \"%s\"\n", optarg);
+                return 1;
+            }
+            break;
+        case 'u':
+            if (!parse_time(optarg, &query.until_us)) {
+                fprintf(stderr, "tapin-audit: invalid time \"%s\"\n", optarg);
+                return 1;
+            }
+            break;
+        case 'U':
+            query.user = optarg;
+            break;
+        case 'r':
+            query.rejected_only = 1;
+            break;
+        case 'c':
+            query.count_only = 1;
+            break;
+        case 'S':
+            query.full_scan = 1;
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    count = audit_list_segments(dir, &sequences);
+    if (count < 0) {
+        fprintf(stderr, "tapin-audit: cannot read %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    
+    // Oldest first, so the output is in time order
+    for (i = 0; i < count; i++) {
+        segment_t segment;
+        if (!open_segment(&segment, dir, sequences[i], query.full_scan)) {
+            continue;
+        }
+        query_segment(&segment, &query);
+        close_segment(&segment);
+    }
+    free(sequences);
+    
+    if (query.count_only) {
+        printf("%lu\n", query.matched);
+        fprintf(stderr, "%lu records read in %d segments\n", query.examined, count);
+    }
+    return 0;
+}
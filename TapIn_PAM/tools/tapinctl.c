@@ -0,0 +1,367 @@
+/*
+ * TapIn Control Tool
+ * Builds and updates the keystore read by the helper daemon
+ *
+ * Every change writes a complete new keystore next to the old one and
+ * renames it into place; the running helper notices the rename and swaps
+ * to the new file.
+ *
+ * Usage: tapinctl [--keystore PATH] list
+ *        tapinctl [--keystore PATH] add USER [DEVICE] [--secret S | --secret-file FILE]
+ *        tapinctl [--keystore PATH] remove USER [DEVICE]
+ *        tapinctl [--keystore PATH] build FILE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <syslog.h>
+#include "keystore.h"
+#include "auth_record.h"
+#include "random_pool.h"
+
+#define GENERATED_SECRET_LENGTH 32
+#define MAX_LINE_LENGTH 512
+
+typedef struct {
+    keystore_entry_t *entries;
+    size_t count;
+    size_t capacity;
+} entry_list_t;
+
+static const char *keystore_path = KEYSTORE_PATH;
+
+static void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [--keystore PATH] list\n", program);
+    fprintf(stderr, "       %s [--keystore PATH] add USER [DEVICE] [--secret S | --secret-file FILE]\n", program);
+    fprintf(stderr, "       %s [--keystore PATH] remove USER [DEVICE]\n", program);
+    fprintf(stderr, "       %s [--keystore PATH] build FILE\n", program);
+    fprintf(stderr, "USER \"*\" matches any user; FILE lines are \"USER DEVICE|- SECRET\"\n");
+}
+
+static keystore_entry_t *append_entry(entry_list_t *list) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 64;
+        keystore_entry_t *grown = realloc(list->entries, capacity * sizeof(*grown));
+        if (!grown) {
+            return NULL;
+        }
+        list->entries = grown;
+        list->capacity = capacity;
+    }
+    
+    keystore_entry_t *entry = &list->entries[list->count++];
+    memset(entry, 0, sizeof(*entry));
+    return entry;
+}
+
+/*
+ * Function to fill an entry from text fields, checking each
+ */
+static int fill_entry(keystore_entry_t *entry, const char *username, const char *device,
+                      const char *secret, size_t secret_length) {
+    if (username[0] == '\0' || strlen(username) > TAPIN_AUTH_USERNAME_LENGTH || strchr(username, ':')) {
+        fprintf(stderr, "tapinctl: invalid username \"%s\"\n", username);
+        return 0;
+    }
+    if (secret_length == 0 || secret_length > KEYSTORE_SECRET_MAX) {
+        fprintf(stderr, "tapinctl: secret for %s must be 1 to %d bytes\n", username, KEYSTORE_SECRET_MAX);
+        return 0;
+    }
+    
+    strcpy(entry->username, username);
+    if (device && strcmp(device, "-") != 0) {
+        if (!auth_device_from_text(device, entry->device)) {
+            fprintf(stderr, "tapinctl: invalid device address \"%s\"\n", device);
+            return 0;
+        }
+        entry->has_device = 1;
+    }
+    memcpy(entry->secret, secret, secret_length);
+    entry->secret_length = (uint8_t)secret_length;
+    return 1;
+}
+
+/*
+ * Function to load the current keystore, if there is one
+ */
+static int load_entries(entry_list_t *list) {
+    keystore_t *keystore = keystore_open(keystore_path);
+    size_t i;
+    
+    if (!keystore) {
+        if (errno == ENOENT) {
+            return 1;
+        }
+        fprintf(stderr, "tapinctl: cannot read %s\n", keystore_path);
+        return 0;
+    }
+    
+    for (i = 0; i < keystore_count(keystore); i++) {
+        keystore_entry_t *entry = append_entry(list);
+        if (!entry) {
+            keystore_close(keystore);
+            return 0;
+        }
+        *entry = *keystore_entry(keystore, i);
+    }
+    
+    keystore_close(keystore);
+    return 1;
+}
+
+static int save_entries(entry_list_t *list) {
+    if (!keystore_write(keystore_path, list->entries, list->count)) {
+        fprintf(stderr, "tapinctl: cannot write %s: %s\n", keystore_path,
+                errno == EEXIST ? "a device is enrolled twice" : strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+static void format_device(const keystore_entry_t *entry, char *out, size_t size) {
+    if (!entry->has_device) {
+        snprintf(out, size, "-");
+        return;
+    }
+    snprintf(out, size, "%02X:%02X:%02X:%02X:%02X:%02X", entry->device[0], entry->device[1],
+             entry->device[2], entry->device[3], entry->device[4], entry->device[5]);
+}
+
+static int same_key(const keystore_entry_t *a, const keystore_entry_t *b) {
+    return strcmp(a->username, b->username) == 0 && a->has_device == b->has_device &&
+           (!a->has_device || memcmp(a->device, b->device, sizeof(a->device)) == 0);
+}
+
+static int command_list(void) {
+    entry_list_t list = { NULL, 0, 0 };
+    char device[18];
+    size_t i;
+    
+    if (!load_entries(&list)) {
+        return 1;
+    }
+    
+    // Secrets are never printed back
+    for (i = 0; i < list.count; i++) {
+        format_device(&list.entries[i], device, sizeof(device));
+        printf("%-32s %s\n", list.entries[i].username, device);
+    }
+    
+    free(list.entries);
+    return 0;
+}
+
+static int command_add(int argc, char *argv[]) {
+    entry_list_t list = { NULL, 0, 0 };
+    const char *username, *device = NULL, *secret = NULL, *secret_file = NULL;
+    char secret_buffer[KEYSTORE_SECRET_MAX + 2];
+    keystore_entry_t added;
+    size_t i;
+    int generated = 0;
+    
+    if (argc < 1) {
+        return -1;
+    }
+    username = argv[0];
+    for (i = 1; i < (size_t)argc; i++) {
+        if (strcmp(argv[i], "--secret") == 0 && i + 1 < (size_t)argc) {
+            secret = argv[++i];
+        } else if (strcmp(argv[i], "--secret-file") == 0 && i + 1 < (size_t)argc) {
+            secret_file = argv[++i];
+        } else if (!device && argv[i][0] != '-') {
+            device = argv[i];
+        } else if (!device && strcmp(argv[i], "-") == 0) {
+            device = argv[i];
+        } else {
+            return -1;
+        }
+    }
+    
+    if (secret_file) {
+        FILE *file = fopen(secret_file, "r");
+        if (!file || !fgets(secret_buffer, sizeof(secret_buffer), file)) {
+            fprintf(stderr, "tapinctl: cannot read secret from %s\n", secret_file);
+            if (file) {
+                fclose(file);
+            }
+            return 1;
+        }
+        fclose(file);
+        secret_buffer[strcspn(secret_buffer, "\n")] = '\0';
+        secret = secret_buffer;
+    } else if (!secret) {
+        if (!random_token(secret_buffer, GENERATED_SECRET_LENGTH + 1)) {
+            fprintf(stderr, "tapinctl: no randomness available to generate a secret\n");
+            return 1;
+        }
+        secret = secret_buffer;
+        generated = 1;
+    }
+    
+    memset(&added, 0, sizeof(added));
+    if (!fill_entry(&added, username, device, secret, strlen(secret)) || !load_entries(&list)) {
+        free(list.entries);
+        return 1;
+    }
+    
+    // Replace the entry for the same user and phone, if any
+    i = 0;
+    while (i < list.count && !same_key(&list.entries[i], &added)) {
+        i++;
+    }
+    if (i == list.count && !append_entry(&list)) {
+        free(list.entries);
+        return 1;
+    }
+    list.entries[i] = added;
+    
+    if (!save_entries(&list)) {
+        free(list.entries);
+        return 1;
+    }
+    
+    // The phone needs the generated secret entered once
+    if (generated) {
+        printf("%s\n", secret);
+    }
+    free(list.entries);
+    return 0;
+}
+
+static int command_remove(int argc, char *argv[]) {
+    entry_list_t list = { NULL, 0, 0 };
+    uint8_t device[6];
+    size_t i, kept = 0;
+    int result;
+    
+    if (argc < 1 || argc > 2) {
+        return -1;
+    }
+    if (argc == 2 && !auth_device_from_text(argv[1], device)) {
+        fprintf(stderr, "tapinctl: invalid device address \"%s\"\n", argv[1]);
+        return 1;
+    }
+    if (!load_entries(&list)) {
+        return 1;
+    }
+    
+    for (i = 0; i < list.count; i++) {
+        const keystore_entry_t *entry = &list.entries[i];
+        int matches = strcmp(entry->username, argv[0]) == 0 &&
+                      (argc == 1 || (entry->has_device && memcmp(entry->device, device, 6) == 0));
+        if (!matches) {
+            list.entries[kept++] = *entry;
+        }
+    }
+    
+    if (kept == list.count) {
+        fprintf(stderr, "tapinctl: no matching entry\n");
+        free(list.entries);
+        return 1;
+    }
+    
+    list.count = kept;
+    result = save_entries(&list) ? 0 : 1;
+    free(list.entries);
+    return result;
+}
+
+static int command_build(int argc, char *argv[]) {
+    entry_list_t list = { NULL, 0, 0 };
+    char line[MAX_LINE_LENGTH];
+    unsigned line_number = 0;
+    FILE *input;
+    int ok = 1;
+    
+    if (argc != 1) {
+        return -1;
+    }
+    input = strcmp(argv[0], "-") == 0 ? stdin : fopen(argv[0], "r");
+    if (!input) {
+        fprintf(stderr, "tapinctl: cannot open %s: %s\n", argv[0], strerror(errno));
+        return 1;
+    }
+    
+    while (ok && fgets(line, sizeof(line), input)) {
+        char *username, *device, *secret, *save;
+        line_number++;
+    
+        line[strcspn(line, "\r\n")] = '\0';
+        username = strtok_r(line, " \t", &save);
+        if (!username || username[0] == '#') {
+            continue;
+        }
+        device = strtok_r(NULL, " \t", &save);
+        secret = strtok_r(NULL, " \t", &save);
+        if (!device || !secret || strtok_r(NULL, " \t", &save)) {
+            fprintf(stderr, "tapinctl: %s:%u: expected \"USER DEVICE|- SECRET\"\n", argv[0], line_number);
+            ok = 0;
+            break;
+        }
+    
+        keystore_entry_t *entry = append_entry(&list);
+        ok = entry && fill_entry(entry, username, device, secret, strlen(secret));
+    }
+    
+    if (input != stdin) {
+        fclose(input);
+    }
+    ok = ok && save_entries(&list);
+    if (ok) {
+        printf("Wrote %zu entries to %s\n", list.count, keystore_path);
+    }
+    free(list.entries);
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "keystore", required_argument, NULL, 'f' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt, result = -1;
+    
+    // Leave subcommand options alone
+    while ((opt = getopt_long(argc, argv, "+f:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'f':
+            keystore_path = optarg;
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    // Keystore errors go to stderr as well
+    openlog("tapinctl", LOG_PERROR, LOG_USER);
+    
+    const char *command = argv[optind];
+    int command_argc = argc - optind - 1;
+    char **command_argv = argv + optind + 1;
+    
+    if (strcmp(command, "list") == 0 && command_argc == 0) {
+        result = command_list();
+    } else if (strcmp(command, "add") == 0) {
+        result = command_add(command_argc, command_argv);
+    } else if (strcmp(command, "remove") == 0) {
+        result = command_remove(command_argc, command_argv);
+    } else if (strcmp(command, "build") == 0) {
+        result = command_build(command_argc, command_argv);
+    }
+    
+    if (result < 0) {
+        print_usage(argv[0]);
+        result = 1;
+    }
+    
+    closelog();
+    return result;
+}
@@ -82,29 +82,86 @@ class BluetoothService {
     }
   }
 
-  // Send data to a device via Bluetooth
-  static Future<bool> writeDataToDevice(BluetoothDevice device, String data) async {
+  // Find the TapIn service on a device, connecting first if needed
+  static Future<BluetoothService?> _findTapInService(BluetoothDevice device) async {
+    // Connect to the device if not already connected
+    if (!device.isConnected) {
+      await device.connect(timeout: const Duration(seconds: 10));
+    }
+    
+    // Get services
+    List<BluetoothService> services = await device.discoverServices();
+    
+    // Look for the service used by TapIn (typically Serial Port Profile with UUID)
+    for (var service in services) {
+      // Standard Serial Port Profile UUID
+      if (service.uuid.toString().toLowerCase() == "00001101-0000-1000-8000-00805f9b34fb") {
+        return service;
+      }
+    }
+    
+    print("TapIn service not found on device");
+    return null;
+  }
+
+  // Connect to a device and wait for the listener's challenge, which it
+  // sends as "CHALLENGE <hex>\n" as soon as a paired phone connects when
+  // run with --challenge. Start this before the fingerprint prompt so the
+  // connection is up by the time the user is verified. Returns null if the
+  // listener sends no challenge; the app then sends a timestamped request
+  static Future<String?> readChallenge(BluetoothDevice device,
+      {Duration timeout = const Duration(seconds: 5)}) async {
     try {
-      // Connect to the device if not already connected
-      if (!device.isConnected) {
-        await device.connect(timeout: const Duration(seconds: 10));
+      BluetoothService? targetService = await _findTapInService(device);
+      if (targetService == null) {
+        return null;
       }
       
-      // Get services
-      List<BluetoothService> services = await device.discoverServices();
-      
-      // Look for the service used by TapIn (typically Serial Port Profile with UUID)
-      BluetoothService? targetService;
-      for (var service in services) {
-        // Standard Serial Port Profile UUID
-        if (service.uuid.toString().toLowerCase() == "00001101-0000-1000-8000-00805f9b34fb") {
-          targetService = service;
+      // Find the characteristic the listener's lines arrive on
+      BluetoothCharacteristic? notifyCharacteristic;
+      for (var characteristic in targetService.characteristics) {
+        if (characteristic.properties.notify || characteristic.properties.indicate) {
+          notifyCharacteristic = characteristic;
           break;
         }
       }
       
+      if (notifyCharacteristic == null) {
+        return null;
+      }
+      
+      // Collect bytes until the challenge line is complete
+      await notifyCharacteristic.setNotifyValue(true);
+      String received = '';
+      await for (List<int> chunk in notifyCharacteristic.onValueReceived.timeout(timeout)) {
+        received += utf8.decode(chunk, allowMalformed: true);
+        int end = received.indexOf('\n');
+        if (end >= 0) {
+          String line = received.substring(0, end).trim();
+          if (line.startsWith('CHALLENGE ')) {
+            return line.substring('CHALLENGE '.length);
+          }
+          return null;
+        }
+      }
+      return null;
+    } catch (e) {
+      // Listeners without --challenge send nothing, so waiting ends here
+      print("No challenge from device: $e");
+      return null;
+    }
+  }
+
+  // Send data to a device via Bluetooth
+  static Future<bool> writeDataToDevice(BluetoothDevice device, String data) async {
+    return writeBytesToDevice(device, utf8.encode(data));
+  }
+
+  // Send raw bytes to a device via Bluetooth, for binary requests
+  static Future<bool> writeBytesToDevice(BluetoothDevice device, List<int> data) async {
+    try {
+      BluetoothService? targetService = await _findTapInService(device);
       if (targetService == null) {
-        print("TapIn service not found on device");
         return false;
       }
       
@@ -124,8 +181,8 @@ class BluetoothService {
       }
       
       // Write the data to the characteristic
-      await writeCharacteristic.write(utf8.encode(data));
-      print("Data sent successfully: $data");
+      await writeCharacteristic.write(data);
+      print("Data sent successfully: ${data.length} bytes");
       return true;
     } catch (e) {
       print("Error writing data to device: $e");
@@ -1,6 +1,7 @@
 import 'dart:async';
 import 'dart:convert';
 import 'dart:math';
+import 'dart:typed_data';
 import 'package:flutter/material.dart';
 import 'package:crypto/crypto.dart';
 import 'components/bluetooth_service.dart';
@@ -592,6 +593,12 @@ class _TapInScreenState extends State<TapInScreen>
       return;
     }
 
+    // Connect while the fingerprint prompt is up, so a listener run with
+    // --challenge has its challenge waiting by the time the user is verified
+    Future<String?> challenge = BluetoothService.readChallenge(
+      _selectedDeviceForCredentials!.device,
+    );
+
     // Attempt to authenticate with fingerprint
     bool isAuthenticated = await FingerprintAuth.authenticate();
 
@@ -620,10 +627,27 @@ class _TapInScreenState extends State<TapInScreen>
 
       // Check if credentials exist for this device
       if (deviceName != null && username != null && password != null) {
+        // The challenge goes out as soon as the connection is up, so it is
+        // normally here by now; listeners without --challenge never send
+        // one, so don't hold the unlock waiting for it
+        String? receivedChallenge = await challenge.timeout(
+          const Duration(milliseconds: 200),
+          onTimeout: () => null,
+        );
+
+        // A listener that challenges also reads the compact binary
+        // layout. Decided afresh on every connection, so a computer rolled
+        // back to a JSON-only listener gets JSON again
+        bool binary = receivedChallenge != null;
+
         // Create authentication request with HMAC signature
-        String authRequest;
+        List<int> authRequest;
         try {
-          authRequest = await _createAuthRequest(username);
+          authRequest = await _createAuthRequest(
+            username,
+            challenge: receivedChallenge,
+            binary: binary,
+          );
         } catch (e) {
           ScaffoldMessenger.of(context).showSnackBar(
             SnackBar(
@@ -635,7 +659,7 @@ class _TapInScreenState extends State<TapInScreen>
         }
 
         // Send the authentication request to the Linux daemon via Bluetooth
-        bool success = await BluetoothService.writeDataToDevice(
+        bool success = await BluetoothService.writeBytesToDevice(
           _selectedDeviceForCredentials!.device,
           authRequest,
         );
@@ -794,7 +818,14 @@ class _TapInScreenState extends State<TapInScreen>
   }
 
   // Create authentication request with HMAC signature
-  Future<String> _createAuthRequest(String username) async {
+  // With a challenge from the listener the request answers it, and the
+  // phone's clock does not matter; otherwise it is timestamped. Sent as
+  // JSON, or in the binary layout if the listener is known to read it
+  Future<List<int>> _createAuthRequest(
+    String username, {
+    String? challenge,
+    bool binary = false,
+  }) async {
     // Get the shared secret from secure storage
     // The app should not proceed if no shared secret is configured
     String? sharedSecret = await SecureStorage.readSecureData('shared_secret');
@@ -805,6 +836,42 @@ class _TapInScreenState extends State<TapInScreen>
       );
     }
 
+    if (challenge != null) {
+      // Sign username:challenge:<challenge>
+      Digest digest = _hmacDigest(
+        '$username:challenge:$challenge',
+        sharedSecret,
+      );
+      if (binary) {
+        // The listener knows its own challenge, so it is not sent back
+        return _encodeBinaryAuthRequest(
+          username,
+          0,
+          const [],
+          digest.bytes,
+          challenge: true,
+        );
+      }
+      return utf8.encode(
+        jsonEncode({
+          'username': username,
+          'challenge': challenge,
+          'hmac': digest.toString(),
+        }),
+      );
+    }
+
+    if (binary) {
+      // Raw nonce bytes, signed as lowercase hex
+      int timestamp = DateTime.now().millisecondsSinceEpoch ~/ 1000;
+      final random = Random.secure();
+      List<int> nonce = List.generate(16, (index) => random.nextInt(256));
+      String nonceHex =
+          nonce.map((byte) => byte.toRadixString(16).padLeft(2, '0')).join();
+      Digest digest = _hmacDigest('$username:$timestamp:$nonceHex', sharedSecret);
+      return _encodeBinaryAuthRequest(username, timestamp, nonce, digest.bytes);
+    }
+
     // Create timestamp and nonce
     int timestamp = DateTime.now().millisecondsSinceEpoch ~/ 1000;
     String nonce = _generateNonce();
@@ -823,7 +890,37 @@ class _TapInScreenState extends State<TapInScreen>
       'hmac': hmac,
     };
 
-    return jsonEncode(authRequest);
+    return utf8.encode(jsonEncode(authRequest));
+  }
+
+  // Encode a request in the listener's binary layout: version 0xB1, flags
+  // (1 for a challenge response), username length, nonce length, the
+  // timestamp as 8 big-endian bytes, the raw 32-byte HMAC, then the
+  // username and nonce. Less than half the size of the JSON request
+  List<int> _encodeBinaryAuthRequest(
+    String username,
+    int timestamp,
+    List<int> nonce,
+    List<int> mac, {
+    bool challenge = false,
+  }) {
+    const int headerLength = 44;
+    List<int> user = utf8.encode(username);
+    if (user.isEmpty || user.length > 64 || nonce.length > 32) {
+      throw Exception('Username or nonce too long for a binary request');
+    }
+
+    final message = Uint8List(headerLength + user.length + nonce.length);
+    final header = ByteData.sublistView(message);
+    header.setUint8(0, 0xB1);
+    header.setUint8(1, challenge ? 0x01 : 0x00);
+    header.setUint8(2, user.length);
+    header.setUint8(3, nonce.length);
+    header.setUint64(4, timestamp, Endian.big);
+    message.setRange(12, headerLength, mac);
+    message.setRange(headerLength, headerLength + user.length, user);
+    message.setRange(headerLength + user.length, message.length, nonce);
+    return message;
   }
 
   // Generate a random nonce
@@ -839,12 +936,15 @@ class _TapInScreenState extends State<TapInScreen>
 
   // Generate HMAC signature
   Future<String> _generateHmac(String data, String secret) async {
-    // Create the HMAC-SHA256 hash
+    return _hmacDigest(data, secret).toString();
+  }
+
+  // Create the HMAC-SHA256 hash
+  Digest _hmacDigest(String data, String secret) {
     var bytes = utf8.encode(data);
     var secretBytes = utf8.encode(secret);
     var hmac = Hmac(sha256, secretBytes);
-    var digest = hmac.convert(bytes);
-    return digest.toString();
+    return hmac.convert(bytes);
   }
 
   // Method to set the shared secret